@@ -39,6 +39,18 @@
  * exited or is not responding, the parent starts a new metadata helper as
  * described above.
  *
+ * There can be several metadata helpers (one per processor, by default), so
+ * files can be read in parallel.  Each request takes an idle helper from
+ * the pool, starting it if necessary, and returns it when done.  The most
+ * recently used helper is handed out first, so when there's little to do,
+ * the others are left to time out.  If a helper crashes or gets stuck,
+ * only that helper is killed and restarted.
+ *
+ * Many files can be read with a single batch request.  The helper sends
+ * back each result as a signal as soon as it's ready, so the caller can
+ * process earlier results while later files are being read, and replies
+ * to the request itself once all the results have been sent.
+ *
  * The child process exits after a certain period of inactivity (30s
  * currently), so the ping message serves two purposes - it checks that the
  * child is still capable of handling messages, and it ensures the child
@@ -77,12 +89,23 @@ static void rb_metadata_class_init (RBMetaDataClass *klass);
 static void rb_metadata_init (RBMetaData *md);
 static void rb_metadata_finalize (GObject *object);
 
+#define RB_METADATA_MAX_HELPERS	8
+
+typedef struct
+{
+	DBusConnection *connection;
+	GPid child;
+	int stdout_fd;
+} RBMetaDataHelper;
+
 static gboolean tried_env_address = FALSE;
-static DBusConnection *dbus_connection = NULL;
-static GPid metadata_child = 0;
-static int metadata_stdout = -1;
+static RBMetaDataHelper *helpers = NULL;
+static guint n_helpers = 0;
+static GSList *idle_helpers = NULL;
+static GMutex *helper_lock = NULL;
+static GCond *helper_cond = NULL;
 static GMainContext *main_context = NULL;
-static GStaticMutex conn_mutex = G_STATIC_MUTEX_INIT;
+static GStaticMutex saveable_types_mutex = G_STATIC_MUTEX_INIT;
 static char **saveable_types = NULL;
 
 struct RBMetaDataPrivate
@@ -98,6 +121,60 @@ struct RBMetaDataPrivate
 
 G_DEFINE_TYPE (RBMetaData, rb_metadata, G_TYPE_OBJECT)
 
+static void
+init_helpers (void)
+{
+	const char *env;
+	long n_cpus;
+	guint i;
+
+	env = g_getenv ("RB_METADATA_HELPERS");
+	if (env != NULL) {
+		n_helpers = strtoul (env, NULL, 10);
+	} else if (g_getenv ("RB_DBUS_METADATA_ADDRESS") != NULL) {
+		/* an externally started service is a single process */
+		n_helpers = 1;
+	} else {
+		n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		n_helpers = (n_cpus > 0) ? n_cpus : 1;
+	}
+	n_helpers = CLAMP (n_helpers, 1, RB_METADATA_MAX_HELPERS);
+	rb_debug ("using up to %u metadata helper processes", n_helpers);
+
+	helpers = g_new0 (RBMetaDataHelper, n_helpers);
+	for (i = n_helpers; i > 0; i--) {
+		helpers[i - 1].stdout_fd = -1;
+		idle_helpers = g_slist_prepend (idle_helpers, &helpers[i - 1]);
+	}
+	helper_lock = g_mutex_new ();
+	helper_cond = g_cond_new ();
+}
+
+static RBMetaDataHelper *
+acquire_helper (void)
+{
+	RBMetaDataHelper *helper;
+
+	g_mutex_lock (helper_lock);
+	while (idle_helpers == NULL) {
+		g_cond_wait (helper_cond, helper_lock);
+	}
+	helper = idle_helpers->data;
+	idle_helpers = g_slist_delete_link (idle_helpers, idle_helpers);
+	g_mutex_unlock (helper_lock);
+
+	return helper;
+}
+
+static void
+release_helper (RBMetaDataHelper *helper)
+{
+	g_mutex_lock (helper_lock);
+	idle_helpers = g_slist_prepend (idle_helpers, helper);
+	g_cond_signal (helper_cond);
+	g_mutex_unlock (helper_lock);
+}
+
 static void
 rb_metadata_class_init (RBMetaDataClass *klass)
 {
@@ -108,6 +185,7 @@ rb_metadata_class_init (RBMetaDataClass *klass)
 	g_type_class_add_private (object_class, sizeof (RBMetaDataPrivate));
 
 	main_context = g_main_context_new ();	/* maybe not needed? */
+	init_helpers ();
 }
 
 static void
@@ -124,6 +202,8 @@ rb_metadata_finalize (GObject *object)
 	md = RB_METADATA (object);
 
 	g_free (md->priv->mimetype);
+	g_strfreev (md->priv->missing_plugins);
+	g_strfreev (md->priv->plugin_descriptions);
 	if (md->priv->metadata)
 		g_hash_table_destroy (md->priv->metadata);
 
@@ -144,40 +224,40 @@ rb_metadata_new (void)
 }
 
 static void
-kill_metadata_service (void)
+kill_metadata_service (RBMetaDataHelper *helper)
 {
-	if (dbus_connection) {
-		if (dbus_connection_get_is_connected (dbus_connection)) {
+	if (helper->connection) {
+		if (dbus_connection_get_is_connected (helper->connection)) {
 			rb_debug ("closing dbus connection");
-			dbus_connection_close (dbus_connection);
+			dbus_connection_close (helper->connection);
 		} else {
 			rb_debug ("dbus connection already closed");
 		}
-		dbus_connection_unref (dbus_connection);
-		dbus_connection = NULL;
+		dbus_connection_unref (helper->connection);
+		helper->connection = NULL;
 	}
 
-	if (metadata_child) {
-		rb_debug ("killing child process");
-		kill (metadata_child, SIGINT);
-		g_spawn_close_pid (metadata_child);
-		metadata_child = 0;
+	if (helper->child) {
+		rb_debug ("killing child process %d", helper->child);
+		kill (helper->child, SIGINT);
+		g_spawn_close_pid (helper->child);
+		helper->child = 0;
 	}
 
-	if (metadata_stdout != -1) {
+	if (helper->stdout_fd != -1) {
 		rb_debug ("closing metadata child process stdout pipe");
-		close (metadata_stdout);
-		metadata_stdout = -1;
+		close (helper->stdout_fd);
+		helper->stdout_fd = -1;
 	}
 }
 
 static gboolean
-ping_metadata_service (GError **error)
+ping_metadata_service (RBMetaDataHelper *helper, GError **error)
 {
 	DBusMessage *message, *response;
 	DBusError dbus_error = {0,};
 
-	if (!dbus_connection_get_is_connected (dbus_connection))
+	if (!dbus_connection_get_is_connected (helper->connection))
 		return FALSE;
 
 	message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
@@ -187,7 +267,7 @@ ping_metadata_service (GError **error)
 	if (!message) {
 		return FALSE;
 	}
-	response = dbus_connection_send_with_reply_and_block (dbus_connection,
+	response = dbus_connection_send_with_reply_and_block (helper->connection,
 							      message,
 							      RB_METADATA_DBUS_TIMEOUT,
 							      &dbus_error);
@@ -205,7 +285,7 @@ ping_metadata_service (GError **error)
 }
 
 static gboolean
-start_metadata_service (GError **error)
+start_metadata_service (RBMetaDataHelper *helper, GError **error)
 {
 	DBusError dbus_error = {0,};
 	DBusMessage *message;
@@ -214,30 +294,33 @@ start_metadata_service (GError **error)
 	GIOChannel *stdout_channel;
 	GIOStatus status;
 	gchar *dbus_address = NULL;
+	char **types;
 	char *saveable_type_list;
 
-	if (dbus_connection) {
-		if (ping_metadata_service (error))
+	if (helper->connection) {
+		if (ping_metadata_service (helper, error))
 			return TRUE;
 
 		/* Metadata service is broken.  Kill it, and if we haven't run
 		 * into any errors yet, we can try to restart it.
 		 */
-		kill_metadata_service ();
+		kill_metadata_service (helper);
 
 		if (*error)
 			return FALSE;
 	}
 
+	g_static_mutex_lock (&saveable_types_mutex);
 	if (!tried_env_address) {
 		const char *addr = g_getenv ("RB_DBUS_METADATA_ADDRESS");
 		tried_env_address = TRUE;
 		if (addr) {
 			rb_debug ("trying metadata service address %s (from environment)", addr);
 			dbus_address = g_strdup (addr);
-			metadata_child = 0;
+			helper->child = 0;
 		}
 	}
+	g_static_mutex_unlock (&saveable_types_mutex);
 
 	if (dbus_address == NULL) {
 		GPtrArray *argv;
@@ -273,9 +356,9 @@ start_metadata_service (GError **error)
 						NULL,
 						0,
 						NULL, NULL,
-						&metadata_child,
+						&helper->child,
 						NULL,
-						&metadata_stdout,
+						&helper->stdout_fd,
 						NULL,
 						&local_error);
 		g_ptr_array_free (argv, TRUE);
@@ -286,11 +369,11 @@ start_metadata_service (GError **error)
 			return FALSE;
 		}
 
-		stdout_channel = g_io_channel_unix_new (metadata_stdout);
+		stdout_channel = g_io_channel_unix_new (helper->stdout_fd);
 		status = g_io_channel_read_line (stdout_channel, &dbus_address, NULL, NULL, error);
 		g_io_channel_unref (stdout_channel);
 		if (status != G_IO_STATUS_NORMAL) {
-			kill_metadata_service ();
+			kill_metadata_service (helper);
 			return FALSE;
 		}
 
@@ -298,25 +381,22 @@ start_metadata_service (GError **error)
 		rb_debug ("Got metadata helper D-BUS address %s", dbus_address);
 	}
 
-	dbus_connection = dbus_connection_open_private (dbus_address, &dbus_error);
+	helper->connection = dbus_connection_open_private (dbus_address, &dbus_error);
 	g_free (dbus_address);
-	if (!dbus_connection) {
-		kill_metadata_service ();
+	if (!helper->connection) {
+		kill_metadata_service (helper);
 
 		dbus_set_g_error (error, &dbus_error);
 		dbus_error_free (&dbus_error);
 		return FALSE;
 	}
-	dbus_connection_set_exit_on_disconnect (dbus_connection, FALSE);
+	dbus_connection_set_exit_on_disconnect (helper->connection, FALSE);
 
-	dbus_connection_setup_with_g_main (dbus_connection, main_context);
+	dbus_connection_setup_with_g_main (helper->connection, main_context);
 
-	rb_debug ("Metadata process %d started", metadata_child);
+	rb_debug ("Metadata process %d started", helper->child);
 
 	/* now ask it what types it can re-tag */
-	if (saveable_types != NULL) {
-		g_strfreev (saveable_types);
-	}
 
 	message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
 						RB_METADATA_DBUS_OBJECT_PATH,
@@ -329,7 +409,7 @@ start_metadata_service (GError **error)
 	}
 
 	rb_debug ("sending metadata saveable types query");
-	response = dbus_connection_send_with_reply_and_block (dbus_connection,
+	response = dbus_connection_send_with_reply_and_block (helper->connection,
 							      message,
 							      RB_METADATA_DBUS_TIMEOUT,
 							      &dbus_error);
@@ -344,19 +424,24 @@ start_metadata_service (GError **error)
 		return FALSE;
 	}
 
-	if (!rb_metadata_dbus_get_strv (&iter, &saveable_types)) {
+	if (!rb_metadata_dbus_get_strv (&iter, &types)) {
 		rb_debug ("couldn't get saveable type data from response message");
 		return FALSE;
 	}
 
-	if (saveable_types != NULL) {
-		saveable_type_list = g_strjoinv (", ", saveable_types);
+	if (types != NULL) {
+		saveable_type_list = g_strjoinv (", ", types);
 		rb_debug ("saveable types from metadata helper: %s", saveable_type_list);
 		g_free (saveable_type_list);
 	} else {
 		rb_debug ("unable to save metadata for any file types");
 	}
 
+	g_static_mutex_lock (&saveable_types_mutex);
+	g_strfreev (saveable_types);
+	saveable_types = types;
+	g_static_mutex_unlock (&saveable_types_mutex);
+
 	if (message)
 		dbus_message_unref (message);
 	if (response)
@@ -365,7 +450,7 @@ start_metadata_service (GError **error)
 }
 
 static void
-handle_dbus_error (RBMetaData *md, DBusError *dbus_error, GError **error)
+handle_dbus_error (RBMetaData *md, RBMetaDataHelper *helper, DBusError *dbus_error, GError **error)
 {
 	/*
 	 * If the error is 'no reply within the specified time',
@@ -373,7 +458,7 @@ handle_dbus_error (RBMetaData *md, DBusError *dbus_error, GError **error)
 	 * it's stuck in a loop and needs to be killed.
 	 */
 	if (strcmp (dbus_error->name, DBUS_ERROR_NO_REPLY) == 0) {
-		kill_metadata_service ();
+		kill_metadata_service (helper);
 
 		g_set_error (error,
 			     RB_METADATA_ERROR,
@@ -424,6 +509,67 @@ rb_metadata_reset (RBMetaData *md)
 						    (GDestroyNotify)rb_value_free);
 }
 
+/* reads the result of a load operation, as sent by the metadata service in
+ * reply to 'load' or in a 'loadResult' signal.
+ */
+static void
+read_load_result (RBMetaData *md, DBusMessageIter *iter, GError **error)
+{
+	gboolean ok;
+
+	if (!rb_metadata_dbus_get_strv (iter, &md->priv->missing_plugins)) {
+		rb_debug ("couldn't get missing plugin data from response message");
+		goto dbus_error;
+	}
+
+	if (!rb_metadata_dbus_get_strv (iter, &md->priv->plugin_descriptions)) {
+		rb_debug ("couldn't get missing plugin descriptions from response message");
+		goto dbus_error;
+	}
+
+	if (!rb_metadata_dbus_get_boolean (iter, &md->priv->has_audio)) {
+		rb_debug ("couldn't get has-audio flag from response message");
+		goto dbus_error;
+	}
+	rb_debug ("has audio: %d", md->priv->has_audio);
+
+	if (!rb_metadata_dbus_get_boolean (iter, &md->priv->has_video)) {
+		rb_debug ("couldn't get has-video flag from response message");
+		goto dbus_error;
+	}
+	rb_debug ("has video: %d", md->priv->has_video);
+
+	if (!rb_metadata_dbus_get_boolean (iter, &md->priv->has_other_data)) {
+		rb_debug ("couldn't get has-other-data flag from response message");
+		goto dbus_error;
+	}
+	rb_debug ("has other data: %d", md->priv->has_other_data);
+
+	if (!rb_metadata_dbus_get_string (iter, &md->priv->mimetype)) {
+		goto dbus_error;
+	}
+	rb_debug ("got mimetype: %s", md->priv->mimetype);
+
+	if (!rb_metadata_dbus_get_boolean (iter, &ok)) {
+		rb_debug ("couldn't get success flag from response message");
+		goto dbus_error;
+	}
+
+	if (ok == FALSE) {
+		read_error_from_message (md, iter, error);
+		return;
+	}
+
+	rb_metadata_dbus_read_from_message (md, md->priv->metadata, iter);
+	return;
+
+dbus_error:
+	g_set_error (error,
+		     RB_METADATA_ERROR,
+		     RB_METADATA_ERROR_INTERNAL,
+		     _("D-BUS communication error"));
+}
+
 /**
  * rb_metadata_load:
  * @md: a #RBMetaData
@@ -444,70 +590,62 @@ rb_metadata_load (RBMetaData *md,
 	DBusMessage *response = NULL;
 	DBusMessageIter iter;
 	DBusError dbus_error = {0,};
-	gboolean ok;
+	RBMetaDataHelper *helper;
 	GError *fake_error = NULL;
-	GError *dbus_gerror;
-
-	dbus_gerror = g_error_new (RB_METADATA_ERROR,
-				   RB_METADATA_ERROR_INTERNAL,
-				   _("D-BUS communication error"));
 
 	if (error == NULL)
 		error = &fake_error;
 
 	g_free (md->priv->mimetype);
 	md->priv->mimetype = NULL;
+	g_strfreev (md->priv->missing_plugins);
+	md->priv->missing_plugins = NULL;
+	g_strfreev (md->priv->plugin_descriptions);
+	md->priv->plugin_descriptions = NULL;
 
 	if (uri == NULL)
 		return;
 
 	rb_metadata_reset (md);
 
-	g_static_mutex_lock (&conn_mutex);
+	helper = acquire_helper ();
 
-	start_metadata_service (error);
+	start_metadata_service (helper, error);
 
 	if (*error == NULL) {
 		message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
 							RB_METADATA_DBUS_OBJECT_PATH,
 							RB_METADATA_DBUS_INTERFACE,
 							"load");
-		if (!message) {
-			g_propagate_error (error, dbus_gerror);
-		} else if (!dbus_message_append_args (message, DBUS_TYPE_STRING, &uri, DBUS_TYPE_INVALID)) {
-			g_propagate_error (error, dbus_gerror);
+		if (!message ||
+		    !dbus_message_append_args (message, DBUS_TYPE_STRING, &uri, DBUS_TYPE_INVALID)) {
+			g_set_error (error,
+				     RB_METADATA_ERROR,
+				     RB_METADATA_ERROR_INTERNAL,
+				     _("D-BUS communication error"));
 		}
 	}
 
 	if (*error == NULL) {
 		rb_debug ("sending metadata load request");
-		response = dbus_connection_send_with_reply_and_block (dbus_connection,
+		response = dbus_connection_send_with_reply_and_block (helper->connection,
 								      message,
 								      RB_METADATA_DBUS_TIMEOUT,
 								      &dbus_error);
 
 		if (!response)
-			handle_dbus_error (md, &dbus_error, error);
+			handle_dbus_error (md, helper, &dbus_error, error);
 	}
 
 	if (*error == NULL) {
 		if (!dbus_message_iter_init (response, &iter)) {
-			g_propagate_error (error, dbus_gerror);
+			g_set_error (error,
+				     RB_METADATA_ERROR,
+				     RB_METADATA_ERROR_INTERNAL,
+				     _("D-BUS communication error"));
 			rb_debug ("couldn't read response message");
-		}
-	}
-	
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_strv (&iter, &md->priv->missing_plugins)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get missing plugin data from response message");
-		}
-	}
-
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_strv (&iter, &md->priv->plugin_descriptions)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get missing plugin descriptions from response message");
+		} else {
+			read_load_result (md, &iter, error);
 		}
 	}
 
@@ -515,69 +653,260 @@ rb_metadata_load (RBMetaData *md,
 	 * metadata helper rereads the registry before the next load.
 	 * the easiest way to do this is to kill it.
 	 */
-	if (*error == NULL && md->priv->missing_plugins != NULL) {
+	if (md->priv->missing_plugins != NULL) {
 		rb_debug ("missing plugins; killing metadata service to force registry reload");
-		kill_metadata_service ();
+		kill_metadata_service (helper);
 	}
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_boolean (&iter, &md->priv->has_audio)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get has-audio flag from response message");
-		} else {
-			rb_debug ("has audio: %d", md->priv->has_audio);
+	if (message)
+		dbus_message_unref (message);
+	if (response)
+		dbus_message_unref (response);
+	if (fake_error)
+		g_error_free (fake_error);
+
+	release_helper (helper);
+}
+
+static void
+fail_batch_items (const char **uris,
+		  gboolean *done,
+		  GError *error,
+		  RBMetaDataLoadFunc func,
+		  gpointer user_data)
+{
+	guint i;
+
+	for (i = 0; uris[i] != NULL; i++) {
+		if (done[i] == FALSE) {
+			done[i] = TRUE;
+			func (rb_metadata_new (), i, g_error_copy (error), user_data);
 		}
 	}
+}
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_boolean (&iter, &md->priv->has_video)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get has-video flag from response message");
-		} else {
-			rb_debug ("has video: %d", md->priv->has_video);
+/* sends one loadBatch request for the URIs in @uris that aren't done yet,
+ * and passes the results to @func as they arrive.  returns FALSE if the
+ * helper stopped responding or went away part way through, in which case
+ * @error is set and the URIs that weren't done are left for the caller.
+ * other errors apply to the whole batch.
+ */
+static gboolean
+load_batch_request (RBMetaDataHelper *helper,
+		    const char **uris,
+		    gboolean *done,
+		    guint n_uris,
+		    gboolean *missing_plugins,
+		    GError **error,
+		    RBMetaDataLoadFunc func,
+		    gpointer user_data)
+{
+	DBusMessage *message = NULL;
+	DBusMessageIter iter;
+	dbus_uint32_t serial;
+	const char **pending;
+	guint *pending_index;
+	guint n_pending = 0;
+	gboolean finished = FALSE;
+	gboolean responding = TRUE;
+	GTimer *timer;
+	guint received = 0;
+	guint i;
+
+	/* results are reported by position in the request, so keep track
+	 * of where each URI we send came from.
+	 */
+	pending = g_new0 (const char *, n_uris + 1);
+	pending_index = g_new0 (guint, n_uris);
+	for (i = 0; i < n_uris; i++) {
+		if (done[i] == FALSE) {
+			pending[n_pending] = uris[i];
+			pending_index[n_pending] = i;
+			n_pending++;
 		}
 	}
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_boolean (&iter, &md->priv->has_other_data)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get has-other-data flag from response message");
-		} else {
-			rb_debug ("has other data: %d", md->priv->has_other_data);
-		}
+	message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
+						RB_METADATA_DBUS_OBJECT_PATH,
+						RB_METADATA_DBUS_INTERFACE,
+						"loadBatch");
+	if (message)
+		dbus_message_iter_init_append (message, &iter);
+	if (!message ||
+	    !rb_metadata_dbus_add_strv (&iter, (char **) pending) ||
+	    !dbus_connection_send (helper->connection, message, &serial)) {
+		g_set_error (error,
+			     RB_METADATA_ERROR,
+			     RB_METADATA_ERROR_INTERNAL,
+			     _("D-BUS communication error"));
 	}
+	if (message)
+		dbus_message_unref (message);
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_string (&iter, &md->priv->mimetype)) {
-			g_propagate_error (error, dbus_gerror);
-		} else {
-			rb_debug ("got mimetype: %s", md->priv->mimetype);
+	/* results arrive as signals, followed by the method reply.  the
+	 * connection isn't attached to a main loop that anything runs,
+	 * so we can just read messages off it here.  each message has to
+	 * arrive within the usual timeout of the previous one.
+	 */
+	rb_debug ("sending metadata load request for %u uris", n_pending);
+	timer = g_timer_new ();
+	while (*error == NULL && finished == FALSE) {
+		DBusMessage *msg;
+		int timeout;
+
+		timeout = RB_METADATA_DBUS_TIMEOUT - (int) (g_timer_elapsed (timer, NULL) * 1000);
+		if (timeout <= 0) {
+			rb_debug ("metadata helper stopped responding after %u of %u results", received, n_pending);
+			responding = FALSE;
+			break;
+		}
+
+		msg = dbus_connection_pop_message (helper->connection);
+		if (msg == NULL) {
+			if (!dbus_connection_read_write (helper->connection, timeout)) {
+				rb_debug ("metadata helper connection closed after %u of %u results", received, n_pending);
+				responding = FALSE;
+				break;
+			}
+			continue;
 		}
+
+		if (dbus_message_is_signal (msg, RB_METADATA_DBUS_INTERFACE, "loadResult")) {
+			guint32 index;
+
+			if (dbus_message_iter_init (msg, &iter) &&
+			    rb_metadata_dbus_get_uint32 (&iter, &index) &&
+			    index < n_pending &&
+			    done[pending_index[index]] == FALSE) {
+				RBMetaData *md;
+				GError *item_error = NULL;
+
+				md = rb_metadata_new ();
+				rb_metadata_reset (md);
+				read_load_result (md, &iter, &item_error);
+				if (md->priv->missing_plugins != NULL)
+					*missing_plugins = TRUE;
+
+				done[pending_index[index]] = TRUE;
+				received++;
+				g_timer_start (timer);
+				func (md, pending_index[index], item_error, user_data);
+			} else {
+				rb_debug ("ignoring invalid batch load result");
+			}
+		} else if (dbus_message_get_reply_serial (msg) == serial) {
+			finished = TRUE;
+			if (dbus_message_get_type (msg) == DBUS_MESSAGE_TYPE_ERROR) {
+				DBusError dbus_error = {0,};
+
+				dbus_set_error_from_message (&dbus_error, msg);
+				dbus_set_g_error (error, &dbus_error);
+				dbus_error_free (&dbus_error);
+			} else if (received < n_pending) {
+				/* the helper gave up on the rest for some reason */
+				g_set_error (error,
+					     RB_METADATA_ERROR,
+					     RB_METADATA_ERROR_INTERNAL,
+					     _("D-BUS communication error"));
+			}
+		}
+		dbus_message_unref (msg);
 	}
+	g_timer_destroy (timer);
 
-	if (*error == NULL) {
-		if (!rb_metadata_dbus_get_boolean (&iter, &ok)) {
-			g_propagate_error (error, dbus_gerror);
-			rb_debug ("couldn't get success flag from response message");
-		} else if (ok == FALSE) {
-			read_error_from_message (md, &iter, error);
+	if (responding == FALSE) {
+		kill_metadata_service (helper);
+		g_set_error (error,
+			     RB_METADATA_ERROR,
+			     RB_METADATA_ERROR_INTERNAL,
+			     _("Internal GStreamer problem; file a bug"));
+	}
+
+	g_free (pending);
+	g_free (pending_index);
+	return responding;
+}
+
+/**
+ * rb_metadata_load_batch:
+ * @uris: (array zero-terminated=1): URIs from which to load metadata
+ * @func: function to call with the result for each URI
+ * @user_data: data to pass to @func
+ *
+ * Reads metadata from each of the URIs, using a single request to the
+ * metadata helper.  Results are passed to @func as they arrive, in the
+ * order in which the URIs are listed, so they can be processed while the
+ * remaining files are being read.  @func is called exactly once for each
+ * URI, with a new #RBMetaData and the error (if any) for that URI, both of
+ * which it takes ownership of.  This is much faster than calling
+ * rb_metadata_load for each URI when reading large numbers of files.
+ *
+ * If the helper crashes or stops responding while reading a file, only
+ * that file fails; the helper is restarted and the rest of the batch is
+ * sent to it again.
+ */
+void
+rb_metadata_load_batch (const char **uris,
+			RBMetaDataLoadFunc func,
+			gpointer user_data)
+{
+	RBMetaDataHelper *helper;
+	GError *error = NULL;
+	gboolean *done;
+	gboolean missing_plugins = FALSE;
+	guint n_uris;
+	guint i;
+
+	n_uris = (uris != NULL) ? g_strv_length ((char **) uris) : 0;
+	if (n_uris == 0)
+		return;
+	done = g_new0 (gboolean, n_uris);
+
+	helper = acquire_helper ();
+
+	for (i = 0; i < n_uris; i++) {
+		if (done[i])
+			continue;
+
+		start_metadata_service (helper, &error);
+		if (error != NULL)
+			break;
+
+		if (load_batch_request (helper, uris, done, n_uris, &missing_plugins,
+					&error, func, user_data)) {
+			break;
+		}
+
+		/* results arrive in order, so the first file without a
+		 * result is the one the helper was reading when it died.
+		 */
+		while (i < n_uris && done[i])
+			i++;
+		if (i == n_uris) {
+			/* it died after sending the last result */
+			g_clear_error (&error);
+			break;
 		}
+		rb_debug ("failing %s, restarting metadata helper for the rest of the batch", uris[i]);
+		done[i] = TRUE;
+		func (rb_metadata_new (), i, error, user_data);
+		error = NULL;
 	}
 
-	if (*error == NULL) {
-		rb_metadata_dbus_read_from_message (md, md->priv->metadata, &iter);
+	if (error != NULL) {
+		rb_debug ("batch metadata load failed: %s", error->message);
+		fail_batch_items (uris, done, error, func, user_data);
+		g_error_free (error);
 	}
 
-	if (message)
-		dbus_message_unref (message);
-	if (response)
-		dbus_message_unref (response);
-	if (*error != dbus_gerror)
-		g_error_free (dbus_gerror);
-	if (fake_error)
-		g_error_free (fake_error);
+	/* as for single loads, make the helper reread the registry */
+	if (missing_plugins) {
+		rb_debug ("missing plugins; killing metadata service to force registry reload");
+		kill_metadata_service (helper);
+	}
 
-	g_static_mutex_unlock (&conn_mutex);
+	g_free (done);
+	release_helper (helper);
 }
 
 /**
@@ -595,6 +924,25 @@ rb_metadata_get_mime (RBMetaData *md)
 	return md->priv->mimetype;
 }
 
+/**
+ * rb_metadata_set_audio_type:
+ * @md: a #RBMetaData
+ * @mimetype: MIME type-ish string for the file
+ *
+ * Records that @md describes an audio file of type @mimetype, for metadata
+ * that was read other than through rb_metadata_load, for example from a
+ * cache of earlier results.
+ */
+void
+rb_metadata_set_audio_type (RBMetaData *md, const char *mimetype)
+{
+	g_free (md->priv->mimetype);
+	md->priv->mimetype = g_strdup (mimetype);
+	md->priv->has_audio = TRUE;
+	md->priv->has_video = FALSE;
+	md->priv->has_other_data = FALSE;
+}
+
 /**
  * rb_metadata_has_missing_plugins:
  * @md: a #RBMetaData
@@ -713,17 +1061,28 @@ rb_metadata_can_save (RBMetaData *md, const char *mimetype)
 {
 	GError *error = NULL;
 	gboolean result = FALSE;
+	gboolean known;
 	int i = 0;
 
-	g_static_mutex_lock (&conn_mutex);
+	g_static_mutex_lock (&saveable_types_mutex);
+	known = (saveable_types != NULL);
+	g_static_mutex_unlock (&saveable_types_mutex);
+
+	if (known == FALSE) {
+		RBMetaDataHelper *helper;
+		gboolean started;
 
-	if (saveable_types == NULL) {
-		if (start_metadata_service (&error) == FALSE) {
-			g_error_free (error);
+		helper = acquire_helper ();
+		started = start_metadata_service (helper, &error);
+		release_helper (helper);
+
+		if (started == FALSE) {
+			g_clear_error (&error);
 			return FALSE;
 		}
 	}
 
+	g_static_mutex_lock (&saveable_types_mutex);
 	if (saveable_types != NULL) {
 		for (i = 0; saveable_types[i] != NULL; i++) {
 			if (g_str_equal (mimetype, saveable_types[i])) {
@@ -732,8 +1091,8 @@ rb_metadata_can_save (RBMetaData *md, const char *mimetype)
 			}
 		}
 	}
+	g_static_mutex_unlock (&saveable_types_mutex);
 
-	g_static_mutex_unlock (&conn_mutex);
 	return result;
 }
 
@@ -750,7 +1109,13 @@ rb_metadata_can_save (RBMetaData *md, const char *mimetype)
 char **
 rb_metadata_get_saveable_types (RBMetaData *md)
 {
-	return g_strdupv (saveable_types);
+	char **types;
+
+	g_static_mutex_lock (&saveable_types_mutex);
+	types = g_strdupv (saveable_types);
+	g_static_mutex_unlock (&saveable_types_mutex);
+
+	return types;
 }
 
 /**
@@ -770,13 +1135,14 @@ rb_metadata_save (RBMetaData *md, const char *uri, GError **error)
 	DBusMessage *response = NULL;
 	DBusError dbus_error = {0,};
 	DBusMessageIter iter;
+	RBMetaDataHelper *helper;
 
 	if (error == NULL)
 		error = &fake_error;
 
-	g_static_mutex_lock (&conn_mutex);
+	helper = acquire_helper ();
 
-	start_metadata_service (error);
+	start_metadata_service (helper, error);
 
 	if (*error == NULL) {
 		message = dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
@@ -810,12 +1176,12 @@ rb_metadata_save (RBMetaData *md, const char *uri, GError **error)
 	}
 
 	if (*error == NULL) {
-		response = dbus_connection_send_with_reply_and_block (dbus_connection,
+		response = dbus_connection_send_with_reply_and_block (helper->connection,
 								      message,
 								      RB_METADATA_SAVE_DBUS_TIMEOUT,
 								      &dbus_error);
 		if (!response) {
-			handle_dbus_error (md, &dbus_error, error);
+			handle_dbus_error (md, helper, &dbus_error, error);
 		} else if (dbus_message_iter_init (response, &iter)) {
 			/* if there's any return data at all, it'll be an error */
 			read_error_from_message (md, &iter, error);
@@ -829,7 +1195,23 @@ rb_metadata_save (RBMetaData *md, const char *uri, GError **error)
 	if (fake_error)
 		g_error_free (fake_error);
 
-	g_static_mutex_unlock (&conn_mutex);
+	release_helper (helper);
+}
+
+/**
+ * rb_metadata_get_max_parallel:
+ *
+ * Returns the number of metadata operations that can be carried out at
+ * the same time.  Callers loading many files can use up to this many
+ * threads to keep all the metadata helpers busy.
+ *
+ * Return value: maximum number of parallel metadata operations
+ */
+guint
+rb_metadata_get_max_parallel (void)
+{
+	g_type_class_unref (g_type_class_ref (RB_TYPE_METADATA));
+	return n_helpers;
 }
 
 gboolean
@@ -98,6 +98,68 @@ send_error (DBusConnection *connection,
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+static gboolean
+append_load_result (DBusMessageIter *iter,
+		    RBMetaData *md,
+		    GError *error)
+{
+	const char *mimetype = NULL;
+	char **missing_plugins = NULL;
+	char **plugin_descriptions = NULL;
+	gboolean has_audio;
+	gboolean has_video;
+	gboolean has_other_data;
+	gboolean ok;
+
+	rb_metadata_get_missing_plugins (md, &missing_plugins, &plugin_descriptions);
+	if (!rb_metadata_dbus_add_strv (iter, missing_plugins) ||
+	    !rb_metadata_dbus_add_strv (iter, plugin_descriptions)) {
+		rb_debug ("out of memory adding data to return message");
+		g_strfreev (missing_plugins);
+		g_strfreev (plugin_descriptions);
+		return FALSE;
+	}
+	g_strfreev (missing_plugins);
+	g_strfreev (plugin_descriptions);
+
+	mimetype = rb_metadata_get_mime (md);
+	if (mimetype == NULL) {
+		mimetype = "";
+	}
+	has_audio = rb_metadata_has_audio (md);
+	has_video = rb_metadata_has_video (md);
+	has_other_data = rb_metadata_has_other_data (md);
+
+	if (!dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN, &has_audio) ||
+	    !dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN, &has_video) ||
+	    !dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN, &has_other_data) ||
+	    !dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING, &mimetype)) {
+		rb_debug ("out of memory adding data to return message");
+		return FALSE;
+	}
+
+	ok = (error == NULL);
+	if (!dbus_message_iter_append_basic (iter, DBUS_TYPE_BOOLEAN, &ok)) {
+		rb_debug ("out of memory adding error flag to return message");
+		return FALSE;
+	}
+
+	if (error != NULL) {
+		rb_debug ("metadata error: %s", error->message);
+		if (append_error (iter, error->code, error->message) == FALSE) {
+			rb_debug ("out of memory adding error details to return message");
+			return FALSE;
+		}
+	}
+
+	if (!rb_metadata_dbus_add_to_message (md, iter)) {
+		rb_debug ("unable to add metadata to return message");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static DBusHandlerResult
 rb_metadata_dbus_load (DBusConnection *connection,
 		       DBusMessage *message,
@@ -108,12 +170,6 @@ rb_metadata_dbus_load (DBusConnection *connection,
 	DBusMessage *reply;
 	GError *error = NULL;
 	gboolean ok;
-	const char *mimetype = NULL;
-	char **missing_plugins = NULL;
-	char **plugin_descriptions = NULL;
-	gboolean has_audio;
-	gboolean has_video;
-	gboolean has_other_data;
 
 	if (!dbus_message_iter_init (message, &iter)) {
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
@@ -132,58 +188,101 @@ rb_metadata_dbus_load (DBusConnection *connection,
 	reply = dbus_message_new_method_return (message);
 	if (!reply) {
 		rb_debug ("out of memory creating return message");
+		g_clear_error (&error);
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 	
 	dbus_message_iter_init_append (reply, &iter);
-
-	rb_metadata_get_missing_plugins (svc->metadata, &missing_plugins, &plugin_descriptions);
-	if (!rb_metadata_dbus_add_strv (&iter, missing_plugins)) {
-		rb_debug ("out of memory adding data to return message");
+	ok = append_load_result (&iter, svc->metadata, error);
+	g_clear_error (&error);
+	if (!ok) {
+		dbus_message_unref (reply);
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
-	if (!rb_metadata_dbus_add_strv (&iter, plugin_descriptions)) {
-		rb_debug ("out of memory adding data to return message");
+
+	if (!dbus_connection_send (connection, reply, NULL)) {
+		rb_debug ("failed to send return message");
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
-	mimetype = rb_metadata_get_mime (svc->metadata);
-	if (mimetype == NULL) {
-		mimetype = "";
-	}
-	has_audio = rb_metadata_has_audio (svc->metadata);
-	has_video = rb_metadata_has_video (svc->metadata);
-	has_other_data = rb_metadata_has_other_data (svc->metadata);
+	dbus_message_unref (reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
 
-	if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_BOOLEAN, &has_audio) ||
-	    !dbus_message_iter_append_basic (&iter, DBUS_TYPE_BOOLEAN, &has_video) ||
-	    !dbus_message_iter_append_basic (&iter, DBUS_TYPE_BOOLEAN, &has_other_data) ||
-	    !dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &mimetype)) {
-		rb_debug ("out of memory adding data to return message");
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+/*
+ * Loads metadata from each of a list of URIs.  Rather than collecting all
+ * the results into a single reply, each one is sent as a 'loadResult'
+ * signal as soon as it's ready, consisting of the index of the URI in the
+ * request followed by the same data as the reply to 'load'.  The client
+ * can process each result while the next file is being read.  The method
+ * reply, containing the number of results sent, comes last.
+ */
+static DBusHandlerResult
+rb_metadata_dbus_load_batch (DBusConnection *connection,
+			     DBusMessage *message,
+			     ServiceData *svc)
+{
+	DBusMessageIter iter;
+	DBusMessage *reply;
+	char **uris;
+	guint32 i;
+
+	if (!dbus_message_iter_init (message, &iter)) {
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 	}
 
-	ok = (error == NULL);
-	if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_BOOLEAN, &ok)) {
-		rb_debug ("out of memory adding error flag to return message");
+	if (!rb_metadata_dbus_get_strv (&iter, &uris)) {
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
-	if (error != NULL) {
-		rb_debug ("metadata error: %s", error->message);
-		if (append_error (&iter, error->code, error->message) == FALSE) {
-			rb_debug ("out of memory adding error details to return message");
-			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	for (i = 0; uris != NULL && uris[i] != NULL; i++) {
+		DBusMessage *result;
+		GError *error = NULL;
+		gboolean ok;
+
+		rb_debug ("loading metadata from %s (%u in batch)", uris[i], i);
+		rb_metadata_load (svc->metadata, uris[i], &error);
+		rb_debug ("metadata load finished (type %s)", rb_metadata_get_mime (svc->metadata));
+
+		result = dbus_message_new_signal (RB_METADATA_DBUS_OBJECT_PATH,
+						  RB_METADATA_DBUS_INTERFACE,
+						  "loadResult");
+		if (!result) {
+			rb_debug ("out of memory creating result message");
+			g_clear_error (&error);
+			g_strfreev (uris);
+			return DBUS_HANDLER_RESULT_NEED_MEMORY;
 		}
+
+		dbus_message_iter_init_append (result, &iter);
+		ok = dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &i) &&
+		     append_load_result (&iter, svc->metadata, error);
+		g_clear_error (&error);
+
+		/* a result that can't be sent will time out on the client side */
+		if (ok && dbus_connection_send (connection, result, NULL)) {
+			dbus_connection_flush (connection);
+		} else {
+			rb_debug ("failed to send result for %s", uris[i]);
+		}
+		dbus_message_unref (result);
+
+		svc->last_active = time (NULL);
 	}
+	g_strfreev (uris);
 
-	if (!rb_metadata_dbus_add_to_message (svc->metadata, &iter)) {
-		rb_debug ("unable to add metadata to return message");
+	reply = dbus_message_new_method_return (message);
+	if (!reply) {
+		rb_debug ("out of memory creating return message");
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
-	if (!dbus_connection_send (connection, reply, NULL)) {
+	if (!dbus_message_append_args (reply,
+				       DBUS_TYPE_UINT32, &i,
+				       DBUS_TYPE_INVALID) ||
+	    !dbus_connection_send (connection, reply, NULL)) {
 		rb_debug ("failed to send return message");
+		dbus_message_unref (reply);
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
@@ -354,6 +453,8 @@ _handle_message (DBusConnection *connection, DBusMessage *message, void *data)
 
 	if (dbus_message_is_method_call (message, RB_METADATA_DBUS_INTERFACE, "load")) {
 		result = rb_metadata_dbus_load (connection, message, svc);
+	} else if (dbus_message_is_method_call (message, RB_METADATA_DBUS_INTERFACE, "loadBatch")) {
+		result = rb_metadata_dbus_load_batch (connection, message, svc);
 	} else if (dbus_message_is_method_call (message, RB_METADATA_DBUS_INTERFACE, "getSaveableTypes")) {
 		result = rb_metadata_dbus_get_saveable_types (connection, message, svc);
 	} else if (dbus_message_is_method_call (message, RB_METADATA_DBUS_INTERFACE, "save")) {
@@ -39,6 +39,7 @@
 
 #include "rb-metadata.h"
 #include "rb-metadata-gst-common.h"
+#include "rb-metadata-native.h"
 #include "rb-debug.h"
 #include "rb-util.h"
 #include "rb-file-helpers.h"
@@ -743,6 +744,91 @@ rb_metadata_event_loop (RBMetaData *md, GstElement *element, gboolean block)
 	gst_object_unref (bus);
 }
 
+static gboolean
+rb_metadata_can_decode (const char *caps_str)
+{
+	static GHashTable *decodable = NULL;
+	gpointer cached;
+	GstCaps *caps;
+	GList *features;
+	GList *l;
+	gboolean found = FALSE;
+
+	if (decodable == NULL)
+		decodable = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	if (g_hash_table_lookup_extended (decodable, caps_str, NULL, &cached))
+		return GPOINTER_TO_INT (cached);
+
+	/* look for a decoder that accepts the stream, as decodebin would */
+	caps = gst_caps_from_string (caps_str);
+	features = gst_registry_get_feature_list (gst_registry_get_default (), GST_TYPE_ELEMENT_FACTORY);
+	for (l = features; l != NULL && found == FALSE; l = l->next) {
+		GstElementFactory *factory = GST_ELEMENT_FACTORY (l->data);
+		const GList *t;
+
+		if (strstr (gst_element_factory_get_klass (factory), "Decoder") == NULL)
+			continue;
+
+		for (t = gst_element_factory_get_static_pad_templates (factory); t != NULL; t = t->next) {
+			GstStaticPadTemplate *tmpl = (GstStaticPadTemplate *) t->data;
+			GstCaps *sink_caps;
+			GstCaps *common;
+
+			if (tmpl->direction != GST_PAD_SINK)
+				continue;
+
+			sink_caps = gst_static_caps_get (&tmpl->static_caps);
+			common = gst_caps_intersect (caps, sink_caps);
+			found = (gst_caps_is_empty (common) == FALSE);
+			gst_caps_unref (common);
+			gst_caps_unref (sink_caps);
+			if (found) {
+				rb_debug ("%s can be decoded by %s", caps_str, GST_PLUGIN_FEATURE_NAME (factory));
+				break;
+			}
+		}
+	}
+	gst_plugin_feature_list_free (features);
+	gst_caps_unref (caps);
+
+	g_hash_table_insert (decodable, g_strdup (caps_str), GINT_TO_POINTER (found));
+	return found;
+}
+
+static gboolean
+rb_metadata_load_native (RBMetaData *md, const char *uri)
+{
+	GstTagList *tags;
+	char *type;
+	char *decoder_caps;
+
+	if (g_getenv ("RB_METADATA_NO_NATIVE") != NULL)
+		return FALSE;
+
+	if (rb_metadata_native_load (uri, &type, &decoder_caps, &tags) == FALSE)
+		return FALSE;
+
+	/* if the audio can't be decoded, the pipeline needs to report the
+	 * missing plugins.
+	 */
+	if (rb_metadata_can_decode (decoder_caps) == FALSE) {
+		rb_debug ("no decoder for %s, using the pipeline", decoder_caps);
+		g_free (type);
+		g_free (decoder_caps);
+		gst_tag_list_free (tags);
+		return FALSE;
+	}
+
+	md->priv->type = type;
+	md->priv->has_audio = TRUE;
+	gst_tag_list_foreach (tags, (GstTagForeachFunc) rb_metadata_gst_load_tag, md);
+
+	g_free (decoder_caps);
+	gst_tag_list_free (tags);
+	return TRUE;
+}
+
 void
 rb_metadata_load (RBMetaData *md,
 		  const char *uri,
@@ -764,6 +850,11 @@ rb_metadata_load (RBMetaData *md,
 
 	rb_debug ("loading metadata for uri: %s", uri);
 
+	if (rb_metadata_load_native (md, uri)) {
+		rb_debug ("successfully read metadata for %s without a pipeline", uri);
+		return;
+	}
+
 	/* The main tagfinding pipeline looks like this:
  	 * <src> ! decodebin ! fakesink
  	 *
@@ -1195,6 +1286,16 @@ rb_metadata_get_mime (RBMetaData *md)
 	return md->priv->type;
 }
 
+void
+rb_metadata_set_audio_type (RBMetaData *md, const char *mimetype)
+{
+	g_free (md->priv->type);
+	md->priv->type = g_strdup (mimetype);
+	md->priv->has_audio = TRUE;
+	md->priv->has_video = FALSE;
+	md->priv->has_non_audio = FALSE;
+}
+
 gboolean
 rb_metadata_set (RBMetaData *md, RBMetaDataField field,
 		 const GValue *val)
@@ -1265,6 +1366,30 @@ rb_metadata_get_missing_plugins (RBMetaData *md,
 	return TRUE;
 }
 
+guint
+rb_metadata_get_max_parallel (void)
+{
+	/* the metadata helper process handles one request at a time */
+	return 1;
+}
+
+void
+rb_metadata_load_batch (const char **uris,
+			RBMetaDataLoadFunc func,
+			gpointer user_data)
+{
+	guint i;
+
+	for (i = 0; uris != NULL && uris[i] != NULL; i++) {
+		RBMetaData *md;
+		GError *error = NULL;
+
+		md = rb_metadata_new ();
+		rb_metadata_load (md, uris[i], &error);
+		func (md, i, error, user_data);
+	}
+}
+
 gboolean
 rb_metadata_has_audio (RBMetaData *md)
 {
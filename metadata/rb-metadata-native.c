@@ -0,0 +1,1378 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Native tag readers
+ *
+ * Building a decoding pipeline and waiting for it to preroll takes tens of
+ * milliseconds per file, which dominates the time taken to import a large
+ * library.  For the most common formats, the tags and duration can be read
+ * straight from the file instead:
+ *
+ * - MP3 files starting with an ID3v2.3 or 2.4 tag, with the duration taken
+ *   from the Xing/Info or VBRI header, or estimated from the bitrate
+ * - FLAC files
+ * - Ogg Vorbis and Opus files
+ * - MP4 audio files (M4A brand) containing a single AAC or MP3 track
+ *
+ * The readers produce a GstTagList using the same tag names, and the same
+ * mappings from ID3 frames and Vorbis comments, as the GStreamer demuxers
+ * and decoders, so the results go through exactly the same processing as
+ * tags from the pipeline.  Anything unusual (unsynchronised or compressed
+ * ID3 frames, APE tags, multiplexed Ogg streams, video tracks, and so on)
+ * is left to the pipeline.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/tag/tag.h>
+
+#include "rb-metadata-native.h"
+#include "rb-debug.h"
+
+/* largest tag block or header packet we're willing to read into memory */
+#define MAX_TAG_SIZE		(16 * 1024 * 1024)
+
+/* how far past the ID3 tag to look for the first MPEG audio frame */
+#define MPEG_SYNC_SEARCH	4096
+
+/* how much of the end of an Ogg file to search for the last page */
+#define OGG_TAIL_SIZE		(64 * 1024)
+
+typedef struct
+{
+	FILE *fp;
+	guint64 size;
+
+	GstTagList *tags;
+	const char *type;
+	const char *decoder_caps;
+} RBMetaDataNativeReader;
+
+static const char *id3v2_encodings[] = {
+	"GST_ID3V2_TAG_ENCODING",
+	"GST_ID3_TAG_ENCODING",
+	NULL
+};
+
+static gboolean
+read_at (RBMetaDataNativeReader *reader, guint64 offset, guint8 *buf, gsize len)
+{
+	if (offset + len > reader->size)
+		return FALSE;
+	if (fseeko (reader->fp, offset, SEEK_SET) != 0)
+		return FALSE;
+	return (fread (buf, 1, len, reader->fp) == len);
+}
+
+static guint8 *
+read_block (RBMetaDataNativeReader *reader, guint64 offset, gsize len)
+{
+	guint8 *buf;
+
+	if (len > MAX_TAG_SIZE)
+		return NULL;
+
+	buf = g_malloc (len);
+	if (read_at (reader, offset, buf, len) == FALSE) {
+		g_free (buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void
+add_string (RBMetaDataNativeReader *reader, const char *tag, char *value)
+{
+	if (value != NULL && value[0] != '\0' && g_utf8_validate (value, -1, NULL)) {
+		gst_tag_list_add (reader->tags, GST_TAG_MERGE_APPEND, tag, value, NULL);
+	}
+	g_free (value);
+}
+
+static void
+add_date (RBMetaDataNativeReader *reader, const char *str)
+{
+	guint year = 0;
+	guint month = 0;
+	guint day = 0;
+	GDate *date;
+
+	if (sscanf (str, "%04u-%02u-%02u", &year, &month, &day) < 1 || year == 0)
+		return;
+	if (month == 0)
+		month = 1;
+	if (day == 0)
+		day = 1;
+	if (g_date_valid_dmy (day, month, year) == FALSE)
+		return;
+
+	date = g_date_new_dmy (day, month, year);
+	gst_tag_list_add (reader->tags, GST_TAG_MERGE_APPEND, GST_TAG_DATE, date, NULL);
+	g_date_free (date);
+}
+
+static void
+add_number_pair (RBMetaDataNativeReader *reader,
+		 const char *number_tag,
+		 const char *count_tag,
+		 guint number,
+		 guint count)
+{
+	if (number > 0)
+		gst_tag_list_add (reader->tags, GST_TAG_MERGE_APPEND, number_tag, number, NULL);
+	if (count > 0)
+		gst_tag_list_add (reader->tags, GST_TAG_MERGE_APPEND, count_tag, count, NULL);
+}
+
+static void
+add_genre_index (RBMetaDataNativeReader *reader, guint index)
+{
+	const char *genre;
+
+	genre = gst_tag_id3_genre_get (index);
+	if (genre != NULL)
+		add_string (reader, GST_TAG_GENRE, g_strdup (genre));
+}
+
+static void
+add_duration (RBMetaDataNativeReader *reader, guint64 samples, guint rate)
+{
+	guint64 duration;
+
+	duration = gst_util_uint64_scale (samples, GST_SECOND, rate);
+	gst_tag_list_add (reader->tags, GST_TAG_MERGE_REPLACE, GST_TAG_DURATION, duration, NULL);
+}
+
+static void
+add_bitrate (RBMetaDataNativeReader *reader, guint bitrate)
+{
+	if (bitrate > 0)
+		gst_tag_list_add (reader->tags, GST_TAG_MERGE_REPLACE, GST_TAG_BITRATE, bitrate, NULL);
+}
+
+static gboolean
+add_vorbis_comments (RBMetaDataNativeReader *reader,
+		     const guint8 *data,
+		     gsize len,
+		     const guint8 *id,
+		     guint id_len)
+{
+	GstBuffer *buffer;
+	GstTagList *comments;
+
+	buffer = gst_buffer_new ();
+	GST_BUFFER_DATA (buffer) = (guint8 *) data;
+	GST_BUFFER_SIZE (buffer) = len;
+	comments = gst_tag_list_from_vorbiscomment_buffer (buffer, id, id_len, NULL);
+	gst_buffer_unref (buffer);
+
+	if (comments == NULL)
+		return FALSE;
+
+	gst_tag_list_insert (reader->tags, comments, GST_TAG_MERGE_APPEND);
+	gst_tag_list_free (comments);
+	return TRUE;
+}
+
+/* ID3v2 and MPEG audio */
+
+static guint32
+syncsafe_int (const guint8 *data, gboolean *valid)
+{
+	if ((data[0] | data[1] | data[2] | data[3]) & 0x80)
+		*valid = FALSE;
+	return (data[0] << 21) | (data[1] << 14) | (data[2] << 7) | data[3];
+}
+
+/* reads the next string from an ID3v2 frame, starting at *pos and
+ * stopping at the terminator for the encoding or the end of the frame.
+ */
+static char *
+id3v2_next_string (const guint8 *data, gsize len, guint8 encoding, gsize *pos)
+{
+	const char *charset;
+	gsize start = *pos;
+	gsize end;
+	gsize width;
+	char *str;
+
+	width = (encoding == 1 || encoding == 2) ? 2 : 1;
+	for (end = start; end + width <= len; end += width) {
+		if (data[end] == 0 && (width == 1 || data[end + 1] == 0))
+			break;
+	}
+	if (end + width > len) {
+		end = len;
+		*pos = len;
+	} else {
+		*pos = end + width;
+	}
+
+	switch (encoding) {
+	case 0:
+		return gst_tag_freeform_string_to_utf8 ((const char *) data + start,
+							end - start,
+							id3v2_encodings);
+	case 1:
+		charset = "UTF-16BE";
+		if (end - start >= 2) {
+			if (data[start] == 0xff && data[start + 1] == 0xfe) {
+				charset = "UTF-16LE";
+				start += 2;
+			} else if (data[start] == 0xfe && data[start + 1] == 0xff) {
+				start += 2;
+			}
+		}
+		break;
+	case 2:
+		charset = "UTF-16BE";
+		break;
+	case 3:
+		return g_strndup ((const char *) data + start, end - start);
+	default:
+		return NULL;
+	}
+
+	str = g_convert ((const char *) data + start, end - start, "UTF-8", charset, NULL, NULL, NULL);
+	return str;
+}
+
+static void
+id3v2_add_genre (RBMetaDataNativeReader *reader, char *str)
+{
+	char *end;
+	gulong index;
+
+	if (str == NULL)
+		return;
+
+	/* ID3v2.3 refers to ID3v1 genres as (n), ID3v2.4 just uses n */
+	if (str[0] == '(') {
+		if (g_str_has_prefix (str, "(RX)")) {
+			add_string (reader, GST_TAG_GENRE, g_strdup ("Remix"));
+		} else if (g_str_has_prefix (str, "(CR)")) {
+			add_string (reader, GST_TAG_GENRE, g_strdup ("Cover"));
+		} else {
+			index = strtoul (str + 1, &end, 10);
+			if (end != str + 1 && *end == ')')
+				add_genre_index (reader, index);
+			else
+				add_string (reader, GST_TAG_GENRE, g_strdup (str));
+		}
+		g_free (str);
+		return;
+	}
+
+	index = strtoul (str, &end, 10);
+	if (end != str && *end == '\0') {
+		add_genre_index (reader, index);
+		g_free (str);
+	} else {
+		add_string (reader, GST_TAG_GENRE, str);
+	}
+}
+
+static void
+id3v2_add_frame (RBMetaDataNativeReader *reader, const char *id, const guint8 *data, gsize len)
+{
+	const char *tag;
+	guint8 encoding;
+	gsize pos;
+	char *str;
+
+	if (len < 2)
+		return;
+
+	if (strncmp (id, "COMM", 4) == 0) {
+		char *desc;
+
+		/* only comments without a description are regular comments */
+		if (len < 5)
+			return;
+		encoding = data[0];
+		pos = 4;
+		desc = id3v2_next_string (data, len, encoding, &pos);
+		str = id3v2_next_string (data, len, encoding, &pos);
+		if (desc != NULL && desc[0] == '\0')
+			add_string (reader, GST_TAG_COMMENT, str);
+		else
+			g_free (str);
+		g_free (desc);
+		return;
+	}
+
+	if (strncmp (id, "UFID", 4) == 0) {
+		char *owner;
+
+		pos = 0;
+		owner = id3v2_next_string (data, len, 0, &pos);
+		tag = (owner != NULL) ? gst_tag_from_id3_user_tag ("UFID", owner) : NULL;
+		if (tag != NULL && pos < len)
+			add_string (reader, tag, g_strndup ((const char *) data + pos, len - pos));
+		g_free (owner);
+		return;
+	}
+
+	if (id[0] != 'T')
+		return;
+
+	encoding = data[0];
+	pos = 1;
+
+	if (strncmp (id, "TXXX", 4) == 0) {
+		char *desc;
+
+		desc = id3v2_next_string (data, len, encoding, &pos);
+		tag = (desc != NULL) ? gst_tag_from_id3_user_tag ("TXXX", desc) : NULL;
+		g_free (desc);
+		if (tag != NULL && gst_tag_get_type (tag) == G_TYPE_STRING)
+			add_string (reader, tag, id3v2_next_string (data, len, encoding, &pos));
+		return;
+	}
+
+	/* only the first value of multi-valued frames is interesting */
+	str = id3v2_next_string (data, len, encoding, &pos);
+	if (str == NULL)
+		return;
+
+	if (strncmp (id, "TCON", 4) == 0) {
+		id3v2_add_genre (reader, str);
+		return;
+	}
+
+	if (strncmp (id, "TRCK", 4) == 0 || strncmp (id, "TPOS", 4) == 0) {
+		guint number = 0;
+		guint count = 0;
+
+		if (sscanf (str, "%u/%u", &number, &count) >= 1) {
+			if (id[1] == 'R')
+				add_number_pair (reader, GST_TAG_TRACK_NUMBER, GST_TAG_TRACK_COUNT, number, count);
+			else
+				add_number_pair (reader, GST_TAG_ALBUM_VOLUME_NUMBER, GST_TAG_ALBUM_VOLUME_COUNT, number, count);
+		}
+		g_free (str);
+		return;
+	}
+
+	/* ID3v2.3 only has the year, which is part of TDRC in 2.4 */
+	if (strncmp (id, "TYER", 4) == 0)
+		tag = GST_TAG_DATE;
+	else
+		tag = gst_tag_from_id3_tag (id);
+	if (tag == NULL) {
+		g_free (str);
+		return;
+	}
+
+	if (gst_tag_get_type (tag) == G_TYPE_STRING) {
+		add_string (reader, tag, str);
+		return;
+	} else if (gst_tag_get_type (tag) == GST_TYPE_DATE) {
+		add_date (reader, str);
+	} else if (gst_tag_get_type (tag) == G_TYPE_DOUBLE) {
+		double value;
+		char *end;
+
+		value = g_ascii_strtod (str, &end);
+		if (end != str && value > 0.0)
+			gst_tag_list_add (reader->tags, GST_TAG_MERGE_APPEND, tag, value, NULL);
+	}
+	g_free (str);
+}
+
+static gboolean
+read_id3v2 (RBMetaDataNativeReader *reader, guint64 *tag_end)
+{
+	guint8 header[10];
+	guint8 *data;
+	gboolean valid = TRUE;
+	guint32 size;
+	guint32 pos;
+	int version;
+
+	if (read_at (reader, 0, header, sizeof (header)) == FALSE)
+		return FALSE;
+
+	version = header[3];
+	if (version != 3 && version != 4) {
+		rb_debug ("unsupported ID3v2 version %d", version);
+		return FALSE;
+	}
+	/* unsynchronisation, extended header, experimental */
+	if (header[5] & 0xe0) {
+		rb_debug ("ID3v2 tag has unusual flags %x", header[5]);
+		return FALSE;
+	}
+
+	size = syncsafe_int (header + 6, &valid);
+	if (valid == FALSE)
+		return FALSE;
+	*tag_end = sizeof (header) + size;
+	if (header[5] & 0x10)
+		*tag_end += sizeof (header);	/* footer */
+
+	data = read_block (reader, sizeof (header), size);
+	if (data == NULL)
+		return FALSE;
+
+	pos = 0;
+	while (pos + 10 <= size) {
+		char id[5];
+		guint32 frame_size;
+		guint16 frame_flags;
+
+		if (data[pos] == 0)
+			break;			/* padding */
+
+		memcpy (id, data + pos, 4);
+		id[4] = '\0';
+		if (version == 4)
+			frame_size = syncsafe_int (data + pos + 4, &valid);
+		else
+			frame_size = GST_READ_UINT32_BE (data + pos + 4);
+		frame_flags = GST_READ_UINT16_BE (data + pos + 8);
+
+		if (valid == FALSE || frame_size > size - pos - 10) {
+			rb_debug ("invalid ID3v2 frame %s", id);
+			g_free (data);
+			return FALSE;
+		}
+
+		/* compressed, encrypted, grouped or unsynchronised frames */
+		if ((version == 3 && (frame_flags & 0x00e0)) ||
+		    (version == 4 && (frame_flags & 0x004f))) {
+			rb_debug ("ID3v2 frame %s has unusual flags %x", id, frame_flags);
+			g_free (data);
+			return FALSE;
+		}
+
+		id3v2_add_frame (reader, id, data + pos + 10, frame_size);
+		pos += 10 + frame_size;
+	}
+
+	g_free (data);
+	return TRUE;
+}
+
+static gboolean
+read_trailing_tags (RBMetaDataNativeReader *reader, guint64 *audio_end)
+{
+	guint8 id3v1[128];
+	guint8 ape[8];
+
+	*audio_end = reader->size;
+	if (reader->size >= 128 &&
+	    read_at (reader, reader->size - 128, id3v1, sizeof (id3v1)) &&
+	    memcmp (id3v1, "TAG", 3) == 0) {
+		GstTagList *v1;
+
+		/* the ID3v2 tag takes precedence */
+		v1 = gst_tag_list_new_from_id3v1 (id3v1);
+		if (v1 != NULL) {
+			gst_tag_list_insert (reader->tags, v1, GST_TAG_MERGE_KEEP);
+			gst_tag_list_free (v1);
+		}
+		*audio_end -= 128;
+	}
+
+	if (*audio_end >= 32 &&
+	    read_at (reader, *audio_end - 32, ape, sizeof (ape)) &&
+	    memcmp (ape, "APETAGEX", 8) == 0) {
+		rb_debug ("file has an APE tag");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static const guint mpeg1_l3_bitrates[] = {
+	0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0
+};
+static const guint mpeg2_l3_bitrates[] = {
+	0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0
+};
+static const guint mpeg_rates[3][3] = {
+	{ 44100, 48000, 32000 },	/* MPEG 1 */
+	{ 22050, 24000, 16000 },	/* MPEG 2 */
+	{ 11025, 12000, 8000 }		/* MPEG 2.5 */
+};
+
+typedef struct
+{
+	int version;			/* 0 = MPEG 1, 1 = MPEG 2, 2 = MPEG 2.5 */
+	guint bitrate;			/* kbps */
+	guint rate;
+	gboolean mono;
+	guint frame_size;
+	guint samples;
+} MPEGHeader;
+
+static gboolean
+parse_mpeg_header (const guint8 *data, MPEGHeader *header)
+{
+	int version_bits;
+	int rate_index;
+	int bitrate_index;
+
+	if (data[0] != 0xff || (data[1] & 0xe0) != 0xe0)
+		return FALSE;
+
+	/* only layer III */
+	if (((data[1] >> 1) & 0x03) != 1)
+		return FALSE;
+
+	version_bits = (data[1] >> 3) & 0x03;
+	switch (version_bits) {
+	case 3: header->version = 0; break;
+	case 2: header->version = 1; break;
+	case 0: header->version = 2; break;
+	default: return FALSE;
+	}
+
+	bitrate_index = data[2] >> 4;
+	rate_index = (data[2] >> 2) & 0x03;
+	if (bitrate_index == 0 || bitrate_index == 15 || rate_index == 3)
+		return FALSE;
+
+	if (header->version == 0) {
+		header->bitrate = mpeg1_l3_bitrates[bitrate_index];
+		header->samples = 1152;
+	} else {
+		header->bitrate = mpeg2_l3_bitrates[bitrate_index];
+		header->samples = 576;
+	}
+	header->rate = mpeg_rates[header->version][rate_index];
+	header->mono = ((data[3] >> 6) == 3);
+	header->frame_size = ((header->version == 0) ? 144000 : 72000) * header->bitrate / header->rate;
+	header->frame_size += (data[2] >> 1) & 0x01;
+	return TRUE;
+}
+
+static gboolean
+read_mpeg_audio (RBMetaDataNativeReader *reader, guint64 start, guint64 end)
+{
+	guint8 buf[MPEG_SYNC_SEARCH + 256];
+	guint8 next[4];
+	MPEGHeader header;
+	MPEGHeader next_header;
+	guint64 frame_start;
+	guint64 frames = 0;
+	guint64 bytes = 0;
+	gsize len;
+	gsize i;
+	gsize side_info;
+
+	if (end <= start + 4)
+		return FALSE;
+	len = MIN (sizeof (buf), end - start);
+	if (read_at (reader, start, buf, len) == FALSE)
+		return FALSE;
+
+	for (i = 0; i + 4 <= MIN (len, MPEG_SYNC_SEARCH); i++) {
+		if (parse_mpeg_header (buf + i, &header))
+			break;
+	}
+	if (i + 4 > MIN (len, MPEG_SYNC_SEARCH)) {
+		rb_debug ("no MPEG audio frame found after the ID3 tag");
+		return FALSE;
+	}
+	frame_start = start + i;
+
+	/* make sure this wasn't a false sync by checking the next frame */
+	if (frame_start + header.frame_size + 4 <= end) {
+		if (read_at (reader, frame_start + header.frame_size, next, sizeof (next)) == FALSE ||
+		    parse_mpeg_header (next, &next_header) == FALSE ||
+		    next_header.version != header.version ||
+		    next_header.rate != header.rate) {
+			rb_debug ("MPEG frame sync at %" G_GUINT64_FORMAT " not followed by another frame", frame_start);
+			return FALSE;
+		}
+	}
+
+	/* look for a Xing/Info or VBRI header in the first frame */
+	if (header.version == 0)
+		side_info = header.mono ? 17 : 32;
+	else
+		side_info = header.mono ? 9 : 17;
+
+	if (i + 4 + side_info + 16 <= len &&
+	    (memcmp (buf + i + 4 + side_info, "Xing", 4) == 0 ||
+	     memcmp (buf + i + 4 + side_info, "Info", 4) == 0)) {
+		const guint8 *xing = buf + i + 4 + side_info;
+		guint32 flags;
+		gsize offset = 8;
+
+		flags = GST_READ_UINT32_BE (xing + 4);
+		if (flags & 0x1) {
+			frames = GST_READ_UINT32_BE (xing + offset);
+			offset += 4;
+		}
+		if (flags & 0x2) {
+			bytes = GST_READ_UINT32_BE (xing + offset);
+		}
+	} else if (i + 4 + 32 + 18 <= len &&
+		   memcmp (buf + i + 4 + 32, "VBRI", 4) == 0) {
+		const guint8 *vbri = buf + i + 4 + 32;
+
+		bytes = GST_READ_UINT32_BE (vbri + 10);
+		frames = GST_READ_UINT32_BE (vbri + 14);
+	}
+
+	if (frames > 0) {
+		guint64 samples = frames * header.samples;
+
+		add_duration (reader, samples, header.rate);
+		if (bytes == 0)
+			bytes = end - frame_start;
+		add_bitrate (reader, gst_util_uint64_scale (bytes * 8, header.rate, samples));
+	} else {
+		/* constant bitrate */
+		add_duration (reader, (end - frame_start) * 8, header.bitrate * 1000);
+		add_bitrate (reader, header.bitrate * 1000);
+	}
+
+	reader->decoder_caps = "audio/mpeg, mpegversion=(int)1, layer=(int)3";
+	return TRUE;
+}
+
+static gboolean
+read_id3_mp3 (RBMetaDataNativeReader *reader)
+{
+	guint64 tag_end;
+	guint64 audio_end;
+
+	if (read_id3v2 (reader, &tag_end) == FALSE)
+		return FALSE;
+	if (read_trailing_tags (reader, &audio_end) == FALSE)
+		return FALSE;
+	if (read_mpeg_audio (reader, tag_end, audio_end) == FALSE)
+		return FALSE;
+
+	reader->type = "application/x-id3";
+	return TRUE;
+}
+
+/* FLAC */
+
+static gboolean
+read_flac (RBMetaDataNativeReader *reader)
+{
+	guint8 header[4];
+	guint8 streaminfo[18];
+	guint64 pos = 4;
+	guint64 total_samples = 0;
+	guint rate = 0;
+	gboolean last = FALSE;
+
+	while (last == FALSE) {
+		guint32 len;
+		int type;
+
+		if (read_at (reader, pos, header, sizeof (header)) == FALSE)
+			return FALSE;
+		last = (header[0] & 0x80) != 0;
+		type = header[0] & 0x7f;
+		len = GST_READ_UINT24_BE (header + 1);
+		pos += sizeof (header);
+
+		switch (type) {
+		case 0:		/* STREAMINFO */
+			if (len < sizeof (streaminfo) ||
+			    read_at (reader, pos, streaminfo, sizeof (streaminfo)) == FALSE)
+				return FALSE;
+			rate = (streaminfo[10] << 12) | (streaminfo[11] << 4) | (streaminfo[12] >> 4);
+			total_samples = ((guint64) (streaminfo[13] & 0x0f) << 32) |
+					GST_READ_UINT32_BE (streaminfo + 14);
+			break;
+
+		case 4:		/* VORBIS_COMMENT */
+		{
+			guint8 *data;
+			gboolean ok;
+
+			data = read_block (reader, pos, len);
+			if (data == NULL)
+				return FALSE;
+			ok = add_vorbis_comments (reader, data, len, NULL, 0);
+			g_free (data);
+			if (ok == FALSE)
+				return FALSE;
+			break;
+		}
+
+		case 127:
+			return FALSE;
+
+		default:
+			break;
+		}
+		pos += len;
+	}
+
+	if (rate == 0)
+		return FALSE;
+	if (total_samples > 0)
+		add_duration (reader, total_samples, rate);
+
+	reader->type = "audio/x-flac";
+	reader->decoder_caps = "audio/x-flac";
+	return TRUE;
+}
+
+/* Ogg */
+
+typedef struct
+{
+	guint64 offset;			/* of the next page */
+	guint32 serial;
+	guint8 segments[255];
+	guint n_segments;
+	guint segment;
+	guint8 *body;
+	gsize body_pos;
+} OggReader;
+
+static gboolean
+ogg_read_page (RBMetaDataNativeReader *reader, OggReader *ogg, gboolean first)
+{
+	guint8 header[27];
+	gsize body_len = 0;
+	guint i;
+
+	if (read_at (reader, ogg->offset, header, sizeof (header)) == FALSE ||
+	    memcmp (header, "OggS", 4) != 0 ||
+	    header[4] != 0)
+		return FALSE;
+
+	if (first) {
+		if ((header[5] & 0x02) == 0)
+			return FALSE;
+		ogg->serial = GST_READ_UINT32_LE (header + 14);
+	} else if (GST_READ_UINT32_LE (header + 14) != ogg->serial || (header[5] & 0x02)) {
+		/* another logical stream; leave these to the pipeline */
+		rb_debug ("multiplexed ogg stream");
+		return FALSE;
+	}
+
+	ogg->n_segments = header[26];
+	if (read_at (reader, ogg->offset + sizeof (header), ogg->segments, ogg->n_segments) == FALSE)
+		return FALSE;
+	for (i = 0; i < ogg->n_segments; i++)
+		body_len += ogg->segments[i];
+
+	g_free (ogg->body);
+	ogg->body = read_block (reader, ogg->offset + sizeof (header) + ogg->n_segments, body_len);
+	if (ogg->body == NULL)
+		return FALSE;
+
+	ogg->offset += sizeof (header) + ogg->n_segments + body_len;
+	ogg->segment = 0;
+	ogg->body_pos = 0;
+	return TRUE;
+}
+
+static GByteArray *
+ogg_next_packet (RBMetaDataNativeReader *reader, OggReader *ogg)
+{
+	GByteArray *packet;
+
+	packet = g_byte_array_new ();
+	while (TRUE) {
+		guint8 len;
+
+		if (ogg->segment == ogg->n_segments &&
+		    ogg_read_page (reader, ogg, FALSE) == FALSE)
+			break;
+
+		len = ogg->segments[ogg->segment++];
+		g_byte_array_append (packet, ogg->body + ogg->body_pos, len);
+		ogg->body_pos += len;
+
+		if (len < 255)
+			return packet;
+		if (packet->len > MAX_TAG_SIZE)
+			break;
+	}
+
+	g_byte_array_free (packet, TRUE);
+	return NULL;
+}
+
+static gboolean
+ogg_last_granule (RBMetaDataNativeReader *reader, guint32 serial, guint64 *granule)
+{
+	guint8 *tail;
+	gsize len;
+	gsize i;
+
+	len = MIN (reader->size, OGG_TAIL_SIZE);
+	tail = read_block (reader, reader->size - len, len);
+	if (tail == NULL)
+		return FALSE;
+
+	for (i = len - 27 + 1; i > 0; i--) {
+		const guint8 *page = tail + i - 1;
+
+		if (memcmp (page, "OggS", 4) == 0 &&
+		    page[4] == 0 &&
+		    GST_READ_UINT32_LE (page + 14) == serial &&
+		    GST_READ_UINT64_LE (page + 6) != G_MAXUINT64) {
+			*granule = GST_READ_UINT64_LE (page + 6);
+			g_free (tail);
+			return TRUE;
+		}
+	}
+
+	g_free (tail);
+	return FALSE;
+}
+
+static gboolean
+read_ogg (RBMetaDataNativeReader *reader)
+{
+	OggReader ogg;
+	GByteArray *ident = NULL;
+	GByteArray *comments = NULL;
+	const guint8 *comment_id;
+	guint comment_id_len;
+	guint64 granule;
+	gboolean ok = FALSE;
+
+	if (reader->size < 27)
+		return FALSE;
+
+	memset (&ogg, 0, sizeof (ogg));
+	if (ogg_read_page (reader, &ogg, TRUE) == FALSE)
+		goto out;
+
+	ident = ogg_next_packet (reader, &ogg);
+	comments = ogg_next_packet (reader, &ogg);
+	if (ident == NULL || comments == NULL)
+		goto out;
+
+	if (ident->len >= 30 && memcmp (ident->data, "\001vorbis", 7) == 0) {
+		guint rate;
+		gint32 nominal;
+
+		rate = GST_READ_UINT32_LE (ident->data + 12);
+		nominal = GST_READ_UINT32_LE (ident->data + 20);
+		if (rate == 0)
+			goto out;
+
+		comment_id = (const guint8 *) "\003vorbis";
+		comment_id_len = 7;
+		if (ogg_last_granule (reader, ogg.serial, &granule) == FALSE)
+			goto out;
+		add_duration (reader, granule, rate);
+		if (nominal > 0)
+			add_bitrate (reader, nominal);
+		reader->decoder_caps = "audio/x-vorbis";
+	} else if (ident->len >= 19 && memcmp (ident->data, "OpusHead", 8) == 0) {
+		guint16 pre_skip;
+
+		pre_skip = GST_READ_UINT16_LE (ident->data + 10);
+		comment_id = (const guint8 *) "OpusTags";
+		comment_id_len = 8;
+		if (ogg_last_granule (reader, ogg.serial, &granule) == FALSE)
+			goto out;
+		add_duration (reader, (granule > pre_skip) ? granule - pre_skip : 0, 48000);
+		reader->decoder_caps = "audio/x-opus";
+	} else {
+		rb_debug ("unsupported ogg codec");
+		goto out;
+	}
+
+	if (add_vorbis_comments (reader, comments->data, comments->len, comment_id, comment_id_len) == FALSE)
+		goto out;
+
+	reader->type = "application/ogg";
+	ok = TRUE;
+out:
+	if (ident != NULL)
+		g_byte_array_free (ident, TRUE);
+	if (comments != NULL)
+		g_byte_array_free (comments, TRUE);
+	g_free (ogg.body);
+	return ok;
+}
+
+/* MP4 */
+
+/* finds the first child box of the given type in a box's payload */
+static const guint8 *
+mp4_child (const guint8 *data, gsize len, const char *type, gsize *child_len)
+{
+	gsize pos = 0;
+
+	while (pos + 8 <= len) {
+		guint64 size;
+		gsize header = 8;
+
+		size = GST_READ_UINT32_BE (data + pos);
+		if (size == 1) {
+			if (pos + 16 > len)
+				return NULL;
+			size = GST_READ_UINT64_BE (data + pos + 8);
+			header = 16;
+		} else if (size == 0) {
+			size = len - pos;
+		}
+		if (size < header || size > len - pos)
+			return NULL;
+
+		if (type == NULL || memcmp (data + pos + 4, type, 4) == 0) {
+			*child_len = size - header;
+			return data + pos + header;
+		}
+		pos += size;
+	}
+	return NULL;
+}
+
+static const guint8 *
+mp4_path (const guint8 *data, gsize len, const char *path, gsize *child_len)
+{
+	char **types;
+	int i;
+
+	types = g_strsplit (path, "/", -1);
+	for (i = 0; types[i] != NULL && data != NULL; i++) {
+		data = mp4_child (data, len, types[i], &len);
+	}
+	g_strfreev (types);
+
+	*child_len = len;
+	return data;
+}
+
+static gsize
+mp4_descriptor_length (const guint8 *data, gsize len, gsize *pos)
+{
+	gsize length = 0;
+	int i;
+
+	for (i = 0; i < 4 && *pos < len; i++) {
+		guint8 b = data[(*pos)++];
+		length = (length << 7) | (b & 0x7f);
+		if ((b & 0x80) == 0)
+			break;
+	}
+	return length;
+}
+
+/* reads the codec and average bitrate from an esds box */
+static gboolean
+mp4_parse_esds (RBMetaDataNativeReader *reader, const guint8 *data, gsize len)
+{
+	gsize pos = 4;		/* version and flags */
+	guint8 flags;
+
+	if (pos >= len || data[pos++] != 0x03)
+		return FALSE;
+	mp4_descriptor_length (data, len, &pos);
+	if (pos + 3 > len)
+		return FALSE;
+	pos += 2;		/* ES_ID */
+	flags = data[pos++];
+	if (flags & 0x80)
+		pos += 2;
+	if ((flags & 0x40) && pos < len)
+		pos += 1 + data[pos];
+	if (flags & 0x20)
+		pos += 2;
+
+	if (pos >= len || data[pos++] != 0x04)
+		return FALSE;
+	mp4_descriptor_length (data, len, &pos);
+	if (pos + 13 > len)
+		return FALSE;
+
+	switch (data[pos]) {
+	case 0x40:		/* MPEG-4 audio */
+	case 0x66:		/* MPEG-2 AAC */
+	case 0x67:
+	case 0x68:
+		reader->decoder_caps = "audio/mpeg, mpegversion=(int)4";
+		break;
+	case 0x69:		/* MPEG-2 audio */
+	case 0x6b:		/* MPEG-1 audio */
+		reader->decoder_caps = "audio/mpeg, mpegversion=(int)1";
+		break;
+	default:
+		rb_debug ("unsupported mp4 object type %x", data[pos]);
+		return FALSE;
+	}
+
+	add_bitrate (reader, GST_READ_UINT32_BE (data + pos + 9));
+	return TRUE;
+}
+
+static gboolean
+mp4_parse_audio_trak (RBMetaDataNativeReader *reader, const guint8 *trak, gsize trak_len)
+{
+	const guint8 *stsd;
+	const guint8 *entry;
+	const guint8 *esds;
+	gsize len;
+	gsize entry_len;
+	gsize esds_len;
+	gsize skip;
+
+	stsd = mp4_path (trak, trak_len, "mdia/minf/stbl/stsd", &len);
+	if (stsd == NULL || len < 8)
+		return FALSE;
+
+	/* first sample entry, after version, flags and entry count */
+	entry = mp4_child (stsd + 8, len - 8, NULL, &entry_len);
+	if (entry == NULL || memcmp (entry - 4, "mp4a", 4) != 0 || entry_len < 28) {
+		rb_debug ("unsupported mp4 sample entry");
+		return FALSE;
+	}
+
+	/* sound sample description, with version 1 and 2 extensions */
+	switch (GST_READ_UINT16_BE (entry + 8)) {
+	case 0: skip = 28; break;
+	case 1: skip = 28 + 16; break;
+	case 2: skip = 28 + 36; break;
+	default: return FALSE;
+	}
+	if (skip > entry_len)
+		return FALSE;
+
+	esds = mp4_child (entry + skip, entry_len - skip, "esds", &esds_len);
+	if (esds == NULL)
+		return FALSE;
+	return mp4_parse_esds (reader, esds, esds_len);
+}
+
+static guint64
+mp4_data_uint (const guint8 *value, gsize len)
+{
+	switch (len) {
+	case 1: return value[0];
+	case 2: return GST_READ_UINT16_BE (value);
+	case 4: return GST_READ_UINT32_BE (value);
+	case 8: return GST_READ_UINT64_BE (value);
+	default: return 0;
+	}
+}
+
+static void
+mp4_add_item (RBMetaDataNativeReader *reader, const guint8 *type, const guint8 *item, gsize item_len)
+{
+	static const struct {
+		const char *type;
+		const char *tag;
+	} string_items[] = {
+		{ "\251nam", GST_TAG_TITLE },
+		{ "\251ART", GST_TAG_ARTIST },
+		{ "\251alb", GST_TAG_ALBUM },
+		{ "\251gen", GST_TAG_GENRE },
+		{ "\251cmt", GST_TAG_COMMENT },
+		{ "cprt", GST_TAG_COPYRIGHT },
+		{ "desc", GST_TAG_DESCRIPTION },
+		{ "soar", GST_TAG_ARTIST_SORTNAME },
+		{ "soal", GST_TAG_ALBUM_SORTNAME },
+#if GST_CHECK_VERSION(0,10,25)
+		{ "aART", GST_TAG_ALBUM_ARTIST },
+		{ "soaa", GST_TAG_ALBUM_ARTIST_SORTNAME },
+#endif
+	};
+	static const struct {
+		const char *name;
+		const char *tag;
+	} freeform_items[] = {
+		{ "MusicBrainz Track Id", GST_TAG_MUSICBRAINZ_TRACKID },
+		{ "MusicBrainz Artist Id", GST_TAG_MUSICBRAINZ_ARTISTID },
+		{ "MusicBrainz Album Id", GST_TAG_MUSICBRAINZ_ALBUMID },
+		{ "MusicBrainz Album Artist Id", GST_TAG_MUSICBRAINZ_ALBUMARTISTID },
+	};
+	const guint8 *data;
+	const guint8 *value;
+	gsize data_len;
+	gsize value_len;
+	int i;
+
+	data = mp4_child (item, item_len, "data", &data_len);
+	if (data == NULL || data_len < 8)
+		return;
+	value = data + 8;		/* type and locale */
+	value_len = data_len - 8;
+
+	for (i = 0; i < G_N_ELEMENTS (string_items); i++) {
+		if (memcmp (type, string_items[i].type, 4) == 0) {
+			add_string (reader, string_items[i].tag, g_strndup ((const char *) value, value_len));
+			return;
+		}
+	}
+
+	if (memcmp (type, "\251day", 4) == 0) {
+		char *str = g_strndup ((const char *) value, value_len);
+		add_date (reader, str);
+		g_free (str);
+	} else if (memcmp (type, "trkn", 4) == 0 && value_len >= 6) {
+		add_number_pair (reader, GST_TAG_TRACK_NUMBER, GST_TAG_TRACK_COUNT,
+				 GST_READ_UINT16_BE (value + 2), GST_READ_UINT16_BE (value + 4));
+	} else if (memcmp (type, "disk", 4) == 0 && value_len >= 6) {
+		add_number_pair (reader, GST_TAG_ALBUM_VOLUME_NUMBER, GST_TAG_ALBUM_VOLUME_COUNT,
+				 GST_READ_UINT16_BE (value + 2), GST_READ_UINT16_BE (value + 4));
+	} else if (memcmp (type, "gnre", 4) == 0 && value_len >= 2) {
+		/* ID3v1 genre index, plus one */
+		guint index = GST_READ_UINT16_BE (value);
+		if (index > 0)
+			add_genre_index (reader, index - 1);
+	} else if (memcmp (type, "tmpo", 4) == 0) {
+		guint64 bpm = mp4_data_uint (value, value_len);
+		if (bpm > 0)
+			gst_tag_list_add (reader->tags, GST_TAG_MERGE_APPEND,
+					  GST_TAG_BEATS_PER_MINUTE, (gdouble) bpm, NULL);
+	} else if (memcmp (type, "----", 4) == 0) {
+		const guint8 *name;
+		gsize name_len;
+
+		name = mp4_child (item, item_len, "name", &name_len);
+		if (name == NULL || name_len < 4)
+			return;
+		name += 4;		/* version and flags */
+		name_len -= 4;
+		for (i = 0; i < G_N_ELEMENTS (freeform_items); i++) {
+			if (name_len == strlen (freeform_items[i].name) &&
+			    memcmp (name, freeform_items[i].name, name_len) == 0) {
+				add_string (reader, freeform_items[i].tag, g_strndup ((const char *) value, value_len));
+				break;
+			}
+		}
+	}
+}
+
+static void
+mp4_parse_ilst (RBMetaDataNativeReader *reader, const guint8 *moov, gsize moov_len)
+{
+	const guint8 *meta;
+	const guint8 *ilst;
+	gsize meta_len;
+	gsize ilst_len;
+	gsize pos;
+
+	meta = mp4_path (moov, moov_len, "udta/meta", &meta_len);
+	if (meta == NULL)
+		return;
+
+	/* meta is usually a full box, but not always */
+	if (meta_len >= 12 && memcmp (meta + 4, "hdlr", 4) != 0 && memcmp (meta + 8, "hdlr", 4) == 0) {
+		meta += 4;
+		meta_len -= 4;
+	} else if (meta_len >= 4 && GST_READ_UINT32_BE (meta) == 0) {
+		meta += 4;
+		meta_len -= 4;
+	}
+
+	ilst = mp4_child (meta, meta_len, "ilst", &ilst_len);
+	if (ilst == NULL)
+		return;
+
+	pos = 0;
+	while (pos + 8 <= ilst_len) {
+		guint32 size = GST_READ_UINT32_BE (ilst + pos);
+
+		if (size < 8 || size > ilst_len - pos)
+			break;
+		mp4_add_item (reader, ilst + pos + 4, ilst + pos + 8, size - 8);
+		pos += size;
+	}
+}
+
+static gboolean
+read_mp4 (RBMetaDataNativeReader *reader)
+{
+	guint8 header[16];
+	guint8 *moov = NULL;
+	const guint8 *mvhd;
+	gsize moov_len = 0;
+	gsize mvhd_len;
+	gsize pos;
+	guint64 offset = 0;
+	int audio_traks = 0;
+	gboolean ok = FALSE;
+
+	/* only files that identify themselves as audio */
+	if (read_at (reader, 0, header, 12) == FALSE ||
+	    memcmp (header + 4, "ftyp", 4) != 0 ||
+	    memcmp (header + 8, "M4A ", 4) != 0)
+		return FALSE;
+
+	/* find the moov box, which may come after the media data */
+	while (offset + 8 <= reader->size) {
+		guint64 size;
+		gsize header_len = 8;
+
+		if (read_at (reader, offset, header, 8) == FALSE)
+			return FALSE;
+		size = GST_READ_UINT32_BE (header);
+		if (size == 1) {
+			if (read_at (reader, offset + 8, header + 8, 8) == FALSE)
+				return FALSE;
+			size = GST_READ_UINT64_BE (header + 8);
+			header_len = 16;
+		} else if (size == 0) {
+			size = reader->size - offset;
+		}
+		if (size < header_len || size > reader->size - offset)
+			return FALSE;
+
+		if (memcmp (header + 4, "moov", 4) == 0) {
+			moov_len = size - header_len;
+			moov = read_block (reader, offset + header_len, moov_len);
+			break;
+		}
+		offset += size;
+	}
+	if (moov == NULL)
+		return FALSE;
+
+	/* exactly one track, and it has to be audio */
+	pos = 0;
+	while (pos + 8 <= moov_len) {
+		guint32 size = GST_READ_UINT32_BE (moov + pos);
+		const guint8 *hdlr;
+		gsize hdlr_len;
+
+		if (size < 8 || size > moov_len - pos)
+			goto out;
+		if (memcmp (moov + pos + 4, "trak", 4) == 0) {
+			hdlr = mp4_path (moov + pos + 8, size - 8, "mdia/hdlr", &hdlr_len);
+			if (hdlr == NULL || hdlr_len < 12 || memcmp (hdlr + 8, "soun", 4) != 0) {
+				rb_debug ("mp4 file has a non-audio track");
+				goto out;
+			}
+			if (++audio_traks > 1 ||
+			    mp4_parse_audio_trak (reader, moov + pos + 8, size - 8) == FALSE)
+				goto out;
+		}
+		pos += size;
+	}
+	if (audio_traks != 1)
+		goto out;
+
+	mvhd = mp4_child (moov, moov_len, "mvhd", &mvhd_len);
+	if (mvhd == NULL || mvhd_len < 1)
+		goto out;
+	if (mvhd[0] == 1 && mvhd_len >= 32) {
+		guint32 timescale = GST_READ_UINT32_BE (mvhd + 20);
+		if (timescale > 0)
+			add_duration (reader, GST_READ_UINT64_BE (mvhd + 24), timescale);
+	} else if (mvhd[0] == 0 && mvhd_len >= 20) {
+		guint32 timescale = GST_READ_UINT32_BE (mvhd + 12);
+		if (timescale > 0)
+			add_duration (reader, GST_READ_UINT32_BE (mvhd + 16), timescale);
+	} else {
+		goto out;
+	}
+
+	mp4_parse_ilst (reader, moov, moov_len);
+
+	reader->type = "audio/x-m4a";
+	ok = TRUE;
+out:
+	g_free (moov);
+	return ok;
+}
+
+/**
+ * rb_metadata_native_load:
+ * @uri: URI of the file to read
+ * @type: returns the media type of the file, as GStreamer's typefinder
+ *   would report it
+ * @decoder_caps: returns caps describing the audio stream, for checking
+ *   that it can be decoded
+ * @tags: returns the tags and duration read from the file
+ *
+ * Attempts to read tags from a local file without using GStreamer.
+ * If the file isn't in one of the supported formats, or there's anything
+ * unusual about it, this returns FALSE and the file should be read using
+ * the GStreamer pipeline instead.
+ *
+ * Return value: TRUE if the file was read
+ */
+gboolean
+rb_metadata_native_load (const char *uri,
+			 char **type,
+			 char **decoder_caps,
+			 GstTagList **tags)
+{
+	RBMetaDataNativeReader reader;
+	guint8 magic[12];
+	char *filename;
+	gboolean ok = FALSE;
+
+	filename = g_filename_from_uri (uri, NULL, NULL);
+	if (filename == NULL)
+		return FALSE;
+
+	memset (&reader, 0, sizeof (reader));
+	reader.fp = fopen (filename, "rb");
+	g_free (filename);
+	if (reader.fp == NULL)
+		return FALSE;
+
+	if (fseeko (reader.fp, 0, SEEK_END) != 0) {
+		fclose (reader.fp);
+		return FALSE;
+	}
+	reader.size = ftello (reader.fp);
+	reader.tags = gst_tag_list_new ();
+
+	if (read_at (&reader, 0, magic, sizeof (magic))) {
+		if (memcmp (magic, "ID3", 3) == 0) {
+			ok = read_id3_mp3 (&reader);
+		} else if (memcmp (magic, "fLaC", 4) == 0) {
+			ok = read_flac (&reader);
+		} else if (memcmp (magic, "OggS", 4) == 0) {
+			ok = read_ogg (&reader);
+		} else if (memcmp (magic + 4, "ftyp", 4) == 0) {
+			ok = read_mp4 (&reader);
+		}
+	}
+	fclose (reader.fp);
+
+	if (ok == FALSE) {
+		rb_debug ("not reading %s natively", uri);
+		gst_tag_list_free (reader.tags);
+		return FALSE;
+	}
+
+	rb_debug ("read %s natively as %s", uri, reader.type);
+	*type = g_strdup (reader.type);
+	*decoder_caps = g_strdup (reader.decoder_caps);
+	*tags = reader.tags;
+	return TRUE;
+}
@@ -135,12 +135,26 @@ void		rb_metadata_load	(RBMetaData *md,
 					 const char *uri,
 					 GError **error);
 
+typedef void	(*RBMetaDataLoadFunc)	(RBMetaData *md,
+					 guint index,
+					 GError *error,
+					 gpointer user_data);
+
+void		rb_metadata_load_batch	(const char **uris,
+					 RBMetaDataLoadFunc func,
+					 gpointer user_data);
+
 void		rb_metadata_save	(RBMetaData *md,
 					 const char *uri,
 					 GError **error);
 
+guint		rb_metadata_get_max_parallel (void);
+
 const char *	rb_metadata_get_mime	(RBMetaData *md);
 
+void		rb_metadata_set_audio_type (RBMetaData *md,
+					 const char *mimetype);
+
 gboolean	rb_metadata_has_missing_plugins (RBMetaData *md);
 
 gboolean	rb_metadata_get_missing_plugins (RBMetaData *md,
@@ -872,34 +872,26 @@ episode_activated_cb (RBEntryView *view,
 }
 
 static void
-podcast_entry_changed_cb (RhythmDB *db,
-			  RhythmDBEntry *entry,
-			  GValueArray *changes,
-			  RBPodcastSource *source)
+podcast_entries_changed_cb (RhythmDB *db,
+			    RhythmDBEntryChangeSet *changes,
+			    RBPodcastSource *source)
 {
-	RhythmDBEntryType *entry_type;
-	gboolean feed_changed;
-	int i;
+	guint n_entries;
+	guint i;
 
-	entry_type = rhythmdb_entry_get_entry_type (entry);
-	if (entry_type != RHYTHMDB_ENTRY_TYPE_PODCAST_FEED)
-		return;
-
-	feed_changed = FALSE;
-	for (i = 0; i < changes->n_values; i++) {
-		GValue *v = g_value_array_get_nth (changes, i);
-		RhythmDBEntryChange *change = g_value_get_boxed (v);
-
-		if (change->prop == RHYTHMDB_PROP_PLAYBACK_ERROR) {
-			feed_changed = TRUE;
-			break;
-		}
-	}
-
-	if (feed_changed) {
+	n_entries = rhythmdb_entry_change_set_get_n_entries (changes);
+	for (i = 0; i < n_entries; i++) {
+		RhythmDBEntry *entry;
 		const char *loc;
 		GtkTreeIter iter;
 
+		entry = rhythmdb_entry_change_set_get_entry (changes, i);
+		if (rhythmdb_entry_get_entry_type (entry) != RHYTHMDB_ENTRY_TYPE_PODCAST_FEED)
+			continue;
+
+		if (rhythmdb_entry_change_set_has_prop (changes, i, RHYTHMDB_PROP_PLAYBACK_ERROR) == FALSE)
+			continue;
+
 		loc = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION);
 		if (rhythmdb_property_model_iter_from_string (source->priv->feed_model,
 							      loc,
@@ -1494,8 +1486,8 @@ impl_constructed (GObject *object)
 
 	/* redraw error indicator when errors are set or cleared */
 	g_signal_connect_object (source->priv->db,
-				 "entry_changed",
-				 G_CALLBACK (podcast_entry_changed_cb),
+				 "entries-changed",
+				 G_CALLBACK (podcast_entries_changed_cb),
 				 source, 0);
 
 	/* title column */
@@ -0,0 +1,401 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Directory manifest
+ *
+ * Every file in the library is checked when the database is loaded, to
+ * find files that have been changed or removed while Rhythmbox wasn't
+ * running.  For large libraries that are mostly left alone, almost all of
+ * these checks find nothing.
+ *
+ * To avoid them, the modification time of each local directory containing
+ * entries, and the number of entries in it, is written next to the
+ * database (as <name>.dirs) after the files have been checked.  On the
+ * next startup, each directory is checked once; if its modification time
+ * and entry count still match the manifest, the files in it are assumed
+ * to be unchanged and are not checked individually.  Hidden entries (files
+ * that were missing last time) are always checked, and a directory is
+ * left out of the manifest if checking any of the files in it failed, so
+ * missing files are never assumed to still be there.  A directory's
+ * modification time changes when files are created, removed or renamed in
+ * it, which covers files being replaced by a new version (as our own tag
+ * writer does), but not files edited in place.
+ *
+ * The file format is one line per directory:
+ *   <mtime> <entry count> <directory uri>
+ * following a version line.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "rb-debug.h"
+#include "rhythmdb.h"
+#include "rhythmdb-private.h"
+
+#define RHYTHMDB_DIR_MANIFEST_VERSION	"rhythmdb-dirs 1"
+
+struct _RhythmDBDirManifest
+{
+	char *path;
+	GHashTable *old_dirs;
+	GHashTable *new_dirs;	/* locked while the files are being checked */
+	GMutex *lock;
+};
+
+typedef struct
+{
+	guint64 mtime;
+	guint count;
+} RhythmDBDirManifestItem;
+
+static RhythmDBDirManifestItem *
+manifest_item_new (guint64 mtime, guint count)
+{
+	RhythmDBDirManifestItem *item;
+
+	item = g_slice_new0 (RhythmDBDirManifestItem);
+	item->mtime = mtime;
+	item->count = count;
+	return item;
+}
+
+static void
+manifest_item_free (RhythmDBDirManifestItem *item)
+{
+	g_slice_free (RhythmDBDirManifestItem, item);
+}
+
+static GHashTable *
+manifest_table_new (void)
+{
+	return g_hash_table_new_full (g_str_hash,
+				      g_str_equal,
+				      g_free,
+				      (GDestroyNotify) manifest_item_free);
+}
+
+static void
+manifest_read (RhythmDBDirManifest *manifest)
+{
+	char *contents;
+	char **lines;
+	GError *error = NULL;
+	int i;
+
+	if (g_file_get_contents (manifest->path, &contents, NULL, &error) == FALSE) {
+		rb_debug ("unable to read directory manifest %s: %s", manifest->path, error->message);
+		g_clear_error (&error);
+		return;
+	}
+
+	lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+
+	if (lines[0] == NULL || strcmp (lines[0], RHYTHMDB_DIR_MANIFEST_VERSION) != 0) {
+		rb_debug ("ignoring directory manifest %s with unknown version", manifest->path);
+		g_strfreev (lines);
+		return;
+	}
+
+	for (i = 1; lines[i] != NULL; i++) {
+		guint64 mtime;
+		gulong count;
+		char *p;
+		char *end;
+
+		if (lines[i][0] == '\0')
+			continue;
+
+		p = lines[i];
+		mtime = g_ascii_strtoull (p, &end, 10);
+		if (end == p || *end != ' ')
+			continue;
+		p = end + 1;
+		count = strtoul (p, &end, 10);
+		if (end == p || *end != ' ' || end[1] == '\0')
+			continue;
+
+		g_hash_table_replace (manifest->old_dirs,
+				      g_strdup (end + 1),
+				      manifest_item_new (mtime, count));
+	}
+	g_strfreev (lines);
+
+	rb_debug ("read %d directories from manifest %s",
+		  g_hash_table_size (manifest->old_dirs),
+		  manifest->path);
+}
+
+/**
+ * rhythmdb_dir_manifest_load:
+ * @db: the #RhythmDB
+ *
+ * Reads the directory manifest saved alongside the database, if any.
+ *
+ * Return value: the manifest, or NULL if the database has no name
+ */
+RhythmDBDirManifest *
+rhythmdb_dir_manifest_load (RhythmDB *db)
+{
+	RhythmDBDirManifest *manifest;
+
+	if (db->priv->name == NULL)
+		return NULL;
+
+	manifest = g_new0 (RhythmDBDirManifest, 1);
+	manifest->path = g_strconcat (db->priv->name, ".dirs", NULL);
+	manifest->old_dirs = manifest_table_new ();
+	manifest->new_dirs = manifest_table_new ();
+	manifest->lock = g_mutex_new ();
+
+	manifest_read (manifest);
+	return manifest;
+}
+
+static char *
+event_directory (RhythmDBEvent *event)
+{
+	const char *uri;
+	const char *slash;
+
+	/* only entries already in the database can be skipped.  hidden
+	 * entries have to be checked to find out if they've come back.
+	 */
+	if (event->entry == NULL)
+		return NULL;
+	if (rhythmdb_entry_get_boolean (event->entry, RHYTHMDB_PROP_HIDDEN))
+		return NULL;
+
+	uri = rb_refstring_get (event->uri);
+	if (g_str_has_prefix (uri, "file://") == FALSE)
+		return NULL;
+
+	slash = strrchr (uri, '/');
+	if (slash == NULL || slash[1] == '\0')
+		return NULL;
+
+	return g_strndup (uri, slash - uri);
+}
+
+static void
+skip_stat (RhythmDBEvent *event)
+{
+	/* the stat only asks for the modification time, so a file info
+	 * carrying the mtime we already have is indistinguishable from
+	 * an unchanged file.
+	 */
+	event->real_uri = rb_refstring_ref (event->uri);
+	event->file_info = g_file_info_new ();
+	g_file_info_set_attribute_uint64 (event->file_info,
+					  G_FILE_ATTRIBUTE_TIME_MODIFIED,
+					  event->entry->mtime);
+}
+
+/**
+ * rhythmdb_dir_manifest_check:
+ * @manifest: the #RhythmDBDirManifest
+ * @db: the #RhythmDB
+ * @stat_list: list of stat events to check
+ * @unchanged: array to add events for unchanged files to
+ *
+ * Checks the modification time of each directory containing files in
+ * @stat_list against the manifest.  Events for files in directories that
+ * haven't changed are completed without checking the files, and are
+ * added to @unchanged.  The new modification times are recorded for
+ * rhythmdb_dir_manifest_save.
+ *
+ * Return value: the list of events that still need to be checked
+ */
+GList *
+rhythmdb_dir_manifest_check (RhythmDBDirManifest *manifest,
+			     RhythmDB *db,
+			     GList *stat_list,
+			     GPtrArray *unchanged)
+{
+	GHashTable *dirs;
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	GList *remaining = NULL;
+	GList *l;
+	guint skipped = 0;
+
+	/* group the events by directory */
+	dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	for (l = stat_list; l != NULL; l = l->next) {
+		RhythmDBEvent *event = (RhythmDBEvent *)l->data;
+		GList *events;
+		char *dir;
+
+		dir = event_directory (event);
+		if (dir == NULL) {
+			remaining = g_list_prepend (remaining, event);
+			continue;
+		}
+
+		events = g_hash_table_lookup (dirs, dir);
+		g_hash_table_replace (dirs, dir, g_list_prepend (events, event));
+	}
+	g_list_free (stat_list);
+
+	g_hash_table_iter_init (&iter, dirs);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		const char *dir = (const char *)key;
+		GList *events = (GList *)value;
+		RhythmDBDirManifestItem *item;
+		GFileInfo *info;
+		GFile *file;
+		guint64 mtime;
+		guint count;
+
+		if (g_cancellable_is_cancelled (db->priv->exiting)) {
+			remaining = g_list_concat (events, remaining);
+			continue;
+		}
+
+		file = g_file_new_for_uri (dir);
+		info = g_file_query_info (file,
+					  G_FILE_ATTRIBUTE_TIME_MODIFIED,
+					  G_FILE_QUERY_INFO_NONE,
+					  db->priv->exiting,
+					  NULL);
+		g_object_unref (file);
+		if (info == NULL) {
+			/* let the file checks report the error */
+			remaining = g_list_concat (events, remaining);
+			continue;
+		}
+
+		mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+		g_object_unref (info);
+		count = g_list_length (events);
+
+		item = g_hash_table_lookup (manifest->old_dirs, dir);
+		if (item != NULL && item->mtime == mtime && item->count == count) {
+			for (l = events; l != NULL; l = l->next) {
+				skip_stat ((RhythmDBEvent *)l->data);
+				g_ptr_array_add (unchanged, l->data);
+			}
+			skipped += count;
+			g_list_free (events);
+		} else {
+			remaining = g_list_concat (events, remaining);
+		}
+
+		g_hash_table_replace (manifest->new_dirs, g_strdup (dir), manifest_item_new (mtime, count));
+	}
+	g_hash_table_destroy (dirs);
+
+	rb_debug ("skipping %u files in unchanged directories", skipped);
+	return remaining;
+}
+
+/**
+ * rhythmdb_dir_manifest_stat_failed:
+ * @manifest: the #RhythmDBDirManifest
+ * @event: the stat event that failed
+ *
+ * Removes the directory containing the file checked by @event from
+ * the manifest, so the files in it are all checked again next time.
+ * This can be called from several threads at once.
+ */
+void
+rhythmdb_dir_manifest_stat_failed (RhythmDBDirManifest *manifest,
+				   RhythmDBEvent *event)
+{
+	const char *uri;
+	const char *slash;
+	char *dir;
+
+	uri = rb_refstring_get (event->uri);
+	slash = strrchr (uri, '/');
+	if (slash == NULL)
+		return;
+
+	dir = g_strndup (uri, slash - uri);
+	g_mutex_lock (manifest->lock);
+	if (g_hash_table_remove (manifest->new_dirs, dir))
+		rb_debug ("not recording directory %s: checking %s failed", dir, uri);
+	g_mutex_unlock (manifest->lock);
+	g_free (dir);
+}
+
+/**
+ * rhythmdb_dir_manifest_save:
+ * @manifest: the #RhythmDBDirManifest
+ *
+ * Writes out the directory modification times recorded by
+ * rhythmdb_dir_manifest_check, replacing the previous manifest.
+ */
+void
+rhythmdb_dir_manifest_save (RhythmDBDirManifest *manifest)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	GString *str;
+	GError *error = NULL;
+
+	str = g_string_new (RHYTHMDB_DIR_MANIFEST_VERSION "\n");
+	g_mutex_lock (manifest->lock);
+	g_hash_table_iter_init (&iter, manifest->new_dirs);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		RhythmDBDirManifestItem *item = (RhythmDBDirManifestItem *)value;
+
+		g_string_append_printf (str, "%" G_GUINT64_FORMAT " %u %s\n",
+					item->mtime, item->count, (const char *)key);
+	}
+	g_mutex_unlock (manifest->lock);
+
+	if (g_file_set_contents (manifest->path, str->str, str->len, &error) == FALSE) {
+		rb_debug ("unable to write directory manifest %s: %s", manifest->path, error->message);
+		g_clear_error (&error);
+	}
+	g_string_free (str, TRUE);
+}
+
+/**
+ * rhythmdb_dir_manifest_free:
+ * @manifest: the #RhythmDBDirManifest
+ *
+ * Frees the manifest.
+ */
+void
+rhythmdb_dir_manifest_free (RhythmDBDirManifest *manifest)
+{
+	g_hash_table_destroy (manifest->old_dirs);
+	g_hash_table_destroy (manifest->new_dirs);
+	g_mutex_free (manifest->lock);
+	g_free (manifest->path);
+	g_free (manifest);
+}
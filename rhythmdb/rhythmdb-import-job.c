@@ -28,8 +28,11 @@
 
 #include "config.h"
 
+#include <gio/gio.h>
+
 #include "rhythmdb-import-job.h"
 #include "rhythmdb-entry-type.h"
+#include "rhythmdb-private.h"
 #include "rb-util.h"
 #include "rb-file-helpers.h"
 #include "rb-marshal.h"
@@ -42,7 +45,8 @@ enum
 	PROP_DB,
 	PROP_ENTRY_TYPE,
 	PROP_IGNORE_TYPE,
-	PROP_ERROR_TYPE
+	PROP_ERROR_TYPE,
+	PROP_ENUMERATE_WORKERS
 };
 
 enum
@@ -56,6 +60,21 @@ enum
 
 static void	rhythmdb_import_job_class_init (RhythmDBImportJobClass *klass);
 static void	rhythmdb_import_job_init (RhythmDBImportJob *job);
+static gboolean	feed_loads (RhythmDBImportJob *job);
+
+/* files found by the directory scan that haven't been handed to the database yet */
+#define RHYTHMDB_IMPORT_JOB_QUEUE_SIZE		512
+/* loads the database can have waiting before we hand it any more files */
+#define RHYTHMDB_IMPORT_JOB_MAX_PENDING_LOADS	256
+/* how often to check whether the database has caught up (ms) */
+#define RHYTHMDB_IMPORT_JOB_FEED_INTERVAL	100
+
+#define RHYTHMDB_IMPORT_JOB_SCAN_ATTRIBUTES		\
+	G_FILE_ATTRIBUTE_STANDARD_NAME ","		\
+	G_FILE_ATTRIBUTE_STANDARD_TYPE ","		\
+	G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN ","		\
+	G_FILE_ATTRIBUTE_ID_FILE ","			\
+	G_FILE_ATTRIBUTE_ACCESS_CAN_READ
 
 static guint	signals[LAST_SIGNAL] = { 0 };
 
@@ -79,6 +98,21 @@ struct _RhythmDBImportJobPrivate
 	int		status_changed_id;
 	gboolean	scan_complete;
 	gboolean	complete;
+
+	/* directory scan */
+	guint		enumerate_workers;
+	GThreadPool	*scan_pool;
+	GHashTable	*scanned;
+	int		dirs_pending;
+	gboolean	enumerated;
+
+	/* files found, waiting to be handed to the database */
+	GQueue		*found;
+	GCond		*found_cond;
+	guint		feed_id;
+
+	guint		stage_processed[RHYTHMDB_IMPORT_JOB_N_STAGES];
+	GTimer		*timer;
 };
 
 G_DEFINE_TYPE (RhythmDBImportJob, rhythmdb_import_job, G_TYPE_OBJECT)
@@ -92,6 +126,18 @@ G_DEFINE_TYPE (RhythmDBImportJob, rhythmdb_import_job, G_TYPE_OBJECT)
  *
  * The entry types to use for the database entries added by the import
  * job are specified on creation.
+ *
+ * Files go through four stages, which run at the same time.  Directories
+ * are listed by a pool of scan threads (see the "enumerate-workers"
+ * property), which put the files they find on a queue.  Files in that
+ * queue are handed to the database in the main thread, as long as the
+ * database doesn't have too many loads waiting already; files that are
+ * not in the database yet go straight to the database's load threads,
+ * which read the file information and the metadata.  The entries are
+ * then inserted into the database in the main thread.  The queue of
+ * files found is bounded, so the scan threads wait when the rest of the
+ * import falls behind.  rhythmdb_import_job_get_stage_stats provides
+ * counters for each stage, to find out which one is holding the import up.
  */
 
 /**
@@ -258,75 +304,262 @@ emit_status_changed (RhythmDBImportJob *job)
 	return FALSE;
 }
 
+static gboolean
+emit_scan_complete_idle (RhythmDBImportJob *job)
+{
+	rb_debug ("emitting scan complete");
+	if (job->priv->scan_pool != NULL) {
+		g_thread_pool_free (job->priv->scan_pool, FALSE, TRUE);
+		job->priv->scan_pool = NULL;
+	}
+
+	g_signal_emit (job, signals[SCAN_COMPLETE], 0, job->priv->total);
+	g_object_unref (job);
+	return FALSE;
+}
+
+/* called with the lock held */
 static void
-uri_recurse_func (GFile *file, gboolean dir, RhythmDBImportJob *job)
+queue_feed (RhythmDBImportJob *job)
 {
-	RhythmDBEntry *entry;
-	char *uri;
+	if (job->priv->feed_id == 0) {
+		job->priv->feed_id = g_idle_add ((GSourceFunc) feed_loads, job);
+	}
+}
 
-	if (dir) {
+static gboolean
+should_scan (GFileInfo *info)
+{
+	/* check that the file is non-hidden and readable */
+	if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ)) {
+		if (g_file_info_get_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) == FALSE) {
+			return FALSE;
+		}
+	}
+	if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN)) {
+		if (g_file_info_get_attribute_boolean (info, G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* runs in a scan thread, called with the lock held.  waits for room in the
+ * queue of files found, so the scan doesn't get too far ahead of the rest
+ * of the import.
+ */
+static void
+add_found_file (RhythmDBImportJob *job, GFile *file)
+{
+	while (g_queue_get_length (job->priv->found) >= RHYTHMDB_IMPORT_JOB_QUEUE_SIZE &&
+	       g_cancellable_is_cancelled (job->priv->cancel) == FALSE) {
+		g_cond_wait (job->priv->found_cond, g_static_mutex_get_mutex (&job->priv->lock));
+	}
+
+	if (g_cancellable_is_cancelled (job->priv->cancel))
 		return;
+
+	g_queue_push_tail (job->priv->found, g_file_get_uri (file));
+	job->priv->stage_processed[RHYTHMDB_IMPORT_JOB_STAGE_ENUMERATE]++;
+	queue_feed (job);
+}
+
+/* runs in a scan thread.  lists one directory, queueing the files in it
+ * and handing subdirectories back to the scan thread pool.
+ */
+static void
+scan_directory (GFile *dir, RhythmDBImportJob *job)
+{
+	GFileEnumerator *files;
+	GFileInfo *info;
+	GError *error = NULL;
+
+	files = g_file_enumerate_children (dir,
+					   RHYTHMDB_IMPORT_JOB_SCAN_ATTRIBUTES,
+					   G_FILE_QUERY_INFO_NONE,
+					   job->priv->cancel,
+					   &error);
+	if (error != NULL && error->code == G_IO_ERROR_NOT_DIRECTORY) {
+		/* we were given a single file to import */
+		g_clear_error (&error);
+		info = g_file_query_info (dir,
+					  RHYTHMDB_IMPORT_JOB_SCAN_ATTRIBUTES,
+					  G_FILE_QUERY_INFO_NONE,
+					  job->priv->cancel,
+					  &error);
+		if (info != NULL) {
+			g_static_mutex_lock (&job->priv->lock);
+			if (should_scan (info))
+				add_found_file (job, dir);
+			g_static_mutex_unlock (&job->priv->lock);
+			g_object_unref (info);
+		}
 	}
 
-	uri = g_file_get_uri (file);
+	if (error != NULL) {
+		char *where;
 
-	/* only add the entry to the map of entries we're waiting for
-	 * if it's not already in the db.
-	 */
-	entry = rhythmdb_entry_lookup_by_location (job->priv->db, uri);
-	if (entry == NULL) {
-		rb_debug ("waiting for entry %s", uri);
-		g_static_mutex_lock (&job->priv->lock);
-		job->priv->total++;
-		g_hash_table_insert (job->priv->outstanding, g_strdup (uri), GINT_TO_POINTER (1));
+		where = g_file_get_uri (dir);
+		rb_debug ("error enumerating %s: %s", where, error->message);
+		g_free (where);
+		g_clear_error (&error);
+	}
 
-		if (job->priv->status_changed_id == 0) {
-			job->priv->status_changed_id = g_idle_add ((GSourceFunc) emit_status_changed, job);
+	while (files != NULL) {
+		GFile *child;
+		const char *file_id;
+		gboolean is_dir;
+
+		info = g_file_enumerator_next_file (files, job->priv->cancel, &error);
+		if (error != NULL) {
+			rb_debug ("error enumerating files: %s", error->message);
+			g_clear_error (&error);
+			break;
+		} else if (info == NULL) {
+			break;
 		}
 
+		if (should_scan (info) == FALSE) {
+			g_object_unref (info);
+			continue;
+		}
+
+		switch (g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_STANDARD_TYPE)) {
+		case G_FILE_TYPE_DIRECTORY:
+		case G_FILE_TYPE_MOUNTABLE:
+			is_dir = TRUE;
+			break;
+		default:
+			is_dir = FALSE;
+			break;
+		}
+
+		child = g_file_get_child (dir, g_file_info_get_name (info));
+		file_id = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILE);
+
+		g_static_mutex_lock (&job->priv->lock);
+		/* skip anything we've already reached through another path */
+		if (file_id == NULL || g_hash_table_lookup (job->priv->scanned, file_id) == NULL) {
+			if (file_id != NULL)
+				g_hash_table_insert (job->priv->scanned, g_strdup (file_id), GINT_TO_POINTER (1));
+
+			if (is_dir) {
+				job->priv->dirs_pending++;
+				g_thread_pool_push (job->priv->scan_pool, g_object_ref (child), NULL);
+			} else {
+				add_found_file (job, child);
+			}
+		}
 		g_static_mutex_unlock (&job->priv->lock);
+
+		g_object_unref (child);
+		g_object_unref (info);
 	}
 
-	rhythmdb_add_uri_with_types (job->priv->db,
-				     uri,
-				     job->priv->entry_type,
-				     job->priv->ignore_type,
-				     job->priv->error_type);
-	g_free (uri);
+	if (files != NULL)
+		g_object_unref (files);
+	g_object_unref (dir);
+
+	g_static_mutex_lock (&job->priv->lock);
+	job->priv->dirs_pending--;
+	if (job->priv->dirs_pending == 0) {
+		rb_debug ("finished scanning directories");
+		job->priv->enumerated = TRUE;
+		queue_feed (job);
+	}
+	g_static_mutex_unlock (&job->priv->lock);
 }
 
-static gboolean
-emit_scan_complete_idle (RhythmDBImportJob *job)
+/* called in the main thread when the database has processed the result
+ * of a load queued by feed_loads.
+ */
+static void
+load_complete_cb (RhythmDB *db, RhythmDBImportJob *job)
 {
-	rb_debug ("emitting scan complete");
-	g_signal_emit (job, signals[SCAN_COMPLETE], 0, job->priv->total);
-	g_object_unref (job);
-	return FALSE;
+	g_static_mutex_lock (&job->priv->lock);
+	job->priv->stage_processed[RHYTHMDB_IMPORT_JOB_STAGE_LOAD]++;
+	g_static_mutex_unlock (&job->priv->lock);
 }
 
-static void
-next_uri (RhythmDBImportJob *job)
+/* runs in the main thread.  hands files found by the scan to the database,
+ * as long as it isn't too far behind already.
+ */
+static gboolean
+feed_loads (RhythmDBImportJob *job)
 {
+	gboolean cancelled;
+	gboolean changed = FALSE;
+
 	g_static_mutex_lock (&job->priv->lock);
-	if (job->priv->uri_list == NULL) {
-		rb_debug ("no more uris to scan");
-		job->priv->scan_complete = TRUE;
-		g_idle_add ((GSourceFunc)emit_scan_complete_idle, job);
-	} else {
-		char *uri = job->priv->uri_list->data;
-		job->priv->uri_list = g_slist_delete_link (job->priv->uri_list,
-							   job->priv->uri_list);
+	job->priv->feed_id = 0;
+	cancelled = g_cancellable_is_cancelled (job->priv->cancel);
+
+	while (g_queue_is_empty (job->priv->found) == FALSE) {
+		RhythmDBEntry *entry;
+		char *uri;
+
+		if (cancelled == FALSE &&
+		    rhythmdb_get_pending_loads (job->priv->db) >= RHYTHMDB_IMPORT_JOB_MAX_PENDING_LOADS) {
+			job->priv->feed_id = g_timeout_add (RHYTHMDB_IMPORT_JOB_FEED_INTERVAL,
+							    (GSourceFunc) feed_loads,
+							    job);
+			break;
+		}
 
-		rb_debug ("scanning uri %s", uri);
-		rb_uri_handle_recursively_async (uri,
-						 job->priv->cancel,
-						 (RBUriRecurseFunc) uri_recurse_func,
-						 job,
-						 (GDestroyNotify) next_uri);
+		uri = g_queue_pop_head (job->priv->found);
+		if (cancelled) {
+			g_free (uri);
+			continue;
+		}
+
+		/* files already in the database only need to be checked for
+		 * changes.  anything else needs its metadata read, and we're
+		 * waiting for it to be added.
+		 */
+		entry = rhythmdb_entry_lookup_by_location (job->priv->db, uri);
+		if (entry != NULL) {
+			rhythmdb_add_uri_with_types (job->priv->db,
+						     uri,
+						     job->priv->entry_type,
+						     job->priv->ignore_type,
+						     job->priv->error_type);
+		} else if (g_hash_table_lookup (job->priv->outstanding, uri) == NULL) {
+			GClosure *closure;
+
+			rb_debug ("waiting for entry %s", uri);
+			job->priv->total++;
+			g_hash_table_insert (job->priv->outstanding, g_strdup (uri), GINT_TO_POINTER (1));
 
+			closure = g_cclosure_new_object (G_CALLBACK (load_complete_cb), G_OBJECT (job));
+			g_closure_set_marshal (closure, g_cclosure_marshal_VOID__VOID);
+			rhythmdb_queue_load (job->priv->db,
+					     uri,
+					     job->priv->entry_type,
+					     job->priv->ignore_type,
+					     job->priv->error_type,
+					     closure);
+			changed = TRUE;
+		}
+		job->priv->stage_processed[RHYTHMDB_IMPORT_JOB_STAGE_FEED]++;
 		g_free (uri);
 	}
+	g_cond_broadcast (job->priv->found_cond);
+
+	if (job->priv->enumerated &&
+	    g_queue_is_empty (job->priv->found) &&
+	    job->priv->scan_complete == FALSE) {
+		rb_debug ("no more files to scan");
+		job->priv->scan_complete = TRUE;
+		g_idle_add ((GSourceFunc) emit_scan_complete_idle, job);
+		changed = TRUE;
+	}
+
+	if (changed && job->priv->status_changed_id == 0) {
+		job->priv->status_changed_id = g_idle_add ((GSourceFunc) emit_status_changed, job);
+	}
 	g_static_mutex_unlock (&job->priv->lock);
+
+	return FALSE;
 }
 
 /**
@@ -340,16 +573,37 @@ next_uri (RhythmDBImportJob *job)
 void
 rhythmdb_import_job_start (RhythmDBImportJob *job)
 {
+	GSList *l;
+
 	g_assert (job->priv->started == FALSE);
 
 	rb_debug ("starting");
 	g_static_mutex_lock (&job->priv->lock);
 	job->priv->started = TRUE;
 	job->priv->uri_list = g_slist_reverse (job->priv->uri_list);
-	g_static_mutex_unlock (&job->priv->lock);
-	
+	job->priv->timer = g_timer_new ();
+
 	/* reference is released in emit_scan_complete_idle */
-	next_uri (g_object_ref (job));
+	g_object_ref (job);
+
+	job->priv->scan_pool = g_thread_pool_new ((GFunc) scan_directory,
+						  job,
+						  job->priv->enumerate_workers,
+						  FALSE,
+						  NULL);
+	for (l = job->priv->uri_list; l != NULL; l = l->next) {
+		rb_debug ("scanning uri %s", (const char *)l->data);
+		job->priv->dirs_pending++;
+		g_thread_pool_push (job->priv->scan_pool, g_file_new_for_uri (l->data), NULL);
+	}
+	rb_slist_deep_free (job->priv->uri_list);
+	job->priv->uri_list = NULL;
+
+	if (job->priv->dirs_pending == 0) {
+		job->priv->enumerated = TRUE;
+		queue_feed (job);
+	}
+	g_static_mutex_unlock (&job->priv->lock);
 }
 
 /**
@@ -382,6 +636,86 @@ rhythmdb_import_job_get_imported (RhythmDBImportJob *job)
 	return job->priv->imported;
 }
 
+/**
+ * RhythmDBImportJobStage:
+ * @RHYTHMDB_IMPORT_JOB_STAGE_ENUMERATE: listing directories to find files
+ * @RHYTHMDB_IMPORT_JOB_STAGE_FEED: handing files found to the database
+ * @RHYTHMDB_IMPORT_JOB_STAGE_LOAD: reading file information and metadata
+ * @RHYTHMDB_IMPORT_JOB_STAGE_INSERT: adding entries to the database
+ * @RHYTHMDB_IMPORT_JOB_N_STAGES: the number of stages
+ *
+ * The stages files go through in an import job.
+ */
+
+/**
+ * RhythmDBImportJobStageStats:
+ * @workers: number of threads working on the stage
+ * @queued: number of items waiting for the stage
+ * @processed: number of items the stage has finished with
+ * @rate: items processed per second
+ *
+ * Counters for one stage of an import job, as returned by
+ * rhythmdb_import_job_get_stage_stats.
+ */
+
+/**
+ * rhythmdb_import_job_get_stage_stats:
+ * @job: the #RhythmDBImportJob
+ * @stage: the #RhythmDBImportJobStage to report on
+ * @stats: returns the counters for the stage
+ *
+ * Returns counters describing the progress of one stage of the import job.
+ * For %RHYTHMDB_IMPORT_JOB_STAGE_ENUMERATE, the queue holds directories
+ * waiting to be listed, and the files found are counted as processed.
+ * For %RHYTHMDB_IMPORT_JOB_STAGE_FEED, the queue holds files found but not
+ * yet handed to the database, and files handed to it are counted as
+ * processed, including files already in the database, which are only
+ * checked for changes.  For %RHYTHMDB_IMPORT_JOB_STAGE_LOAD, the queue
+ * holds all the metadata loads the database has waiting, including those
+ * queued by anything else, the workers are the database's load threads,
+ * and the files whose loads have been completed are counted as processed.
+ * For %RHYTHMDB_IMPORT_JOB_STAGE_INSERT, the queue holds files that have
+ * been loaded but not yet added to the database, and added entries are
+ * counted as processed.  The rate is the number of items processed per
+ * second since the job was started.
+ */
+void
+rhythmdb_import_job_get_stage_stats (RhythmDBImportJob *job,
+				     RhythmDBImportJobStage stage,
+				     RhythmDBImportJobStageStats *stats)
+{
+	double elapsed;
+
+	g_return_if_fail (stage < RHYTHMDB_IMPORT_JOB_N_STAGES);
+
+	g_static_mutex_lock (&job->priv->lock);
+	switch (stage) {
+	case RHYTHMDB_IMPORT_JOB_STAGE_ENUMERATE:
+		stats->workers = job->priv->enumerate_workers;
+		stats->queued = MAX (job->priv->dirs_pending, 0);
+		break;
+	case RHYTHMDB_IMPORT_JOB_STAGE_FEED:
+		stats->workers = 1;
+		stats->queued = g_queue_get_length (job->priv->found);
+		break;
+	case RHYTHMDB_IMPORT_JOB_STAGE_LOAD:
+		stats->workers = rb_metadata_get_max_parallel ();
+		stats->queued = MAX (rhythmdb_get_pending_loads (job->priv->db), 0);
+		break;
+	case RHYTHMDB_IMPORT_JOB_STAGE_INSERT:
+		stats->workers = 1;
+		stats->queued = MAX ((int) job->priv->stage_processed[RHYTHMDB_IMPORT_JOB_STAGE_LOAD] - job->priv->imported, 0);
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+	stats->processed = job->priv->stage_processed[stage];
+
+	elapsed = (job->priv->timer != NULL) ? g_timer_elapsed (job->priv->timer, NULL) : 0.0;
+	stats->rate = (elapsed > 0.0) ? stats->processed / elapsed : 0.0;
+	g_static_mutex_unlock (&job->priv->lock);
+}
+
 /**
  * rhythmdb_import_job_scan_complete:
  * @job: the #RhythmDBImportJob
@@ -424,6 +758,8 @@ rhythmdb_import_job_cancel (RhythmDBImportJob *job)
 {
 	g_static_mutex_lock (&job->priv->lock);
 	g_cancellable_cancel (job->priv->cancel);
+	/* wake up scan threads waiting for room in the queue */
+	g_cond_broadcast (job->priv->found_cond);
 	g_static_mutex_unlock (&job->priv->lock);
 }
 
@@ -444,6 +780,7 @@ entry_added_cb (RhythmDB *db,
 		const char *details;
 
 		job->priv->imported++;
+		job->priv->stage_processed[RHYTHMDB_IMPORT_JOB_STAGE_INSERT]++;
 		rb_debug ("got entry %s; %d now imported", uri, job->priv->imported);
 		g_signal_emit (job, signals[ENTRY_ADDED], 0, entry);
 
@@ -471,6 +808,9 @@ rhythmdb_import_job_init (RhythmDBImportJob *job)
 
 	g_static_mutex_init (&job->priv->lock);
 	job->priv->outstanding = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	job->priv->scanned = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	job->priv->found = g_queue_new ();
+	job->priv->found_cond = g_cond_new ();
 
 	job->priv->cancel = g_cancellable_new ();
 }
@@ -500,6 +840,14 @@ impl_set_property (GObject *object,
 	case PROP_ERROR_TYPE:
 		job->priv->error_type = g_value_get_object (value);
 		break;
+	case PROP_ENUMERATE_WORKERS:
+		g_static_mutex_lock (&job->priv->lock);
+		job->priv->enumerate_workers = g_value_get_uint (value);
+		if (job->priv->scan_pool != NULL) {
+			g_thread_pool_set_max_threads (job->priv->scan_pool, job->priv->enumerate_workers, NULL);
+		}
+		g_static_mutex_unlock (&job->priv->lock);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -527,6 +875,9 @@ impl_get_property (GObject *object,
 	case PROP_ERROR_TYPE:
 		g_value_set_object (value, job->priv->error_type);
 		break;
+	case PROP_ENUMERATE_WORKERS:
+		g_value_set_uint (value, job->priv->enumerate_workers);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -556,6 +907,14 @@ impl_finalize (GObject *object)
 	RhythmDBImportJob *job = RHYTHMDB_IMPORT_JOB (object);
 	
 	g_hash_table_destroy (job->priv->outstanding);
+	g_hash_table_destroy (job->priv->scanned);
+
+	g_queue_foreach (job->priv->found, (GFunc) g_free, NULL);
+	g_queue_free (job->priv->found);
+	g_cond_free (job->priv->found_cond);
+
+	if (job->priv->timer != NULL)
+		g_timer_destroy (job->priv->timer);
 
 	rb_slist_deep_free (job->priv->uri_list);
 
@@ -603,6 +962,18 @@ rhythmdb_import_job_class_init (RhythmDBImportJobClass *klass)
 							      "Entry type to use for import error entries added by this job",
 							      RHYTHMDB_TYPE_ENTRY_TYPE,
 							      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+	/**
+	 * RhythmDBImportJob:enumerate-workers:
+	 *
+	 * The number of threads used to list directories.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_ENUMERATE_WORKERS,
+					 g_param_spec_uint ("enumerate-workers",
+							    "Enumerate workers",
+							    "Number of threads used to list directories",
+							    1, 16, 2,
+							    G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
 
 	/**
 	 * RhythmDBImportJob::entry-added:
@@ -47,6 +47,23 @@ typedef struct _RhythmDBImportJobClass 	RhythmDBImportJobClass;
 
 typedef struct _RhythmDBImportJobPrivate RhythmDBImportJobPrivate;
 
+typedef enum
+{
+	RHYTHMDB_IMPORT_JOB_STAGE_ENUMERATE,
+	RHYTHMDB_IMPORT_JOB_STAGE_FEED,
+	RHYTHMDB_IMPORT_JOB_STAGE_LOAD,
+	RHYTHMDB_IMPORT_JOB_STAGE_INSERT,
+	RHYTHMDB_IMPORT_JOB_N_STAGES
+} RhythmDBImportJobStage;
+
+typedef struct
+{
+	guint workers;
+	guint queued;
+	guint processed;
+	double rate;
+} RhythmDBImportJobStageStats;
+
 struct _RhythmDBImportJob
 {
 	GObject parent;
@@ -78,6 +95,9 @@ gboolean	rhythmdb_import_job_complete		(RhythmDBImportJob *job);
 gboolean	rhythmdb_import_job_scan_complete	(RhythmDBImportJob *job);
 int		rhythmdb_import_job_get_total		(RhythmDBImportJob *job);
 int		rhythmdb_import_job_get_imported	(RhythmDBImportJob *job);
+void		rhythmdb_import_job_get_stage_stats	(RhythmDBImportJob *job,
+							 RhythmDBImportJobStage stage,
+							 RhythmDBImportJobStageStats *stats);
 
 G_END_DECLS
 
@@ -0,0 +1,715 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Metadata cache
+ *
+ * Reading metadata from a file means a round trip to a metadata helper
+ * process, which then has to open and parse the file.  When the database
+ * is rebuilt from scratch, or a library is added again, or the same files
+ * are reached through another mount, the results are the same as they were
+ * the last time each file was read.
+ *
+ * To avoid reading them again, the metadata read from each audio file is
+ * kept in a cache file in the user cache directory, keyed by the device
+ * and inode of the file where the file system provides them, or by its
+ * URI otherwise.  A cached result is only used if the size and modification
+ * time of the file still match those recorded with it.
+ *
+ * The file format is one line per file:
+ *   <key> TAB <size> TAB <mtime in usec> TAB <uri> TAB <media type> [TAB <field>=<value>]...
+ * following a version line, with field names as returned by
+ * rb_metadata_get_field_name and string values escaped as by g_strescape.
+ * New results are appended to the file as they are read, so a later line
+ * for a key replaces any earlier ones.  Only the key, size and modification
+ * time of each line are kept in memory; the rest is read back from the
+ * file when the line is used.  Appends are made under an flock so other
+ * processes using the same file can't interleave with them.
+ *
+ * Records for local files that have been deleted are dropped by
+ * rhythmdb_metadata_cache_prune, which appends a line holding only the
+ * key, with zero size and modification time, for each of them.  A file
+ * that can't be found is only treated as deleted if the directory it
+ * was in is still on the same device, so records for files on volumes
+ * that aren't mounted are kept.  When more than half of the lines in the
+ * file have been replaced or dropped, it is rewritten on the next startup.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "rb-debug.h"
+#include "rb-metadata.h"
+#include "rhythmdb.h"
+#include "rhythmdb-private.h"
+
+#define RHYTHMDB_METADATA_CACHE_VERSION	"rhythmdb-metadata 2"
+
+struct _RhythmDBMetadataCache
+{
+	char *path;
+	GMutex *lock;
+	gboolean opened;
+	gboolean writable;
+	int fd;
+	GHashTable *items;
+	char escape_exceptions[129];
+};
+
+typedef struct
+{
+	guint64 size;
+	guint64 mtime;
+	gint64 offset;
+	guint length;
+} RhythmDBMetadataCacheItem;
+
+typedef struct
+{
+	char *key;
+	gint64 offset;
+	guint length;
+} RhythmDBMetadataCachePruneItem;
+
+static RhythmDBMetadataCacheItem *
+cache_item_new (guint64 size, guint64 mtime, gint64 offset, guint length)
+{
+	RhythmDBMetadataCacheItem *item;
+
+	item = g_slice_new0 (RhythmDBMetadataCacheItem);
+	item->size = size;
+	item->mtime = mtime;
+	item->offset = offset;
+	item->length = length;
+	return item;
+}
+
+static void
+cache_item_free (RhythmDBMetadataCacheItem *item)
+{
+	g_slice_free (RhythmDBMetadataCacheItem, item);
+}
+
+static char *
+cache_key (const char *uri, GFileInfo *info, guint64 *size, guint64 *mtime)
+{
+	*size = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
+	*mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+		 g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+
+	if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_INODE)) {
+		return g_strdup_printf ("inode:%u:%" G_GUINT64_FORMAT,
+					g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE),
+					g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE));
+	}
+	return g_strdup (uri);
+}
+
+/* parses the key, size and modification time at the start of a line,
+ * returning the key and pointing @rest at the rest of the line.
+ */
+static char *
+parse_record_header (const char *line, const char *line_end, guint64 *size, guint64 *mtime, const char **rest)
+{
+	const char *tab;
+	char *end;
+
+	tab = memchr (line, '\t', line_end - line);
+	if (tab == NULL || tab == line)
+		return NULL;
+
+	*size = g_ascii_strtoull (tab + 1, &end, 10);
+	if (end == tab + 1 || end >= line_end || *end != '\t')
+		return NULL;
+	*mtime = g_ascii_strtoull (end + 1, &end, 10);
+	if (end >= line_end || *end != '\t')
+		return NULL;
+
+	*rest = end + 1;
+	return g_strndup (line, tab - line);
+}
+
+/* reads the records in the cache file into the item table.  returns FALSE
+ * if the file needs to be rewritten before anything is appended to it.
+ */
+static gboolean
+cache_read (RhythmDBMetadataCache *cache, const char *contents, gsize length)
+{
+	const char *p;
+	const char *end;
+	guint records = 0;
+	gboolean complete = TRUE;
+
+	end = contents + length;
+	p = memchr (contents, '\n', length);
+	if (p == NULL ||
+	    p - contents != strlen (RHYTHMDB_METADATA_CACHE_VERSION) ||
+	    strncmp (contents, RHYTHMDB_METADATA_CACHE_VERSION, p - contents) != 0) {
+		rb_debug ("ignoring metadata cache %s with unknown version", cache->path);
+		return FALSE;
+	}
+
+	for (p = p + 1; p < end; ) {
+		const char *nl;
+		guint64 size;
+		guint64 mtime;
+		const char *rest;
+		char *key;
+
+		nl = memchr (p, '\n', end - p);
+		if (nl == NULL) {
+			/* last write was interrupted */
+			complete = FALSE;
+			break;
+		}
+
+		key = parse_record_header (p, nl, &size, &mtime, &rest);
+		if (key != NULL && rest == nl) {
+			/* the file was deleted */
+			g_hash_table_remove (cache->items, key);
+			g_free (key);
+			records++;
+		} else if (key != NULL) {
+			g_hash_table_replace (cache->items,
+					      key,
+					      cache_item_new (size, mtime, p - contents, nl - p));
+			records++;
+		}
+		p = nl + 1;
+	}
+
+	rb_debug ("read %u records for %u files from metadata cache %s",
+		  records, g_hash_table_size (cache->items), cache->path);
+	return complete && (records <= 2 * g_hash_table_size (cache->items));
+}
+
+/* writes out the current records only, dropping those that have been
+ * replaced, and updates the item table to match.
+ */
+static void
+cache_rewrite (RhythmDBMetadataCache *cache, const char *contents)
+{
+	GHashTableIter iter;
+	gpointer value;
+	GString *str;
+	GError *error = NULL;
+
+	str = g_string_new (RHYTHMDB_METADATA_CACHE_VERSION "\n");
+	g_hash_table_iter_init (&iter, cache->items);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		RhythmDBMetadataCacheItem *item = (RhythmDBMetadataCacheItem *)value;
+
+		g_string_append_len (str, contents + item->offset, item->length);
+		item->offset = str->len - item->length;
+		g_string_append_c (str, '\n');
+	}
+
+	if (g_file_set_contents (cache->path, str->str, str->len, &error) == FALSE) {
+		rb_debug ("unable to write metadata cache %s: %s", cache->path, error->message);
+		g_clear_error (&error);
+		g_hash_table_remove_all (cache->items);
+	}
+	g_string_free (str, TRUE);
+}
+
+/* called with the lock held */
+static void
+cache_open (RhythmDBMetadataCache *cache)
+{
+	GMappedFile *mapped;
+	GError *error = NULL;
+	const char *contents = NULL;
+	gsize length = 0;
+
+	cache->opened = TRUE;
+
+	mapped = g_mapped_file_new (cache->path, FALSE, &error);
+	if (mapped != NULL) {
+		contents = g_mapped_file_get_contents (mapped);
+		length = g_mapped_file_get_length (mapped);
+	} else {
+		rb_debug ("unable to read metadata cache %s: %s", cache->path, error->message);
+		g_clear_error (&error);
+	}
+
+	if (length == 0 || cache_read (cache, contents, length) == FALSE) {
+		rb_debug ("rewriting metadata cache %s", cache->path);
+		cache_rewrite (cache, contents);
+	}
+
+	if (mapped != NULL)
+		g_mapped_file_free (mapped);
+
+	cache->fd = g_open (cache->path, O_RDWR | O_APPEND, 0);
+	if (cache->fd == -1) {
+		rb_debug ("unable to open metadata cache %s: %s", cache->path, g_strerror (errno));
+		g_hash_table_remove_all (cache->items);
+		return;
+	}
+	cache->writable = TRUE;
+}
+
+/* appends to the cache file, returning the offset the data was written
+ * at, or -1 if it couldn't be written.  other processes may be appending
+ * to the file too, so the offset is only known once the data has been
+ * written.  called with the lock held.
+ */
+static gint64
+cache_append (RhythmDBMetadataCache *cache, const char *data, gsize length)
+{
+	gint64 offset = -1;
+
+	if (flock (cache->fd, LOCK_EX) == -1)
+		return -1;
+	if (write (cache->fd, data, length) == (gssize) length)
+		offset = lseek (cache->fd, 0, SEEK_CUR) - length;
+	flock (cache->fd, LOCK_UN);
+
+	return offset;
+}
+
+/**
+ * rhythmdb_metadata_cache_new:
+ * @path: path to the cache file
+ *
+ * Creates a metadata cache stored in @path.  The file is not read until
+ * the cache is first used.
+ *
+ * Return value: the cache
+ */
+RhythmDBMetadataCache *
+rhythmdb_metadata_cache_new (const char *path)
+{
+	RhythmDBMetadataCache *cache;
+	int i;
+
+	cache = g_new0 (RhythmDBMetadataCache, 1);
+	cache->path = g_strdup (path);
+	cache->lock = g_mutex_new ();
+	cache->fd = -1;
+	cache->items = g_hash_table_new_full (g_str_hash,
+					      g_str_equal,
+					      g_free,
+					      (GDestroyNotify) cache_item_free);
+
+	/* leave UTF-8 alone when escaping strings */
+	for (i = 0; i < 128; i++)
+		cache->escape_exceptions[i] = (char) (0x80 + i);
+	cache->escape_exceptions[128] = '\0';
+
+	return cache;
+}
+
+static RBMetaData *
+parse_record (const char *key, char *record)
+{
+	GEnumClass *klass;
+	RBMetaData *md;
+	char **fields;
+	int i;
+
+	fields = g_strsplit (record, "\t", -1);
+	if (g_strv_length (fields) < 5 || strcmp (fields[0], key) != 0) {
+		g_strfreev (fields);
+		return NULL;
+	}
+
+	md = rb_metadata_new ();
+	rb_metadata_reset (md);
+	rb_metadata_set_audio_type (md, fields[4]);
+
+	klass = g_type_class_ref (RB_TYPE_METADATA_FIELD);
+	for (i = 5; fields[i] != NULL; i++) {
+		GEnumValue *field;
+		GValue value = {0,};
+		GType type;
+		char *eq;
+
+		eq = strchr (fields[i], '=');
+		if (eq == NULL)
+			continue;
+		*eq = '\0';
+
+		field = g_enum_get_value_by_nick (klass, fields[i]);
+		if (field == NULL)
+			continue;
+
+		type = rb_metadata_get_field_type (field->value);
+		g_value_init (&value, type);
+		switch (type) {
+		case G_TYPE_STRING:
+			g_value_take_string (&value, g_strcompress (eq + 1));
+			break;
+		case G_TYPE_ULONG:
+			g_value_set_ulong (&value, strtoul (eq + 1, NULL, 10));
+			break;
+		case G_TYPE_DOUBLE:
+			g_value_set_double (&value, g_ascii_strtod (eq + 1, NULL));
+			break;
+		default:
+			g_assert_not_reached ();
+			break;
+		}
+		rb_metadata_set (md, field->value, &value);
+		g_value_unset (&value);
+	}
+	g_type_class_unref (klass);
+	g_strfreev (fields);
+
+	return md;
+}
+
+/**
+ * rhythmdb_metadata_cache_lookup:
+ * @cache: the #RhythmDBMetadataCache
+ * @uri: URI of the file
+ * @info: file information for the file, including its size and modification time
+ *
+ * Looks for metadata read from the file earlier.  This may be called from
+ * any thread.
+ *
+ * Return value: a new #RBMetaData holding the cached metadata, or NULL if
+ * there is none or the file has changed since it was read.
+ */
+RBMetaData *
+rhythmdb_metadata_cache_lookup (RhythmDBMetadataCache *cache, const char *uri, GFileInfo *info)
+{
+	RhythmDBMetadataCacheItem *item;
+	RBMetaData *md = NULL;
+	guint64 size;
+	guint64 mtime;
+	gint64 offset = 0;
+	guint length = 0;
+	int fd;
+	char *key;
+
+	key = cache_key (uri, info, &size, &mtime);
+
+	g_mutex_lock (cache->lock);
+	if (cache->opened == FALSE)
+		cache_open (cache);
+
+	fd = cache->fd;
+	item = g_hash_table_lookup (cache->items, key);
+	if (item != NULL && item->size == size && item->mtime == mtime) {
+		offset = item->offset;
+		length = item->length;
+	}
+	g_mutex_unlock (cache->lock);
+
+	/* the file descriptor stays open until the cache is freed, so
+	 * reading outside the lock is safe.
+	 */
+	if (length > 0) {
+		char *record;
+
+		record = g_malloc (length + 1);
+		if (pread (fd, record, length, offset) == (gssize) length) {
+			record[length] = '\0';
+			md = parse_record (key, record);
+		}
+		g_free (record);
+	}
+
+	g_free (key);
+	return md;
+}
+
+/**
+ * rhythmdb_metadata_cache_store:
+ * @cache: the #RhythmDBMetadataCache
+ * @uri: URI of the file
+ * @info: file information for the file, including its size and modification time
+ * @md: metadata read from the file
+ *
+ * Adds metadata read from an audio file to the cache.  Anything other than
+ * a complete set of metadata for an audio file is not stored.  This may be
+ * called from any thread.
+ */
+void
+rhythmdb_metadata_cache_store (RhythmDBMetadataCache *cache, const char *uri, GFileInfo *info, RBMetaData *md)
+{
+	const char *mimetype;
+	guint64 size;
+	guint64 mtime;
+	char *key;
+	GString *str;
+	int field;
+
+	mimetype = rb_metadata_get_mime (md);
+	if (mimetype == NULL || mimetype[0] == '\0' ||
+	    rb_metadata_has_audio (md) == FALSE ||
+	    rb_metadata_has_video (md) ||
+	    rb_metadata_has_missing_plugins (md))
+		return;
+
+	key = cache_key (uri, info, &size, &mtime);
+	str = g_string_new (key);
+	g_string_append_printf (str, "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%s\t%s",
+				size, mtime, uri, mimetype);
+
+	for (field = 0; field < RB_METADATA_FIELD_LAST; field++) {
+		GValue value = {0,};
+		char buf[G_ASCII_DTOSTR_BUF_SIZE];
+		char *escaped;
+
+		if (rb_metadata_get (md, field, &value) == FALSE)
+			continue;
+
+		g_string_append_printf (str, "\t%s=", rb_metadata_get_field_name (field));
+		switch (G_VALUE_TYPE (&value)) {
+		case G_TYPE_STRING:
+			escaped = g_strescape (g_value_get_string (&value), cache->escape_exceptions);
+			g_string_append (str, escaped);
+			g_free (escaped);
+			break;
+		case G_TYPE_ULONG:
+			g_string_append_printf (str, "%lu", g_value_get_ulong (&value));
+			break;
+		case G_TYPE_DOUBLE:
+			g_string_append (str, g_ascii_dtostr (buf, sizeof (buf), g_value_get_double (&value)));
+			break;
+		default:
+			g_assert_not_reached ();
+			break;
+		}
+		g_value_unset (&value);
+	}
+	g_string_append_c (str, '\n');
+
+	g_mutex_lock (cache->lock);
+	if (cache->opened == FALSE)
+		cache_open (cache);
+
+	if (cache->writable) {
+		gint64 offset;
+
+		offset = cache_append (cache, str->str, str->len);
+		if (offset != -1) {
+			g_hash_table_replace (cache->items,
+					      key,
+					      cache_item_new (size, mtime, offset, str->len - 1));
+			key = NULL;
+		} else {
+			/* the file now ends with a partial record, so stop
+			 * adding to it; it'll be rewritten next time.  the
+			 * file stays open, as lookups in other threads may
+			 * still be reading from it.
+			 */
+			rb_debug ("unable to write to metadata cache %s: %s", cache->path, g_strerror (errno));
+			cache->writable = FALSE;
+			g_hash_table_remove_all (cache->items);
+		}
+	}
+	g_mutex_unlock (cache->lock);
+
+	g_free (key);
+	g_string_free (str, TRUE);
+}
+
+/* checks whether a record is for a local file that has been deleted.  if
+ * the file can't be found, but the closest directory above it that does
+ * exist is on a different device from the file, the volume holding the
+ * file probably isn't mounted, so the file doesn't count as deleted.
+ */
+static gboolean
+record_file_deleted (const char *key, const char *record)
+{
+	struct stat st;
+	guint64 device;
+	char **fields;
+	char *filename;
+	char *dir;
+	gboolean deleted = FALSE;
+
+	/* only records keyed by device and inode can be checked */
+	if (g_str_has_prefix (key, "inode:") == FALSE)
+		return FALSE;
+	device = g_ascii_strtoull (key + strlen ("inode:"), NULL, 10);
+
+	fields = g_strsplit (record, "\t", 5);
+	if (g_strv_length (fields) < 5) {
+		g_strfreev (fields);
+		return FALSE;
+	}
+	filename = g_filename_from_uri (fields[3], NULL, NULL);
+	g_strfreev (fields);
+	if (filename == NULL)
+		return FALSE;
+
+	if (g_lstat (filename, &st) == 0 || errno != ENOENT) {
+		g_free (filename);
+		return FALSE;
+	}
+
+	dir = g_path_get_dirname (filename);
+	for (;;) {
+		char *parent;
+		int err;
+
+		if (g_stat (dir, &st) == 0) {
+			deleted = ((guint32) st.st_dev == (guint32) device);
+			break;
+		}
+		err = errno;
+
+		parent = g_path_get_dirname (dir);
+		if (err != ENOENT || strcmp (parent, dir) == 0) {
+			g_free (parent);
+			break;
+		}
+		g_free (dir);
+		dir = parent;
+	}
+	g_free (dir);
+	g_free (filename);
+
+	return deleted;
+}
+
+/**
+ * rhythmdb_metadata_cache_prune:
+ * @cache: the #RhythmDBMetadataCache
+ * @cancellable: a #GCancellable to stop early, or NULL
+ *
+ * Drops the records for local files that have been deleted.  The files
+ * are checked without holding the cache's lock, so lookups and stores
+ * can carry on meanwhile, but checking a large cache takes a while, so
+ * this should be called from a thread of its own.
+ */
+void
+rhythmdb_metadata_cache_prune (RhythmDBMetadataCache *cache, GCancellable *cancellable)
+{
+	RhythmDBMetadataCachePruneItem *prune;
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	GArray *items;
+	GPtrArray *deleted;
+	GString *str;
+	int fd;
+	guint i;
+
+	g_mutex_lock (cache->lock);
+	if (cache->opened == FALSE)
+		cache_open (cache);
+
+	fd = cache->fd;
+	items = g_array_sized_new (FALSE, FALSE,
+				   sizeof (RhythmDBMetadataCachePruneItem),
+				   g_hash_table_size (cache->items));
+	g_hash_table_iter_init (&iter, cache->items);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		RhythmDBMetadataCacheItem *item = (RhythmDBMetadataCacheItem *)value;
+		RhythmDBMetadataCachePruneItem p;
+
+		p.key = g_strdup (key);
+		p.offset = item->offset;
+		p.length = item->length;
+		g_array_append_val (items, p);
+	}
+	g_mutex_unlock (cache->lock);
+
+	/* the file descriptor stays open until the cache is freed */
+	deleted = g_ptr_array_new ();
+	for (i = 0; i < items->len; i++) {
+		char *record;
+
+		if (g_cancellable_is_cancelled (cancellable))
+			break;
+
+		prune = &g_array_index (items, RhythmDBMetadataCachePruneItem, i);
+		record = g_malloc (prune->length + 1);
+		if (pread (fd, record, prune->length, prune->offset) == (gssize) prune->length) {
+			record[prune->length] = '\0';
+			if (record_file_deleted (prune->key, record))
+				g_ptr_array_add (deleted, prune);
+		}
+		g_free (record);
+	}
+
+	if (deleted->len > 0) {
+		str = g_string_new (NULL);
+
+		g_mutex_lock (cache->lock);
+		for (i = 0; i < deleted->len; i++) {
+			RhythmDBMetadataCacheItem *item;
+
+			prune = g_ptr_array_index (deleted, i);
+
+			/* skip files that were read again after being checked */
+			item = g_hash_table_lookup (cache->items, prune->key);
+			if (item == NULL || item->offset != prune->offset)
+				continue;
+
+			g_string_append_printf (str, "%s\t0\t0\t\n", prune->key);
+			g_hash_table_remove (cache->items, prune->key);
+		}
+
+		if (str->len > 0 && cache->writable && cache_append (cache, str->str, str->len) == -1) {
+			rb_debug ("unable to write to metadata cache %s: %s", cache->path, g_strerror (errno));
+			cache->writable = FALSE;
+			g_hash_table_remove_all (cache->items);
+		}
+		g_mutex_unlock (cache->lock);
+
+		rb_debug ("dropped records for %u deleted files from metadata cache %s", deleted->len, cache->path);
+		g_string_free (str, TRUE);
+	}
+
+	for (i = 0; i < items->len; i++)
+		g_free (g_array_index (items, RhythmDBMetadataCachePruneItem, i).key);
+	g_array_free (items, TRUE);
+	g_ptr_array_free (deleted, TRUE);
+}
+
+/**
+ * rhythmdb_metadata_cache_free:
+ * @cache: the #RhythmDBMetadataCache
+ *
+ * Closes the cache file and frees the cache.
+ */
+void
+rhythmdb_metadata_cache_free (RhythmDBMetadataCache *cache)
+{
+	if (cache->fd != -1)
+		close (cache->fd);
+	g_hash_table_destroy (cache->items);
+	g_mutex_free (cache->lock);
+	g_free (cache->path);
+	g_free (cache);
+}
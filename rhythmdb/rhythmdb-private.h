@@ -116,6 +116,26 @@ struct _RhythmDBEntry {
 	RBRefString *playback_error;
 };
 
+/* entry type data follows the entry itself, aligned like this.
+ * structure alignment magic, stolen from glib */
+#define STRUCT_ALIGNMENT	(2 * sizeof (gsize))
+#define ALIGN_STRUCT(offset) \
+	((offset + (STRUCT_ALIGNMENT - 1)) & -STRUCT_ALIGNMENT)
+
+/* events from the worker threads are processed in the main thread in order
+ * of these lanes, so query results and property changes the user is waiting
+ * for don't queue up behind the files being imported or rescanned.
+ */
+typedef enum
+{
+	RHYTHMDB_EVENT_LANE_INTERACTIVE,
+	RHYTHMDB_EVENT_LANE_IMPORT,
+	RHYTHMDB_EVENT_LANE_BACKGROUND,
+	RHYTHMDB_EVENT_N_LANES
+} RhythmDBEventLane;
+
+typedef struct _RhythmDBMetadataCache RhythmDBMetadataCache;
+
 struct _RhythmDBPrivate
 {
 	char *name;
@@ -134,6 +154,10 @@ struct _RhythmDBPrivate
 	GAsyncQueue *restored_queue;
 	GAsyncQueue *delayed_write_queue;
 	GThreadPool *query_thread_pool;
+	GAsyncQueue *load_queue;
+	gint outstanding_loads;
+	RhythmDBMetadataCache *metadata_cache;
+	char *metadata_cache_path;
 
 	GList *stat_list;
 	GList *outstanding_stats;
@@ -143,6 +167,8 @@ struct _RhythmDBPrivate
 	gboolean stat_thread_running;
 	int stat_thread_count;
 	int stat_thread_done;
+	guint stat_threads;
+	GHashTable *mount_stat_threads;
 
 	GVolumeMonitor *volume_monitor;
 	GHashTable *monitored_directories;
@@ -157,6 +183,7 @@ struct _RhythmDBPrivate
 	gboolean no_update;
 
 	GMutex *change_mutex;
+	GStaticRWLock entry_fields_lock;
 	GHashTable *added_entries;
 	GHashTable *changed_entries;
 	GHashTable *deleted_entries;
@@ -171,6 +198,9 @@ struct _RhythmDBPrivate
 	guint save_count;
 
 	guint event_queue_watch_id;
+	GQueue *event_lanes[RHYTHMDB_EVENT_N_LANES];	/* only used in the main thread */
+	guint event_lanes_id;
+	GTimer *event_timer;
 	guint commit_timeout_id;
 	guint save_timeout_id;
 
@@ -188,6 +218,10 @@ struct _RhythmDBPrivate
 	GMutex *entry_type_mutex;
 
 	gint next_entry_id;
+
+	GMutex *query_cache_lock;
+	GHashTable *query_cache;
+	GList *query_cache_lru;
 };
 
 typedef struct
@@ -199,13 +233,15 @@ typedef struct
 		RHYTHMDB_EVENT_THREAD_EXITED,
 		RHYTHMDB_EVENT_DB_SAVED,
 		RHYTHMDB_EVENT_QUERY_COMPLETE,
-		RHYTHMDB_EVENT_ENTRY_SET
+		RHYTHMDB_EVENT_ENTRY_SET,
+		RHYTHMDB_EVENT_ENTRY_SET_MANY
 	} type;
 	RBRefString *uri;
 	RBRefString *real_uri; /* Target of a symlink, if any */
 	RhythmDBEntryType *entry_type;
 	RhythmDBEntryType *ignore_type;
 	RhythmDBEntryType *error_type;
+	gboolean background;	/* STAT and METADATA_LOAD for files already in the db */
 
 	GError *error;
 	RhythmDB *db;
@@ -214,6 +250,7 @@ typedef struct
 	GFileInfo *file_info;
 	/* LOAD */
 	RBMetaData *metadata;
+	GClosure *load_complete;
 	/* QUERY_COMPLETE */
 	RhythmDBQueryResults *results;
 	/* ENTRY_SET */
@@ -221,6 +258,10 @@ typedef struct
 	/* ENTRY_SET */
 	gboolean signal_change;
 	RhythmDBEntryChange change;
+	/* ENTRY_SET_MANY */
+	RhythmDBEntryUpdate *updates;
+	GValue *update_values;
+	guint n_updates;
 } RhythmDBEvent;
 
 /* from rhythmdb.c */
@@ -229,8 +270,14 @@ void rhythmdb_entry_set_visibility (RhythmDB *db, RhythmDBEntry *entry,
 void rhythmdb_entry_set_internal (RhythmDB *db, RhythmDBEntry *entry,
 				  gboolean notify_if_inserted, guint propid,
 				  const GValue *value);
+void rhythmdb_entry_fields_lock (RhythmDB *db, gboolean write);
+void rhythmdb_entry_fields_unlock (RhythmDB *db, gboolean write);
 void rhythmdb_entry_type_foreach (RhythmDB *db, GHFunc func, gpointer data);
 RhythmDBEntry *	rhythmdb_entry_lookup_by_location_refstring (RhythmDB *db, RBRefString *uri);
+void rhythmdb_queue_load (RhythmDB *db, const char *uri, RhythmDBEntryType *type,
+			  RhythmDBEntryType *ignore_type, RhythmDBEntryType *error_type,
+			  GClosure *load_complete);
+int rhythmdb_get_pending_loads (RhythmDB *db);
 
 /* from rhythmdb-monitor.c */
 void rhythmdb_init_monitoring (RhythmDB *db);
@@ -241,6 +288,32 @@ void rhythmdb_start_monitoring (RhythmDB *db);
 void rhythmdb_monitor_uri_path (RhythmDB *db, const char *uri, GError **error);
 GList *rhythmdb_get_active_mounts (RhythmDB *db);
 
+/* from rhythmdb-dir-manifest.c */
+typedef struct _RhythmDBDirManifest RhythmDBDirManifest;
+
+RhythmDBDirManifest *rhythmdb_dir_manifest_load (RhythmDB *db);
+GList *rhythmdb_dir_manifest_check (RhythmDBDirManifest *manifest, RhythmDB *db,
+				    GList *stat_list, GPtrArray *unchanged);
+void rhythmdb_dir_manifest_stat_failed (RhythmDBDirManifest *manifest, RhythmDBEvent *event);
+void rhythmdb_dir_manifest_save (RhythmDBDirManifest *manifest);
+void rhythmdb_dir_manifest_free (RhythmDBDirManifest *manifest);
+
+/* from rhythmdb-metadata-cache.c */
+RhythmDBMetadataCache *rhythmdb_metadata_cache_new (const char *path);
+RBMetaData *rhythmdb_metadata_cache_lookup (RhythmDBMetadataCache *cache, const char *uri,
+					    GFileInfo *info);
+void rhythmdb_metadata_cache_store (RhythmDBMetadataCache *cache, const char *uri,
+				    GFileInfo *info, RBMetaData *md);
+void rhythmdb_metadata_cache_prune (RhythmDBMetadataCache *cache, GCancellable *cancellable);
+void rhythmdb_metadata_cache_free (RhythmDBMetadataCache *cache);
+
+/* from rhythmdb-query-cache.c */
+void rhythmdb_init_query_cache (RhythmDB *db);
+void rhythmdb_finalize_query_cache (RhythmDB *db);
+void rhythmdb_query_cache_do_full_query (RhythmDB *db, GPtrArray *query,
+					 RhythmDBQueryResults *results, gboolean *cancel);
+void rhythmdb_query_cache_entry_changed (RhythmDB *db, RhythmDBEntry *entry, gboolean deleted);
+
 /* from rhythmdb-query.c */
 GPtrArray *rhythmdb_query_parse_valist (RhythmDB *db, va_list args);
 void       rhythmdb_read_encoded_property (RhythmDB *db, const char *data, RhythmDBPropType propid, GValue *val);
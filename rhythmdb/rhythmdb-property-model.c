@@ -77,9 +77,8 @@ static void rhythmdb_property_model_row_inserted_cb (GtkTreeModel *model,
 						     GtkTreePath *path,
 						     GtkTreeIter *iter,
 						     RhythmDBPropertyModel *propmodel);
-static void rhythmdb_property_model_prop_changed_cb (RhythmDB *db, RhythmDBEntry *entry,
-						     RhythmDBPropType prop, const GValue *old,
-						     const GValue *new,
+static void rhythmdb_property_model_entry_changes_cb (RhythmDBQueryModel *model, RhythmDBEntry *entry,
+						     RhythmDBEntryChangeSet *changes, guint index,
 						     RhythmDBPropertyModel *propmodel);
 static void rhythmdb_property_model_entry_removed_cb (RhythmDBQueryModel *model,
 						      RhythmDBEntry *entry,
@@ -365,7 +364,7 @@ rhythmdb_property_model_set_query_model_internal (RhythmDBPropertyModel *model,
 						      G_CALLBACK (rhythmdb_property_model_entry_removed_cb),
 						      model);
 		g_signal_handlers_disconnect_by_func (model->priv->query_model,
-						      G_CALLBACK (rhythmdb_property_model_prop_changed_cb),
+						      G_CALLBACK (rhythmdb_property_model_entry_changes_cb),
 						      model);
 
 		gtk_tree_model_foreach (GTK_TREE_MODEL (model->priv->query_model),
@@ -392,8 +391,8 @@ rhythmdb_property_model_set_query_model_internal (RhythmDBPropertyModel *model,
 					 model,
 					 0);
 		g_signal_connect_object (model->priv->query_model,
-					 "entry-prop-changed",
-					 G_CALLBACK (rhythmdb_property_model_prop_changed_cb),
+					 "entry-changes",
+					 G_CALLBACK (rhythmdb_property_model_entry_changes_cb),
 					 model,
 					 0);
 		gtk_tree_model_foreach (GTK_TREE_MODEL (model->priv->query_model),
@@ -595,12 +594,11 @@ rhythmdb_property_model_row_inserted_cb (GtkTreeModel *model,
 }
 
 static void
-rhythmdb_property_model_prop_changed_cb (RhythmDB *db,
-					 RhythmDBEntry *entry,
-					 RhythmDBPropType propid,
-					 const GValue *old,
-					 const GValue *new,
-					 RhythmDBPropertyModel *propmodel)
+rhythmdb_property_model_prop_changed (RhythmDBPropertyModel *propmodel,
+				      RhythmDBEntry *entry,
+				      RhythmDBPropType propid,
+				      const GValue *old,
+				      const GValue *new)
 {
 	if (propid == RHYTHMDB_PROP_HIDDEN) {
 		gboolean old_val = g_value_get_boolean (old);
@@ -656,6 +654,42 @@ rhythmdb_property_model_prop_changed_cb (RhythmDB *db,
 	}
 }
 
+static void
+rhythmdb_property_model_entry_changes_cb (RhythmDBQueryModel *model,
+					  RhythmDBEntry *entry,
+					  RhythmDBEntryChangeSet *changes,
+					  guint index,
+					  RhythmDBPropertyModel *propmodel)
+{
+	RhythmDBEntryChange *hidden = NULL;
+	guint n_changes;
+	guint i;
+
+	n_changes = rhythmdb_entry_change_set_get_n_changes (changes, index);
+	for (i = 0; i < n_changes; i++) {
+		RhythmDBEntryChange *change = rhythmdb_entry_change_set_get_change (changes, index, i);
+
+		if (change->prop == RHYTHMDB_PROP_HIDDEN) {
+			if (hidden == NULL)
+				hidden = change;
+		} else {
+			rhythmdb_property_model_prop_changed (propmodel, entry, change->prop,
+							      &change->old, &change->new);
+		}
+	}
+
+	/* only the overall change in visibility matters */
+	if (hidden != NULL) {
+		GValue new_val = {0,};
+
+		g_value_init (&new_val, G_TYPE_BOOLEAN);
+		g_value_set_boolean (&new_val, rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN));
+		rhythmdb_property_model_prop_changed (propmodel, entry, RHYTHMDB_PROP_HIDDEN,
+						      &hidden->old, &new_val);
+		g_value_unset (&new_val);
+	}
+}
+
 static void
 rhythmdb_property_model_entry_removed_cb (RhythmDBQueryModel *model,
 					  RhythmDBEntry *entry,
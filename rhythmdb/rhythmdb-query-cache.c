@@ -0,0 +1,458 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Query result cache
+ *
+ * Several sources often run the same query: the library browser, auto
+ * playlists with the same criteria, and the various sharing plugins.  The
+ * results of asynchronous queries are kept here, keyed by the serialized
+ * form of the query, so the next model with the same query can be
+ * populated straight from the cache.  Each commit re-evaluates the changed,
+ * added and deleted entries against the cached queries, so the results
+ * stay up to date without running the queries again.
+ *
+ * Queries relative to the current time, and keyword queries (keyword
+ * changes aren't committed), are never cached.  Synchronous queries don't
+ * use the cache either, as they're often run straight after making
+ * changes that haven't been committed yet.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib-object.h>
+#include <libxml/tree.h>
+
+#include "rb-debug.h"
+#include "rhythmdb.h"
+#include "rhythmdb-private.h"
+#include "rhythmdb-query-model.h"
+#include "rhythmdb-query-results.h"
+
+#define RHYTHMDB_QUERY_CACHE_SIZE	16
+
+typedef struct
+{
+	char *key;
+	GPtrArray *query;		/* preprocessed */
+	RhythmDBCompiledQuery *compiled;
+	GHashTable *entries;		/* GHashTable<RhythmDBEntry, RhythmDBEntry>, holding references */
+
+	/* while the query is running, entries changed by commits are noted
+	 * here, and checked again once it's done.  the value is TRUE if the
+	 * entry was deleted.
+	 */
+	GHashTable *dirty;
+} RhythmDBQueryCacheItem;
+
+/* query results that add the entries to a cache item before passing them on */
+
+typedef struct
+{
+	GObject parent;
+	RhythmDB *db;
+	RhythmDBQueryCacheItem *item;
+	RhythmDBQueryResults *results;
+} RhythmDBQueryCacheFill;
+
+typedef struct
+{
+	GObjectClass parent_class;
+} RhythmDBQueryCacheFillClass;
+
+static void rhythmdb_query_cache_fill_iface_init (RhythmDBQueryResultsIface *iface);
+GType rhythmdb_query_cache_fill_get_type (void);
+
+G_DEFINE_TYPE_WITH_CODE (RhythmDBQueryCacheFill, rhythmdb_query_cache_fill, G_TYPE_OBJECT,
+			 G_IMPLEMENT_INTERFACE (RHYTHMDB_TYPE_QUERY_RESULTS,
+						rhythmdb_query_cache_fill_iface_init))
+
+static void
+rhythmdb_query_cache_fill_set_query (RhythmDBQueryResults *results,
+				     GPtrArray *query)
+{
+}
+
+static void
+rhythmdb_query_cache_fill_add_results (RhythmDBQueryResults *results,
+				       GPtrArray *entries)
+{
+	RhythmDBQueryCacheFill *fill = (RhythmDBQueryCacheFill *) results;
+	guint i;
+
+	g_mutex_lock (fill->db->priv->query_cache_lock);
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+
+		if (g_hash_table_lookup (fill->item->entries, entry) == NULL) {
+			rhythmdb_entry_ref (entry);
+			g_hash_table_insert (fill->item->entries, entry, entry);
+		}
+	}
+	g_mutex_unlock (fill->db->priv->query_cache_lock);
+
+	rhythmdb_query_results_add_results (fill->results, entries);
+}
+
+static void
+rhythmdb_query_cache_fill_query_complete (RhythmDBQueryResults *results)
+{
+}
+
+static void
+rhythmdb_query_cache_fill_iface_init (RhythmDBQueryResultsIface *iface)
+{
+	iface->set_query = rhythmdb_query_cache_fill_set_query;
+	iface->add_results = rhythmdb_query_cache_fill_add_results;
+	iface->query_complete = rhythmdb_query_cache_fill_query_complete;
+}
+
+static void
+rhythmdb_query_cache_fill_init (RhythmDBQueryCacheFill *fill)
+{
+}
+
+static void
+rhythmdb_query_cache_fill_class_init (RhythmDBQueryCacheFillClass *klass)
+{
+}
+
+static void
+query_cache_item_free (RhythmDBQueryCacheItem *item)
+{
+	g_free (item->key);
+	rhythmdb_compiled_query_free (item->compiled);
+	rhythmdb_query_free (item->query);
+	g_hash_table_destroy (item->entries);
+	if (item->dirty != NULL)
+		g_hash_table_destroy (item->dirty);
+	g_free (item);
+}
+
+static gboolean
+query_is_cacheable (GPtrArray *query)
+{
+	guint i;
+
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+
+		switch (data->type) {
+		case RHYTHMDB_QUERY_SUBQUERY:
+			if (query_is_cacheable (data->subquery) == FALSE)
+				return FALSE;
+			break;
+		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+			return FALSE;
+		case RHYTHMDB_QUERY_DISJUNCTION:
+		case RHYTHMDB_QUERY_END:
+			break;
+		default:
+			if (data->propid == RHYTHMDB_PROP_KEYWORD)
+				return FALSE;
+			break;
+		}
+	}
+	return TRUE;
+}
+
+static char *
+query_cache_key (RhythmDB *db,
+		 GPtrArray *query)
+{
+	xmlDocPtr doc;
+	xmlNodePtr root;
+	xmlChar *buf;
+	int len;
+	char *key;
+
+	doc = xmlNewDoc (BAD_CAST "1.0");
+	root = xmlNewDocNode (doc, NULL, BAD_CAST "query", NULL);
+	xmlDocSetRootElement (doc, root);
+	rhythmdb_query_serialize (db, query, root);
+
+	xmlDocDumpMemory (doc, &buf, &len);
+	key = g_strndup ((const char *) buf, len);
+	xmlFree (buf);
+	xmlFreeDoc (doc);
+
+	return key;
+}
+
+/* must be called with the cache lock held */
+static void
+query_cache_item_update (RhythmDBQueryCacheItem *item,
+			 RhythmDBEntry *entry,
+			 gboolean deleted)
+{
+	gboolean present;
+
+	if (item->dirty != NULL) {
+		if (g_hash_table_lookup_extended (item->dirty, entry, NULL, NULL) == FALSE)
+			rhythmdb_entry_ref (entry);
+		g_hash_table_insert (item->dirty, entry, GINT_TO_POINTER (deleted));
+		return;
+	}
+
+	present = (g_hash_table_lookup (item->entries, entry) != NULL);
+	if (deleted == FALSE && rhythmdb_compiled_query_evaluate (item->compiled, entry)) {
+		if (present == FALSE) {
+			rhythmdb_entry_ref (entry);
+			g_hash_table_insert (item->entries, entry, entry);
+		}
+	} else if (present) {
+		g_hash_table_remove (item->entries, entry);
+	}
+}
+
+/* must be called with the cache lock held */
+static void
+query_cache_item_finish (RhythmDBQueryCacheItem *item)
+{
+	GHashTable *dirty = item->dirty;
+	GHashTableIter iter;
+	gpointer entry;
+	gpointer deleted;
+
+	item->dirty = NULL;
+	g_hash_table_iter_init (&iter, dirty);
+	while (g_hash_table_iter_next (&iter, &entry, &deleted)) {
+		query_cache_item_update (item, entry, GPOINTER_TO_INT (deleted));
+	}
+	g_hash_table_destroy (dirty);
+}
+
+/* must be called with the cache lock held.  returns the items removed from
+ * the cache, to be freed once the lock is released.
+ */
+static GList *
+query_cache_add (RhythmDB *db,
+		 RhythmDBQueryCacheItem *item)
+{
+	GList *evicted = NULL;
+	GList *l;
+	guint n_items;
+
+	g_hash_table_insert (db->priv->query_cache, item->key, item);
+	db->priv->query_cache_lru = g_list_prepend (db->priv->query_cache_lru, item);
+
+	/* throw out the least recently used queries that aren't still running */
+	n_items = g_hash_table_size (db->priv->query_cache);
+	l = g_list_last (db->priv->query_cache_lru);
+	while (n_items > RHYTHMDB_QUERY_CACHE_SIZE && l != NULL) {
+		RhythmDBQueryCacheItem *old = l->data;
+		GList *prev = l->prev;
+
+		if (old->dirty == NULL) {
+			rb_debug ("evicting cached query %p", old);
+			g_hash_table_remove (db->priv->query_cache, old->key);
+			db->priv->query_cache_lru = g_list_delete_link (db->priv->query_cache_lru, l);
+			evicted = g_list_prepend (evicted, old);
+			n_items--;
+		}
+		l = prev;
+	}
+	return evicted;
+}
+
+/* feeds the entries in the cache item to the results in chunks, and
+ * returns FALSE if there's no usable item for the query.
+ */
+static gboolean
+query_cache_lookup (RhythmDB *db,
+		    const char *key,
+		    RhythmDBQueryResults *results,
+		    gboolean *cancel)
+{
+	RhythmDBQueryCacheItem *item;
+	GHashTableIter iter;
+	GPtrArray *entries;
+	gpointer entry;
+	guint i;
+
+	g_mutex_lock (db->priv->query_cache_lock);
+	item = g_hash_table_lookup (db->priv->query_cache, key);
+	if (item == NULL || item->dirty != NULL) {
+		/* either not cached or still running somewhere else */
+		g_mutex_unlock (db->priv->query_cache_lock);
+		return FALSE;
+	}
+
+	db->priv->query_cache_lru = g_list_remove (db->priv->query_cache_lru, item);
+	db->priv->query_cache_lru = g_list_prepend (db->priv->query_cache_lru, item);
+
+	/* take references so the lock needn't be held while the results
+	 * take the entries.
+	 */
+	entries = g_ptr_array_sized_new (g_hash_table_size (item->entries));
+	g_hash_table_iter_init (&iter, item->entries);
+	while (g_hash_table_iter_next (&iter, &entry, NULL)) {
+		g_ptr_array_add (entries, rhythmdb_entry_ref (entry));
+	}
+	g_mutex_unlock (db->priv->query_cache_lock);
+
+	rb_debug ("query results cached, %u entries", entries->len);
+	for (i = 0; i < entries->len && *cancel == FALSE; i += RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+		GPtrArray *chunk;
+		guint j;
+
+		chunk = g_ptr_array_new ();
+		for (j = i; j < entries->len && j < i + RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK; j++) {
+			g_ptr_array_add (chunk, g_ptr_array_index (entries, j));
+		}
+		rhythmdb_query_results_add_results (results, chunk);
+	}
+
+	g_ptr_array_foreach (entries, (GFunc) rhythmdb_entry_unref, NULL);
+	g_ptr_array_free (entries, TRUE);
+	return TRUE;
+}
+
+/**
+ * rhythmdb_query_cache_do_full_query:
+ * @db: the #RhythmDB
+ * @query: the query to run, not yet preprocessed
+ * @results: a #RhythmDBQueryResults instance to feed results to
+ * @cancel: set to TRUE to stop the query
+ *
+ * Runs a full query, using the cached results if there are any, or adding
+ * the results to the cache otherwise.  @query is preprocessed as for
+ * rhythmdb_query_preprocess().
+ */
+void
+rhythmdb_query_cache_do_full_query (RhythmDB *db,
+				    GPtrArray *query,
+				    RhythmDBQueryResults *results,
+				    gboolean *cancel)
+{
+	RhythmDBClass *klass = RHYTHMDB_GET_CLASS (db);
+	RhythmDBQueryCacheItem *item;
+	RhythmDBQueryCacheFill *fill;
+	GList *evicted;
+	char *key;
+
+	if (query_is_cacheable (query) == FALSE) {
+		rhythmdb_query_preprocess (db, query);
+		klass->impl_do_full_query (db, query, results, cancel);
+		return;
+	}
+
+	key = query_cache_key (db, query);
+	if (query_cache_lookup (db, key, results, cancel)) {
+		g_free (key);
+		return;
+	}
+
+	rhythmdb_query_preprocess (db, query);
+
+	item = g_new0 (RhythmDBQueryCacheItem, 1);
+	item->key = key;
+	item->query = rhythmdb_query_copy (query);
+	item->compiled = rhythmdb_query_compile (db, item->query);
+	item->entries = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					       (GDestroyNotify) rhythmdb_entry_unref, NULL);
+	item->dirty = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					     (GDestroyNotify) rhythmdb_entry_unref, NULL);
+
+	g_mutex_lock (db->priv->query_cache_lock);
+	if (g_hash_table_lookup (db->priv->query_cache, key) != NULL) {
+		/* somebody else got there first */
+		g_mutex_unlock (db->priv->query_cache_lock);
+		query_cache_item_free (item);
+		klass->impl_do_full_query (db, query, results, cancel);
+		return;
+	}
+	evicted = query_cache_add (db, item);
+	g_mutex_unlock (db->priv->query_cache_lock);
+
+	g_list_foreach (evicted, (GFunc) query_cache_item_free, NULL);
+	g_list_free (evicted);
+
+	fill = g_object_new (rhythmdb_query_cache_fill_get_type (), NULL);
+	fill->db = db;
+	fill->item = item;
+	fill->results = results;
+	klass->impl_do_full_query (db, query, RHYTHMDB_QUERY_RESULTS (fill), cancel);
+	g_object_unref (fill);
+
+	g_mutex_lock (db->priv->query_cache_lock);
+	if (*cancel) {
+		/* the results are incomplete */
+		g_hash_table_remove (db->priv->query_cache, item->key);
+		db->priv->query_cache_lru = g_list_remove (db->priv->query_cache_lru, item);
+	} else {
+		query_cache_item_finish (item);
+		rb_debug ("cached query results, %u entries", g_hash_table_size (item->entries));
+		item = NULL;
+	}
+	g_mutex_unlock (db->priv->query_cache_lock);
+
+	if (item != NULL)
+		query_cache_item_free (item);
+}
+
+/**
+ * rhythmdb_query_cache_entry_changed:
+ * @db: the #RhythmDB
+ * @entry: a #RhythmDBEntry that has been added, changed or deleted
+ * @deleted: whether the entry has been deleted
+ *
+ * Updates the cached query results for a committed change to an entry.
+ */
+void
+rhythmdb_query_cache_entry_changed (RhythmDB *db,
+				    RhythmDBEntry *entry,
+				    gboolean deleted)
+{
+	GList *l;
+
+	g_mutex_lock (db->priv->query_cache_lock);
+	for (l = db->priv->query_cache_lru; l != NULL; l = l->next) {
+		query_cache_item_update (l->data, entry, deleted);
+	}
+	g_mutex_unlock (db->priv->query_cache_lock);
+}
+
+void
+rhythmdb_init_query_cache (RhythmDB *db)
+{
+	db->priv->query_cache_lock = g_mutex_new ();
+	db->priv->query_cache = g_hash_table_new (g_str_hash, g_str_equal);
+	db->priv->query_cache_lru = NULL;
+}
+
+void
+rhythmdb_finalize_query_cache (RhythmDB *db)
+{
+	g_list_foreach (db->priv->query_cache_lru, (GFunc) query_cache_item_free, NULL);
+	g_list_free (db->priv->query_cache_lru);
+	g_hash_table_destroy (db->priv->query_cache);
+	g_mutex_free (db->priv->query_cache_lock);
+}
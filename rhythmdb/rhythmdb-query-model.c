@@ -82,9 +82,10 @@ static void rhythmdb_query_model_do_insert (RhythmDBQueryModel *model,
 static void rhythmdb_query_model_entry_added_cb (RhythmDB *db, RhythmDBEntry *entry,
 						 RhythmDBQueryModel *model);
 static void rhythmdb_query_model_entry_changed_cb (RhythmDB *db, RhythmDBEntry *entry,
-						   GValueArray *changes, RhythmDBQueryModel *model);
-static void rhythmdb_query_model_entry_deleted_cb (RhythmDB *db, RhythmDBEntry *entry,
+						   RhythmDBEntryChangeSet *changes, guint index,
 						   RhythmDBQueryModel *model);
+static void rhythmdb_query_model_remove_entries (RhythmDBQueryModel *model, GPtrArray *entries,
+						 gboolean emit_removed);
 
 static void rhythmdb_query_model_filter_out_entry (RhythmDBQueryModel *model,
 						   RhythmDBEntry *entry);
@@ -160,12 +161,11 @@ static void rhythmdb_query_model_base_rows_reordered (GtkTreeModel *base_model,
 static void rhythmdb_query_model_base_entry_removed (RhythmDBQueryModel *base_model,
 						     RhythmDBEntry *entry,
 						     RhythmDBQueryModel *model);
-static void rhythmdb_query_model_base_entry_prop_changed (RhythmDBQueryModel *base_model,
-							  RhythmDBEntry *entry,
-							  RhythmDBPropType prop,
-							  const GValue *old,
-							  const GValue *new_value,
-							  RhythmDBQueryModel *model);
+static void rhythmdb_query_model_base_entry_changes (RhythmDBQueryModel *base_model,
+						     RhythmDBEntry *entry,
+						     RhythmDBEntryChangeSet *changes,
+						     guint index,
+						     RhythmDBQueryModel *model);
 static int rhythmdb_query_model_child_index_to_base_index (RhythmDBQueryModel *model, int index);
 
 static gint _reverse_sorting_func (gpointer a, gpointer b, struct ReverseSortData *model);
@@ -207,6 +207,10 @@ static const GtkTargetEntry rhythmdb_query_model_drag_types[] = {
 
 static GtkTargetList *rhythmdb_query_model_drag_target_list = NULL;
 
+#define RHYTHMDB_QUERY_MODEL_PROP_WORDS	((RHYTHMDB_NUM_PROPERTIES + 31) / 32)
+#define PROP_SET_ADD(set, prop)		((set)[(prop) / 32] |= (1U << ((prop) % 32)))
+#define PROP_SET_HAS(set, prop)		(((set)[(prop) / 32] & (1U << ((prop) % 32))) != 0)
+
 struct _RhythmDBQueryModelPrivate
 {
 	RhythmDB *db;
@@ -220,6 +224,7 @@ struct _RhythmDBQueryModelPrivate
 
 	GPtrArray *query;
 	GPtrArray *original_query;
+	RhythmDBCompiledQuery *compiled_query;
 
 	guint stamp;
 
@@ -241,6 +246,17 @@ struct _RhythmDBQueryModelPrivate
 	gboolean show_hidden;
 
 	gint query_reapply_timeout_id;
+
+	/* change dispatching */
+	gboolean dispatched;
+	guint dispatch_serial;
+	int dispatch_key;		/* index into dispatch_key_props, or -1 */
+	gpointer dispatch_value;	/* entry type or RBRefString required by the query */
+	guint32 query_props[RHYTHMDB_QUERY_MODEL_PROP_WORDS];
+
+	/* properties the sort function depends on */
+	gboolean sort_props_known;
+	guint32 sort_props[RHYTHMDB_QUERY_MODEL_PROP_WORDS];
 };
 
 #define RHYTHMDB_QUERY_MODEL_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), RHYTHMDB_TYPE_QUERY_MODEL, RhythmDBQueryModelPrivate))
@@ -264,6 +280,7 @@ enum
 {
 	COMPLETE,
 	ENTRY_PROP_CHANGED,
+	ENTRY_CHANGES,
 	ENTRY_REMOVED,
 	NON_ENTRY_DROPPED,
 	POST_ENTRY_DELETE,
@@ -414,6 +431,27 @@ rhythmdb_query_model_class_init (RhythmDBQueryModelClass *klass)
 			      rb_marshal_VOID__BOXED_INT_POINTER_POINTER,
 			      G_TYPE_NONE,
 			      4, RHYTHMDB_TYPE_ENTRY, G_TYPE_INT, G_TYPE_POINTER, G_TYPE_POINTER);
+	/**
+	 * RhythmDBQueryModel::entry-changes:
+	 * @model: the #RhythmDBQueryModel
+	 * @entry: the #RhythmDBEntry that changed
+	 * @changes: the #RhythmDBEntryChangeSet containing the changes
+	 * @index: the index of @entry in @changes
+	 *
+	 * Emitted once when an entry in the query model is changed, carrying
+	 * all the changes made to it.  This is emitted before any
+	 * entry-prop-changed signals for the entry, which are only emitted
+	 * if something is connected to them.
+	 */
+	rhythmdb_query_model_signals[ENTRY_CHANGES] =
+		g_signal_new ("entry-changes",
+			      RHYTHMDB_TYPE_QUERY_MODEL,
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (RhythmDBQueryModelClass, entry_changes),
+			      NULL, NULL,
+			      rb_marshal_VOID__BOXED_BOXED_UINT,
+			      G_TYPE_NONE,
+			      3, RHYTHMDB_TYPE_ENTRY, RHYTHMDB_TYPE_ENTRY_CHANGE_SET, G_TYPE_UINT);
 	/**
 	 * RhythmDBQueryModel::entry-removed:
 	 * @model: the #RhythmDBQueryModel
@@ -543,19 +581,598 @@ rhythmdb_query_model_drag_dest_init (RbTreeDragDestIface *iface)
 	iface->rb_row_drop_position = rhythmdb_query_model_row_drop_position;
 }
 
+/*
+ * Change dispatching
+ *
+ * Rather than having every query model connect to the database's entry
+ * signals and evaluate its query for each change, one dispatcher per
+ * database receives the signals and passes them on only to the models
+ * they could affect.  Changes go to the models that contain the entry, and
+ * to those whose queries test one of the changed properties; the entry
+ * can't have started matching any other query.  New entries only go to the
+ * models whose queries could match them, going by the entry type, genre,
+ * artist or album the query requires, if any.
+ *
+ * Setting RHYTHMDB_QUERY_MODEL_DISPATCH_ALL in the environment passes
+ * everything to every model instead, for comparison.
+ */
+
+static const RhythmDBPropType dispatch_key_props[] = {
+	RHYTHMDB_PROP_ALBUM,
+	RHYTHMDB_PROP_ARTIST,
+	RHYTHMDB_PROP_GENRE,
+	RHYTHMDB_PROP_TYPE
+};
+
+typedef struct
+{
+	RhythmDB *db;
+	GList *models;
+	guint serial;
+	gboolean dispatch_all;
+
+	/* models requiring each value of the key properties */
+	GHashTable *keyed[G_N_ELEMENTS (dispatch_key_props)];
+	/* models whose queries don't require any particular value */
+	GList *unkeyed;
+	/* models whose queries test each property */
+	GList *prop_models[RHYTHMDB_NUM_PROPERTIES];
+} RhythmDBQueryModelDispatcher;
+
+/* marks a property, and the properties it's derived from */
+static void
+add_prop_dependency (guint32 *props,
+			 RhythmDBPropType prop)
+{
+	PROP_SET_ADD (props, prop);
+
+	switch (prop) {
+	case RHYTHMDB_PROP_TITLE_SORT_KEY:
+	case RHYTHMDB_PROP_TITLE_FOLDED:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_TITLE);
+		break;
+	case RHYTHMDB_PROP_GENRE_SORT_KEY:
+	case RHYTHMDB_PROP_GENRE_FOLDED:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_GENRE);
+		break;
+	case RHYTHMDB_PROP_ARTIST_SORT_KEY:
+	case RHYTHMDB_PROP_ARTIST_FOLDED:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_ARTIST);
+		break;
+	case RHYTHMDB_PROP_ALBUM_SORT_KEY:
+	case RHYTHMDB_PROP_ALBUM_FOLDED:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_ALBUM);
+		break;
+	case RHYTHMDB_PROP_ARTIST_SORTNAME_SORT_KEY:
+	case RHYTHMDB_PROP_ARTIST_SORTNAME_FOLDED:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_ARTIST_SORTNAME);
+		break;
+	case RHYTHMDB_PROP_ALBUM_SORTNAME_SORT_KEY:
+	case RHYTHMDB_PROP_ALBUM_SORTNAME_FOLDED:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_ALBUM_SORTNAME);
+		break;
+	case RHYTHMDB_PROP_ALBUM_ARTIST_SORT_KEY:
+	case RHYTHMDB_PROP_ALBUM_ARTIST_FOLDED:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_ALBUM_ARTIST);
+		break;
+	case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME_SORT_KEY:
+	case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME_FOLDED:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME);
+		break;
+	case RHYTHMDB_PROP_LAST_PLAYED_STR:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_LAST_PLAYED);
+		break;
+	case RHYTHMDB_PROP_FIRST_SEEN_STR:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_FIRST_SEEN);
+		break;
+	case RHYTHMDB_PROP_LAST_SEEN_STR:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_LAST_SEEN);
+		break;
+	case RHYTHMDB_PROP_YEAR:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_DATE);
+		break;
+	case RHYTHMDB_PROP_SEARCH_MATCH:
+		PROP_SET_ADD (props, RHYTHMDB_PROP_TITLE);
+		PROP_SET_ADD (props, RHYTHMDB_PROP_ALBUM);
+		PROP_SET_ADD (props, RHYTHMDB_PROP_ARTIST);
+		PROP_SET_ADD (props, RHYTHMDB_PROP_GENRE);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+dispatch_collect_query_props (GPtrArray *query,
+			      guint32 *props)
+{
+	guint i;
+
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+
+		switch (data->type) {
+		case RHYTHMDB_QUERY_SUBQUERY:
+			dispatch_collect_query_props (data->subquery, props);
+			break;
+		case RHYTHMDB_QUERY_DISJUNCTION:
+		case RHYTHMDB_QUERY_END:
+			break;
+		default:
+			add_prop_dependency (props, data->propid);
+			break;
+		}
+	}
+}
+
+/* finds the most selective value a query requires entries to have */
+static void
+dispatch_find_query_key (RhythmDBQueryModel *model)
+{
+	GPtrArray *query = model->priv->query;
+	guint i;
+	guint k;
+
+	model->priv->dispatch_key = -1;
+	model->priv->dispatch_value = NULL;
+
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+
+		/* only the criteria every match has to satisfy will do */
+		if (data->type == RHYTHMDB_QUERY_DISJUNCTION)
+			return;
+	}
+
+	for (k = 0; k < G_N_ELEMENTS (dispatch_key_props); k++) {
+		for (i = 0; i < query->len; i++) {
+			RhythmDBQueryData *data = g_ptr_array_index (query, i);
+
+			if (data->type != RHYTHMDB_QUERY_PROP_EQUALS ||
+			    data->propid != dispatch_key_props[k])
+				continue;
+
+			model->priv->dispatch_key = k;
+			if (data->propid == RHYTHMDB_PROP_TYPE)
+				model->priv->dispatch_value = g_value_get_object (data->val);
+			else
+				model->priv->dispatch_value = rb_refstring_new (g_value_get_string (data->val));
+			return;
+		}
+	}
+}
+
+static void
+dispatch_index_model (RhythmDBQueryModelDispatcher *dispatcher,
+		      RhythmDBQueryModel *model)
+{
+	guint prop;
+
+	memset (model->priv->query_props, 0, sizeof (model->priv->query_props));
+	model->priv->dispatch_key = -1;
+	model->priv->dispatch_value = NULL;
+
+	/* models without queries only care about the entries they contain */
+	if (model->priv->query == NULL)
+		return;
+
+	dispatch_collect_query_props (model->priv->query, model->priv->query_props);
+	for (prop = 0; prop < RHYTHMDB_NUM_PROPERTIES; prop++) {
+		if (PROP_SET_HAS (model->priv->query_props, prop))
+			dispatcher->prop_models[prop] = g_list_prepend (dispatcher->prop_models[prop], model);
+	}
+
+	dispatch_find_query_key (model);
+	if (model->priv->dispatch_key != -1) {
+		GHashTable *keyed = dispatcher->keyed[model->priv->dispatch_key];
+		GList *models;
+
+		models = g_hash_table_lookup (keyed, model->priv->dispatch_value);
+		g_hash_table_steal (keyed, model->priv->dispatch_value);
+		g_hash_table_insert (keyed, model->priv->dispatch_value, g_list_prepend (models, model));
+	} else {
+		dispatcher->unkeyed = g_list_prepend (dispatcher->unkeyed, model);
+	}
+}
+
+static void
+dispatch_unindex_model (RhythmDBQueryModelDispatcher *dispatcher,
+			RhythmDBQueryModel *model)
+{
+	guint prop;
+
+	if (model->priv->query == NULL)
+		return;
+
+	for (prop = 0; prop < RHYTHMDB_NUM_PROPERTIES; prop++) {
+		if (PROP_SET_HAS (model->priv->query_props, prop))
+			dispatcher->prop_models[prop] = g_list_remove (dispatcher->prop_models[prop], model);
+	}
+
+	if (model->priv->dispatch_key != -1) {
+		GHashTable *keyed = dispatcher->keyed[model->priv->dispatch_key];
+		GList *models;
+
+		models = g_hash_table_lookup (keyed, model->priv->dispatch_value);
+		g_hash_table_steal (keyed, model->priv->dispatch_value);
+		models = g_list_remove (models, model);
+		if (models != NULL)
+			g_hash_table_insert (keyed, model->priv->dispatch_value, models);
+
+		if (dispatch_key_props[model->priv->dispatch_key] != RHYTHMDB_PROP_TYPE)
+			rb_refstring_unref (model->priv->dispatch_value);
+	} else {
+		dispatcher->unkeyed = g_list_remove (dispatcher->unkeyed, model);
+	}
+	model->priv->dispatch_key = -1;
+	model->priv->dispatch_value = NULL;
+}
+
+static void
+rhythmdb_query_model_dispatcher_free (RhythmDBQueryModelDispatcher *dispatcher)
+{
+	GList *l;
+	guint i;
+
+	/* models don't hold a reference to the database, so some may outlive it */
+	for (l = dispatcher->models; l != NULL; l = l->next) {
+		RhythmDBQueryModel *model = l->data;
+
+		dispatch_unindex_model (dispatcher, model);
+		model->priv->dispatched = FALSE;
+	}
+	g_list_free (dispatcher->models);
+
+	for (i = 0; i < G_N_ELEMENTS (dispatch_key_props); i++) {
+		g_hash_table_destroy (dispatcher->keyed[i]);
+	}
+	g_free (dispatcher);
+}
+
+static void
+dispatch_add_target (RhythmDBQueryModelDispatcher *dispatcher,
+		     GPtrArray *targets,
+		     RhythmDBQueryModel *model)
+{
+	if (model->priv->dispatch_serial == dispatcher->serial)
+		return;
+
+	model->priv->dispatch_serial = dispatcher->serial;
+	g_ptr_array_add (targets, g_object_ref (model));
+}
+
+static void
+dispatch_add_targets (RhythmDBQueryModelDispatcher *dispatcher,
+		      GPtrArray *targets,
+		      GList *models)
+{
+	GList *l;
+
+	for (l = models; l != NULL; l = l->next) {
+		dispatch_add_target (dispatcher, targets, l->data);
+	}
+}
+
+/* models may be disposed by the handlers for earlier ones */
+#define DISPATCH_TARGETS(targets, call)							\
+	G_STMT_START {									\
+		guint _i;								\
+		for (_i = 0; _i < (targets)->len; _i++) {				\
+			RhythmDBQueryModel *model = g_ptr_array_index ((targets), _i);	\
+			if (model->priv->dispatched)					\
+				call;							\
+			g_object_unref (model);						\
+		}									\
+		g_ptr_array_free ((targets), TRUE);					\
+	} G_STMT_END
+
+static void
+dispatch_entry_added (RhythmDB *db,
+		      RhythmDBEntry *entry,
+		      RhythmDBQueryModelDispatcher *dispatcher)
+{
+	GPtrArray *targets;
+	guint k;
+
+	targets = g_ptr_array_new ();
+	dispatcher->serial++;
+
+	if (dispatcher->dispatch_all) {
+		dispatch_add_targets (dispatcher, targets, dispatcher->models);
+	} else {
+		dispatch_add_targets (dispatcher, targets, dispatcher->unkeyed);
+		for (k = 0; k < G_N_ELEMENTS (dispatch_key_props); k++) {
+			gpointer value;
+
+			if (g_hash_table_size (dispatcher->keyed[k]) == 0)
+				continue;
+
+			if (dispatch_key_props[k] == RHYTHMDB_PROP_TYPE) {
+				value = rhythmdb_entry_get_entry_type (entry);
+				dispatch_add_targets (dispatcher, targets,
+						      g_hash_table_lookup (dispatcher->keyed[k], value));
+			} else {
+				value = rhythmdb_entry_get_refstring (entry, dispatch_key_props[k]);
+				if (value != NULL) {
+					dispatch_add_targets (dispatcher, targets,
+							      g_hash_table_lookup (dispatcher->keyed[k], value));
+					rb_refstring_unref (value);
+				}
+			}
+		}
+	}
+
+	DISPATCH_TARGETS (targets, rhythmdb_query_model_entry_added_cb (db, entry, model));
+}
+
+static void
+dispatch_entry_changed (RhythmDB *db,
+			RhythmDBEntryChangeSet *changes,
+			guint index,
+			RhythmDBQueryModelDispatcher *dispatcher)
+{
+	GPtrArray *targets;
+	RhythmDBEntry *entry;
+	gboolean all = dispatcher->dispatch_all;
+	guint n_changes;
+	GList *l;
+	guint i;
+
+	targets = g_ptr_array_new ();
+	dispatcher->serial++;
+
+	entry = rhythmdb_entry_change_set_get_entry (changes, index);
+	n_changes = rhythmdb_entry_change_set_get_n_changes (changes, index);
+	for (i = 0; i < n_changes && all == FALSE; i++) {
+		RhythmDBEntryChange *change = rhythmdb_entry_change_set_get_change (changes, index, i);
+
+		/* visibility affects every model */
+		if (change->prop == RHYTHMDB_PROP_HIDDEN)
+			all = TRUE;
+		else
+			dispatch_add_targets (dispatcher, targets, dispatcher->prop_models[change->prop]);
+	}
+
+	for (l = dispatcher->models; l != NULL; l = l->next) {
+		RhythmDBQueryModel *model = l->data;
+
+		if (all ||
+		    g_hash_table_lookup (model->priv->reverse_map, entry) != NULL ||
+		    g_hash_table_lookup (model->priv->limited_reverse_map, entry) != NULL ||
+		    g_hash_table_lookup_extended (model->priv->hidden_entry_map, entry, NULL, NULL))
+			dispatch_add_target (dispatcher, targets, model);
+	}
+
+	DISPATCH_TARGETS (targets, rhythmdb_query_model_entry_changed_cb (db, entry, changes, index, model));
+}
+
+static void
+dispatch_entries_changed (RhythmDB *db,
+			  RhythmDBEntryChangeSet *changes,
+			  RhythmDBQueryModelDispatcher *dispatcher)
+{
+	guint n_entries;
+	guint i;
+
+	n_entries = rhythmdb_entry_change_set_get_n_entries (changes);
+	for (i = 0; i < n_entries; i++) {
+		dispatch_entry_changed (db, changes, i, dispatcher);
+	}
+}
+
+static void
+dispatch_entries_deleted (RhythmDB *db,
+			  GPtrArray *entries,
+			  RhythmDBQueryModelDispatcher *dispatcher)
+{
+	GPtrArray *targets;
+	GPtrArray *chained;
+	GList *l;
+
+	targets = g_ptr_array_new ();
+	chained = g_ptr_array_new ();
+	dispatcher->serial++;
+
+	for (l = dispatcher->models; l != NULL; l = l->next) {
+		RhythmDBQueryModel *model = l->data;
+
+		if (g_hash_table_size (model->priv->reverse_map) == 0 &&
+		    g_hash_table_size (model->priv->limited_reverse_map) == 0)
+			continue;
+
+		dispatch_add_target (dispatcher, model->priv->base_model ? chained : targets, model);
+	}
+
+	/* chained models drop their rows first, so the row-deleted signals
+	 * from their base models find nothing left to remove.  the base
+	 * models emit entry-removed, which the chained models pass on.
+	 */
+	DISPATCH_TARGETS (chained, rhythmdb_query_model_remove_entries (model, entries, FALSE));
+	DISPATCH_TARGETS (targets, rhythmdb_query_model_remove_entries (model, entries, TRUE));
+}
+
+static RhythmDBQueryModelDispatcher *
+rhythmdb_query_model_get_dispatcher (RhythmDB *db)
+{
+	RhythmDBQueryModelDispatcher *dispatcher;
+	guint i;
+
+	dispatcher = g_object_get_data (G_OBJECT (db), "rhythmdb-query-model-dispatcher");
+	if (dispatcher != NULL)
+		return dispatcher;
+
+	dispatcher = g_new0 (RhythmDBQueryModelDispatcher, 1);
+	dispatcher->db = db;
+	dispatcher->dispatch_all = (g_getenv ("RHYTHMDB_QUERY_MODEL_DISPATCH_ALL") != NULL);
+	for (i = 0; i < G_N_ELEMENTS (dispatch_key_props); i++) {
+		dispatcher->keyed[i] = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+							      NULL, (GDestroyNotify) g_list_free);
+	}
+
+	g_signal_connect (G_OBJECT (db), "entry_added", G_CALLBACK (dispatch_entry_added), dispatcher);
+	g_signal_connect (G_OBJECT (db), "entries-changed", G_CALLBACK (dispatch_entries_changed), dispatcher);
+	g_signal_connect (G_OBJECT (db), "entries-deleted", G_CALLBACK (dispatch_entries_deleted), dispatcher);
+
+	g_object_set_data_full (G_OBJECT (db), "rhythmdb-query-model-dispatcher",
+				dispatcher, (GDestroyNotify) rhythmdb_query_model_dispatcher_free);
+	return dispatcher;
+}
+
+static void
+rhythmdb_query_model_dispatch_register (RhythmDBQueryModel *model)
+{
+	RhythmDBQueryModelDispatcher *dispatcher;
+
+	dispatcher = rhythmdb_query_model_get_dispatcher (model->priv->db);
+	dispatcher->models = g_list_prepend (dispatcher->models, model);
+	dispatch_index_model (dispatcher, model);
+	model->priv->dispatched = TRUE;
+}
+
+static void
+rhythmdb_query_model_dispatch_unregister (RhythmDBQueryModel *model)
+{
+	RhythmDBQueryModelDispatcher *dispatcher;
+
+	if (model->priv->dispatched == FALSE)
+		return;
+
+	dispatcher = rhythmdb_query_model_get_dispatcher (model->priv->db);
+	dispatch_unindex_model (dispatcher, model);
+	dispatcher->models = g_list_remove (dispatcher->models, model);
+	model->priv->dispatched = FALSE;
+}
+
+/*
+ * Change relevance
+ *
+ * Most changes (play counts, last played times, playback errors) don't
+ * affect whether an entry matches a model's query or where it sorts, so
+ * there's no need to evaluate the query or re-sort the entry for them.
+ */
+
+static void
+add_album_sort_dependencies (guint32 *props)
+{
+	add_prop_dependency (props, RHYTHMDB_PROP_ALBUM_SORTNAME);
+	add_prop_dependency (props, RHYTHMDB_PROP_ALBUM);
+	add_prop_dependency (props, RHYTHMDB_PROP_DISC_NUMBER);
+	add_prop_dependency (props, RHYTHMDB_PROP_TRACK_NUMBER);
+	add_prop_dependency (props, RHYTHMDB_PROP_TITLE);
+	add_prop_dependency (props, RHYTHMDB_PROP_LOCATION);
+}
+
+static void
+rhythmdb_query_model_update_sort_props (RhythmDBQueryModel *model)
+{
+	GCompareDataFunc func = model->priv->sort_func;
+	guint32 *props = model->priv->sort_props;
+
+	memset (props, 0, sizeof (model->priv->sort_props));
+	model->priv->sort_props_known = TRUE;
+
+	if (func == NULL) {
+		return;
+	} else if (func == (GCompareDataFunc) rhythmdb_query_model_location_sort_func) {
+		add_prop_dependency (props, RHYTHMDB_PROP_LOCATION);
+	} else if (func == (GCompareDataFunc) rhythmdb_query_model_title_sort_func) {
+		add_prop_dependency (props, RHYTHMDB_PROP_TITLE);
+		add_prop_dependency (props, RHYTHMDB_PROP_LOCATION);
+	} else if (func == (GCompareDataFunc) rhythmdb_query_model_album_sort_func ||
+		   func == (GCompareDataFunc) rhythmdb_query_model_track_sort_func) {
+		add_album_sort_dependencies (props);
+	} else if (func == (GCompareDataFunc) rhythmdb_query_model_artist_sort_func) {
+		add_prop_dependency (props, RHYTHMDB_PROP_ARTIST_SORTNAME);
+		add_prop_dependency (props, RHYTHMDB_PROP_ARTIST);
+		add_album_sort_dependencies (props);
+	} else if (func == (GCompareDataFunc) rhythmdb_query_model_genre_sort_func) {
+		add_prop_dependency (props, RHYTHMDB_PROP_GENRE);
+		add_prop_dependency (props, RHYTHMDB_PROP_ARTIST_SORTNAME);
+		add_prop_dependency (props, RHYTHMDB_PROP_ARTIST);
+		add_album_sort_dependencies (props);
+	} else if (func == (GCompareDataFunc) rhythmdb_query_model_date_sort_func) {
+		add_prop_dependency (props, RHYTHMDB_PROP_DATE);
+		add_album_sort_dependencies (props);
+	} else if (func == (GCompareDataFunc) rhythmdb_query_model_bitrate_sort_func) {
+		add_prop_dependency (props, RHYTHMDB_PROP_BITRATE);
+		add_prop_dependency (props, RHYTHMDB_PROP_MIMETYPE);
+		add_prop_dependency (props, RHYTHMDB_PROP_LOCATION);
+	} else if (func == (GCompareDataFunc) rhythmdb_query_model_string_sort_func ||
+		   func == (GCompareDataFunc) rhythmdb_query_model_ulong_sort_func ||
+		   func == (GCompareDataFunc) rhythmdb_query_model_double_ceiling_sort_func) {
+		int prop = GPOINTER_TO_INT (model->priv->sort_data);
+
+		if (prop < 0 || prop >= RHYTHMDB_NUM_PROPERTIES) {
+			model->priv->sort_props_known = FALSE;
+			return;
+		}
+		add_prop_dependency (props, prop);
+		add_prop_dependency (props, RHYTHMDB_PROP_LOCATION);
+	} else {
+		/* we don't know what other sort functions look at */
+		model->priv->sort_props_known = FALSE;
+	}
+}
+
+/* checks whether changes to an entry could affect whether it matches the
+ * query, and whether they could affect its position in the model.
+ */
+static void
+rhythmdb_query_model_check_changes (RhythmDBQueryModel *model,
+				    RhythmDBEntryChangeSet *changes,
+				    guint index,
+				    gboolean *query_changed,
+				    gboolean *sort_changed)
+{
+	guint n_changes;
+	guint i;
+
+	*query_changed = FALSE;
+	*sort_changed = FALSE;
+
+	n_changes = rhythmdb_entry_change_set_get_n_changes (changes, index);
+	for (i = 0; i < n_changes; i++) {
+		RhythmDBPropType prop = rhythmdb_entry_change_set_get_change (changes, index, i)->prop;
+
+		if (prop == RHYTHMDB_PROP_HIDDEN || PROP_SET_HAS (model->priv->query_props, prop))
+			*query_changed = TRUE;
+
+		if (model->priv->sort_func != NULL &&
+		    (model->priv->sort_props_known == FALSE || PROP_SET_HAS (model->priv->sort_props, prop)))
+			*sort_changed = TRUE;
+
+		/* the entry's size or duration may move it in or out of the limit */
+		if ((prop == RHYTHMDB_PROP_FILE_SIZE && model->priv->limit_type == RHYTHMDB_QUERY_MODEL_LIMIT_SIZE) ||
+		    (prop == RHYTHMDB_PROP_DURATION && model->priv->limit_type == RHYTHMDB_QUERY_MODEL_LIMIT_TIME))
+			*sort_changed = TRUE;
+	}
+}
+
 static void
 rhythmdb_query_model_set_query_internal (RhythmDBQueryModel *model,
 					GPtrArray          *query)
 {
+	RhythmDBQueryModelDispatcher *dispatcher = NULL;
+
 	if (query == model->priv->original_query)
 		return;
 
+	if (model->priv->dispatched) {
+		dispatcher = rhythmdb_query_model_get_dispatcher (model->priv->db);
+		dispatch_unindex_model (dispatcher, model);
+	}
+
+	rhythmdb_compiled_query_free (model->priv->compiled_query);
 	rhythmdb_query_free (model->priv->query);
 	rhythmdb_query_free (model->priv->original_query);
 
 	model->priv->query = rhythmdb_query_copy (query);
 	model->priv->original_query = rhythmdb_query_copy (model->priv->query);
 	rhythmdb_query_preprocess (model->priv->db, model->priv->query);
+	model->priv->compiled_query = rhythmdb_query_compile (model->priv->db, model->priv->query);
+
+	if (dispatcher != NULL)
+		dispatch_index_model (dispatcher, model);
 
 	/* if the query contains time-relative criteria, re-run it periodically.
 	 * currently it's just every minute, but perhaps it could be smarter.
@@ -588,11 +1205,13 @@ rhythmdb_query_model_set_property (GObject *object,
 		break;
 	case PROP_SORT_FUNC:
 		model->priv->sort_func = g_value_get_pointer (value);
+		rhythmdb_query_model_update_sort_props (model);
 		break;
 	case PROP_SORT_DATA:
 		if (model->priv->sort_data_destroy && model->priv->sort_data)
 			model->priv->sort_data_destroy (model->priv->sort_data);
 		model->priv->sort_data = g_value_get_pointer (value);
+		rhythmdb_query_model_update_sort_props (model);
 		break;
 	case PROP_SORT_DATA_DESTROY:
 		model->priv->sort_data_destroy = g_value_get_pointer (value);
@@ -701,18 +1320,7 @@ rhythmdb_query_model_constructed (GObject *object)
 	RB_CHAIN_GOBJECT_METHOD (rhythmdb_query_model_parent_class, constructed, object);
 	model = RHYTHMDB_QUERY_MODEL (object);
 
-	g_signal_connect_object (G_OBJECT (model->priv->db),
-				 "entry_added",
-				 G_CALLBACK (rhythmdb_query_model_entry_added_cb),
-				 model, 0);
-	g_signal_connect_object (G_OBJECT (model->priv->db),
-				 "entry_changed",
-				 G_CALLBACK (rhythmdb_query_model_entry_changed_cb),
-				 model, 0);
-	g_signal_connect_object (G_OBJECT (model->priv->db),
-				 "entry_deleted",
-				 G_CALLBACK (rhythmdb_query_model_entry_deleted_cb),
-				 model, 0);
+	rhythmdb_query_model_dispatch_register (model);
 }
 
 static void
@@ -729,6 +1337,8 @@ rhythmdb_query_model_dispose (GObject *object)
 
 	rb_debug ("disposing query model %p", object);
 
+	rhythmdb_query_model_dispatch_unregister (model);
+
 	if (model->priv->base_model) {
 		g_signal_handlers_disconnect_by_func (G_OBJECT (model->priv->base_model),
 						      G_CALLBACK (rhythmdb_query_model_base_row_inserted),
@@ -749,7 +1359,7 @@ rhythmdb_query_model_dispose (GObject *object)
 						      G_CALLBACK (rhythmdb_query_model_base_entry_removed),
 						      model);
 		g_signal_handlers_disconnect_by_func (G_OBJECT (model->priv->base_model),
-						      G_CALLBACK (rhythmdb_query_model_base_entry_prop_changed),
+						      G_CALLBACK (rhythmdb_query_model_base_entry_changes),
 						      model);
 		g_object_unref (model->priv->base_model);
 		model->priv->base_model = NULL;
@@ -785,6 +1395,7 @@ rhythmdb_query_model_finalize (GObject *object)
 
 	g_hash_table_destroy (model->priv->hidden_entry_map);
 
+	rhythmdb_compiled_query_free (model->priv->compiled_query);
 	if (model->priv->query)
 		rhythmdb_query_free (model->priv->query);
 	if (model->priv->original_query)
@@ -855,7 +1466,7 @@ static void
 _copy_contents_foreach_cb (RhythmDBEntry *entry, RhythmDBQueryModel *dest)
 {
 	if (dest->priv->query == NULL ||
-	    rhythmdb_evaluate_query (dest->priv->db, dest->priv->query, entry)) {
+	    rhythmdb_compiled_query_evaluate (dest->priv->compiled_query, entry)) {
 		if (dest->priv->show_hidden || (rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN) == FALSE))
 			rhythmdb_query_model_do_insert (dest, entry, -1);
 	}
@@ -915,7 +1526,7 @@ rhythmdb_query_model_chain (RhythmDBQueryModel *model,
 						      G_CALLBACK (rhythmdb_query_model_base_entry_removed),
 						      model);
 		g_signal_handlers_disconnect_by_func (model->priv->base_model,
-						      G_CALLBACK (rhythmdb_query_model_base_entry_prop_changed),
+						      G_CALLBACK (rhythmdb_query_model_base_entry_changes),
 						      model);
 		g_object_unref (model->priv->base_model);
 	}
@@ -952,8 +1563,8 @@ rhythmdb_query_model_chain (RhythmDBQueryModel *model,
 					 G_CALLBACK (rhythmdb_query_model_base_entry_removed),
 					 model, 0);
 		g_signal_connect_object (model->priv->base_model,
-					 "entry-prop-changed",
-					 G_CALLBACK (rhythmdb_query_model_base_entry_prop_changed),
+					 "entry-changes",
+					 G_CALLBACK (rhythmdb_query_model_base_entry_changes),
 					 model, 0);
 
 		if (import_entries)
@@ -1001,7 +1612,7 @@ rhythmdb_query_model_entry_added_cb (RhythmDB *db,
 	}
 
 	if (model->priv->query != NULL) {
-		insert = rhythmdb_evaluate_query (db, model->priv->query, entry);
+		insert = rhythmdb_compiled_query_evaluate (model->priv->compiled_query, entry);
 	} else {
 		index = GPOINTER_TO_INT (g_hash_table_lookup (model->priv->hidden_entry_map, entry));
 		insert = g_hash_table_remove (model->priv->hidden_entry_map, entry);
@@ -1014,19 +1625,56 @@ rhythmdb_query_model_entry_added_cb (RhythmDB *db,
 	}
 }
 
+static void
+rhythmdb_query_model_emit_entry_changes (RhythmDBQueryModel *model,
+					 RhythmDBEntry *entry,
+					 RhythmDBEntryChangeSet *changes,
+					 guint index)
+{
+	guint n_changes;
+	guint i;
+
+	g_signal_emit (G_OBJECT (model),
+		       rhythmdb_query_model_signals[ENTRY_CHANGES], 0,
+		       entry, changes, index);
+
+	/* the per-property signals are only worth emitting if they're used */
+	if (RHYTHMDB_QUERY_MODEL_GET_CLASS (model)->entry_prop_changed == NULL &&
+	    g_signal_has_handler_pending (model, rhythmdb_query_model_signals[ENTRY_PROP_CHANGED], 0, TRUE) == FALSE)
+		return;
+
+	n_changes = rhythmdb_entry_change_set_get_n_changes (changes, index);
+	for (i = 0; i < n_changes; i++) {
+		RhythmDBEntryChange *change = rhythmdb_entry_change_set_get_change (changes, index, i);
+
+		g_signal_emit (G_OBJECT (model),
+			       rhythmdb_query_model_signals[ENTRY_PROP_CHANGED], 0,
+			       entry, change->prop, &change->old, &change->new);
+	}
+}
+
 static void
 rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
 				       RhythmDBEntry *entry,
-				       GValueArray *changes,
+				       RhythmDBEntryChangeSet *changes,
+				       guint index,
 				       RhythmDBQueryModel *model)
 {
 	gboolean hidden = FALSE;
-	int i;
+	gboolean query_changed;
+	gboolean sort_changed;
+	guint n_changes;
+	guint i;
 
 	hidden = (!model->priv->show_hidden && rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN));
+	rhythmdb_query_model_check_changes (model, changes, index, &query_changed, &sort_changed);
 
 	if (g_hash_table_lookup (model->priv->reverse_map, entry) == NULL) {
-		if (hidden == FALSE) {
+		/* entries beyond the limit may have moved inside it */
+		if (sort_changed && g_hash_table_lookup (model->priv->limited_reverse_map, entry))
+			query_changed = TRUE;
+
+		if (hidden == FALSE && query_changed) {
 			/* the changed entry may now satisfy the query
 			 * so we test it */
 			rhythmdb_query_model_entry_added_cb (db, entry, model);
@@ -1035,11 +1683,18 @@ rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
 	}
 
 	if (hidden) {
-		/* emit an entry-prop-changed signal so property models
-		 * can be updated correctly.  if we have a base model,
-		 * we'll propagate the parent's signal instead.
+		/* emit change signals so property models can be updated
+		 * correctly.  if we have a base model, we'll propagate the
+		 * parent's signals instead.
 		 */
 		if (model->priv->base_model == NULL) {
+			g_signal_emit (G_OBJECT (model),
+				       rhythmdb_query_model_signals[ENTRY_CHANGES], 0,
+				       entry, changes, index);
+		}
+		if (model->priv->base_model == NULL &&
+		    (RHYTHMDB_QUERY_MODEL_GET_CLASS (model)->entry_prop_changed != NULL ||
+		     g_signal_has_handler_pending (model, rhythmdb_query_model_signals[ENTRY_PROP_CHANGED], 0, TRUE))) {
 			GValue true_val = { 0, };
 			GValue false_val = { 0, };
 
@@ -1085,19 +1740,15 @@ rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
 		return;
 	}
 
-	/* emit separate change signals for each property
-	 * unless this is a chained query model, in which
-	 * case we propagate the parent model's signals instead.
+	/* emit change signals unless this is a chained query model,
+	 * in which case we propagate the parent model's signals instead.
 	 */
-	for (i = 0; i < changes->n_values; i++) {
-		GValue *v = g_value_array_get_nth (changes, i);
-		RhythmDBEntryChange *change = g_value_get_boxed (v);
+	if (model->priv->base_model == NULL)
+		rhythmdb_query_model_emit_entry_changes (model, entry, changes, index);
 
-		if (model->priv->base_model == NULL) {
-			g_signal_emit (G_OBJECT (model),
-				       rhythmdb_query_model_signals[ENTRY_PROP_CHANGED], 0,
-				       entry, change->prop, &change->old, &change->new);
-		}
+	n_changes = rhythmdb_entry_change_set_get_n_changes (changes, index);
+	for (i = 0; i < n_changes; i++) {
+		RhythmDBEntryChange *change = rhythmdb_entry_change_set_get_change (changes, index, i);
 
 		if (change->prop == RHYTHMDB_PROP_DURATION) {
 			model->priv->total_duration -= g_value_get_ulong (&change->old);
@@ -1108,14 +1759,14 @@ rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
 		}
 	}
 
-	if (model->priv->query &&
-	    !rhythmdb_evaluate_query (db, model->priv->query, entry)) {
+	if (query_changed && model->priv->query &&
+	    !rhythmdb_compiled_query_evaluate (model->priv->compiled_query, entry)) {
 		rhythmdb_query_model_filter_out_entry (model, entry);
 		return;
 	}
 
 	/* it may have moved, so we can't just emit a changed entry */
-	if (!rhythmdb_query_model_do_reorder (model, entry)) {
+	if (sort_changed == FALSE || !rhythmdb_query_model_do_reorder (model, entry)) {
 		/* but if it didn't, we can */
 		GtkTreeIter iter;
 		GtkTreePath *path;
@@ -1131,32 +1782,18 @@ rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
 }
 
 static void
-rhythmdb_query_model_base_entry_prop_changed (RhythmDBQueryModel *base_model,
-					      RhythmDBEntry *entry,
-					      RhythmDBPropType prop,
-					      const GValue *old,
-					      const GValue *new_value,
-					      RhythmDBQueryModel *model)
+rhythmdb_query_model_base_entry_changes (RhythmDBQueryModel *base_model,
+					 RhythmDBEntry *entry,
+					 RhythmDBEntryChangeSet *changes,
+					 guint index,
+					 RhythmDBQueryModel *model)
 {
 	if (g_hash_table_lookup (model->priv->reverse_map, entry)) {
-		/* propagate the signal */
-		g_signal_emit (G_OBJECT (model),
-			       rhythmdb_query_model_signals[ENTRY_PROP_CHANGED], 0,
-			       entry, prop, old, new_value);
+		/* propagate the signals */
+		rhythmdb_query_model_emit_entry_changes (model, entry, changes, index);
 	}
 }
 
-static void
-rhythmdb_query_model_entry_deleted_cb (RhythmDB *db,
-				       RhythmDBEntry *entry,
-				       RhythmDBQueryModel *model)
-{
-
-	if (g_hash_table_lookup (model->priv->reverse_map, entry) ||
-	    g_hash_table_lookup (model->priv->limited_reverse_map, entry))
-		rhythmdb_query_model_remove_entry (model, entry);
-}
-
 static gboolean
 idle_process_update_idle (struct RhythmDBQueryModelUpdate *update)
 {
@@ -1480,6 +2117,129 @@ rhythmdb_query_model_update_limited_entries (RhythmDBQueryModel *model)
 	}
 }
 
+/* removes a batch of deleted entries, and only refills the model from
+ * the limited entries once at the end.  a few entries are removed one at
+ * a time, finding each row's position through the reverse map; when the
+ * batch is a large part of the model, the rows are found in one pass
+ * over the model instead.
+ */
+static void
+rhythmdb_query_model_remove_entries (RhythmDBQueryModel *model,
+				     GPtrArray *entries,
+				     gboolean emit_removed)
+{
+	GHashTable *removed;
+	GSequenceIter *ptr;
+	guint remaining;
+	gboolean changed = FALSE;
+	int index;
+	guint i;
+
+	removed = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+		gboolean limited;
+
+		if (g_hash_table_lookup (model->priv->reverse_map, entry) != NULL) {
+			limited = FALSE;
+		} else if (g_hash_table_lookup (model->priv->limited_reverse_map, entry) != NULL) {
+			limited = TRUE;
+		} else {
+			continue;
+		}
+
+		/* emit entry-removed, so listeners know the
+		 * entry has actually been removed, rather than filtered
+		 * out.
+		 */
+		if (emit_removed) {
+			g_signal_emit (G_OBJECT (model),
+				       rhythmdb_query_model_signals[ENTRY_REMOVED], 0,
+				       entry);
+		}
+
+		/* entries past the limit aren't visible, so they can go straight away */
+		if (limited) {
+			if (g_hash_table_lookup (model->priv->limited_reverse_map, entry) != NULL)
+				rhythmdb_query_model_remove_from_limited_list (model, entry);
+			changed = TRUE;
+		} else {
+			g_hash_table_insert (removed, entry, entry);
+		}
+	}
+
+	remaining = g_hash_table_size (removed);
+	if (remaining > 0 && remaining * 16 < (guint) g_sequence_get_length (model->priv->entries)) {
+		GHashTableIter iter;
+		gpointer entry;
+
+		g_hash_table_iter_init (&iter, removed);
+		while (g_hash_table_iter_next (&iter, &entry, NULL)) {
+			/* a row-deleted handler may have removed it already */
+			if (g_hash_table_lookup (model->priv->reverse_map, entry) == NULL)
+				continue;
+
+			rhythmdb_query_model_remove_from_main_list (model, entry);
+			changed = TRUE;
+		}
+		remaining = 0;
+	}
+
+	ptr = g_sequence_get_begin_iter (model->priv->entries);
+	index = 0;
+	while (remaining > 0 && !g_sequence_iter_is_end (ptr)) {
+		RhythmDBEntry *entry = g_sequence_get (ptr);
+		GSequenceIter *entry_ptr;
+		GtkTreePath *path;
+
+		if (g_hash_table_lookup (removed, entry) == NULL) {
+			ptr = g_sequence_iter_next (ptr);
+			index++;
+			continue;
+		}
+
+		path = gtk_tree_path_new_from_indices (index, -1);
+		gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
+		gtk_tree_path_free (path);
+
+		model->priv->total_duration -= rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DURATION);
+		model->priv->total_size -= rhythmdb_entry_get_uint64 (entry, RHYTHMDB_PROP_FILE_SIZE);
+
+		/* take temporary ref */
+		rhythmdb_entry_ref (entry);
+
+		/* find the sequence pointer again in case a row-deleted
+		 * signal handler moved it, and if it did, start again
+		 * from the top, as the positions are no longer known.
+		 */
+		entry_ptr = g_hash_table_lookup (model->priv->reverse_map, entry);
+		if (entry_ptr == ptr) {
+			ptr = g_sequence_iter_next (ptr);
+		} else {
+			ptr = NULL;
+		}
+		g_sequence_remove (entry_ptr);
+		g_assert (g_hash_table_remove (model->priv->reverse_map, entry));
+		g_hash_table_remove (removed, entry);
+		remaining--;
+		changed = TRUE;
+
+		g_signal_emit (G_OBJECT (model), rhythmdb_query_model_signals[POST_ENTRY_DELETE], 0, entry);
+
+		/* release temporary ref */
+		rhythmdb_entry_unref (entry);
+
+		if (ptr == NULL) {
+			ptr = g_sequence_get_begin_iter (model->priv->entries);
+			index = 0;
+		}
+	}
+	g_hash_table_destroy (removed);
+
+	if (changed)
+		rhythmdb_query_model_update_limited_entries (model);
+}
+
 static gboolean
 rhythmdb_query_model_emit_reorder (RhythmDBQueryModel *model,
 				   gint old_pos,
@@ -2560,6 +3320,7 @@ rhythmdb_query_model_set_sort_order (RhythmDBQueryModel *model,
 	model->priv->sort_data = sort_data;
 	model->priv->sort_data_destroy = sort_data_destroy;
 	model->priv->sort_reverse = sort_reverse;
+	rhythmdb_query_model_update_sort_props (model);
 
 	if (model->priv->sort_reverse) {
 		reverse_data.func = sort_func;
@@ -2659,7 +3420,7 @@ rhythmdb_query_model_base_row_inserted (GtkTreeModel *tree_model,
 	if (!model->priv->show_hidden && rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN))
 		goto out;
 
-	if (rhythmdb_evaluate_query (model->priv->db, model->priv->query, entry)) {
+	if (rhythmdb_compiled_query_evaluate (model->priv->compiled_query, entry)) {
 		/* find the closest previous entry that is in the filter model, and it it after that */
 		prev_entry = rhythmdb_query_model_get_previous_from_entry (base_model, entry);
 		while (prev_entry && g_hash_table_lookup (model->priv->reverse_map, prev_entry) == NULL) {
@@ -2768,9 +3529,7 @@ typedef struct {
 static void
 _reapply_query_foreach_cb (RhythmDBEntry *entry, _ReapplyQueryForeachData *data)
 {
-	if (!rhythmdb_evaluate_query (data->model->priv->db,
-				      data->model->priv->query,
-				      entry)) {
+	if (!rhythmdb_compiled_query_evaluate (data->model->priv->compiled_query, entry)) {
 		data->remove = g_list_prepend (data->remove, entry);
 	}
 }
@@ -87,6 +87,10 @@ struct _RhythmDBQueryModelClass
 					 RhythmDBEntry *entry);
 	gboolean (*filter_entry_drop)	(RhythmDBQueryModel *model,
 					 RhythmDBEntry *entry);
+	void	(*entry_changes)	(RhythmDBQueryModel *model,
+					 RhythmDBEntry *entry,
+					 RhythmDBEntryChangeSet *changes,
+					 guint index);
 
 };
 
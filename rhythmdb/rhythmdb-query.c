@@ -947,6 +947,601 @@ rhythmdb_query_is_time_relative (RhythmDB *db, GPtrArray *query)
 	return FALSE;
 }
 
+/*
+ * Compiled queries
+ *
+ * Evaluating a query as it is means looking up the type of each property,
+ * unpacking GValues and splitting subqueries at their disjunctions, for
+ * every entry.  A compiled query is a flat array of steps, each testing one
+ * criteria against an entry, worked out once.  Where possible, a step
+ * reads the field of the entry directly rather than going through the
+ * property accessors.
+ *
+ * Steps are run in order for as long as they succeed; the entry matches if
+ * evaluation gets past the last step.  When a step fails, evaluation
+ * continues at its target: the start of the next disjunction, the step
+ * after the subquery it was part of, or nowhere, in which case the entry
+ * doesn't match.  Jump steps always fail, and are used to skip the
+ * remaining disjunctions once one of them has matched.
+ */
+
+typedef enum {
+	STEP_REFSTRING,		/* RBRefString field */
+	STEP_REFSTRING_FOLDED,	/* folded RBRefString field */
+	STEP_REFSTRING_SORT_KEY,	/* sort key of an RBRefString field */
+	STEP_ULONG_FIELD,
+	STEP_DOUBLE_FIELD,
+	STEP_UINT64_FIELD,
+	STEP_ENTRY_TYPE,
+	STEP_STRING,		/* anything else, through the property accessors */
+	STEP_ULONG,
+	STEP_DOUBLE,
+	STEP_UINT64,
+	STEP_BOOLEAN,
+	STEP_OBJECT,
+	STEP_KEYWORD,
+	STEP_SEARCH,
+	STEP_JUMP
+} RhythmDBQueryStepKind;
+
+#define STEP_REJECT	G_MAXUINT
+
+typedef struct {
+	guint8 kind;		/* RhythmDBQueryStepKind */
+	guint8 op;		/* RhythmDBQueryType */
+	guint target;		/* where to continue if the test fails */
+	RhythmDBPropType propid;
+	gsize offset;		/* of the field in the entry */
+	RBRefString *refstring;	/* interned version of the value, if any */
+	union {
+		const char *string;
+		char **words;
+		gulong ulong;
+		gdouble dbl;
+		guint64 uint64;
+		gboolean boolean;
+		gpointer object;
+	} value;
+} RhythmDBQueryStep;
+
+struct _RhythmDBCompiledQuery
+{
+	RhythmDB *db;
+	guint n_steps;
+	RhythmDBQueryStep *steps;
+};
+
+static gboolean
+query_step_field (RhythmDBPropType propid,
+		  RhythmDBQueryStepKind *kind,
+		  gsize *offset)
+{
+	switch (propid) {
+	case RHYTHMDB_PROP_TYPE:
+		*kind = STEP_ENTRY_TYPE;
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, type);
+		return TRUE;
+
+#define REFSTRING_FIELD(prop, field) \
+	case RHYTHMDB_PROP_##prop: \
+		*kind = STEP_REFSTRING; \
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, field); \
+		return TRUE; \
+	case RHYTHMDB_PROP_##prop##_FOLDED: \
+		*kind = STEP_REFSTRING_FOLDED; \
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, field); \
+		return TRUE; \
+	case RHYTHMDB_PROP_##prop##_SORT_KEY: \
+		*kind = STEP_REFSTRING_SORT_KEY; \
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, field); \
+		return TRUE;
+
+	REFSTRING_FIELD (TITLE, title)
+	REFSTRING_FIELD (ARTIST, artist)
+	REFSTRING_FIELD (ALBUM, album)
+	REFSTRING_FIELD (GENRE, genre)
+	REFSTRING_FIELD (ALBUM_ARTIST, album_artist)
+	REFSTRING_FIELD (ARTIST_SORTNAME, artist_sortname)
+	REFSTRING_FIELD (ALBUM_SORTNAME, album_sortname)
+	REFSTRING_FIELD (ALBUM_ARTIST_SORTNAME, album_artist_sortname)
+#undef REFSTRING_FIELD
+
+	case RHYTHMDB_PROP_LOCATION:
+		*kind = STEP_REFSTRING;
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, location);
+		return TRUE;
+	case RHYTHMDB_PROP_MIMETYPE:
+		*kind = STEP_REFSTRING;
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, mimetype);
+		return TRUE;
+	case RHYTHMDB_PROP_COMMENT:
+		*kind = STEP_REFSTRING;
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, comment);
+		return TRUE;
+
+#define ULONG_FIELD(prop, field) \
+	case RHYTHMDB_PROP_##prop: \
+		*kind = STEP_ULONG_FIELD; \
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, field); \
+		return TRUE;
+
+	ULONG_FIELD (TRACK_NUMBER, tracknum)
+	ULONG_FIELD (DISC_NUMBER, discnum)
+	ULONG_FIELD (DURATION, duration)
+	ULONG_FIELD (BITRATE, bitrate)
+	ULONG_FIELD (MTIME, mtime)
+	ULONG_FIELD (FIRST_SEEN, first_seen)
+	ULONG_FIELD (LAST_SEEN, last_seen)
+	ULONG_FIELD (LAST_PLAYED, last_played)
+	ULONG_FIELD (PLAY_COUNT, play_count)
+#undef ULONG_FIELD
+
+	case RHYTHMDB_PROP_RATING:
+		*kind = STEP_DOUBLE_FIELD;
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, rating);
+		return TRUE;
+	case RHYTHMDB_PROP_BPM:
+		*kind = STEP_DOUBLE_FIELD;
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, bpm);
+		return TRUE;
+	case RHYTHMDB_PROP_FILE_SIZE:
+		*kind = STEP_UINT64_FIELD;
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, file_size);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void
+compile_step (RhythmDB *db,
+	      GArray *steps,
+	      RhythmDBQueryData *data,
+	      guint fail,
+	      GArray *pending)
+{
+	RhythmDBQueryStep step;
+	RhythmDBQueryStepKind kind;
+	GType type;
+
+	memset (&step, 0, sizeof (step));
+	step.op = data->type;
+	step.propid = data->propid;
+	type = rhythmdb_get_property_type (db, data->propid);
+
+	switch (data->type) {
+	case RHYTHMDB_QUERY_PROP_LIKE:
+	case RHYTHMDB_QUERY_PROP_NOT_LIKE:
+		if (data->propid == RHYTHMDB_PROP_KEYWORD) {
+			step.kind = STEP_KEYWORD;
+			step.value.string = g_value_get_string (data->val);
+			step.refstring = rb_refstring_find (step.value.string);
+			break;
+		} else if (data->propid == RHYTHMDB_PROP_SEARCH_MATCH) {
+			step.kind = STEP_SEARCH;
+			step.value.words = g_value_get_boxed (data->val);
+			break;
+		} else if (type != G_TYPE_STRING) {
+			/* substring matches on other types are equality tests */
+			step.op = RHYTHMDB_QUERY_PROP_EQUALS;
+		}
+		/* fall through */
+	case RHYTHMDB_QUERY_PROP_EQUALS:
+	case RHYTHMDB_QUERY_PROP_NOT_EQUAL:
+	case RHYTHMDB_QUERY_PROP_GREATER:
+	case RHYTHMDB_QUERY_PROP_LESS:
+	case RHYTHMDB_QUERY_PROP_PREFIX:
+	case RHYTHMDB_QUERY_PROP_SUFFIX:
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+		if (query_step_field (data->propid, &kind, &step.offset)) {
+			step.kind = kind;
+		} else {
+			switch (type) {
+			case G_TYPE_STRING:
+				step.kind = STEP_STRING;
+				break;
+			case G_TYPE_ULONG:
+				step.kind = STEP_ULONG;
+				break;
+			case G_TYPE_DOUBLE:
+				step.kind = STEP_DOUBLE;
+				break;
+			case G_TYPE_UINT64:
+				step.kind = STEP_UINT64;
+				break;
+			case G_TYPE_BOOLEAN:
+				step.kind = STEP_BOOLEAN;
+				break;
+			default:
+				step.kind = STEP_OBJECT;
+				break;
+			}
+		}
+
+		switch (type) {
+		case G_TYPE_STRING:
+			step.value.string = g_value_get_string (data->val);
+			/* entries share the RBRefString for equal values, so
+			 * equality can be tested by comparing pointers.
+			 */
+			if (step.kind == STEP_REFSTRING &&
+			    (step.op == RHYTHMDB_QUERY_PROP_EQUALS || step.op == RHYTHMDB_QUERY_PROP_NOT_EQUAL))
+				step.refstring = rb_refstring_find (step.value.string);
+			break;
+		case G_TYPE_ULONG:
+			step.value.ulong = g_value_get_ulong (data->val);
+			break;
+		case G_TYPE_DOUBLE:
+			step.value.dbl = g_value_get_double (data->val);
+			break;
+		case G_TYPE_UINT64:
+			step.value.uint64 = g_value_get_uint64 (data->val);
+			break;
+		case G_TYPE_BOOLEAN:
+			step.value.boolean = g_value_get_boolean (data->val);
+			break;
+		default:
+			step.value.object = g_value_get_object (data->val);
+			break;
+		}
+		break;
+	default:
+		g_warning ("Unexpected query type %d", data->type);
+		step.kind = STEP_JUMP;
+		break;
+	}
+
+	step.target = fail;
+	if (pending != NULL)
+		g_array_append_val (pending, steps->len);
+	g_array_append_val (steps, step);
+}
+
+/* sets the target of the steps listed in @pending */
+static void
+compile_patch (GArray *steps,
+	       GArray *pending,
+	       guint target)
+{
+	guint i;
+
+	for (i = 0; i < pending->len; i++)
+		g_array_index (steps, RhythmDBQueryStep, g_array_index (pending, guint, i)).target = target;
+	g_array_set_size (pending, 0);
+}
+
+/*
+ * Compiles a query, or a subquery, made of conjunctions separated by
+ * disjunctions.  If the query doesn't match, evaluation continues at
+ * @fail, unless @pending is given, in which case the steps that fail are
+ * added to it so their target can be set later.
+ */
+static void
+compile_disjunction (RhythmDB *db,
+		     GArray *steps,
+		     GPtrArray *query,
+		     gboolean subquery,
+		     guint fail,
+		     GArray *pending)
+{
+	GArray *next;
+	GArray *done;
+	guint start;
+	guint end;
+	guint i;
+
+	next = g_array_new (FALSE, FALSE, sizeof (guint));
+	done = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	/* a trailing disjunction is ignored in subqueries, but in the query
+	 * itself it adds an empty conjunction, which matches everything.
+	 */
+	end = query->len;
+	if (subquery && end > 0 &&
+	    ((RhythmDBQueryData *) g_ptr_array_index (query, end - 1))->type == RHYTHMDB_QUERY_DISJUNCTION)
+		end--;
+
+	start = 0;
+	for (i = 0; i <= end; i++) {
+		RhythmDBQueryData *data = NULL;
+		gboolean last;
+		guint j;
+
+		if (i < end) {
+			data = g_ptr_array_index (query, i);
+			if (data->type != RHYTHMDB_QUERY_DISJUNCTION)
+				continue;
+		}
+		last = (i == end);
+
+		/* the previous conjunction continues here when it fails */
+		compile_patch (steps, next, steps->len);
+
+		for (j = start; j < i; j++) {
+			RhythmDBQueryData *criteria = g_ptr_array_index (query, j);
+
+			if (criteria->type == RHYTHMDB_QUERY_SUBQUERY) {
+				compile_disjunction (db, steps, criteria->subquery, TRUE,
+						     fail, last ? pending : next);
+			} else {
+				compile_step (db, steps, criteria, fail, last ? pending : next);
+			}
+		}
+
+		if (!last) {
+			RhythmDBQueryStep jump;
+
+			memset (&jump, 0, sizeof (jump));
+			jump.kind = STEP_JUMP;
+			g_array_append_val (done, steps->len);
+			g_array_append_val (steps, jump);
+		}
+		start = i + 1;
+	}
+
+	compile_patch (steps, done, steps->len);
+	g_array_free (next, TRUE);
+	g_array_free (done, TRUE);
+}
+
+/**
+ * rhythmdb_query_compile:
+ * @db: the #RhythmDB
+ * @query: a preprocessed query
+ *
+ * Compiles a query into a form that can be evaluated against entries
+ * more quickly than the query itself, for cases where the same query is
+ * evaluated many times.  The compiled query refers to the values in
+ * @query, so @query must not be freed or modified while it is in use.
+ *
+ * Return value: the compiled query, to be freed with
+ * rhythmdb_compiled_query_free.
+ */
+RhythmDBCompiledQuery *
+rhythmdb_query_compile (RhythmDB *db, GPtrArray *query)
+{
+	RhythmDBCompiledQuery *compiled;
+	GArray *steps;
+
+	steps = g_array_new (FALSE, FALSE, sizeof (RhythmDBQueryStep));
+	if (query != NULL)
+		compile_disjunction (db, steps, query, FALSE, STEP_REJECT, NULL);
+
+	compiled = g_new0 (RhythmDBCompiledQuery, 1);
+	compiled->db = db;
+	compiled->n_steps = steps->len;
+	compiled->steps = (RhythmDBQueryStep *) g_array_free (steps, FALSE);
+	return compiled;
+}
+
+/**
+ * rhythmdb_compiled_query_free:
+ * @compiled: a compiled query
+ *
+ * Frees a query compiled with rhythmdb_query_compile.
+ */
+void
+rhythmdb_compiled_query_free (RhythmDBCompiledQuery *compiled)
+{
+	guint i;
+
+	if (compiled == NULL)
+		return;
+
+	for (i = 0; i < compiled->n_steps; i++)
+		rb_refstring_unref (compiled->steps[i].refstring);
+	g_free (compiled->steps);
+	g_free (compiled);
+}
+
+static gboolean
+step_test_string (const RhythmDBQueryStep *step,
+		  const char *str)
+{
+	switch (step->op) {
+	case RHYTHMDB_QUERY_PROP_EQUALS:
+		return g_strcmp0 (str, step->value.string) == 0;
+	case RHYTHMDB_QUERY_PROP_NOT_EQUAL:
+		return g_strcmp0 (str, step->value.string) != 0;
+	case RHYTHMDB_QUERY_PROP_GREATER:
+		return g_strcmp0 (str, step->value.string) >= 0;
+	case RHYTHMDB_QUERY_PROP_LESS:
+		return g_strcmp0 (str, step->value.string) <= 0;
+	case RHYTHMDB_QUERY_PROP_LIKE:
+		return (str != NULL && strstr (str, step->value.string) != NULL);
+	case RHYTHMDB_QUERY_PROP_NOT_LIKE:
+		return (str != NULL && strstr (str, step->value.string) == NULL);
+	case RHYTHMDB_QUERY_PROP_PREFIX:
+		return (str != NULL && g_str_has_prefix (str, step->value.string));
+	case RHYTHMDB_QUERY_PROP_SUFFIX:
+		return (str != NULL && g_str_has_suffix (str, step->value.string));
+	default:
+		return FALSE;
+	}
+}
+
+static gboolean
+step_test_ulong (const RhythmDBQueryStep *step,
+		 gulong value,
+		 glong *now)
+{
+	switch (step->op) {
+	case RHYTHMDB_QUERY_PROP_EQUALS:
+		return value == step->value.ulong;
+	case RHYTHMDB_QUERY_PROP_NOT_EQUAL:
+		return value != step->value.ulong;
+	case RHYTHMDB_QUERY_PROP_GREATER:
+		return value >= step->value.ulong;
+	case RHYTHMDB_QUERY_PROP_LESS:
+		return value <= step->value.ulong;
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+		if (*now == 0) {
+			GTimeVal current_time;
+
+			g_get_current_time (&current_time);
+			*now = current_time.tv_sec;
+		}
+		if (step->op == RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN)
+			return value >= (*now - step->value.ulong);
+		else
+			return value < (*now - step->value.ulong);
+	default:
+		return FALSE;
+	}
+}
+
+/* compares two values of the same type using the operator of a step */
+#define STEP_COMPARE(step, a, b) \
+	((step)->op == RHYTHMDB_QUERY_PROP_EQUALS ? (a) == (b) : \
+	 (step)->op == RHYTHMDB_QUERY_PROP_NOT_EQUAL ? (a) != (b) : \
+	 (step)->op == RHYTHMDB_QUERY_PROP_GREATER ? (a) >= (b) : \
+	 (step)->op == RHYTHMDB_QUERY_PROP_LESS ? (a) <= (b) : FALSE)
+
+static gboolean
+step_test_search (RhythmDBEntry *entry,
+		  char **words)
+{
+	char **word;
+
+	if (words == NULL)
+		return TRUE;
+
+	for (word = words; *word != NULL; word++) {
+		const char *folded;
+
+		folded = rb_refstring_get_folded (entry->title);
+		if (folded != NULL && strstr (folded, *word) != NULL)
+			continue;
+		folded = rb_refstring_get_folded (entry->album);
+		if (folded != NULL && strstr (folded, *word) != NULL)
+			continue;
+		folded = rb_refstring_get_folded (entry->artist);
+		if (folded != NULL && strstr (folded, *word) != NULL)
+			continue;
+		folded = rb_refstring_get_folded (entry->genre);
+		if (folded != NULL && strstr (folded, *word) != NULL)
+			continue;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+step_test_keyword (RhythmDB *db,
+		   const RhythmDBQueryStep *step,
+		   RhythmDBEntry *entry)
+{
+	RBRefString *keyword;
+	gboolean has = FALSE;
+
+	/* the keyword may not have existed when the query was compiled */
+	keyword = step->refstring;
+	if (keyword == NULL)
+		keyword = rb_refstring_find (step->value.string);
+
+	if (keyword != NULL)
+		has = rhythmdb_entry_keyword_has (db, entry, keyword);
+
+	if (keyword != step->refstring)
+		rb_refstring_unref (keyword);
+
+	return (step->op == RHYTHMDB_QUERY_PROP_LIKE) ? has : !has;
+}
+
+/**
+ * rhythmdb_compiled_query_evaluate:
+ * @compiled: a compiled query
+ * @entry: a #RhythmDBEntry
+ *
+ * Evaluates a compiled query against an entry.
+ *
+ * Return value: whether the entry matches the query
+ */
+gboolean
+rhythmdb_compiled_query_evaluate (RhythmDBCompiledQuery *compiled,
+				  RhythmDBEntry *entry)
+{
+	glong now = 0;
+	guint pc = 0;
+
+	while (pc < compiled->n_steps) {
+		const RhythmDBQueryStep *step = &compiled->steps[pc];
+		gboolean ok;
+
+		switch (step->kind) {
+		case STEP_REFSTRING:
+		{
+			RBRefString *value = G_STRUCT_MEMBER (RBRefString *, entry, step->offset);
+
+			if (step->refstring != NULL)
+				ok = STEP_COMPARE (step, value, step->refstring);
+			else
+				ok = step_test_string (step, rb_refstring_get (value));
+			break;
+		}
+		case STEP_REFSTRING_FOLDED:
+			ok = step_test_string (step, rb_refstring_get_folded (G_STRUCT_MEMBER (RBRefString *, entry, step->offset)));
+			break;
+		case STEP_REFSTRING_SORT_KEY:
+			ok = step_test_string (step, rb_refstring_get_sort_key (G_STRUCT_MEMBER (RBRefString *, entry, step->offset)));
+			break;
+		case STEP_ULONG_FIELD:
+			ok = step_test_ulong (step, G_STRUCT_MEMBER (gulong, entry, step->offset), &now);
+			break;
+		case STEP_DOUBLE_FIELD:
+			ok = STEP_COMPARE (step, G_STRUCT_MEMBER (gdouble, entry, step->offset), step->value.dbl);
+			break;
+		case STEP_UINT64_FIELD:
+			ok = STEP_COMPARE (step, G_STRUCT_MEMBER (guint64, entry, step->offset), step->value.uint64);
+			break;
+		case STEP_ENTRY_TYPE:
+			ok = STEP_COMPARE (step, (gpointer) entry->type, step->value.object);
+			break;
+		case STEP_STRING:
+			ok = step_test_string (step, rhythmdb_entry_get_string (entry, step->propid));
+			break;
+		case STEP_ULONG:
+			ok = step_test_ulong (step, rhythmdb_entry_get_ulong (entry, step->propid), &now);
+			break;
+		case STEP_DOUBLE:
+			ok = STEP_COMPARE (step, rhythmdb_entry_get_double (entry, step->propid), step->value.dbl);
+			break;
+		case STEP_UINT64:
+			ok = STEP_COMPARE (step, rhythmdb_entry_get_uint64 (entry, step->propid), step->value.uint64);
+			break;
+		case STEP_BOOLEAN:
+			ok = STEP_COMPARE (step, rhythmdb_entry_get_boolean (entry, step->propid), step->value.boolean);
+			break;
+		case STEP_OBJECT:
+			ok = STEP_COMPARE (step, (gpointer) rhythmdb_entry_get_object (entry, step->propid), step->value.object);
+			break;
+		case STEP_KEYWORD:
+			ok = step_test_keyword (compiled->db, step, entry);
+			break;
+		case STEP_SEARCH:
+			ok = step_test_search (entry, step->value.words);
+			if (step->op == RHYTHMDB_QUERY_PROP_NOT_LIKE)
+				ok = !ok;
+			break;
+		case STEP_JUMP:
+		default:
+			ok = FALSE;
+			break;
+		}
+
+		if (ok)
+			pc++;
+		else if (step->target == STEP_REJECT)
+			return FALSE;
+		else
+			pc = step->target;
+	}
+
+	return TRUE;
+}
+
 /**
  * rhythmdb_query_to_string:
  * @db: a #RhythmDB instance
@@ -36,6 +36,8 @@
 #undef _GNU_SOURCE
 #endif
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
@@ -63,13 +65,33 @@ typedef struct RhythmDBTreeProperty
 #endif
 	struct RhythmDBTreeProperty *parent;
 	GHashTable *children;
+	guint n_entries; /* number of entries below this node, used in query planning */
 } RhythmDBTreeProperty;
 
 #define RHYTHMDB_TREE_PROPERTY_FROM_ENTRY(entry) ((RhythmDBTreeProperty *) entry->data)
 
+/* the genre/artist/album tree for each entry type is kept separately, with
+ * its own lock, so queries over entries of different types don't contend
+ * with each other, or with changes to entries of other types.  shards are
+ * created as needed and live as long as the database.
+ */
+typedef struct
+{
+	GStaticRWLock lock; /* must be held while using the tree */
+	GHashTable *genres; /* GHashTable<RBRefString, RhythmDBTreeProperty> */
+} RhythmDBTreeShard;
+
 G_DEFINE_TYPE(RhythmDBTree, rhythmdb_tree, RHYTHMDB_TYPE)
 
 static void rhythmdb_tree_finalize (GObject *object);
+static void rhythmdb_tree_set_property (GObject *object,
+					guint prop_id,
+					const GValue *value,
+					GParamSpec *pspec);
+static void rhythmdb_tree_get_property (GObject *object,
+					guint prop_id,
+					GValue *value,
+					GParamSpec *pspec);
 
 static gboolean rhythmdb_tree_load (RhythmDB *rdb, GCancellable *cancel, GError **error);
 static void rhythmdb_tree_save (RhythmDB *rdb);
@@ -80,6 +102,8 @@ static gboolean rhythmdb_tree_entry_set (RhythmDB *db, RhythmDBEntry *entry,
 
 static void rhythmdb_tree_entry_delete (RhythmDB *db, RhythmDBEntry *entry);
 static void rhythmdb_tree_entry_delete_by_type (RhythmDB *adb, RhythmDBEntryType *type);
+static void rhythmdb_tree_entry_delete_many (RhythmDB *adb, GPtrArray *entries);
+static void rhythmdb_tree_entry_added (RhythmDB *db, RhythmDBEntry *entry);
 
 static RhythmDBEntry * rhythmdb_tree_entry_lookup_by_location (RhythmDB *db, RBRefString *uri);
 static RhythmDBEntry * rhythmdb_tree_entry_lookup_by_id (RhythmDB *db, gint id);
@@ -98,6 +122,36 @@ static gboolean rhythmdb_tree_evaluate_query (RhythmDB *adb, GPtrArray *query,
 				       RhythmDBEntry *aentry);
 static void rhythmdb_tree_entry_type_registered (RhythmDB *db,
 						 RhythmDBEntryType *type);
+static guint rhythmdb_tree_query_thread_count (RhythmDBTree *db);
+
+static void search_index_add_entry (RhythmDBTree *db, RhythmDBEntry *entry);
+static void search_index_remove_entry (RhythmDBTree *db, RhythmDBEntry *entry);
+static void search_index_remove_entries (RhythmDBTree *db, GPtrArray *entries);
+static void search_index_replace (RhythmDBTree *db, RhythmDBEntry *entry,
+				  RBRefString *old_value, const char *new_value);
+static void trigram_index_add_entry (RhythmDBTree *db, RhythmDBEntry *entry);
+static void trigram_index_remove_entry (RhythmDBTree *db, RhythmDBEntry *entry);
+static void trigram_index_remove_entries (RhythmDBTree *db, GPtrArray *entries);
+static void trigram_index_replace (RhythmDBTree *db, RhythmDBEntry *entry,
+				   guint propid, const GValue *value);
+static void trigram_index_free (gpointer data);
+static void report_trigram_index (gpointer propid, gpointer data, RhythmDBTree *db);
+static void range_index_add_entry (RhythmDBTree *db, RhythmDBEntry *entry);
+static void range_index_remove_entry (RhythmDBTree *db, RhythmDBEntry *entry);
+static void range_index_remove_entries (RhythmDBTree *db, GPtrArray *entries);
+static void range_index_replace (RhythmDBTree *db, RhythmDBEntry *entry,
+				 guint propid, const GValue *value);
+
+/* numeric properties with sorted indexes, for range queries */
+static const RhythmDBPropType range_index_props[] = {
+	RHYTHMDB_PROP_LAST_PLAYED,
+	RHYTHMDB_PROP_FIRST_SEEN,
+	RHYTHMDB_PROP_PLAY_COUNT,
+	RHYTHMDB_PROP_RATING,
+	RHYTHMDB_PROP_DURATION,
+	RHYTHMDB_PROP_DATE
+};
+#define RHYTHMDB_TREE_N_RANGE_INDEXES	G_N_ELEMENTS (range_index_props)
 
 typedef void (*RBTreeEntryItFunc)(RhythmDBTree *db,
 				  RhythmDBEntry *entry,
@@ -119,12 +173,15 @@ static void rhythmdb_hash_tree_foreach (RhythmDB *adb,
 #define RHYTHMDB_TREE_XML_VERSION_INT 170
 
 static void destroy_tree_property (RhythmDBTreeProperty *prop);
+static void count_tree_entry (RhythmDBTreeProperty *album, gint delta);
+static void destroy_shard (gpointer data);
 static RhythmDBTreeProperty *get_or_create_album (RhythmDBTree *db, RhythmDBTreeProperty *artist,
 						  RBRefString *name);
 static RhythmDBTreeProperty *get_or_create_artist (RhythmDBTree *db, RhythmDBTreeProperty *genre,
 						   RBRefString *name);
 static RhythmDBTreeProperty *get_or_create_genre (RhythmDBTree *db, RhythmDBEntryType *type,
 							 RBRefString *name);
+static RhythmDBTreeShard *get_shard (RhythmDBTree *db, RhythmDBEntryType *type);
 
 static void remove_entry_from_album (RhythmDBTree *db, RhythmDBEntry *entry);
 static void remove_entry_from_keywords (RhythmDBTree *db, RhythmDBEntry *entry);
@@ -137,17 +194,38 @@ struct RhythmDBTreePrivate
 {
 	GHashTable *entries;
 	GHashTable *entry_ids;
-	GMutex *entries_lock;
+	GStaticRWLock entries_lock;
 
 	GHashTable *keywords; /* GHashTable<RBRefString, GHashTable<RhyhmDBEntry, 1>> */
-	GMutex *keywords_lock;
+	GStaticRWLock keywords_lock;
 
-	GHashTable *genres;
-	GMutex *genres_lock; /* must be held while using the tree */
+	GHashTable *genres; /* GHashTable<RhythmDBEntryType, RhythmDBTreeShard> */
+	GStaticRWLock genres_lock; /* only protects the hash table of shards */
+
+	GHashTable *words; /* GHashTable<char *, GHashTable<RhythmDBEntry, count>> */
+	GStaticRWLock words_lock;
+
+	GHashTable *trigram_indexes; /* GHashTable<RhythmDBPropType, RhythmDBTreeTrigramIndex> */
+	GStaticRWLock trigram_lock;
+
+	GSequence *range_indexes[RHYTHMDB_TREE_N_RANGE_INDEXES]; /* GSequence<RhythmDBTreeRangeItem> */
+	GHashTable *range_items; /* GHashTable<RhythmDBEntry, RhythmDBTreeRangeItem[]> */
+	GStaticRWLock range_lock;
 
 	GHashTable *unknown_entry_types;
 	gboolean finalizing;
 
+	FILE *journal;
+	GMutex *journal_lock;
+	long journal_compact_offset;
+	guint journal_first_id;
+
+	guint load_threads;
+
+	guint query_threads;
+	GThreadPool *query_pool;
+	GMutex *query_pool_lock;
+
 	guint idle_load_id;
 };
 
@@ -163,11 +241,18 @@ typedef struct
 	GList *properties;
 } RhythmDBUnknownEntry;
 
+/* there is no way to tell who holds a reader/writer lock, so this only
+ * checks that somebody does.
+ */
+#define rhythmdb_tree_assert_locked(lock) g_assert (!g_static_rw_lock_writer_trylock (lock))
+
 #define RHYTHMDB_TREE_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), RHYTHMDB_TYPE_TREE, RhythmDBTreePrivate))
 
 enum
 {
 	PROP_0,
+	PROP_LOAD_THREADS,
+	PROP_QUERY_THREADS,
 };
 
 const int RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE = 512;
@@ -189,6 +274,8 @@ rhythmdb_tree_class_init (RhythmDBTreeClass *klass)
 	RhythmDBClass *rhythmdb_class = RHYTHMDB_CLASS (klass);
 
 	object_class->finalize = rhythmdb_tree_finalize;
+	object_class->set_property = rhythmdb_tree_set_property;
+	object_class->get_property = rhythmdb_tree_get_property;
 
 	rhythmdb_class->impl_load = rhythmdb_tree_load;
 	rhythmdb_class->impl_save = rhythmdb_tree_save;
@@ -196,6 +283,7 @@ rhythmdb_tree_class_init (RhythmDBTreeClass *klass)
 	rhythmdb_class->impl_entry_set = rhythmdb_tree_entry_set;
 	rhythmdb_class->impl_entry_delete = rhythmdb_tree_entry_delete;
 	rhythmdb_class->impl_entry_delete_by_type = rhythmdb_tree_entry_delete_by_type;
+	rhythmdb_class->impl_entry_delete_many = rhythmdb_tree_entry_delete_many;
 	rhythmdb_class->impl_lookup_by_location = rhythmdb_tree_entry_lookup_by_location;
 	rhythmdb_class->impl_lookup_by_id = rhythmdb_tree_entry_lookup_by_id;
 	rhythmdb_class->impl_entry_foreach = rhythmdb_tree_entry_foreach;
@@ -210,38 +298,141 @@ rhythmdb_tree_class_init (RhythmDBTreeClass *klass)
 	rhythmdb_class->impl_do_full_query = rhythmdb_tree_do_full_query;
 	rhythmdb_class->impl_entry_type_registered = rhythmdb_tree_entry_type_registered;
 
+	rhythmdb_class->entry_added = rhythmdb_tree_entry_added;
+
+	/**
+	 * RhythmDBTree:load-threads
+	 *
+	 * The number of threads used to parse the XML database when loading
+	 * it.  If 0, one thread per processor is used; if 1, the database
+	 * is parsed serially.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_LOAD_THREADS,
+					 g_param_spec_uint ("load-threads",
+							    "load threads",
+							    "Number of threads used to load the database",
+							    0, 64, 0,
+							    G_PARAM_READWRITE));
+
+	/**
+	 * RhythmDBTree:query-threads
+	 *
+	 * The number of threads used to evaluate large queries.  If 0, one
+	 * thread per processor is used; if 1, queries are evaluated
+	 * serially.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_QUERY_THREADS,
+					 g_param_spec_uint ("query-threads",
+							    "query threads",
+							    "Number of threads used to evaluate queries",
+							    0, 64, 0,
+							    G_PARAM_READWRITE));
+
 	g_type_class_add_private (klass, sizeof (RhythmDBTreePrivate));
 }
 
 static void
 rhythmdb_tree_init (RhythmDBTree *db)
 {
+	guint i;
+
 	db->priv = RHYTHMDB_TREE_GET_PRIVATE (db);
 
 	db->priv->entries = g_hash_table_new (rb_refstring_hash, rb_refstring_equal);
 	db->priv->entry_ids = g_hash_table_new (g_direct_hash, g_direct_equal);
-	db->priv->entries_lock = g_mutex_new();
+	g_static_rw_lock_init (&db->priv->entries_lock);
 
 	db->priv->keywords = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
 						    (GDestroyNotify)rb_refstring_unref, (GDestroyNotify)g_hash_table_destroy);
-	db->priv->keywords_lock = g_mutex_new();
+	g_static_rw_lock_init (&db->priv->keywords_lock);
 
-	db->priv->genres_lock = g_mutex_new();
+	g_static_rw_lock_init (&db->priv->genres_lock);
 	db->priv->genres = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-						  NULL, (GDestroyNotify)g_hash_table_destroy);
+						  NULL, (GDestroyNotify)destroy_shard);
+
+	db->priv->words = g_hash_table_new_full (g_str_hash, g_str_equal,
+						 g_free, (GDestroyNotify)g_hash_table_destroy);
+	g_static_rw_lock_init (&db->priv->words_lock);
+
+	db->priv->trigram_indexes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+							   NULL, trigram_index_free);
+	g_static_rw_lock_init (&db->priv->trigram_lock);
+
+	for (i = 0; i < RHYTHMDB_TREE_N_RANGE_INDEXES; i++) {
+		db->priv->range_indexes[i] = g_sequence_new (NULL);
+	}
+	db->priv->range_items = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+	g_static_rw_lock_init (&db->priv->range_lock);
 
 	db->priv->unknown_entry_types = g_hash_table_new (rb_refstring_hash, rb_refstring_equal);
+
+	db->priv->journal_lock = g_mutex_new();
+	db->priv->journal_compact_offset = -1;
+
+	db->priv->query_pool_lock = g_mutex_new ();
+}
+
+static void
+rhythmdb_tree_set_property (GObject *object,
+			    guint prop_id,
+			    const GValue *value,
+			    GParamSpec *pspec)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (object);
+
+	switch (prop_id) {
+	case PROP_LOAD_THREADS:
+		db->priv->load_threads = g_value_get_uint (value);
+		break;
+	case PROP_QUERY_THREADS:
+		db->priv->query_threads = g_value_get_uint (value);
+		g_mutex_lock (db->priv->query_pool_lock);
+		if (db->priv->query_pool != NULL) {
+			g_thread_pool_set_max_threads (db->priv->query_pool,
+						       MAX (rhythmdb_tree_query_thread_count (db), 2) - 1,
+						       NULL);
+		}
+		g_mutex_unlock (db->priv->query_pool_lock);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+rhythmdb_tree_get_property (GObject *object,
+			    guint prop_id,
+			    GValue *value,
+			    GParamSpec *pspec)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (object);
+
+	switch (prop_id) {
+	case PROP_LOAD_THREADS:
+		g_value_set_uint (value, db->priv->load_threads);
+		break;
+	case PROP_QUERY_THREADS:
+		g_value_set_uint (value, db->priv->query_threads);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
 }
 
-/* must be called with the genres lock held */
 static void
 unparent_entries (gpointer key,
 		  RhythmDBEntry *entry,
 		  RhythmDBTree *db)
 {
-	rb_assert_locked (db->priv->genres_lock);
+	RhythmDBTreeShard *shard = get_shard (db, entry->type);
 
+	g_static_rw_lock_writer_lock (&shard->lock);
 	remove_entry_from_album (db, entry);
+	g_static_rw_lock_writer_unlock (&shard->lock);
 }
 
 static void
@@ -266,6 +457,7 @@ free_unknown_entries (RBRefString *name,
 		}
 
 		g_list_free (entry->properties);
+		g_free (entry);
 	}
 	g_list_free (entries);
 }
@@ -274,6 +466,7 @@ static void
 rhythmdb_tree_finalize (GObject *object)
 {
 	RhythmDBTree *db;
+	guint i;
 
 	g_return_if_fail (object != NULL);
 	g_return_if_fail (RHYTHMDB_IS_TREE (object));
@@ -284,1552 +477,4861 @@ rhythmdb_tree_finalize (GObject *object)
 
 	db->priv->finalizing = TRUE;
 
-	g_mutex_lock (db->priv->genres_lock);
 	g_hash_table_foreach (db->priv->entries, (GHFunc) unparent_entries, db);
-	g_mutex_unlock (db->priv->genres_lock);
 
 	g_hash_table_destroy (db->priv->entries);
 	g_hash_table_destroy (db->priv->entry_ids);
-	g_mutex_free (db->priv->entries_lock);
+	g_static_rw_lock_free (&db->priv->entries_lock);
 
 	g_hash_table_destroy (db->priv->keywords);
-	g_mutex_free (db->priv->keywords_lock);
+	g_static_rw_lock_free (&db->priv->keywords_lock);
 
 	g_hash_table_destroy (db->priv->genres);
-	g_mutex_free (db->priv->genres_lock);
+	g_static_rw_lock_free (&db->priv->genres_lock);
+
+	g_hash_table_destroy (db->priv->words);
+	g_static_rw_lock_free (&db->priv->words_lock);
+
+	g_hash_table_destroy (db->priv->trigram_indexes);
+	g_static_rw_lock_free (&db->priv->trigram_lock);
+
+	for (i = 0; i < RHYTHMDB_TREE_N_RANGE_INDEXES; i++) {
+		g_sequence_free (db->priv->range_indexes[i]);
+	}
+	g_hash_table_destroy (db->priv->range_items);
+	g_static_rw_lock_free (&db->priv->range_lock);
 
 	g_hash_table_foreach (db->priv->unknown_entry_types,
 			      (GHFunc) free_unknown_entries,
 			      NULL);
 	g_hash_table_destroy (db->priv->unknown_entry_types);
 
+	if (db->priv->journal != NULL)
+		fclose (db->priv->journal);
+	g_mutex_free (db->priv->journal_lock);
+
+	if (db->priv->query_pool != NULL)
+		g_thread_pool_free (db->priv->query_pool, FALSE, TRUE);
+	g_mutex_free (db->priv->query_pool_lock);
+
 	G_OBJECT_CLASS (rhythmdb_tree_parent_class)->finalize (object);
 }
 
-struct RhythmDBTreeLoadContext
+/*
+ * Binary snapshot of the tree.
+ *
+ * Every time the XML database is saved, a snapshot of the same data is
+ * written next to it (as <name>.snapshot).  The snapshot consists of a
+ * header, an array of fixed size entry records, a table of groups
+ * describing the genre/artist/album hierarchy the entries belong to,
+ * the entry type names, keyword references, and a table of unique
+ * strings.  Entry records refer to strings by index, so each distinct
+ * string only has to be interned once on load, and since the records are
+ * stored grouped by album, the tree structure only has to be looked up
+ * once per album rather than once per entry.
+ *
+ * The snapshot is only used if it matches the size and modification time
+ * of the XML file it was written with, and is written in native byte
+ * order; in every other case, we just fall back to parsing the XML file,
+ * which remains the canonical format.
+ */
+
+#define RHYTHMDB_TREE_SNAPSHOT_MAGIC		"RBDBSNAP"
+#define RHYTHMDB_TREE_SNAPSHOT_VERSION		1
+#define RHYTHMDB_TREE_SNAPSHOT_BYTE_ORDER	0x01020304
+#define RHYTHMDB_TREE_SNAPSHOT_NO_STRING	G_MAXUINT32
+
+enum {
+	RHYTHMDB_TREE_SNAPSHOT_STR_TITLE,
+	RHYTHMDB_TREE_SNAPSHOT_STR_ARTIST,
+	RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM,
+	RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM_ARTIST,
+	RHYTHMDB_TREE_SNAPSHOT_STR_GENRE,
+	RHYTHMDB_TREE_SNAPSHOT_STR_COMMENT,
+	RHYTHMDB_TREE_SNAPSHOT_STR_MUSICBRAINZ_TRACKID,
+	RHYTHMDB_TREE_SNAPSHOT_STR_MUSICBRAINZ_ARTISTID,
+	RHYTHMDB_TREE_SNAPSHOT_STR_MUSICBRAINZ_ALBUMID,
+	RHYTHMDB_TREE_SNAPSHOT_STR_MUSICBRAINZ_ALBUMARTISTID,
+	RHYTHMDB_TREE_SNAPSHOT_STR_ARTIST_SORTNAME,
+	RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM_SORTNAME,
+	RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM_ARTIST_SORTNAME,
+	RHYTHMDB_TREE_SNAPSHOT_STR_LOCATION,
+	RHYTHMDB_TREE_SNAPSHOT_STR_MOUNTPOINT,
+	RHYTHMDB_TREE_SNAPSHOT_STR_MIMETYPE,
+	RHYTHMDB_TREE_SNAPSHOT_STR_DESCRIPTION,
+	RHYTHMDB_TREE_SNAPSHOT_STR_SUBTITLE,
+	RHYTHMDB_TREE_SNAPSHOT_STR_SUMMARY,
+	RHYTHMDB_TREE_SNAPSHOT_STR_LANG,
+	RHYTHMDB_TREE_SNAPSHOT_STR_COPYRIGHT,
+	RHYTHMDB_TREE_SNAPSHOT_STR_IMAGE,
+	/* keep this even, so entry records stay 8 byte aligned */
+	RHYTHMDB_TREE_SNAPSHOT_N_STRINGS
+};
+
+typedef struct
 {
-	RhythmDBTree *db;
-	xmlParserCtxtPtr xmlctx;
-	GCancellable *cancel;
-	enum {
-		RHYTHMDB_TREE_PARSER_STATE_START,
-		RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB,
-		RHYTHMDB_TREE_PARSER_STATE_ENTRY,
-		RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY,
-		RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD,
-		RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY,
-		RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY,
-		RHYTHMDB_TREE_PARSER_STATE_END,
-	} state;
-	guint in_unknown_elt;
-	RhythmDBEntry *entry;
-	RhythmDBUnknownEntry *unknown_entry;
-	GString *buf;
-	RhythmDBPropType propid;
-	gint batch_count;
-	GError **error;
+	char magic[8];
+	guint32 byte_order;
+	guint32 version;
+	guint32 xml_version;
+	guint32 entry_size;
+	guint64 xml_size;
+	guint64 xml_mtime;
+	guint32 n_entries;
+	guint32 n_groups;
+	guint32 n_types;
+	guint32 n_keywords;
+	guint32 n_strings;
+	guint32 string_data_size;
+	guint64 entries_offset;
+	guint64 groups_offset;
+	guint64 types_offset;
+	guint64 keywords_offset;
+	guint64 strings_offset;
+	guint64 string_data_offset;
+} RhythmDBTreeSnapshotHeader;
 
-	/* updating */
-	guint has_date : 1;
-	guint canonicalise_uris : 1;
-	guint reload_all_metadata : 1;
-	guint update_podcasts : 1;
-	guint update_local_mountpoints : 1;
+typedef struct
+{
+	guint64 file_size;
+	gint64 play_count;
+	guint64 mtime;
+	guint64 first_seen;
+	guint64 last_seen;
+	guint64 last_played;
+	guint64 status;
+	guint64 post_time;
+	gdouble bpm;
+	gdouble rating;
+	guint32 tracknum;
+	guint32 discnum;
+	guint32 duration;
+	guint32 bitrate;
+	guint32 date;
+	guint32 flags;
+	guint32 keywords_start;
+	guint32 n_keywords;
+	guint32 strings[RHYTHMDB_TREE_SNAPSHOT_N_STRINGS];
+} RhythmDBTreeSnapshotEntry;
+
+/* a run of entries with the same type, genre, artist and album */
+typedef struct
+{
+	guint32 type;
+	guint32 genre;
+	guint32 artist;
+	guint32 album;
+	guint32 first_entry;
+	guint32 n_entries;
+} RhythmDBTreeSnapshotGroup;
+
+struct RhythmDBTreeSnapshotWriter
+{
+	FILE *handle;
+	char *path;
+	char *error;
+
+	GHashTable *string_ids;		/* RBRefString -> index */
+	GArray *string_offsets;
+	GString *string_data;
+
+	GPtrArray *types;
+	GArray *type_names;
+	guint32 current_type;
+
+	GArray *groups;
+	GArray *keywords;
+	guint32 n_entries;
 };
 
-/* Returns the version as an int, multiplied by 100,
- * eg. "1.4" becomes 140 */
-static int
-version_to_int (const char *version)
+static char *
+rhythmdb_tree_snapshot_path (const char *name)
 {
-	float ver;
-	char *eptr;
+	return g_strconcat (name, ".snapshot", NULL);
+}
 
-	ver = g_ascii_strtod (version, &eptr);
-	if (eptr == version) {
-		return (int) (1.0 * 100);
+/* fills in pointers to each of the string fields of the entry, in
+ * snapshot order.  fields that don't apply to the entry are set to NULL.
+ */
+static void
+snapshot_entry_string_slots (RhythmDBEntry *entry,
+			     RBRefString **slots[RHYTHMDB_TREE_SNAPSHOT_N_STRINGS])
+{
+	RhythmDBPodcastFields *podcast = NULL;
+
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED ||
+	    entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST)
+		podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
+
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_TITLE] = &entry->title;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_ARTIST] = &entry->artist;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM] = &entry->album;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM_ARTIST] = &entry->album_artist;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_GENRE] = &entry->genre;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_COMMENT] = &entry->comment;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_MUSICBRAINZ_TRACKID] = &entry->musicbrainz_trackid;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_MUSICBRAINZ_ARTISTID] = &entry->musicbrainz_artistid;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_MUSICBRAINZ_ALBUMID] = &entry->musicbrainz_albumid;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_MUSICBRAINZ_ALBUMARTISTID] = &entry->musicbrainz_albumartistid;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_ARTIST_SORTNAME] = &entry->artist_sortname;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM_SORTNAME] = &entry->album_sortname;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM_ARTIST_SORTNAME] = &entry->album_artist_sortname;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_LOCATION] = &entry->location;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_MOUNTPOINT] = &entry->mountpoint;
+	slots[RHYTHMDB_TREE_SNAPSHOT_STR_MIMETYPE] = &entry->mimetype;
+
+	if (podcast) {
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_DESCRIPTION] = &podcast->description;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_SUBTITLE] = &podcast->subtitle;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_SUMMARY] = &podcast->summary;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_LANG] = &podcast->lang;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_COPYRIGHT] = &podcast->copyright;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_IMAGE] = &podcast->image;
+	} else {
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_DESCRIPTION] = NULL;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_SUBTITLE] = NULL;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_SUMMARY] = NULL;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_LANG] = NULL;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_COPYRIGHT] = NULL;
+		slots[RHYTHMDB_TREE_SNAPSHOT_STR_IMAGE] = NULL;
 	}
-	return (int)roundf(ver * 100);
 }
 
 static void
-rhythmdb_tree_parser_start_element (struct RhythmDBTreeLoadContext *ctx,
-				    const char *name,
-				    const char **attrs)
+snapshot_write (struct RhythmDBTreeSnapshotWriter *writer,
+		gconstpointer data,
+		gsize len)
 {
-	if (g_cancellable_is_cancelled (ctx->cancel)) {
-		xmlStopParser (ctx->xmlctx);
-		return;
+	if (writer->error == NULL && len > 0) {
+		if (fwrite (data, 1, len, writer->handle) != len) {
+			writer->error = g_strdup (g_strerror (errno));
+		}
 	}
+}
 
-	if (ctx->in_unknown_elt) {
-		ctx->in_unknown_elt++;
-		return;
+static struct RhythmDBTreeSnapshotWriter *
+snapshot_writer_new (const char *name)
+{
+	struct RhythmDBTreeSnapshotWriter *writer;
+	RhythmDBTreeSnapshotHeader header;
+	char *path;
+
+	path = rhythmdb_tree_snapshot_path (name);
+	writer = g_new0 (struct RhythmDBTreeSnapshotWriter, 1);
+	writer->path = g_strconcat (path, ".tmp", NULL);
+	g_free (path);
+
+	writer->handle = fopen (writer->path, "w");
+	if (writer->handle == NULL) {
+		rb_debug ("can't write database snapshot %s: %s", writer->path, g_strerror (errno));
+		g_free (writer->path);
+		g_free (writer);
+		return NULL;
 	}
 
-	switch (ctx->state)
-	{
-	case RHYTHMDB_TREE_PARSER_STATE_START:
-	{
-		if (!strcmp (name, "rhythmdb")) {
-			ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
-			for (; *attrs; attrs +=2) {
-				if (!strcmp (*attrs, "version")) {
-					const char *version = *(attrs+1);
+	writer->string_ids = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+						    (GDestroyNotify) rb_refstring_unref, NULL);
+	writer->string_offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+	writer->string_data = g_string_new (NULL);
+	writer->types = g_ptr_array_new ();
+	writer->type_names = g_array_new (FALSE, FALSE, sizeof (guint32));
+	writer->groups = g_array_new (FALSE, FALSE, sizeof (RhythmDBTreeSnapshotGroup));
+	writer->keywords = g_array_new (FALSE, FALSE, sizeof (guint32));
 
-					rb_debug ("loading database version %s (%d)", version, version_to_int (version));
-					switch (version_to_int (version)) {
-					case 100:
-					case 110:
-						rb_debug ("old version of rhythmdb, performing URI canonicalisation for all entries (DB version 1.0 or 1.1)");
-						ctx->canonicalise_uris = TRUE;
-					case 120:
-						rb_debug ("reloading all file metadata to get MusicBrainz tags (DB version 1.2)");
-						ctx->reload_all_metadata = TRUE;
-					case 130:
-					case 140:
-						/* Avoid being warned twice for very old DBs */
-						if (ctx->canonicalise_uris == FALSE) {
-							rb_debug ("old version of rhythmdb, performing URI canonicalisation for all entries (DB version %s)", version);
-							ctx->canonicalise_uris = TRUE;
-						}
-					case 150:
-						rb_debug ("Upgrade Podcasts remote vs. local locations");
-						ctx->update_podcasts = TRUE;
-					case 160:
-						rb_debug ("reloading all file metadata to get sortnames, album artist, comments, bpm and updating mountpoints");
-						ctx->reload_all_metadata = TRUE;
-						ctx->update_local_mountpoints = TRUE;
-					case RHYTHMDB_TREE_XML_VERSION_INT:
-						/* current version */
-						break;
-					default:
-						if (version_to_int (version) > RHYTHMDB_TREE_XML_VERSION_INT) {
-							g_set_error (ctx->error,
-								     RHYTHMDB_TREE_ERROR,
-								     RHYTHMDB_TREE_ERROR_DATABASE_TOO_NEW,
-								     _("The database was created by a later version of Rhythmbox."
-								       "  This version of Rhythmbox cannot read the database."));
-							xmlStopParser (ctx->xmlctx);
-						}
-					}
-				} else {
-					g_assert_not_reached ();
-				}
-			}
+	/* reserve space for the header, filled in when we're done */
+	memset (&header, 0, sizeof (header));
+	snapshot_write (writer, &header, sizeof (header));
 
-		} else {
-			ctx->in_unknown_elt++;
-		}
+	return writer;
+}
 
-		break;
+static void
+snapshot_writer_free (struct RhythmDBTreeSnapshotWriter *writer)
+{
+	if (writer->handle != NULL) {
+		fclose (writer->handle);
+		unlink (writer->path);
 	}
-	case RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB:
-	{
-		if (!strcmp (name, "entry")) {
-			RhythmDBEntryType *type = NULL;
-			const char *typename = NULL;
-			for (; *attrs; attrs +=2) {
-				if (!strcmp (*attrs, "type")) {
-					typename = *(attrs+1);
-					type = rhythmdb_entry_type_get_by_name (RHYTHMDB (ctx->db), typename);
-					break;
-				}
-			}
 
-			g_assert (typename);
-			if (type != NULL) {
-				ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY;
-				ctx->entry = rhythmdb_entry_allocate (RHYTHMDB (ctx->db), type);
-				ctx->entry->flags |= RHYTHMDB_ENTRY_TREE_LOADING;
-				ctx->has_date = FALSE;
-			} else {
-				rb_debug ("reading unknown entry");
-				ctx->state = RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY;
-				ctx->unknown_entry = g_new0 (RhythmDBUnknownEntry, 1);
-				ctx->unknown_entry->typename = rb_refstring_new (typename);
-			}
-		} else {
-			ctx->in_unknown_elt++;
-		}
-		break;
-	}
-	case RHYTHMDB_TREE_PARSER_STATE_ENTRY:
-		if (strcmp (name, "keyword") == 0) {
-			ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD;
-		} else {
-			int val = rhythmdb_propid_from_nice_elt_name (RHYTHMDB (ctx->db), BAD_CAST name);
-			if (val < 0) {
-				ctx->in_unknown_elt++;
-				break;
-			}
+	g_hash_table_destroy (writer->string_ids);
+	g_array_free (writer->string_offsets, TRUE);
+	g_string_free (writer->string_data, TRUE);
+	g_ptr_array_free (writer->types, TRUE);
+	g_array_free (writer->type_names, TRUE);
+	g_array_free (writer->groups, TRUE);
+	g_array_free (writer->keywords, TRUE);
+	g_free (writer->error);
+	g_free (writer->path);
+	g_free (writer);
+}
 
-			ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY;
-			ctx->propid = val;
-		}
-		g_string_truncate (ctx->buf, 0);
-		break;
-	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY:
-	{
-		RhythmDBUnknownEntryProperty *prop;
+/* refstrings are interned, so the pointer identifies the string.  the
+ * table holds a reference to each string so the pointer can't be reused
+ * for a different string while we're writing.
+ */
+static guint32
+snapshot_string_index (struct RhythmDBTreeSnapshotWriter *writer,
+		       RBRefString *str)
+{
+	gpointer id;
+	guint32 index;
+	guint32 offset;
+	const char *s;
 
-		prop = g_new0 (RhythmDBUnknownEntryProperty, 1);
-		prop->name = rb_refstring_new (name);
+	if (str == NULL)
+		return RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
 
-		ctx->unknown_entry->properties = g_list_prepend (ctx->unknown_entry->properties, prop);
-		ctx->state = RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY;
-		g_string_truncate (ctx->buf, 0);
-		break;
-	}
-	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY:
-	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY:
-	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD:
-	case RHYTHMDB_TREE_PARSER_STATE_END:
-	break;
-	}
+	if (g_hash_table_lookup_extended (writer->string_ids, str, NULL, &id))
+		return GPOINTER_TO_UINT (id);
+
+	s = rb_refstring_get (str);
+	offset = writer->string_data->len;
+	g_string_append_len (writer->string_data, s, strlen (s) + 1);
+
+	index = writer->string_offsets->len;
+	g_array_append_val (writer->string_offsets, offset);
+	g_hash_table_insert (writer->string_ids, rb_refstring_ref (str), GUINT_TO_POINTER (index));
+	return index;
 }
 
 static void
-rhythmdb_tree_parser_end_element (struct RhythmDBTreeLoadContext *ctx,
-				  const char *name)
+snapshot_writer_set_type (struct RhythmDBTreeSnapshotWriter *writer,
+			  RhythmDBEntryType *type,
+			  const char *name)
 {
-	if (g_cancellable_is_cancelled (ctx->cancel)) {
-		xmlStopParser (ctx->xmlctx);
-		return;
-	}
-
-	if (ctx->in_unknown_elt) {
-		ctx->in_unknown_elt--;
-		return;
-	}
+	RBRefString *rs;
+	guint32 index;
+	guint i;
 
-	switch (ctx->state)
-	{
-	case RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB:
-		ctx->state = RHYTHMDB_TREE_PARSER_STATE_END;
-		break;
-	case RHYTHMDB_TREE_PARSER_STATE_ENTRY:
-	{
-		if (!ctx->has_date || ctx->reload_all_metadata) {
-			/* there is no date metadata, so this is from an old version
-			 * reset the last-modified timestamp, so that the file is re-read
-			 */
-			rb_debug ("pre-Date entry found, causing re-read");
-			ctx->entry->mtime = 0;
-		}
-		if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED) {
-			RhythmDBPodcastFields *podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (ctx->entry, RhythmDBPodcastFields);
-			/* Handle upgrades from 0.9.2.
-			 * Previously, last-seen for podcast feeds was the time of the last post,
-			 * and post-time was unused.  Now, we want last-seen to be the time we
-			 * last updated the feed, and post-time to be the time of the last post.
-			 */
-			if (podcast->post_time == 0) {
-				podcast->post_time = ctx->entry->last_seen;
-			}
+	for (i = 0; i < writer->types->len; i++) {
+		if (g_ptr_array_index (writer->types, i) == type) {
+			writer->current_type = i;
+			return;
 		}
-		if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST) {
-			/* When upgrading Podcasts from 0.11.6 and prior, we need to
-			 * swap mountpoint and location if there is a mountpoint */
-			if (ctx->update_podcasts && ctx->entry->mountpoint != NULL) {
-				RBRefString *tmp;
+	}
 
-				rb_debug ("pre-Podcast avoidance found, swapping location/mountpoint");
+	rs = rb_refstring_new (name);
+	index = snapshot_string_index (writer, rs);
+	rb_refstring_unref (rs);
 
-				tmp = ctx->entry->location;
-				ctx->entry->location = ctx->entry->mountpoint;
-				ctx->entry->mountpoint = tmp;
-			}
-		}
-		if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_SONG) {
-			/* Since we now care about mountpoints for all local entries, not just
-			 * those on things that actually get mounted and unmounted, we need to
-			 * ensure they're all correct.
-			 */
-			if (ctx->update_local_mountpoints) {
-				const char *loc = rb_refstring_get (ctx->entry->location);
-				if (loc == NULL || g_str_has_prefix (loc, "file:///")) {
-					char *nmp;
-					nmp = rb_uri_get_mount_point (loc);
-					if (ctx->entry->mountpoint != NULL) {
-						rb_refstring_unref (ctx->entry->mountpoint);
-						ctx->entry->mountpoint = NULL;
-					}
+	g_ptr_array_add (writer->types, type);
+	g_array_append_val (writer->type_names, index);
+	writer->current_type = writer->types->len - 1;
+}
 
-					if (nmp != NULL) {
-						ctx->entry->mountpoint = rb_refstring_new (nmp);
-						g_free (nmp);
-					}
-				}
-			}
-		}
+static void
+snapshot_write_entry (RhythmDBTree *db,
+		      struct RhythmDBTreeSnapshotWriter *writer,
+		      RhythmDBEntry *entry,
+		      GList *keywords)
+{
+	RhythmDBTreeSnapshotEntry record;
+	RhythmDBTreeSnapshotGroup *group = NULL;
+	RBRefString **slots[RHYTHMDB_TREE_SNAPSHOT_N_STRINGS];
+	RhythmDBPodcastFields *podcast = NULL;
+	GList *l;
+	int i;
 
-		if (ctx->entry->location != NULL && rb_refstring_get (ctx->entry->location)[0] != '\0') {
-			RhythmDBEntry *entry;
+	if (writer->error)
+		return;
 
-			g_mutex_lock (ctx->db->priv->entries_lock);
-			entry = g_hash_table_lookup (ctx->db->priv->entries, ctx->entry->location);
-			if (entry == NULL) {
-				rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), ctx->entry);
-				rhythmdb_entry_insert (RHYTHMDB (ctx->db), ctx->entry);
-				if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
-					rhythmdb_commit (RHYTHMDB (ctx->db));
-					ctx->batch_count = 0;
-				}
-			} else if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST &&
-				   entry->type == RHYTHMDB_ENTRY_TYPE_SONG) {
-				rb_debug ("found song entry with duplicate location for Podcast post %s. merging metadata",
-					  rb_refstring_get (ctx->entry->location));
-
-				ctx->entry->play_count += entry->play_count;
-				if (ctx->entry->last_played < entry->last_played)
-					ctx->entry->last_played = entry->last_played;
-
-				/* Remove the song entry,
-				 * deleting requires relinquishing the locks */
-				g_mutex_unlock (ctx->db->priv->entries_lock);
-				rhythmdb_entry_delete (RHYTHMDB(ctx->db), entry);
-				g_mutex_lock (ctx->db->priv->entries_lock);
-				rhythmdb_commit (RHYTHMDB (ctx->db));
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED ||
+	    entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST)
+		podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
 
-				/* And add the Podcast entry to the database */
-				rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), ctx->entry);
-				rhythmdb_entry_insert (RHYTHMDB (ctx->db), ctx->entry);
-				if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
-					rhythmdb_commit (RHYTHMDB (ctx->db));
-					ctx->batch_count = 0;
-				}
-			} else {
-				rb_debug ("found entry with duplicate location %s. merging metadata",
-					  rb_refstring_get (ctx->entry->location));
+	memset (&record, 0, sizeof (record));
+	snapshot_entry_string_slots (entry, slots);
+	for (i = 0; i < RHYTHMDB_TREE_SNAPSHOT_N_STRINGS; i++) {
+		if (slots[i] != NULL)
+			record.strings[i] = snapshot_string_index (writer, *slots[i]);
+		else
+			record.strings[i] = RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
+	}
 
-				entry->play_count += ctx->entry->play_count;
+	record.file_size = entry->file_size;
+	record.play_count = entry->play_count;
+	record.mtime = entry->mtime;
+	record.first_seen = entry->first_seen;
+	record.last_seen = entry->last_seen;
+	record.last_played = entry->last_played;
+	record.bpm = entry->bpm;
+	record.rating = entry->rating;
+	record.tracknum = entry->tracknum;
+	record.discnum = entry->discnum;
+	record.duration = entry->duration;
+	record.bitrate = entry->bitrate;
+	if (g_date_valid (&entry->date))
+		record.date = g_date_get_julian (&entry->date);
+	record.flags = entry->flags & RHYTHMDB_ENTRY_HIDDEN;
+	if (podcast) {
+		record.status = podcast->status;
+		record.post_time = podcast->post_time;
+	}
 
-				if (entry->rating < 0.01)
-					entry->rating = ctx->entry->rating;
-				else if (ctx->entry->rating > 0.01)
-					entry->rating = (entry->rating + ctx->entry->rating) / 2;
+	record.keywords_start = writer->keywords->len;
+	for (l = keywords; l != NULL; l = l->next) {
+		RBRefString *keyword = (RBRefString *) l->data;
+		guint32 index;
 
-				if (ctx->entry->last_played > entry->last_played)
-					entry->last_played = ctx->entry->last_played;
+		index = snapshot_string_index (writer, keyword);
+		g_array_append_val (writer->keywords, index);
+		record.n_keywords++;
+	}
 
-				if (ctx->entry->first_seen < entry->first_seen)
-					entry->first_seen = ctx->entry->first_seen;
+	/* entries arrive album by album, so a new group starts whenever the
+	 * album changes.  compare all the keys in case the entry is being
+	 * moved around the tree while we're saving.
+	 */
+	if (writer->groups->len > 0) {
+		group = &g_array_index (writer->groups, RhythmDBTreeSnapshotGroup, writer->groups->len - 1);
+		if (group->type != writer->current_type ||
+		    group->genre != record.strings[RHYTHMDB_TREE_SNAPSHOT_STR_GENRE] ||
+		    group->artist != record.strings[RHYTHMDB_TREE_SNAPSHOT_STR_ARTIST] ||
+		    group->album != record.strings[RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM])
+			group = NULL;
+	}
+	if (group == NULL) {
+		RhythmDBTreeSnapshotGroup new_group;
+
+		new_group.type = writer->current_type;
+		new_group.genre = record.strings[RHYTHMDB_TREE_SNAPSHOT_STR_GENRE];
+		new_group.artist = record.strings[RHYTHMDB_TREE_SNAPSHOT_STR_ARTIST];
+		new_group.album = record.strings[RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM];
+		new_group.first_entry = writer->n_entries;
+		new_group.n_entries = 0;
+		g_array_append_val (writer->groups, new_group);
+		group = &g_array_index (writer->groups, RhythmDBTreeSnapshotGroup, writer->groups->len - 1);
+	}
+	group->n_entries++;
+	writer->n_entries++;
 
-				if (ctx->entry->last_seen > entry->last_seen)
-					entry->last_seen = ctx->entry->last_seen;
+	snapshot_write (writer, &record, sizeof (record));
+}
 
-				rhythmdb_entry_unref (ctx->entry);
-			}
-			g_mutex_unlock (ctx->db->priv->entries_lock);
+/* writes out the tables collected while writing the entries, then fills
+ * in the header and moves the snapshot into place.  the XML file must
+ * already have been written, as the snapshot records its size and mtime.
+ */
+static void
+snapshot_writer_finish (struct RhythmDBTreeSnapshotWriter *writer,
+			const char *name)
+{
+	RhythmDBTreeSnapshotHeader header;
+	struct stat xml_stat;
+	guint64 offset;
+	char *path;
+
+	if (writer->error == NULL && stat (name, &xml_stat) < 0)
+		writer->error = g_strdup (g_strerror (errno));
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, RHYTHMDB_TREE_SNAPSHOT_MAGIC, sizeof (header.magic));
+	header.byte_order = RHYTHMDB_TREE_SNAPSHOT_BYTE_ORDER;
+	header.version = RHYTHMDB_TREE_SNAPSHOT_VERSION;
+	header.xml_version = RHYTHMDB_TREE_XML_VERSION_INT;
+	header.entry_size = sizeof (RhythmDBTreeSnapshotEntry);
+	if (writer->error == NULL) {
+		header.xml_size = xml_stat.st_size;
+		header.xml_mtime = xml_stat.st_mtime;
+	}
+	header.n_entries = writer->n_entries;
+	header.n_groups = writer->groups->len;
+	header.n_types = writer->type_names->len;
+	header.n_keywords = writer->keywords->len;
+	header.n_strings = writer->string_offsets->len;
+	header.string_data_size = writer->string_data->len;
+
+	offset = sizeof (header);
+	header.entries_offset = offset;
+	offset += (guint64) header.n_entries * sizeof (RhythmDBTreeSnapshotEntry);
+	header.groups_offset = offset;
+	offset += (guint64) header.n_groups * sizeof (RhythmDBTreeSnapshotGroup);
+	header.types_offset = offset;
+	offset += (guint64) header.n_types * sizeof (guint32);
+	header.keywords_offset = offset;
+	offset += (guint64) header.n_keywords * sizeof (guint32);
+	header.strings_offset = offset;
+	offset += (guint64) header.n_strings * sizeof (guint32);
+	header.string_data_offset = offset;
+
+	snapshot_write (writer, writer->groups->data, writer->groups->len * sizeof (RhythmDBTreeSnapshotGroup));
+	snapshot_write (writer, writer->type_names->data, writer->type_names->len * sizeof (guint32));
+	snapshot_write (writer, writer->keywords->data, writer->keywords->len * sizeof (guint32));
+	snapshot_write (writer, writer->string_offsets->data, writer->string_offsets->len * sizeof (guint32));
+	snapshot_write (writer, writer->string_data->str, writer->string_data->len);
+
+	if (writer->error == NULL && fseek (writer->handle, 0, SEEK_SET) < 0)
+		writer->error = g_strdup (g_strerror (errno));
+	snapshot_write (writer, &header, sizeof (header));
+
+	if (fclose (writer->handle) < 0 && writer->error == NULL)
+		writer->error = g_strdup (g_strerror (errno));
+	writer->handle = NULL;
+
+	path = rhythmdb_tree_snapshot_path (name);
+	if (writer->error == NULL) {
+		if (rename (writer->path, path) < 0) {
+			g_warning ("Couldn't rename %s to %s: %s",
+				   writer->path, path,
+				   g_strerror (errno));
+			unlink (writer->path);
+			unlink (path);
 		} else {
-			rb_debug ("found entry without location");
-			rhythmdb_entry_unref (ctx->entry);
+			rb_debug ("wrote database snapshot: %u entries, %u albums, %u strings",
+				  header.n_entries, header.n_groups, header.n_strings);
 		}
-		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
-		ctx->entry = NULL;
-		break;
+	} else {
+		g_warning ("Writing the database snapshot failed: %s", writer->error);
+		unlink (writer->path);
+		/* the old snapshot no longer matches the XML file */
+		unlink (path);
 	}
-	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY:
-	{
-		GList *entry_list;
+	g_free (path);
+}
 
-		rb_debug ("finished reading unknown entry");
-		ctx->unknown_entry->properties = g_list_reverse (ctx->unknown_entry->properties);
+struct RhythmDBTreeSnapshotReader
+{
+	const char *data;
+	const RhythmDBTreeSnapshotHeader *header;
+	const RhythmDBTreeSnapshotEntry *entries;
+	const RhythmDBTreeSnapshotGroup *groups;
+	const guint32 *type_names;
+	const guint32 *keywords;
+	const guint32 *string_offsets;
+	const char *string_data;
+
+	RhythmDBEntryType **types;
+	RBRefString **strings;
+};
 
-		g_mutex_lock (ctx->db->priv->entries_lock);
-		entry_list = g_hash_table_lookup (ctx->db->priv->unknown_entry_types, ctx->unknown_entry->typename);
-		entry_list = g_list_prepend (entry_list, ctx->unknown_entry);
-		g_hash_table_insert (ctx->db->priv->unknown_entry_types, ctx->unknown_entry->typename, entry_list);
-		g_mutex_unlock (ctx->db->priv->entries_lock);
+static gboolean
+snapshot_section_valid (gsize length,
+			guint64 offset,
+			guint64 count,
+			gsize size)
+{
+	if (offset > length)
+		return FALSE;
+	if (count > (length - offset) / size)
+		return FALSE;
+	return TRUE;
+}
 
-		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
-		ctx->unknown_entry = NULL;
-		break;
+static gboolean
+snapshot_string_valid (struct RhythmDBTreeSnapshotReader *reader,
+		       guint32 index,
+		       gboolean allow_none)
+{
+	if (index == RHYTHMDB_TREE_SNAPSHOT_NO_STRING)
+		return allow_none;
+	return (index < reader->header->n_strings);
+}
+
+/* checks everything the loader relies on before touching the database,
+ * so that a corrupt snapshot can't result in a half-loaded database.
+ */
+static gboolean
+snapshot_reader_validate (struct RhythmDBTreeSnapshotReader *reader,
+			  gsize length)
+{
+	const RhythmDBTreeSnapshotHeader *header = reader->header;
+	guint32 next_entry = 0;
+	guint32 i;
+	int s;
+
+	if (!snapshot_section_valid (length, header->entries_offset, header->n_entries, sizeof (RhythmDBTreeSnapshotEntry)) ||
+	    !snapshot_section_valid (length, header->groups_offset, header->n_groups, sizeof (RhythmDBTreeSnapshotGroup)) ||
+	    !snapshot_section_valid (length, header->types_offset, header->n_types, sizeof (guint32)) ||
+	    !snapshot_section_valid (length, header->keywords_offset, header->n_keywords, sizeof (guint32)) ||
+	    !snapshot_section_valid (length, header->strings_offset, header->n_strings, sizeof (guint32)) ||
+	    !snapshot_section_valid (length, header->string_data_offset, header->string_data_size, 1)) {
+		rb_debug ("snapshot sections out of range");
+		return FALSE;
+	}
+	if ((header->entries_offset % 8) != 0 ||
+	    (header->groups_offset % 4) != 0 ||
+	    (header->types_offset % 4) != 0 ||
+	    (header->keywords_offset % 4) != 0 ||
+	    (header->strings_offset % 4) != 0) {
+		rb_debug ("snapshot sections misaligned");
+		return FALSE;
 	}
-	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY:
-	{
-		GValue value = {0,};
-		gboolean set = FALSE;
-		gboolean skip = FALSE;
 
-		/* special case some properties for upgrade handling etc. */
-		switch (ctx->propid) {
-		case RHYTHMDB_PROP_DATE:
-			ctx->has_date = TRUE;
-			break;
-		case RHYTHMDB_PROP_LOCATION:
-			if (ctx->canonicalise_uris) {
-				char *canon = rb_canonicalise_uri (ctx->buf->str);
+	reader->entries = (const RhythmDBTreeSnapshotEntry *) (reader->data + header->entries_offset);
+	reader->groups = (const RhythmDBTreeSnapshotGroup *) (reader->data + header->groups_offset);
+	reader->type_names = (const guint32 *) (reader->data + header->types_offset);
+	reader->keywords = (const guint32 *) (reader->data + header->keywords_offset);
+	reader->string_offsets = (const guint32 *) (reader->data + header->strings_offset);
+	reader->string_data = reader->data + header->string_data_offset;
+
+	/* all strings must be nul terminated within the string data */
+	if (header->n_strings > 0 &&
+	    (header->string_data_size == 0 || reader->string_data[header->string_data_size - 1] != '\0')) {
+		rb_debug ("snapshot string data not terminated");
+		return FALSE;
+	}
+	for (i = 0; i < header->n_strings; i++) {
+		if (reader->string_offsets[i] >= header->string_data_size) {
+			rb_debug ("snapshot string %u out of range", i);
+			return FALSE;
+		}
+	}
 
-				g_value_init (&value, G_TYPE_STRING);
-				g_value_take_string (&value, canon);
-				set = TRUE;
-			}
-			break;
-			/* drop replaygain properties */
-		case RHYTHMDB_PROP_TRACK_GAIN:
-		case RHYTHMDB_PROP_TRACK_PEAK:
-		case RHYTHMDB_PROP_ALBUM_GAIN:
-		case RHYTHMDB_PROP_ALBUM_PEAK:
-			skip = TRUE;
-			break;
-		default:
-			break;
+	for (i = 0; i < header->n_types; i++) {
+		if (!snapshot_string_valid (reader, reader->type_names[i], FALSE)) {
+			rb_debug ("snapshot entry type %u invalid", i);
+			return FALSE;
 		}
+	}
 
-		if (!skip) {
-			if (!set) {
-				rhythmdb_read_encoded_property (RHYTHMDB (ctx->db), ctx->buf->str, ctx->propid, &value);
-			}
+	for (i = 0; i < header->n_keywords; i++) {
+		if (!snapshot_string_valid (reader, reader->keywords[i], FALSE)) {
+			rb_debug ("snapshot keyword %u invalid", i);
+			return FALSE;
+		}
+	}
 
-			rhythmdb_entry_set_internal (RHYTHMDB (ctx->db), ctx->entry, FALSE, ctx->propid, &value);
-			g_value_unset (&value);
+	for (i = 0; i < header->n_groups; i++) {
+		const RhythmDBTreeSnapshotGroup *group = &reader->groups[i];
+		guint32 e;
+
+		if (group->type >= header->n_types ||
+		    group->first_entry != next_entry ||
+		    group->n_entries > header->n_entries - next_entry ||
+		    !snapshot_string_valid (reader, group->genre, FALSE) ||
+		    !snapshot_string_valid (reader, group->artist, FALSE) ||
+		    !snapshot_string_valid (reader, group->album, FALSE)) {
+			rb_debug ("snapshot group %u invalid", i);
+			return FALSE;
 		}
 
-		ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY;
-		break;
-	}
-	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD:
-	{
-		RBRefString *keyword;
+		for (e = group->first_entry; e < group->first_entry + group->n_entries; e++) {
+			const RhythmDBTreeSnapshotEntry *record = &reader->entries[e];
 
-		keyword = rb_refstring_new (ctx->buf->str);
-		rhythmdb_entry_keyword_add (RHYTHMDB(ctx->db), ctx->entry, keyword);
-		rb_refstring_unref (keyword);
+			if (record->strings[RHYTHMDB_TREE_SNAPSHOT_STR_GENRE] != group->genre ||
+			    record->strings[RHYTHMDB_TREE_SNAPSHOT_STR_ARTIST] != group->artist ||
+			    record->strings[RHYTHMDB_TREE_SNAPSHOT_STR_ALBUM] != group->album ||
+			    !snapshot_string_valid (reader, record->strings[RHYTHMDB_TREE_SNAPSHOT_STR_LOCATION], FALSE) ||
+			    record->keywords_start > header->n_keywords ||
+			    record->n_keywords > header->n_keywords - record->keywords_start) {
+				rb_debug ("snapshot entry %u invalid", e);
+				return FALSE;
+			}
+			for (s = 0; s < RHYTHMDB_TREE_SNAPSHOT_N_STRINGS; s++) {
+				if (!snapshot_string_valid (reader, record->strings[s], TRUE)) {
+					rb_debug ("snapshot entry %u string %d invalid", e, s);
+					return FALSE;
+				}
+			}
+		}
+		next_entry += group->n_entries;
+	}
 
-		ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY;
-		break;
+	if (next_entry != header->n_entries) {
+		rb_debug ("snapshot groups don't cover all entries");
+		return FALSE;
 	}
-	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY:
-	{
-		RhythmDBUnknownEntryProperty *prop;
 
-		g_assert (ctx->unknown_entry->properties);
-		prop = ctx->unknown_entry->properties->data;
-		g_assert (prop->value == NULL);
-		prop->value = rb_refstring_new (ctx->buf->str);
-		rb_debug ("unknown entry property: %s = %s", rb_refstring_get (prop->name), rb_refstring_get (prop->value));
+	return TRUE;
+}
 
-		ctx->state = RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY;
-		break;
-	}
-	case RHYTHMDB_TREE_PARSER_STATE_START:
-	case RHYTHMDB_TREE_PARSER_STATE_END:
-	break;
+/* returns an unowned refstring; each string is only interned once */
+static RBRefString *
+snapshot_reader_get_string (struct RhythmDBTreeSnapshotReader *reader,
+			    guint32 index)
+{
+	if (reader->strings[index] == NULL) {
+		reader->strings[index] = rb_refstring_new (reader->string_data + reader->string_offsets[index]);
 	}
+	return reader->strings[index];
 }
 
-static void
-rhythmdb_tree_parser_characters (struct RhythmDBTreeLoadContext *ctx,
-				 const char *data,
-				 guint len)
+static RhythmDBEntry *
+snapshot_reader_create_entry (RhythmDBTree *db,
+			      struct RhythmDBTreeSnapshotReader *reader,
+			      RhythmDBEntryType *type,
+			      const RhythmDBTreeSnapshotEntry *record)
 {
-	if (g_cancellable_is_cancelled (ctx->cancel)) {
-		xmlStopParser (ctx->xmlctx);
-		return;
+	RhythmDBEntry *entry;
+	RBRefString **slots[RHYTHMDB_TREE_SNAPSHOT_N_STRINGS];
+	RhythmDBPodcastFields *podcast = NULL;
+	guint32 k;
+	int i;
+
+	entry = rhythmdb_entry_allocate (RHYTHMDB (db), type);
+	entry->flags |= RHYTHMDB_ENTRY_TREE_LOADING;
+
+	snapshot_entry_string_slots (entry, slots);
+	for (i = 0; i < RHYTHMDB_TREE_SNAPSHOT_N_STRINGS; i++) {
+		if (slots[i] == NULL || record->strings[i] == RHYTHMDB_TREE_SNAPSHOT_NO_STRING)
+			continue;
+
+		rb_refstring_unref (*slots[i]);
+		*slots[i] = rb_refstring_ref (snapshot_reader_get_string (reader, record->strings[i]));
 	}
 
-	switch (ctx->state)
-	{
-	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY:
-	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD:
-	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY:
-		g_string_append_len (ctx->buf, data, len);
-		break;
-	case RHYTHMDB_TREE_PARSER_STATE_ENTRY:
-	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY:
-	case RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB:
-	case RHYTHMDB_TREE_PARSER_STATE_START:
-	case RHYTHMDB_TREE_PARSER_STATE_END:
-	break;
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED ||
+	    entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST) {
+		podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
+		podcast->status = record->status;
+		podcast->post_time = record->post_time;
+	}
+
+	entry->file_size = record->file_size;
+	entry->play_count = record->play_count;
+	entry->mtime = record->mtime;
+	entry->first_seen = record->first_seen;
+	entry->last_seen = record->last_seen;
+	entry->last_played = record->last_played;
+	entry->bpm = record->bpm;
+	entry->rating = record->rating;
+	entry->tracknum = record->tracknum;
+	entry->discnum = record->discnum;
+	entry->duration = record->duration;
+	entry->bitrate = record->bitrate;
+	if (record->date > 0)
+		g_date_set_julian (&entry->date, record->date);
+	entry->flags |= (record->flags & RHYTHMDB_ENTRY_HIDDEN);
+
+	for (k = record->keywords_start; k < record->keywords_start + record->n_keywords; k++) {
+		rhythmdb_entry_keyword_add (RHYTHMDB (db), entry,
+					    snapshot_reader_get_string (reader, reader->keywords[k]));
 	}
+
+	return entry;
 }
 
+/* Loads the database from the snapshot for the XML file @name, if there
+ * is a usable one.  Returns FALSE if nothing was loaded, in which case
+ * the caller should parse the XML file instead.
+ */
 static gboolean
-rhythmdb_tree_load (RhythmDB *rdb,
-		    GCancellable *cancel,
-		    GError **error)
+rhythmdb_tree_load_snapshot (RhythmDBTree *db,
+			     const char *name,
+			     GCancellable *cancel)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
-	xmlParserCtxtPtr ctxt;
-	xmlSAXHandlerPtr sax_handler;
-	struct RhythmDBTreeLoadContext *ctx;
-	char *name;
-	GError *local_error;
-	gboolean ret;
+	struct RhythmDBTreeSnapshotReader reader;
+	const RhythmDBTreeSnapshotHeader *header;
+	GMappedFile *mapped;
+	GError *error = NULL;
+	struct stat xml_stat;
+	char *path;
+	gsize length;
+	gboolean ret = FALSE;
+	guint batch_count = 0;
+	guint32 i;
+
+	if (stat (name, &xml_stat) < 0)
+		return FALSE;
 
-	local_error = NULL;
+	path = rhythmdb_tree_snapshot_path (name);
+	mapped = g_mapped_file_new (path, FALSE, &error);
+	if (mapped == NULL) {
+		rb_debug ("unable to map database snapshot %s: %s", path, error->message);
+		g_error_free (error);
+		g_free (path);
+		return FALSE;
+	}
 
-	sax_handler = g_new0 (xmlSAXHandler, 1);
-	ctx = g_new0 (struct RhythmDBTreeLoadContext, 1);
+	memset (&reader, 0, sizeof (reader));
+	reader.data = g_mapped_file_get_contents (mapped);
+	length = g_mapped_file_get_length (mapped);
+	header = reader.header = (const RhythmDBTreeSnapshotHeader *) reader.data;
+
+	if (length < sizeof (RhythmDBTreeSnapshotHeader) ||
+	    memcmp (header->magic, RHYTHMDB_TREE_SNAPSHOT_MAGIC, sizeof (header->magic)) != 0 ||
+	    header->byte_order != RHYTHMDB_TREE_SNAPSHOT_BYTE_ORDER ||
+	    header->version != RHYTHMDB_TREE_SNAPSHOT_VERSION ||
+	    header->xml_version != RHYTHMDB_TREE_XML_VERSION_INT ||
+	    header->entry_size != sizeof (RhythmDBTreeSnapshotEntry)) {
+		rb_debug ("database snapshot %s is not usable", path);
+		goto out;
+	}
 
-	sax_handler->startElement = (startElementSAXFunc) rhythmdb_tree_parser_start_element;
-	sax_handler->endElement = (endElementSAXFunc) rhythmdb_tree_parser_end_element;
-	sax_handler->characters = (charactersSAXFunc) rhythmdb_tree_parser_characters;
+	if (header->xml_size != (guint64) xml_stat.st_size ||
+	    header->xml_mtime != (guint64) xml_stat.st_mtime) {
+		rb_debug ("database snapshot %s is out of date", path);
+		goto out;
+	}
 
-	ctx->state = RHYTHMDB_TREE_PARSER_STATE_START;
-	ctx->db = db;
-	ctx->cancel = cancel;
-	ctx->buf = g_string_sized_new (RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE);
-	ctx->error = &local_error;
-
-	g_object_get (G_OBJECT (db), "name", &name, NULL);
-
-	if (g_file_test (name, G_FILE_TEST_EXISTS)) {
-		ctxt = xmlCreateFileParserCtxt (name);
-		ctx->xmlctx = ctxt;
-		xmlFree (ctxt->sax);
-		ctxt->userData = ctx;
-		ctxt->sax = sax_handler;
-		xmlParseDocument (ctxt);
-		ctxt->sax = NULL;
-		xmlFreeParserCtxt (ctxt);
+	if (snapshot_reader_validate (&reader, length) == FALSE) {
+		g_warning ("Database snapshot %s is corrupt, ignoring it", path);
+		goto out;
+	}
 
-		if (ctx->batch_count)
-			rhythmdb_commit (RHYTHMDB (ctx->db));
+	/* all entry types have to be registered already; otherwise, let
+	 * the XML parser deal with unknown entries.
+	 */
+	reader.types = g_new0 (RhythmDBEntryType *, header->n_types);
+	for (i = 0; i < header->n_types; i++) {
+		const char *typename = reader.string_data + reader.string_offsets[reader.type_names[i]];
+
+		reader.types[i] = rhythmdb_entry_type_get_by_name (RHYTHMDB (db), typename);
+		if (reader.types[i] == NULL) {
+			rb_debug ("snapshot contains entries of unknown type %s", typename);
+			goto out;
+		}
 	}
 
+	rb_debug ("loading %u entries from database snapshot %s", header->n_entries, path);
+	reader.strings = g_new0 (RBRefString *, header->n_strings);
 	ret = TRUE;
-	if (local_error != NULL) {
-		g_propagate_error (error, local_error);
-		ret = FALSE;
-	}
 
-	g_string_free (ctx->buf, TRUE);
-	g_free (name);
-	g_free (sax_handler);
-	g_free (ctx);
+	for (i = 0; i < header->n_groups; i++) {
+		const RhythmDBTreeSnapshotGroup *group = &reader.groups[i];
+		RhythmDBEntryType *type = reader.types[group->type];
+		RhythmDBTreeShard *shard = get_shard (db, type);
+		RhythmDBTreeProperty *album = NULL;
+		guint32 e;
 
-	return ret;
-}
+		if (g_cancellable_is_cancelled (cancel))
+			break;
 
-struct RhythmDBTreeSaveContext
-{
-	RhythmDBTree *db;
-	FILE *handle;
-	char *error;
-};
+		for (e = group->first_entry; e < group->first_entry + group->n_entries; e++) {
+			RhythmDBEntry *entry;
 
-#ifdef HAVE_GNU_FWRITE_UNLOCKED
-#define RHYTHMDB_FWRITE_REAL fwrite_unlocked
-#define RHYTHMDB_FPUTC_REAL fputc_unlocked
-#else
-#define RHYTHMDB_FWRITE_REAL fwrite
-#define RHYTHMDB_FPUTC_REAL fputc
-#endif
+			entry = snapshot_reader_create_entry (db, &reader, type, &reader.entries[e]);
 
-#define RHYTHMDB_FWRITE(w,x,len,handle,error) do {			\
-	if (error == NULL) {						\
-		if (RHYTHMDB_FWRITE_REAL (w,x,len,handle) != len) {	\
-			error = g_strdup (g_strerror (errno));		\
-		}							\
-	}								\
-} while (0)
+			g_static_rw_lock_writer_lock (&db->priv->entries_lock);
+			if (g_hash_table_lookup (db->priv->entries, entry->location) != NULL) {
+				g_static_rw_lock_writer_unlock (&db->priv->entries_lock);
+				rb_debug ("found entry with duplicate location %s in snapshot",
+					  rb_refstring_get (entry->location));
+				rhythmdb_entry_unref (entry);
+				continue;
+			}
 
-#define RHYTHMDB_FPUTC(x,handle,error) do {				\
-	if (error == NULL) {						\
-		if (RHYTHMDB_FPUTC_REAL (x,handle) == EOF) {		\
-			error = g_strdup (g_strerror (errno));		\
-		}							\
-	}								\
-} while (0)
+			/* the hierarchy is looked up once per album */
+			g_static_rw_lock_writer_lock (&shard->lock);
+			if (album == NULL) {
+				RhythmDBTreeProperty *genre;
+				RhythmDBTreeProperty *artist;
 
-#define RHYTHMDB_FWRITE_STATICSTR(STR, HANDLE, ERROR) RHYTHMDB_FWRITE(STR, 1, sizeof(STR)-1, HANDLE, ERROR)
+				genre = get_or_create_genre (db, type, entry->genre);
+				artist = get_or_create_artist (db, genre, entry->artist);
+				album = get_or_create_album (db, artist, entry->album);
+			}
+			g_hash_table_insert (album->children, entry, NULL);
+			entry->data = album;
+			count_tree_entry (album, 1);
+			g_static_rw_lock_writer_unlock (&shard->lock);
+
+			search_index_add_entry (db, entry);
+			trigram_index_add_entry (db, entry);
+			range_index_add_entry (db, entry);
+
+			g_hash_table_insert (db->priv->entries, entry->location, entry);
+			g_hash_table_insert (db->priv->entry_ids, GINT_TO_POINTER (entry->id), entry);
+			entry->flags &= ~RHYTHMDB_ENTRY_TREE_LOADING;
+			g_static_rw_lock_writer_unlock (&db->priv->entries_lock);
+
+			rhythmdb_entry_insert (RHYTHMDB (db), entry);
+			if (++batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+				rhythmdb_commit (RHYTHMDB (db));
+				batch_count = 0;
+			}
+		}
+	}
 
-static void
-write_elt_name_open (struct RhythmDBTreeSaveContext *ctx,
-		     const xmlChar *elt_name)
-{
-	RHYTHMDB_FWRITE_STATICSTR ("    <", ctx->handle, ctx->error);
-	RHYTHMDB_FWRITE (elt_name, 1, xmlStrlen (elt_name), ctx->handle, ctx->error);
-	RHYTHMDB_FPUTC ('>', ctx->handle, ctx->error);
+	if (batch_count)
+		rhythmdb_commit (RHYTHMDB (db));
+
+out:
+	if (reader.strings != NULL) {
+		for (i = 0; i < header->n_strings; i++)
+			rb_refstring_unref (reader.strings[i]);
+		g_free (reader.strings);
+	}
+	g_free (reader.types);
+	g_mapped_file_free (mapped);
+	g_free (path);
+	return ret;
 }
 
-static void
-write_elt_name_close (struct RhythmDBTreeSaveContext *ctx,
-		      const xmlChar *elt_name)
+/*
+ * Change journal.
+ *
+ * Rather than rewriting the whole XML file every time the database is
+ * saved, changes are appended to a journal (<name>.journal) as they are
+ * made: property and keyword changes as they are applied to entries that
+ * have already been committed, new entries when they are added, and
+ * deletions.  Records use the same XML representation as the main file,
+ * and the journal starts with a header identifying the XML file it
+ * applies to, by size and modification time.
+ *
+ * On load, the journal is replayed on top of the XML file (or snapshot).
+ * Records are idempotent, so replaying records that are already reflected
+ * in the XML file is harmless, and an incomplete record at the end of the
+ * journal (from a crash while it was being written) is discarded.
+ *
+ * Saving the database only flushes the journal to disk, until it grows
+ * past a fraction of the size of the XML file; then the XML file is
+ * rewritten and the journal is restarted, carrying over any records
+ * appended while the XML file was being written.
+ */
+
+#define RHYTHMDB_TREE_JOURNAL_MIN_COMPACT_SIZE	(1024 * 1024)
+#define RHYTHMDB_TREE_JOURNAL_COMPACT_RATIO	4
+
+static char *
+rhythmdb_tree_journal_path (const char *name)
 {
-	RHYTHMDB_FWRITE_STATICSTR ("</", ctx->handle, ctx->error);
-	RHYTHMDB_FWRITE (elt_name, 1, xmlStrlen (elt_name), ctx->handle, ctx->error);
-	RHYTHMDB_FWRITE_STATICSTR (">\n", ctx->handle, ctx->error);
+	return g_strconcat (name, ".journal", NULL);
 }
 
+/* identifies the XML file a journal applies to; a database that hasn't
+ * been saved yet is identified by zeroes.
+ */
 static void
-save_entry_string (struct RhythmDBTreeSaveContext *ctx,
-		   const xmlChar *elt_name,
-		   const char *str)
+journal_base_identity (const char *name,
+		       guint64 *size,
+		       guint64 *mtime)
 {
-	xmlChar *encoded;
+	struct stat xml_stat;
 
-	g_return_if_fail (str != NULL);
-	write_elt_name_open (ctx, elt_name);
-	encoded	= xmlEncodeEntitiesReentrant (NULL, BAD_CAST str);
-	RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx->handle, ctx->error);
-	g_free (encoded);
-	write_elt_name_close (ctx, elt_name);
+	if (stat (name, &xml_stat) < 0) {
+		*size = 0;
+		*mtime = 0;
+	} else {
+		*size = xml_stat.st_size;
+		*mtime = xml_stat.st_mtime;
+	}
 }
 
-static void
-save_entry_string_if_set (struct RhythmDBTreeSaveContext *ctx,
-			  const xmlChar *elt_name,
-			  const char *str)
+struct RhythmDBTreeLoadContext
 {
-	if (str == NULL || str[0] == '\0')
-		return;
-	save_entry_string (ctx, elt_name, str);
-}
+	RhythmDBTree *db;
+	xmlParserCtxtPtr xmlctx;
+	GCancellable *cancel;
+	enum {
+		RHYTHMDB_TREE_PARSER_STATE_START,
+		RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB,
+		RHYTHMDB_TREE_PARSER_STATE_ENTRY,
+		RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY,
+		RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD,
+		RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY,
+		RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY,
+		RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE,
+		RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE_PROPERTY,
+		RHYTHMDB_TREE_PARSER_STATE_JOURNAL_KEYWORD,
+		RHYTHMDB_TREE_PARSER_STATE_JOURNAL_DELETE,
+		RHYTHMDB_TREE_PARSER_STATE_END,
+	} state;
+	guint in_unknown_elt;
+	RhythmDBEntry *entry;
+	RhythmDBUnknownEntry *unknown_entry;
+	GString *buf;
+	RhythmDBPropType propid;
+	gint batch_count;
+	GError **error;
 
-static void
-save_entry_int (struct RhythmDBTreeSaveContext *ctx,
-		const xmlChar *elt_name,
-		int num)
+	/* updating */
+	guint has_date : 1;
+	guint canonicalise_uris : 1;
+	guint reload_all_metadata : 1;
+	guint update_podcasts : 1;
+	guint update_local_mountpoints : 1;
+
+	/* replaying the journal */
+	guint journal : 1;
+	guint journal_stale : 1;
+	guint journal_keyword_add : 1;
+	guint64 journal_base_size;
+	guint64 journal_base_mtime;
+	long journal_valid_end;
+
+	/* parsing a chunk of the file on a worker thread */
+	guint worker : 1;
+	GPtrArray *loaded_entries;
+	GList *loaded_unknown_entries;
+};
+
+/* Returns the version as an int, multiplied by 100,
+ * eg. "1.4" becomes 140 */
+static int
+version_to_int (const char *version)
 {
-	char buf[92];
-	if (num == 0)
-		return;
-	write_elt_name_open (ctx, elt_name);
-	g_snprintf (buf, sizeof (buf), "%d", num);
-	RHYTHMDB_FWRITE (buf, 1, strlen (buf), ctx->handle, ctx->error);
-	write_elt_name_close (ctx, elt_name);
+	float ver;
+	char *eptr;
+
+	ver = g_ascii_strtod (version, &eptr);
+	if (eptr == version) {
+		return (int) (1.0 * 100);
+	}
+	return (int)roundf(ver * 100);
 }
 
 static void
-save_entry_ulong (struct RhythmDBTreeSaveContext *ctx,
-		  const xmlChar *elt_name,
-		  gulong num,
-		  gboolean save_zeroes)
+rhythmdb_tree_parser_journal_header (struct RhythmDBTreeLoadContext *ctx,
+				     const char **attrs)
 {
-	char buf[92];
+	int version = 0;
+	guint64 size = G_MAXUINT64;
+	guint64 mtime = G_MAXUINT64;
+
+	for (; *attrs; attrs +=2) {
+		if (!strcmp (*attrs, "version")) {
+			version = version_to_int (*(attrs+1));
+		} else if (!strcmp (*attrs, "size")) {
+			size = g_ascii_strtoull (*(attrs+1), NULL, 10);
+		} else if (!strcmp (*attrs, "mtime")) {
+			mtime = g_ascii_strtoull (*(attrs+1), NULL, 10);
+		}
+	}
 
-	if (num == 0 && !save_zeroes)
+	if (version != RHYTHMDB_TREE_XML_VERSION_INT ||
+	    size != ctx->journal_base_size ||
+	    mtime != ctx->journal_base_mtime) {
+		rb_debug ("journal was written for a different database file, ignoring it");
+		ctx->journal_stale = TRUE;
+		xmlStopParser (ctx->xmlctx);
 		return;
-	write_elt_name_open (ctx, elt_name);
-	g_snprintf (buf, sizeof (buf), "%lu", num);
-	RHYTHMDB_FWRITE (buf, 1, strlen (buf), ctx->handle, ctx->error);
-	write_elt_name_close (ctx, elt_name);
+	}
+
+	ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
+	ctx->journal_valid_end = xmlByteConsumed (ctx->xmlctx);
+}
+
+static RhythmDBEntry *
+rhythmdb_tree_parser_journal_entry (struct RhythmDBTreeLoadContext *ctx,
+				    const char **attrs)
+{
+	for (; *attrs; attrs +=2) {
+		if (!strcmp (*attrs, "location"))
+			return rhythmdb_entry_lookup_by_location (RHYTHMDB (ctx->db), *(attrs+1));
+	}
+	return NULL;
 }
 
+/* called at the end of each top level element; when replaying the journal,
+ * this marks the end of the last complete record.
+ */
 static void
-save_entry_boolean (struct RhythmDBTreeSaveContext *ctx,
-		    const xmlChar *elt_name,
-		    gboolean val)
+rhythmdb_tree_parser_record_done (struct RhythmDBTreeLoadContext *ctx)
 {
-	save_entry_ulong (ctx, elt_name, val ? 1 : 0, FALSE);
+	if (ctx->journal)
+		ctx->journal_valid_end = xmlByteConsumed (ctx->xmlctx);
 }
 
+/* inserts an entry read from the XML file, merging it with any existing
+ * entry with the same location.
+ */
 static void
-save_entry_uint64 (struct RhythmDBTreeSaveContext *ctx,
-		   const xmlChar *elt_name,
-		   guint64 num)
+rhythmdb_tree_load_insert_entry (struct RhythmDBTreeLoadContext *ctx,
+				 RhythmDBEntry *entry)
 {
-	char buf[92];
+	RhythmDBEntry *existing;
 
-	if (num == 0)
+	if (entry->location == NULL || rb_refstring_get (entry->location)[0] == '\0') {
+		rb_debug ("found entry without location");
+		rhythmdb_entry_unref (entry);
 		return;
+	}
 
-	write_elt_name_open (ctx, elt_name);
-	g_snprintf (buf, sizeof (buf), "%" G_GUINT64_FORMAT, num);
-	RHYTHMDB_FWRITE (buf, 1, strlen (buf), ctx->handle, ctx->error);
-	write_elt_name_close (ctx, elt_name);
+	g_static_rw_lock_writer_lock (&ctx->db->priv->entries_lock);
+	existing = g_hash_table_lookup (ctx->db->priv->entries, entry->location);
+	if (existing == NULL) {
+		rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), entry);
+		rhythmdb_entry_insert (RHYTHMDB (ctx->db), entry);
+		if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+			rhythmdb_commit (RHYTHMDB (ctx->db));
+			ctx->batch_count = 0;
+		}
+	} else if (ctx->journal) {
+		/* the entry was saved in the XML file after this
+		 * record was written, or added by an earlier record.
+		 */
+		rhythmdb_entry_unref (entry);
+	} else if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST &&
+		   existing->type == RHYTHMDB_ENTRY_TYPE_SONG) {
+		rb_debug ("found song entry with duplicate location for Podcast post %s. merging metadata",
+			  rb_refstring_get (entry->location));
+
+		entry->play_count += existing->play_count;
+		if (entry->last_played < existing->last_played)
+			entry->last_played = existing->last_played;
+
+		/* Remove the song entry,
+		 * deleting requires relinquishing the locks */
+		g_static_rw_lock_writer_unlock (&ctx->db->priv->entries_lock);
+		rhythmdb_entry_delete (RHYTHMDB(ctx->db), existing);
+		g_static_rw_lock_writer_lock (&ctx->db->priv->entries_lock);
+		rhythmdb_commit (RHYTHMDB (ctx->db));
+
+		/* And add the Podcast entry to the database */
+		rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), entry);
+		rhythmdb_entry_insert (RHYTHMDB (ctx->db), entry);
+		if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+			rhythmdb_commit (RHYTHMDB (ctx->db));
+			ctx->batch_count = 0;
+		}
+	} else {
+		rb_debug ("found entry with duplicate location %s. merging metadata",
+			  rb_refstring_get (entry->location));
+
+		/* the merged values are sorted differently, so take the
+		 * existing entry out of the range indexes while changing them.
+		 */
+		range_index_remove_entry (ctx->db, existing);
+
+		existing->play_count += entry->play_count;
+
+		if (existing->rating < 0.01)
+			existing->rating = entry->rating;
+		else if (entry->rating > 0.01)
+			existing->rating = (existing->rating + entry->rating) / 2;
+
+		if (entry->last_played > existing->last_played)
+			existing->last_played = entry->last_played;
+
+		if (entry->first_seen < existing->first_seen)
+			existing->first_seen = entry->first_seen;
+
+		if (entry->last_seen > existing->last_seen)
+			existing->last_seen = entry->last_seen;
+
+		range_index_add_entry (ctx->db, existing);
+
+		rhythmdb_entry_unref (entry);
+	}
+	g_static_rw_lock_writer_unlock (&ctx->db->priv->entries_lock);
 }
 
 static void
-save_entry_double (struct RhythmDBTreeSaveContext *ctx,
-		   const xmlChar *elt_name,
-		   double num)
+rhythmdb_tree_load_add_unknown_entry (RhythmDBTree *db,
+				      RhythmDBUnknownEntry *unknown_entry)
 {
-	char buf[G_ASCII_DTOSTR_BUF_SIZE+1];
+	GList *entry_list;
 
-	if (num > -0.001 && num < 0.001)
-		return;
-
-	write_elt_name_open (ctx, elt_name);
-	g_ascii_dtostr (buf, sizeof (buf), num);
-	RHYTHMDB_FWRITE (buf, 1, strlen (buf), ctx->handle, ctx->error);
-	write_elt_name_close (ctx, elt_name);
+	g_static_rw_lock_writer_lock (&db->priv->entries_lock);
+	entry_list = g_hash_table_lookup (db->priv->unknown_entry_types, unknown_entry->typename);
+	entry_list = g_list_prepend (entry_list, unknown_entry);
+	g_hash_table_insert (db->priv->unknown_entry_types, unknown_entry->typename, entry_list);
+	g_static_rw_lock_writer_unlock (&db->priv->entries_lock);
 }
 
-/* This code is intended to be highly optimized.  This came at a small
- * readability cost.  Sorry about that.
- */
 static void
-save_entry (RhythmDBTree *db,
-	    RhythmDBEntry *entry,
-	    struct RhythmDBTreeSaveContext *ctx)
+rhythmdb_tree_parser_start_element (struct RhythmDBTreeLoadContext *ctx,
+				    const char *name,
+				    const char **attrs)
 {
-	RhythmDBPropType i;
-	RhythmDBPodcastFields *podcast = NULL;
-	xmlChar *encoded;
-	GList *keywords, *l;
+	if (g_cancellable_is_cancelled (ctx->cancel)) {
+		xmlStopParser (ctx->xmlctx);
+		return;
+	}
 
-	if (ctx->error)
+	if (ctx->in_unknown_elt) {
+		ctx->in_unknown_elt++;
 		return;
+	}
 
-	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED ||
-	    entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST)
-		podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
+	switch (ctx->state)
+	{
+	case RHYTHMDB_TREE_PARSER_STATE_START:
+	{
+		if (ctx->journal) {
+			if (!strcmp (name, "rhythmdb-journal"))
+				rhythmdb_tree_parser_journal_header (ctx, attrs);
+			else
+				ctx->in_unknown_elt++;
+		} else if (!strcmp (name, "rhythmdb")) {
+			ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
+			for (; *attrs; attrs +=2) {
+				if (!strcmp (*attrs, "version")) {
+					const char *version = *(attrs+1);
 
-	RHYTHMDB_FWRITE_STATICSTR ("  <entry type=\"", ctx->handle, ctx->error);
-	encoded	= xmlEncodeEntitiesReentrant (NULL, BAD_CAST rhythmdb_entry_type_get_name (entry->type));
-	RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx->handle, ctx->error);
-	g_free (encoded);
+					rb_debug ("loading database version %s (%d)", version, version_to_int (version));
+					switch (version_to_int (version)) {
+					case 100:
+					case 110:
+						rb_debug ("old version of rhythmdb, performing URI canonicalisation for all entries (DB version 1.0 or 1.1)");
+						ctx->canonicalise_uris = TRUE;
+					case 120:
+						rb_debug ("reloading all file metadata to get MusicBrainz tags (DB version 1.2)");
+						ctx->reload_all_metadata = TRUE;
+					case 130:
+					case 140:
+						/* Avoid being warned twice for very old DBs */
+						if (ctx->canonicalise_uris == FALSE) {
+							rb_debug ("old version of rhythmdb, performing URI canonicalisation for all entries (DB version %s)", version);
+							ctx->canonicalise_uris = TRUE;
+						}
+					case 150:
+						rb_debug ("Upgrade Podcasts remote vs. local locations");
+						ctx->update_podcasts = TRUE;
+					case 160:
+						rb_debug ("reloading all file metadata to get sortnames, album artist, comments, bpm and updating mountpoints");
+						ctx->reload_all_metadata = TRUE;
+						ctx->update_local_mountpoints = TRUE;
+					case RHYTHMDB_TREE_XML_VERSION_INT:
+						/* current version */
+						break;
+					default:
+						if (version_to_int (version) > RHYTHMDB_TREE_XML_VERSION_INT) {
+							g_set_error (ctx->error,
+								     RHYTHMDB_TREE_ERROR,
+								     RHYTHMDB_TREE_ERROR_DATABASE_TOO_NEW,
+								     _("The database was created by a later version of Rhythmbox."
+								       "  This version of Rhythmbox cannot read the database."));
+							xmlStopParser (ctx->xmlctx);
+						}
+					}
+				} else {
+					g_assert_not_reached ();
+				}
+			}
 
-	RHYTHMDB_FWRITE_STATICSTR ("\">\n", ctx->handle, ctx->error);
+		} else {
+			ctx->in_unknown_elt++;
+		}
 
-	/* Skip over the first property - the type */
-	for (i = 1; i < RHYTHMDB_NUM_PROPERTIES; i++) {
-		const xmlChar *elt_name;
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB:
+	{
+		if (!strcmp (name, "entry")) {
+			RhythmDBEntryType *type = NULL;
+			const char *typename = NULL;
+			for (; *attrs; attrs +=2) {
+				if (!strcmp (*attrs, "type")) {
+					typename = *(attrs+1);
+					type = rhythmdb_entry_type_get_by_name (RHYTHMDB (ctx->db), typename);
+					break;
+				}
+			}
 
-		if (ctx->error)
-			return;
+			g_assert (typename);
+			if (type != NULL) {
+				ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY;
+				ctx->entry = rhythmdb_entry_allocate (RHYTHMDB (ctx->db), type);
+				ctx->entry->flags |= RHYTHMDB_ENTRY_TREE_LOADING;
+				ctx->has_date = FALSE;
+			} else if (ctx->journal) {
+				/* entries of unknown types are kept in the XML file */
+				ctx->in_unknown_elt++;
+			} else {
+				rb_debug ("reading unknown entry");
+				ctx->state = RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY;
+				ctx->unknown_entry = g_new0 (RhythmDBUnknownEntry, 1);
+				ctx->unknown_entry->typename = rb_refstring_new (typename);
+			}
+		} else if (ctx->journal && !strcmp (name, "change")) {
+			ctx->entry = rhythmdb_tree_parser_journal_entry (ctx, attrs);
+			if (ctx->entry != NULL)
+				ctx->state = RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE;
+			else
+				ctx->in_unknown_elt++;
+		} else if (ctx->journal && (!strcmp (name, "keyword-add") || !strcmp (name, "keyword-remove"))) {
+			ctx->entry = rhythmdb_tree_parser_journal_entry (ctx, attrs);
+			if (ctx->entry != NULL) {
+				ctx->state = RHYTHMDB_TREE_PARSER_STATE_JOURNAL_KEYWORD;
+				ctx->journal_keyword_add = (strcmp (name, "keyword-add") == 0);
+				g_string_truncate (ctx->buf, 0);
+			} else {
+				ctx->in_unknown_elt++;
+			}
+		} else if (ctx->journal && !strcmp (name, "delete")) {
+			ctx->entry = rhythmdb_tree_parser_journal_entry (ctx, attrs);
+			ctx->state = RHYTHMDB_TREE_PARSER_STATE_JOURNAL_DELETE;
+		} else if (ctx->journal && !strcmp (name, "delete-type")) {
+			for (; *attrs; attrs +=2) {
+				if (!strcmp (*attrs, "type")) {
+					RhythmDBEntryType *type;
 
-		elt_name = rhythmdb_nice_elt_name_from_propid ((RhythmDB *) ctx->db, i);
+					type = rhythmdb_entry_type_get_by_name (RHYTHMDB (ctx->db), *(attrs+1));
+					if (type != NULL)
+						rhythmdb_entry_delete_by_type (RHYTHMDB (ctx->db), type);
+					break;
+				}
+			}
+			ctx->in_unknown_elt++;
+		} else {
+			ctx->in_unknown_elt++;
+		}
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_ENTRY:
+		if (strcmp (name, "keyword") == 0) {
+			ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD;
+		} else {
+			int val = rhythmdb_propid_from_nice_elt_name (RHYTHMDB (ctx->db), BAD_CAST name);
+			if (val < 0) {
+				ctx->in_unknown_elt++;
+				break;
+			}
 
-		switch (i) {
-		case RHYTHMDB_PROP_TYPE:
-			break;
-		case RHYTHMDB_PROP_ENTRY_ID:
+			ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY;
+			ctx->propid = val;
+		}
+		g_string_truncate (ctx->buf, 0);
+		break;
+	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY:
+	{
+		RhythmDBUnknownEntryProperty *prop;
+
+		prop = g_new0 (RhythmDBUnknownEntryProperty, 1);
+		prop->name = rb_refstring_new (name);
+
+		ctx->unknown_entry->properties = g_list_prepend (ctx->unknown_entry->properties, prop);
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY;
+		g_string_truncate (ctx->buf, 0);
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE:
+	{
+		int val = rhythmdb_propid_from_nice_elt_name (RHYTHMDB (ctx->db), BAD_CAST name);
+		if (val < 0) {
+			ctx->in_unknown_elt++;
 			break;
-		case RHYTHMDB_PROP_TITLE:
-			save_entry_string(ctx, elt_name, rb_refstring_get (entry->title));
+		}
+
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE_PROPERTY;
+		ctx->propid = val;
+		g_string_truncate (ctx->buf, 0);
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY:
+	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY:
+	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD:
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE_PROPERTY:
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_KEYWORD:
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_DELETE:
+	case RHYTHMDB_TREE_PARSER_STATE_END:
+	break;
+	}
+}
+
+static void
+rhythmdb_tree_parser_end_element (struct RhythmDBTreeLoadContext *ctx,
+				  const char *name)
+{
+	if (g_cancellable_is_cancelled (ctx->cancel)) {
+		xmlStopParser (ctx->xmlctx);
+		return;
+	}
+
+	if (ctx->in_unknown_elt) {
+		ctx->in_unknown_elt--;
+		if (ctx->in_unknown_elt == 0 && ctx->state == RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB)
+			rhythmdb_tree_parser_record_done (ctx);
+		return;
+	}
+
+	switch (ctx->state)
+	{
+	case RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB:
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_END;
+		break;
+	case RHYTHMDB_TREE_PARSER_STATE_ENTRY:
+	{
+		if (!ctx->has_date || ctx->reload_all_metadata) {
+			/* there is no date metadata, so this is from an old version
+			 * reset the last-modified timestamp, so that the file is re-read
+			 */
+			rb_debug ("pre-Date entry found, causing re-read");
+			ctx->entry->mtime = 0;
+		}
+		if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED) {
+			RhythmDBPodcastFields *podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (ctx->entry, RhythmDBPodcastFields);
+			/* Handle upgrades from 0.9.2.
+			 * Previously, last-seen for podcast feeds was the time of the last post,
+			 * and post-time was unused.  Now, we want last-seen to be the time we
+			 * last updated the feed, and post-time to be the time of the last post.
+			 */
+			if (podcast->post_time == 0) {
+				podcast->post_time = ctx->entry->last_seen;
+			}
+		}
+		if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST) {
+			/* When upgrading Podcasts from 0.11.6 and prior, we need to
+			 * swap mountpoint and location if there is a mountpoint */
+			if (ctx->update_podcasts && ctx->entry->mountpoint != NULL) {
+				RBRefString *tmp;
+
+				rb_debug ("pre-Podcast avoidance found, swapping location/mountpoint");
+
+				tmp = ctx->entry->location;
+				ctx->entry->location = ctx->entry->mountpoint;
+				ctx->entry->mountpoint = tmp;
+			}
+		}
+		if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_SONG) {
+			/* Since we now care about mountpoints for all local entries, not just
+			 * those on things that actually get mounted and unmounted, we need to
+			 * ensure they're all correct.
+			 */
+			if (ctx->update_local_mountpoints) {
+				const char *loc = rb_refstring_get (ctx->entry->location);
+				if (loc == NULL || g_str_has_prefix (loc, "file:///")) {
+					char *nmp;
+					nmp = rb_uri_get_mount_point (loc);
+					if (ctx->entry->mountpoint != NULL) {
+						rb_refstring_unref (ctx->entry->mountpoint);
+						ctx->entry->mountpoint = NULL;
+					}
+
+					if (nmp != NULL) {
+						ctx->entry->mountpoint = rb_refstring_new (nmp);
+						g_free (nmp);
+					}
+				}
+			}
+		}
+
+		if (ctx->worker) {
+			/* inserted later, in file order, by the loading thread */
+			g_ptr_array_add (ctx->loaded_entries, ctx->entry);
+		} else {
+			rhythmdb_tree_load_insert_entry (ctx, ctx->entry);
+		}
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
+		ctx->entry = NULL;
+		rhythmdb_tree_parser_record_done (ctx);
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY:
+	{
+		rb_debug ("finished reading unknown entry");
+		ctx->unknown_entry->properties = g_list_reverse (ctx->unknown_entry->properties);
+
+		if (ctx->worker)
+			ctx->loaded_unknown_entries = g_list_prepend (ctx->loaded_unknown_entries, ctx->unknown_entry);
+		else
+			rhythmdb_tree_load_add_unknown_entry (ctx->db, ctx->unknown_entry);
+
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
+		ctx->unknown_entry = NULL;
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY:
+	{
+		GValue value = {0,};
+		gboolean set = FALSE;
+		gboolean skip = FALSE;
+
+		/* special case some properties for upgrade handling etc. */
+		switch (ctx->propid) {
+		case RHYTHMDB_PROP_DATE:
+			ctx->has_date = TRUE;
 			break;
-		case RHYTHMDB_PROP_ALBUM:
-			save_entry_string(ctx, elt_name, rb_refstring_get (entry->album));
+		case RHYTHMDB_PROP_LOCATION:
+			if (ctx->canonicalise_uris) {
+				char *canon = rb_canonicalise_uri (ctx->buf->str);
+
+				g_value_init (&value, G_TYPE_STRING);
+				g_value_take_string (&value, canon);
+				set = TRUE;
+			}
 			break;
-		case RHYTHMDB_PROP_ARTIST:
-			save_entry_string(ctx, elt_name, rb_refstring_get (entry->artist));
-			break;
-		case RHYTHMDB_PROP_ALBUM_ARTIST:
-			save_entry_string_if_set(ctx, elt_name, rb_refstring_get (entry->album_artist));
-			break;
-		case RHYTHMDB_PROP_GENRE:
-			save_entry_string(ctx, elt_name, rb_refstring_get (entry->genre));
-			break;
-		case RHYTHMDB_PROP_COMMENT:
-			save_entry_string_if_set(ctx, elt_name, rb_refstring_get (entry->comment));
-			break;
-		case RHYTHMDB_PROP_MUSICBRAINZ_TRACKID:
-			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->musicbrainz_trackid));
-			break;
-		case RHYTHMDB_PROP_MUSICBRAINZ_ARTISTID:
-			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->musicbrainz_artistid));
-			break;
-		case RHYTHMDB_PROP_MUSICBRAINZ_ALBUMID:
-			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->musicbrainz_albumid));
-			break;
-		case RHYTHMDB_PROP_MUSICBRAINZ_ALBUMARTISTID:
-			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->musicbrainz_albumartistid));
-			break;
-		case RHYTHMDB_PROP_ARTIST_SORTNAME:
-			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->artist_sortname));
-			break;
-		case RHYTHMDB_PROP_ALBUM_SORTNAME:
-			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->album_sortname));
-			break;
-		case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME:
-			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->album_artist_sortname));
-			break;
-		case RHYTHMDB_PROP_TRACK_NUMBER:
-			save_entry_ulong (ctx, elt_name, entry->tracknum, FALSE);
-			break;
-		case RHYTHMDB_PROP_DISC_NUMBER:
-			save_entry_ulong (ctx, elt_name, entry->discnum, FALSE);
-			break;
-		case RHYTHMDB_PROP_DATE:
-			if (g_date_valid (&entry->date))
-				save_entry_ulong (ctx, elt_name, g_date_get_julian (&entry->date), TRUE);
-			else
-				save_entry_ulong (ctx, elt_name, 0, TRUE);
-			break;
-		case RHYTHMDB_PROP_DURATION:
-			save_entry_ulong (ctx, elt_name, entry->duration, FALSE);
-			break;
-		case RHYTHMDB_PROP_BITRATE:
-			save_entry_int(ctx, elt_name, entry->bitrate);
-			break;
-		case RHYTHMDB_PROP_LOCATION:
-			save_entry_string(ctx, elt_name, rb_refstring_get (entry->location));
-			break;
-		case RHYTHMDB_PROP_BPM:
-			save_entry_double(ctx, elt_name, entry->bpm);
+			/* drop replaygain properties */
+		case RHYTHMDB_PROP_TRACK_GAIN:
+		case RHYTHMDB_PROP_TRACK_PEAK:
+		case RHYTHMDB_PROP_ALBUM_GAIN:
+		case RHYTHMDB_PROP_ALBUM_PEAK:
+			skip = TRUE;
 			break;
-		case RHYTHMDB_PROP_MOUNTPOINT:
-			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->mountpoint));
+		default:
 			break;
-		case RHYTHMDB_PROP_FILE_SIZE:
-			save_entry_uint64(ctx, elt_name, entry->file_size);
+		}
+
+		if (!skip) {
+			if (!set) {
+				rhythmdb_read_encoded_property (RHYTHMDB (ctx->db), ctx->buf->str, ctx->propid, &value);
+			}
+
+			rhythmdb_entry_set_internal (RHYTHMDB (ctx->db), ctx->entry, FALSE, ctx->propid, &value);
+			g_value_unset (&value);
+		}
+
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY;
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD:
+	{
+		RBRefString *keyword;
+
+		keyword = rb_refstring_new (ctx->buf->str);
+		rhythmdb_entry_keyword_add (RHYTHMDB(ctx->db), ctx->entry, keyword);
+		rb_refstring_unref (keyword);
+
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY;
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY:
+	{
+		RhythmDBUnknownEntryProperty *prop;
+
+		g_assert (ctx->unknown_entry->properties);
+		prop = ctx->unknown_entry->properties->data;
+		g_assert (prop->value == NULL);
+		prop->value = rb_refstring_new (ctx->buf->str);
+		rb_debug ("unknown entry property: %s = %s", rb_refstring_get (prop->name), rb_refstring_get (prop->value));
+
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY;
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE:
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
+		ctx->entry = NULL;
+		rhythmdb_tree_parser_record_done (ctx);
+		break;
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE_PROPERTY:
+	{
+		GValue value = {0,};
+
+		rhythmdb_read_encoded_property (RHYTHMDB (ctx->db), ctx->buf->str, ctx->propid, &value);
+		rhythmdb_entry_set_internal (RHYTHMDB (ctx->db), ctx->entry, TRUE, ctx->propid, &value);
+		g_value_unset (&value);
+
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE;
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_KEYWORD:
+	{
+		RBRefString *keyword;
+
+		keyword = rb_refstring_new (ctx->buf->str);
+		if (ctx->journal_keyword_add)
+			rhythmdb_entry_keyword_add (RHYTHMDB (ctx->db), ctx->entry, keyword);
+		else
+			rhythmdb_entry_keyword_remove (RHYTHMDB (ctx->db), ctx->entry, keyword);
+		rb_refstring_unref (keyword);
+
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
+		ctx->entry = NULL;
+		rhythmdb_tree_parser_record_done (ctx);
+		break;
+	}
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_DELETE:
+		if (ctx->entry != NULL) {
+			/* commit any pending additions first, as the entry may be one of them */
+			if (ctx->batch_count) {
+				rhythmdb_commit (RHYTHMDB (ctx->db));
+				ctx->batch_count = 0;
+			}
+			rhythmdb_entry_delete (RHYTHMDB (ctx->db), ctx->entry);
+		}
+
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
+		ctx->entry = NULL;
+		rhythmdb_tree_parser_record_done (ctx);
+		break;
+	case RHYTHMDB_TREE_PARSER_STATE_START:
+	case RHYTHMDB_TREE_PARSER_STATE_END:
+	break;
+	}
+}
+
+static void
+rhythmdb_tree_parser_characters (struct RhythmDBTreeLoadContext *ctx,
+				 const char *data,
+				 guint len)
+{
+	if (g_cancellable_is_cancelled (ctx->cancel)) {
+		xmlStopParser (ctx->xmlctx);
+		return;
+	}
+
+	switch (ctx->state)
+	{
+	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY:
+	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD:
+	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY_PROPERTY:
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE_PROPERTY:
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_KEYWORD:
+		g_string_append_len (ctx->buf, data, len);
+		break;
+	case RHYTHMDB_TREE_PARSER_STATE_ENTRY:
+	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY:
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_CHANGE:
+	case RHYTHMDB_TREE_PARSER_STATE_JOURNAL_DELETE:
+	case RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB:
+	case RHYTHMDB_TREE_PARSER_STATE_START:
+	case RHYTHMDB_TREE_PARSER_STATE_END:
+	break;
+	}
+}
+
+/* replays the journal on top of the loaded database.  returns TRUE if the
+ * journal applies to the database and can be appended to.
+ */
+static gboolean
+rhythmdb_tree_replay_journal (RhythmDBTree *db,
+			      const char *name,
+			      GCancellable *cancel)
+{
+	xmlParserCtxtPtr ctxt;
+	xmlSAXHandlerPtr sax_handler;
+	struct RhythmDBTreeLoadContext *ctx;
+	GError *local_error = NULL;
+	char *path;
+	char *contents;
+	gsize length;
+	GString *data;
+	gboolean ret = FALSE;
+	long i;
+
+	path = rhythmdb_tree_journal_path (name);
+	if (g_file_get_contents (path, &contents, &length, NULL) == FALSE) {
+		g_free (path);
+		return FALSE;
+	}
+
+	/* the journal's root element is never closed, so records can be appended */
+	data = g_string_new_len (contents, length);
+	g_string_append (data, "</rhythmdb-journal>\n");
+	g_free (contents);
+
+	sax_handler = g_new0 (xmlSAXHandler, 1);
+	ctx = g_new0 (struct RhythmDBTreeLoadContext, 1);
+
+	sax_handler->startElement = (startElementSAXFunc) rhythmdb_tree_parser_start_element;
+	sax_handler->endElement = (endElementSAXFunc) rhythmdb_tree_parser_end_element;
+	sax_handler->characters = (charactersSAXFunc) rhythmdb_tree_parser_characters;
+
+	ctx->state = RHYTHMDB_TREE_PARSER_STATE_START;
+	ctx->db = db;
+	ctx->cancel = cancel;
+	ctx->buf = g_string_sized_new (RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE);
+	ctx->error = &local_error;
+	ctx->journal = TRUE;
+	journal_base_identity (name, &ctx->journal_base_size, &ctx->journal_base_mtime);
+
+	ctxt = xmlCreateMemoryParserCtxt (data->str, data->len);
+	ctx->xmlctx = ctxt;
+	xmlFree (ctxt->sax);
+	ctxt->userData = ctx;
+	ctxt->sax = sax_handler;
+	xmlParseDocument (ctxt);
+	ctxt->sax = NULL;
+	xmlFreeParserCtxt (ctxt);
+
+	/* an entry from an incomplete record */
+	if (ctx->entry != NULL &&
+	    (ctx->state == RHYTHMDB_TREE_PARSER_STATE_ENTRY ||
+	     ctx->state == RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY ||
+	     ctx->state == RHYTHMDB_TREE_PARSER_STATE_ENTRY_KEYWORD))
+		rhythmdb_entry_unref (ctx->entry);
+
+	rhythmdb_commit (RHYTHMDB (db));
+
+	if (ctx->journal_stale || ctx->journal_valid_end == 0 || g_cancellable_is_cancelled (cancel)) {
+		rb_debug ("not using journal %s", path);
+	} else {
+		ret = TRUE;
+		for (i = ctx->journal_valid_end; i < (long) length; i++) {
+			if (g_ascii_isspace (data->str[i]) == FALSE)
+				break;
+		}
+		if (i < (long) length) {
+			rb_debug ("discarding incomplete journal record at offset %ld", ctx->journal_valid_end);
+			if (truncate (path, ctx->journal_valid_end) < 0) {
+				g_warning ("Couldn't truncate %s: %s", path, g_strerror (errno));
+				ret = FALSE;
+			}
+		}
+	}
+
+	if (local_error != NULL)
+		g_error_free (local_error);
+	g_string_free (ctx->buf, TRUE);
+	g_string_free (data, TRUE);
+	g_free (sax_handler);
+	g_free (ctx);
+	g_free (path);
+	return ret;
+}
+
+/*
+ * Parallel loading.
+ *
+ * Most of the time spent loading a large XML database goes into parsing
+ * it and building entries, which only depends on the contents of each
+ * <entry> element.  So the file is split into chunks at entry boundaries,
+ * and a pool of threads parses the chunks (each wrapped in the XML
+ * declaration and root element from the start of the file) into arrays
+ * of entries.  The loading thread inserts the entries chunk by chunk, in
+ * file order, using the same code as the serial parser, so duplicate
+ * handling and everything else works out the same.
+ */
+
+#define RHYTHMDB_TREE_PARALLEL_MAX_THREADS		8
+#define RHYTHMDB_TREE_PARALLEL_CHUNKS_PER_THREAD	4
+#define RHYTHMDB_TREE_PARALLEL_MIN_CHUNK_SIZE		(64 * 1024)
+
+struct RhythmDBTreeLoadChunk
+{
+	const char *data;
+	gsize length;
+
+	GPtrArray *entries;
+	GList *unknown_entries;
+	GError *error;
+	gboolean failed;
+	gboolean done;
+};
+
+struct RhythmDBTreeParallelLoad
+{
+	RhythmDBTree *db;
+	GCancellable *cancel;
+	const char *header;
+	gsize header_length;
+
+	GMutex *lock;
+	GCond *cond;
+};
+
+static guint
+rhythmdb_tree_load_thread_count (RhythmDBTree *db)
+{
+	long n_cpus;
+
+	if (db->priv->load_threads > 0)
+		return db->priv->load_threads;
+
+	n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1)
+		return 1;
+	return MIN (n_cpus, RHYTHMDB_TREE_PARALLEL_MAX_THREADS);
+}
+
+static void
+rhythmdb_tree_parse_chunk (struct RhythmDBTreeLoadChunk *chunk,
+			   struct RhythmDBTreeParallelLoad *load)
+{
+	xmlParserCtxtPtr ctxt;
+	xmlSAXHandler sax_handler;
+	struct RhythmDBTreeLoadContext ctx;
+	static const char footer[] = "</rhythmdb>";
+
+	memset (&sax_handler, 0, sizeof (sax_handler));
+	sax_handler.startElement = (startElementSAXFunc) rhythmdb_tree_parser_start_element;
+	sax_handler.endElement = (endElementSAXFunc) rhythmdb_tree_parser_end_element;
+	sax_handler.characters = (charactersSAXFunc) rhythmdb_tree_parser_characters;
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.state = RHYTHMDB_TREE_PARSER_STATE_START;
+	ctx.db = load->db;
+	ctx.cancel = load->cancel;
+	ctx.buf = g_string_sized_new (RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE);
+	ctx.error = &chunk->error;
+	ctx.worker = TRUE;
+	ctx.loaded_entries = chunk->entries;
+
+	ctxt = xmlCreatePushParserCtxt (&sax_handler, &ctx, NULL, 0, NULL);
+	ctx.xmlctx = ctxt;
+	if (xmlParseChunk (ctxt, load->header, load->header_length, 0) == 0 &&
+	    xmlParseChunk (ctxt, chunk->data, chunk->length, 0) == 0)
+		xmlParseChunk (ctxt, footer, sizeof (footer) - 1, 1);
+	chunk->failed = (ctxt->wellFormed == 0);
+	xmlFreeParserCtxt (ctxt);
+
+	/* incomplete entries, if parsing stopped early */
+	if (ctx.entry != NULL)
+		rhythmdb_entry_unref (ctx.entry);
+	if (ctx.unknown_entry != NULL)
+		ctx.loaded_unknown_entries = g_list_prepend (ctx.loaded_unknown_entries, ctx.unknown_entry);
+
+	chunk->unknown_entries = g_list_reverse (ctx.loaded_unknown_entries);
+	g_string_free (ctx.buf, TRUE);
+
+	g_mutex_lock (load->lock);
+	chunk->done = TRUE;
+	g_cond_broadcast (load->cond);
+	g_mutex_unlock (load->lock);
+}
+
+/* splits the body of the file (between the root element's tags) into
+ * chunks starting at <entry> elements.  returns the number of chunks.
+ */
+static guint
+rhythmdb_tree_load_split (const char *data,
+			  gsize body_start,
+			  gsize body_end,
+			  guint max_chunks,
+			  struct RhythmDBTreeLoadChunk *chunks)
+{
+	gsize body_length = body_end - body_start;
+	gsize pos = body_start;
+	guint n_chunks = 0;
+	guint i;
+
+	for (i = 1; i <= max_chunks && pos < body_end; i++) {
+		gsize end = body_end;
+
+		if (i < max_chunks) {
+			gsize target = body_start + (body_length / max_chunks) * i;
+			const char *next;
+
+			if (target <= pos)
+				continue;
+
+			next = g_strstr_len (data + target, body_end - target, "<entry ");
+			if (next != NULL)
+				end = next - data;
+		}
+
+		chunks[n_chunks].data = data + pos;
+		chunks[n_chunks].length = end - pos;
+		n_chunks++;
+		pos = end;
+	}
+
+	return n_chunks;
+}
+
+/* loads the database using a pool of threads.  returns FALSE if the file
+ * isn't worth splitting up, or doesn't look like something we can split;
+ * the caller should use the serial parser instead.
+ */
+static gboolean
+rhythmdb_tree_load_parallel (RhythmDBTree *db,
+			     struct RhythmDBTreeLoadContext *ctx,
+			     const char *name)
+{
+	struct RhythmDBTreeParallelLoad load;
+	struct RhythmDBTreeLoadChunk *chunks;
+	GThreadPool *pool;
+	GMappedFile *mapped;
+	const char *data;
+	const char *root;
+	const char *footer;
+	gsize length;
+	gsize body_start;
+	guint n_threads;
+	guint max_chunks;
+	guint n_chunks;
+	gboolean stopped = FALSE;
+	guint i;
+	guint j;
+
+	n_threads = rhythmdb_tree_load_thread_count (db);
+	if (n_threads < 2)
+		return FALSE;
+
+	mapped = g_mapped_file_new (name, FALSE, NULL);
+	if (mapped == NULL)
+		return FALSE;
+
+	data = g_mapped_file_get_contents (mapped);
+	length = g_mapped_file_get_length (mapped);
+
+	/* find the end of the root element's start tag, and its end tag */
+	root = (data != NULL) ? g_strstr_len (data, length, "<rhythmdb") : NULL;
+	if (root != NULL)
+		root = memchr (root, '>', length - (root - data));
+	footer = (root != NULL) ? g_strrstr_len (data, length, "</rhythmdb>") : NULL;
+	if (footer == NULL || footer < root) {
+		g_mapped_file_free (mapped);
+		return FALSE;
+	}
+	body_start = (root + 1) - data;
+
+	max_chunks = MIN (n_threads * RHYTHMDB_TREE_PARALLEL_CHUNKS_PER_THREAD,
+			  (footer - data - body_start) / RHYTHMDB_TREE_PARALLEL_MIN_CHUNK_SIZE);
+	if (max_chunks < 2) {
+		g_mapped_file_free (mapped);
+		return FALSE;
+	}
+
+	chunks = g_new0 (struct RhythmDBTreeLoadChunk, max_chunks);
+	n_chunks = rhythmdb_tree_load_split (data, body_start, footer - data, max_chunks, chunks);
+	rb_debug ("loading %s in %u chunks using %u threads", name, n_chunks, n_threads);
+
+	load.db = db;
+	load.cancel = ctx->cancel;
+	load.header = data;
+	load.header_length = body_start;
+	load.lock = g_mutex_new ();
+	load.cond = g_cond_new ();
+
+	pool = g_thread_pool_new ((GFunc) rhythmdb_tree_parse_chunk, &load, n_threads, FALSE, NULL);
+	for (i = 0; i < n_chunks; i++) {
+		chunks[i].entries = g_ptr_array_new ();
+		g_thread_pool_push (pool, &chunks[i], NULL);
+	}
+
+	/* insert entries as the chunks are finished, in order */
+	for (i = 0; i < n_chunks && stopped == FALSE; i++) {
+		struct RhythmDBTreeLoadChunk *chunk = &chunks[i];
+		GList *l;
+
+		g_mutex_lock (load.lock);
+		while (chunk->done == FALSE)
+			g_cond_wait (load.cond, load.lock);
+		g_mutex_unlock (load.lock);
+
+		if (chunk->error != NULL) {
+			g_propagate_error (ctx->error, chunk->error);
+			chunk->error = NULL;
+			stopped = TRUE;
 			break;
-		case RHYTHMDB_PROP_MIMETYPE:
-			save_entry_string(ctx, elt_name, rb_refstring_get (entry->mimetype));
+		}
+		if (g_cancellable_is_cancelled (ctx->cancel)) {
+			stopped = TRUE;
+			break;
+		}
+
+		for (j = 0; j < chunk->entries->len; j++) {
+			rhythmdb_tree_load_insert_entry (ctx, g_ptr_array_index (chunk->entries, j));
+		}
+		g_ptr_array_set_size (chunk->entries, 0);
+
+		for (l = chunk->unknown_entries; l != NULL; l = l->next) {
+			rhythmdb_tree_load_add_unknown_entry (db, l->data);
+		}
+		g_list_free (chunk->unknown_entries);
+		chunk->unknown_entries = NULL;
+
+		/* the serial parser would have stopped here too */
+		if (chunk->failed) {
+			rb_debug ("error parsing chunk %u of %s, ignoring the rest of the file", i, name);
+			stopped = TRUE;
+		}
+	}
+
+	g_thread_pool_free (pool, FALSE, TRUE);
+
+	/* clean up anything left over after an error or cancellation */
+	for (i = 0; i < n_chunks; i++) {
+		for (j = 0; j < chunks[i].entries->len; j++) {
+			rhythmdb_entry_unref (g_ptr_array_index (chunks[i].entries, j));
+		}
+		g_ptr_array_free (chunks[i].entries, TRUE);
+		free_unknown_entries (NULL, chunks[i].unknown_entries, NULL);
+		if (chunks[i].error != NULL)
+			g_error_free (chunks[i].error);
+	}
+
+	g_free (chunks);
+	g_cond_free (load.cond);
+	g_mutex_free (load.lock);
+	g_mapped_file_free (mapped);
+	return TRUE;
+}
+
+static void
+find_max_entry_id (gpointer id,
+		   RhythmDBEntry *entry,
+		   guint *max_id)
+{
+	if (entry->id > *max_id)
+		*max_id = entry->id;
+}
+
+static gboolean
+rhythmdb_tree_load (RhythmDB *rdb,
+		    GCancellable *cancel,
+		    GError **error)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
+	xmlParserCtxtPtr ctxt;
+	xmlSAXHandlerPtr sax_handler;
+	struct RhythmDBTreeLoadContext *ctx;
+	char *name;
+	GError *local_error;
+	gboolean ret;
+
+	local_error = NULL;
+
+	sax_handler = g_new0 (xmlSAXHandler, 1);
+	ctx = g_new0 (struct RhythmDBTreeLoadContext, 1);
+
+	sax_handler->startElement = (startElementSAXFunc) rhythmdb_tree_parser_start_element;
+	sax_handler->endElement = (endElementSAXFunc) rhythmdb_tree_parser_end_element;
+	sax_handler->characters = (charactersSAXFunc) rhythmdb_tree_parser_characters;
+
+	ctx->state = RHYTHMDB_TREE_PARSER_STATE_START;
+	ctx->db = db;
+	ctx->cancel = cancel;
+	ctx->buf = g_string_sized_new (RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE);
+	ctx->error = &local_error;
+
+	g_object_get (G_OBJECT (db), "name", &name, NULL);
+
+	if (g_file_test (name, G_FILE_TEST_EXISTS) &&
+	    rhythmdb_tree_load_snapshot (db, name, cancel)) {
+		rb_debug ("loaded database from snapshot");
+	} else if (g_file_test (name, G_FILE_TEST_EXISTS)) {
+		if (rhythmdb_tree_load_parallel (db, ctx, name) == FALSE) {
+			ctxt = xmlCreateFileParserCtxt (name);
+			ctx->xmlctx = ctxt;
+			xmlFree (ctxt->sax);
+			ctxt->userData = ctx;
+			ctxt->sax = sax_handler;
+			xmlParseDocument (ctxt);
+			ctxt->sax = NULL;
+			xmlFreeParserCtxt (ctxt);
+		}
+
+		if (ctx->batch_count)
+			rhythmdb_commit (RHYTHMDB (ctx->db));
+	}
+
+	if (local_error == NULL && g_cancellable_is_cancelled (cancel) == FALSE) {
+		gboolean journal_valid;
+		guint max_id = 0;
+
+		journal_valid = rhythmdb_tree_replay_journal (db, name, cancel);
+
+		/* everything loaded so far is already on disk */
+		g_static_rw_lock_reader_lock (&db->priv->entries_lock);
+		g_hash_table_foreach (db->priv->entry_ids, (GHFunc) find_max_entry_id, &max_id);
+		g_static_rw_lock_reader_unlock (&db->priv->entries_lock);
+
+		g_mutex_lock (db->priv->journal_lock);
+		db->priv->journal_first_id = max_id + 1;
+		if (journal_valid) {
+			char *path = rhythmdb_tree_journal_path (name);
+			db->priv->journal = fopen (path, "a+");
+			if (db->priv->journal == NULL)
+				g_warning ("Couldn't open %s: %s", path, g_strerror (errno));
+			g_free (path);
+		}
+		g_mutex_unlock (db->priv->journal_lock);
+
+		g_static_rw_lock_reader_lock (&db->priv->trigram_lock);
+		g_hash_table_foreach (db->priv->trigram_indexes, (GHFunc) report_trigram_index, db);
+		g_static_rw_lock_reader_unlock (&db->priv->trigram_lock);
+	}
+
+	ret = TRUE;
+	if (local_error != NULL) {
+		g_propagate_error (error, local_error);
+		ret = FALSE;
+	}
+
+	g_string_free (ctx->buf, TRUE);
+	g_free (name);
+	g_free (sax_handler);
+	g_free (ctx);
+
+	return ret;
+}
+
+struct RhythmDBTreeSaveContext
+{
+	RhythmDBTree *db;
+	FILE *handle;
+	char *error;
+	struct RhythmDBTreeSnapshotWriter *snapshot;
+	GPtrArray *records;
+	gsize entry_size;
+};
+
+/* a copy of an entry's fields, taken while the entry fields lock is held,
+ * so the save thread doesn't read strings that are being replaced.
+ */
+typedef struct
+{
+	RhythmDBEntry *entry;
+	GList *keywords;
+} RhythmDBTreeSaveRecord;
+
+#ifdef HAVE_GNU_FWRITE_UNLOCKED
+#define RHYTHMDB_FWRITE_REAL fwrite_unlocked
+#define RHYTHMDB_FPUTC_REAL fputc_unlocked
+#else
+#define RHYTHMDB_FWRITE_REAL fwrite
+#define RHYTHMDB_FPUTC_REAL fputc
+#endif
+
+#define RHYTHMDB_FWRITE(w,x,len,handle,error) do {			\
+	if (error == NULL) {						\
+		if (RHYTHMDB_FWRITE_REAL (w,x,len,handle) != len) {	\
+			error = g_strdup (g_strerror (errno));		\
+		}							\
+	}								\
+} while (0)
+
+#define RHYTHMDB_FPUTC(x,handle,error) do {				\
+	if (error == NULL) {						\
+		if (RHYTHMDB_FPUTC_REAL (x,handle) == EOF) {		\
+			error = g_strdup (g_strerror (errno));		\
+		}							\
+	}								\
+} while (0)
+
+#define RHYTHMDB_FWRITE_STATICSTR(STR, HANDLE, ERROR) RHYTHMDB_FWRITE(STR, 1, sizeof(STR)-1, HANDLE, ERROR)
+
+static void
+write_elt_name_open (struct RhythmDBTreeSaveContext *ctx,
+		     const xmlChar *elt_name)
+{
+	RHYTHMDB_FWRITE_STATICSTR ("    <", ctx->handle, ctx->error);
+	RHYTHMDB_FWRITE (elt_name, 1, xmlStrlen (elt_name), ctx->handle, ctx->error);
+	RHYTHMDB_FPUTC ('>', ctx->handle, ctx->error);
+}
+
+static void
+write_elt_name_close (struct RhythmDBTreeSaveContext *ctx,
+		      const xmlChar *elt_name)
+{
+	RHYTHMDB_FWRITE_STATICSTR ("</", ctx->handle, ctx->error);
+	RHYTHMDB_FWRITE (elt_name, 1, xmlStrlen (elt_name), ctx->handle, ctx->error);
+	RHYTHMDB_FWRITE_STATICSTR (">\n", ctx->handle, ctx->error);
+}
+
+static void
+save_entry_string (struct RhythmDBTreeSaveContext *ctx,
+		   const xmlChar *elt_name,
+		   const char *str)
+{
+	xmlChar *encoded;
+
+	g_return_if_fail (str != NULL);
+	write_elt_name_open (ctx, elt_name);
+	encoded	= xmlEncodeEntitiesReentrant (NULL, BAD_CAST str);
+	RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx->handle, ctx->error);
+	g_free (encoded);
+	write_elt_name_close (ctx, elt_name);
+}
+
+static void
+save_entry_string_if_set (struct RhythmDBTreeSaveContext *ctx,
+			  const xmlChar *elt_name,
+			  const char *str)
+{
+	if (str == NULL || str[0] == '\0')
+		return;
+	save_entry_string (ctx, elt_name, str);
+}
+
+static void
+save_entry_int (struct RhythmDBTreeSaveContext *ctx,
+		const xmlChar *elt_name,
+		int num)
+{
+	char buf[92];
+	if (num == 0)
+		return;
+	write_elt_name_open (ctx, elt_name);
+	g_snprintf (buf, sizeof (buf), "%d", num);
+	RHYTHMDB_FWRITE (buf, 1, strlen (buf), ctx->handle, ctx->error);
+	write_elt_name_close (ctx, elt_name);
+}
+
+static void
+save_entry_ulong (struct RhythmDBTreeSaveContext *ctx,
+		  const xmlChar *elt_name,
+		  gulong num,
+		  gboolean save_zeroes)
+{
+	char buf[92];
+
+	if (num == 0 && !save_zeroes)
+		return;
+	write_elt_name_open (ctx, elt_name);
+	g_snprintf (buf, sizeof (buf), "%lu", num);
+	RHYTHMDB_FWRITE (buf, 1, strlen (buf), ctx->handle, ctx->error);
+	write_elt_name_close (ctx, elt_name);
+}
+
+static void
+save_entry_boolean (struct RhythmDBTreeSaveContext *ctx,
+		    const xmlChar *elt_name,
+		    gboolean val)
+{
+	save_entry_ulong (ctx, elt_name, val ? 1 : 0, FALSE);
+}
+
+static void
+save_entry_uint64 (struct RhythmDBTreeSaveContext *ctx,
+		   const xmlChar *elt_name,
+		   guint64 num)
+{
+	char buf[92];
+
+	if (num == 0)
+		return;
+
+	write_elt_name_open (ctx, elt_name);
+	g_snprintf (buf, sizeof (buf), "%" G_GUINT64_FORMAT, num);
+	RHYTHMDB_FWRITE (buf, 1, strlen (buf), ctx->handle, ctx->error);
+	write_elt_name_close (ctx, elt_name);
+}
+
+static void
+save_entry_double (struct RhythmDBTreeSaveContext *ctx,
+		   const xmlChar *elt_name,
+		   double num)
+{
+	char buf[G_ASCII_DTOSTR_BUF_SIZE+1];
+
+	if (num > -0.001 && num < 0.001)
+		return;
+
+	write_elt_name_open (ctx, elt_name);
+	g_ascii_dtostr (buf, sizeof (buf), num);
+	RHYTHMDB_FWRITE (buf, 1, strlen (buf), ctx->handle, ctx->error);
+	write_elt_name_close (ctx, elt_name);
+}
+
+/* This code is intended to be highly optimized.  This came at a small
+ * readability cost.  Sorry about that.
+ */
+static void
+save_entry (RhythmDBTree *db,
+	    RhythmDBEntry *entry,
+	    GList *keywords,
+	    struct RhythmDBTreeSaveContext *ctx)
+{
+	RhythmDBPropType i;
+	RhythmDBPodcastFields *podcast = NULL;
+	xmlChar *encoded;
+	GList *l;
+
+	if (ctx->error)
+		return;
+
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED ||
+	    entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST)
+		podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
+
+	RHYTHMDB_FWRITE_STATICSTR ("  <entry type=\"", ctx->handle, ctx->error);
+	encoded	= xmlEncodeEntitiesReentrant (NULL, BAD_CAST rhythmdb_entry_type_get_name (entry->type));
+	RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx->handle, ctx->error);
+	g_free (encoded);
+
+	RHYTHMDB_FWRITE_STATICSTR ("\">\n", ctx->handle, ctx->error);
+
+	/* Skip over the first property - the type */
+	for (i = 1; i < RHYTHMDB_NUM_PROPERTIES; i++) {
+		const xmlChar *elt_name;
+
+		if (ctx->error)
+			return;
+
+		elt_name = rhythmdb_nice_elt_name_from_propid ((RhythmDB *) ctx->db, i);
+
+		switch (i) {
+		case RHYTHMDB_PROP_TYPE:
+			break;
+		case RHYTHMDB_PROP_ENTRY_ID:
+			break;
+		case RHYTHMDB_PROP_TITLE:
+			save_entry_string(ctx, elt_name, rb_refstring_get (entry->title));
+			break;
+		case RHYTHMDB_PROP_ALBUM:
+			save_entry_string(ctx, elt_name, rb_refstring_get (entry->album));
+			break;
+		case RHYTHMDB_PROP_ARTIST:
+			save_entry_string(ctx, elt_name, rb_refstring_get (entry->artist));
+			break;
+		case RHYTHMDB_PROP_ALBUM_ARTIST:
+			save_entry_string_if_set(ctx, elt_name, rb_refstring_get (entry->album_artist));
+			break;
+		case RHYTHMDB_PROP_GENRE:
+			save_entry_string(ctx, elt_name, rb_refstring_get (entry->genre));
+			break;
+		case RHYTHMDB_PROP_COMMENT:
+			save_entry_string_if_set(ctx, elt_name, rb_refstring_get (entry->comment));
+			break;
+		case RHYTHMDB_PROP_MUSICBRAINZ_TRACKID:
+			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->musicbrainz_trackid));
+			break;
+		case RHYTHMDB_PROP_MUSICBRAINZ_ARTISTID:
+			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->musicbrainz_artistid));
+			break;
+		case RHYTHMDB_PROP_MUSICBRAINZ_ALBUMID:
+			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->musicbrainz_albumid));
+			break;
+		case RHYTHMDB_PROP_MUSICBRAINZ_ALBUMARTISTID:
+			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->musicbrainz_albumartistid));
+			break;
+		case RHYTHMDB_PROP_ARTIST_SORTNAME:
+			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->artist_sortname));
+			break;
+		case RHYTHMDB_PROP_ALBUM_SORTNAME:
+			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->album_sortname));
+			break;
+		case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME:
+			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->album_artist_sortname));
+			break;
+		case RHYTHMDB_PROP_TRACK_NUMBER:
+			save_entry_ulong (ctx, elt_name, entry->tracknum, FALSE);
+			break;
+		case RHYTHMDB_PROP_DISC_NUMBER:
+			save_entry_ulong (ctx, elt_name, entry->discnum, FALSE);
+			break;
+		case RHYTHMDB_PROP_DATE:
+			if (g_date_valid (&entry->date))
+				save_entry_ulong (ctx, elt_name, g_date_get_julian (&entry->date), TRUE);
+			else
+				save_entry_ulong (ctx, elt_name, 0, TRUE);
+			break;
+		case RHYTHMDB_PROP_DURATION:
+			save_entry_ulong (ctx, elt_name, entry->duration, FALSE);
+			break;
+		case RHYTHMDB_PROP_BITRATE:
+			save_entry_int(ctx, elt_name, entry->bitrate);
+			break;
+		case RHYTHMDB_PROP_LOCATION:
+			save_entry_string(ctx, elt_name, rb_refstring_get (entry->location));
+			break;
+		case RHYTHMDB_PROP_BPM:
+			save_entry_double(ctx, elt_name, entry->bpm);
+			break;
+		case RHYTHMDB_PROP_MOUNTPOINT:
+			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->mountpoint));
+			break;
+		case RHYTHMDB_PROP_FILE_SIZE:
+			save_entry_uint64(ctx, elt_name, entry->file_size);
+			break;
+		case RHYTHMDB_PROP_MIMETYPE:
+			save_entry_string(ctx, elt_name, rb_refstring_get (entry->mimetype));
 			break;
 		case RHYTHMDB_PROP_MTIME:
 			save_entry_ulong (ctx, elt_name, entry->mtime, FALSE);
 			break;
-		case RHYTHMDB_PROP_FIRST_SEEN:
-			save_entry_ulong (ctx, elt_name, entry->first_seen, FALSE);
+		case RHYTHMDB_PROP_FIRST_SEEN:
+			save_entry_ulong (ctx, elt_name, entry->first_seen, FALSE);
+			break;
+		case RHYTHMDB_PROP_LAST_SEEN:
+			save_entry_ulong (ctx, elt_name, entry->last_seen, FALSE);
+			break;
+		case RHYTHMDB_PROP_RATING:
+			save_entry_double(ctx, elt_name, entry->rating);
+			break;
+		case RHYTHMDB_PROP_PLAY_COUNT:
+			save_entry_ulong (ctx, elt_name, entry->play_count, FALSE);
+			break;
+		case RHYTHMDB_PROP_LAST_PLAYED:
+			save_entry_ulong (ctx, elt_name, entry->last_played, FALSE);
+			break;
+		case RHYTHMDB_PROP_HIDDEN:
+			{
+				gboolean hidden = ((entry->flags & RHYTHMDB_ENTRY_HIDDEN) != 0);
+				save_entry_boolean (ctx, elt_name, hidden);
+			}
+			break;
+		case RHYTHMDB_PROP_STATUS:
+			if (podcast)
+				save_entry_ulong (ctx, elt_name, podcast->status, FALSE);
+			break;
+		case RHYTHMDB_PROP_DESCRIPTION:
+			if (podcast && podcast->description)
+				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->description));
+			break;
+		case RHYTHMDB_PROP_SUBTITLE:
+			if (podcast && podcast->subtitle)
+				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->subtitle));
+			break;
+		case RHYTHMDB_PROP_SUMMARY:
+			if (podcast && podcast->summary)
+				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->summary));
+			break;
+		case RHYTHMDB_PROP_LANG:
+			if (podcast && podcast->lang)
+				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->lang));
+			break;
+		case RHYTHMDB_PROP_COPYRIGHT:
+			if (podcast && podcast->copyright)
+				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->copyright));
 			break;
-		case RHYTHMDB_PROP_LAST_SEEN:
-			save_entry_ulong (ctx, elt_name, entry->last_seen, FALSE);
+		case RHYTHMDB_PROP_IMAGE:
+			if (podcast && podcast->image)
+				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->image));
 			break;
-		case RHYTHMDB_PROP_RATING:
-			save_entry_double(ctx, elt_name, entry->rating);
+		case RHYTHMDB_PROP_POST_TIME:
+			if (podcast)
+				save_entry_ulong (ctx, elt_name, podcast->post_time, FALSE);
 			break;
-		case RHYTHMDB_PROP_PLAY_COUNT:
-			save_entry_ulong (ctx, elt_name, entry->play_count, FALSE);
+		case RHYTHMDB_PROP_KEYWORD:
+			for (l = keywords; l != NULL; l = g_list_next (l)) {
+				RBRefString *keyword = (RBRefString*)l->data;
+
+				RHYTHMDB_FWRITE_STATICSTR ("    <keyword>", ctx->handle, ctx->error);
+				encoded	= xmlEncodeEntitiesReentrant (NULL, BAD_CAST rb_refstring_get (keyword));
+				RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx->handle, ctx->error);
+				g_free (encoded);
+				RHYTHMDB_FWRITE_STATICSTR ("</keyword>\n", ctx->handle, ctx->error);
+			}
 			break;
-		case RHYTHMDB_PROP_LAST_PLAYED:
-			save_entry_ulong (ctx, elt_name, entry->last_played, FALSE);
+		case RHYTHMDB_PROP_TITLE_SORT_KEY:
+		case RHYTHMDB_PROP_GENRE_SORT_KEY:
+		case RHYTHMDB_PROP_ARTIST_SORT_KEY:
+		case RHYTHMDB_PROP_ALBUM_SORT_KEY:
+		case RHYTHMDB_PROP_ALBUM_ARTIST_SORT_KEY:
+		case RHYTHMDB_PROP_ARTIST_SORTNAME_SORT_KEY:
+		case RHYTHMDB_PROP_ALBUM_SORTNAME_SORT_KEY:
+		case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME_SORT_KEY:
+		case RHYTHMDB_PROP_TITLE_FOLDED:
+		case RHYTHMDB_PROP_GENRE_FOLDED:
+		case RHYTHMDB_PROP_ARTIST_FOLDED:
+		case RHYTHMDB_PROP_ALBUM_FOLDED:
+		case RHYTHMDB_PROP_ALBUM_ARTIST_FOLDED:
+		case RHYTHMDB_PROP_ARTIST_SORTNAME_FOLDED:
+		case RHYTHMDB_PROP_ALBUM_SORTNAME_FOLDED:
+		case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME_FOLDED:
+		case RHYTHMDB_PROP_LAST_PLAYED_STR:
+		case RHYTHMDB_PROP_PLAYBACK_ERROR:
+		case RHYTHMDB_PROP_FIRST_SEEN_STR:
+		case RHYTHMDB_PROP_LAST_SEEN_STR:
+		case RHYTHMDB_PROP_SEARCH_MATCH:
+		case RHYTHMDB_PROP_YEAR:
+		case RHYTHMDB_NUM_PROPERTIES:
+		/* obsolete replaygain properties */
+		case RHYTHMDB_PROP_TRACK_GAIN:
+		case RHYTHMDB_PROP_TRACK_PEAK:
+		case RHYTHMDB_PROP_ALBUM_GAIN:
+		case RHYTHMDB_PROP_ALBUM_PEAK:
 			break;
-		case RHYTHMDB_PROP_HIDDEN:
-			{
-				gboolean hidden = ((entry->flags & RHYTHMDB_ENTRY_HIDDEN) != 0);
-				save_entry_boolean (ctx, elt_name, hidden);
+		}
+	}
+
+	RHYTHMDB_FWRITE_STATICSTR ("  </entry>\n", ctx->handle, ctx->error);
+
+	if (ctx->snapshot)
+		snapshot_write_entry (db, ctx->snapshot, entry, keywords);
+}
+
+/* the entries to save are copied while walking the tree, with the entry
+ * fields lock held, which only takes as long as copying the fields and
+ * referencing their strings.  the file is written from the copies
+ * afterwards, without holding any locks, so entries can be added and
+ * changed while it is being written.  changes made in the meantime may or
+ * may not make it into the file, but they are always recorded in the
+ * journal.
+ */
+static void
+collect_entry (RhythmDBTree *db,
+	       RhythmDBEntry *entry,
+	       struct RhythmDBTreeSaveContext *ctx)
+{
+	RhythmDBTreeSaveRecord *record;
+	RBRefString **slots[RHYTHMDB_TREE_SNAPSHOT_N_STRINGS];
+	RhythmDBEntry *copy;
+	int i;
+
+	copy = g_memdup (entry, ctx->entry_size);
+	copy->refcount = 0;
+	copy->data = NULL;
+	copy->last_played_str = NULL;
+	copy->first_seen_str = NULL;
+	copy->last_seen_str = NULL;
+	copy->playback_error = NULL;
+
+	snapshot_entry_string_slots (copy, slots);
+	for (i = 0; i < RHYTHMDB_TREE_SNAPSHOT_N_STRINGS; i++) {
+		if (slots[i] != NULL && *slots[i] != NULL)
+			rb_refstring_ref (*slots[i]);
+	}
+
+	record = g_new0 (RhythmDBTreeSaveRecord, 1);
+	record->entry = copy;
+	record->keywords = rhythmdb_entry_keywords_get (RHYTHMDB (db), entry);
+	g_ptr_array_add (ctx->records, record);
+}
+
+static void
+free_save_record (RhythmDBTreeSaveRecord *record)
+{
+	RBRefString **slots[RHYTHMDB_TREE_SNAPSHOT_N_STRINGS];
+	int i;
+
+	snapshot_entry_string_slots (record->entry, slots);
+	for (i = 0; i < RHYTHMDB_TREE_SNAPSHOT_N_STRINGS; i++) {
+		if (slots[i] != NULL && *slots[i] != NULL)
+			rb_refstring_unref (*slots[i]);
+	}
+	g_free (record->entry);
+
+	g_list_foreach (record->keywords, (GFunc) rb_refstring_unref, NULL);
+	g_list_free (record->keywords);
+	g_free (record);
+}
+
+static void
+collect_entry_type (const char *name,
+		    RhythmDBEntryType *entry_type,
+		    struct RhythmDBTreeSaveContext *ctx)
+{
+	gboolean save_to_disk = FALSE;
+	guint type_data_size = 0;
+
+	g_object_get (entry_type,
+		      "save-to-disk", &save_to_disk,
+		      "type-data-size", &type_data_size,
+		      NULL);
+	if (save_to_disk == FALSE)
+		return;
+
+	/* the type data follows the entry, see rhythmdb_entry_allocate */
+	ctx->entry_size = sizeof (RhythmDBEntry);
+	if (type_data_size > 0)
+		ctx->entry_size = ALIGN_STRUCT (sizeof (RhythmDBEntry)) + type_data_size;
+
+	rhythmdb_entry_fields_lock (RHYTHMDB (ctx->db), FALSE);
+	rhythmdb_hash_tree_foreach (RHYTHMDB (ctx->db), entry_type,
+				    (RBTreeEntryItFunc) collect_entry,
+				    NULL, NULL, NULL, ctx);
+	rhythmdb_entry_fields_unlock (RHYTHMDB (ctx->db), FALSE);
+}
+
+static void
+collect_unknown_entry_type (RBRefString *typename,
+			    GList *entries,
+			    GList **unknown_entries)
+{
+	*unknown_entries = g_list_concat (g_list_copy (entries), *unknown_entries);
+}
+
+static void
+save_entries (struct RhythmDBTreeSaveContext *ctx)
+{
+	RhythmDBEntryType *type = NULL;
+	guint i;
+
+	for (i = 0; i < ctx->records->len; i++) {
+		RhythmDBTreeSaveRecord *record = g_ptr_array_index (ctx->records, i);
+		RhythmDBEntry *entry = record->entry;
+
+		if (ctx->error)
+			return;
+
+		if (entry->type != type) {
+			const char *name = rhythmdb_entry_type_get_name (entry->type);
+
+			type = entry->type;
+			rb_debug ("saving entries of type %s", name);
+			if (ctx->snapshot)
+				snapshot_writer_set_type (ctx->snapshot, type, name);
+		}
+		save_entry (ctx->db, entry, record->keywords, ctx);
+	}
+}
+
+static void
+save_unknown_entries (GList *entries,
+		      struct RhythmDBTreeSaveContext *ctx)
+{
+	GList *t;
+
+	for (t = entries; t != NULL; t = t->next) {
+		RhythmDBUnknownEntry *entry;
+		xmlChar *encoded;
+		GList *p;
+
+		if (ctx->error)
+			return;
+
+		entry = (RhythmDBUnknownEntry *)t->data;
+
+		RHYTHMDB_FWRITE_STATICSTR ("  <entry type=\"", ctx->handle, ctx->error);
+		encoded	= xmlEncodeEntitiesReentrant (NULL, BAD_CAST rb_refstring_get (entry->typename));
+		RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx->handle, ctx->error);
+		g_free (encoded);
+
+		RHYTHMDB_FWRITE_STATICSTR ("\">\n", ctx->handle, ctx->error);
+
+		for (p = entry->properties; p != NULL; p = p->next) {
+			RhythmDBUnknownEntryProperty *prop;
+			prop = (RhythmDBUnknownEntryProperty *) p->data;
+			save_entry_string(ctx, (const xmlChar *)rb_refstring_get (prop->name), rb_refstring_get (prop->value));
+		}
+
+		RHYTHMDB_FWRITE_STATICSTR ("  </entry>\n", ctx->handle, ctx->error);
+	}
+}
+
+static void
+journal_write_header (struct RhythmDBTreeSaveContext *ctx,
+		      const char *name)
+{
+	guint64 size;
+	guint64 mtime;
+	char *header;
+
+	journal_base_identity (name, &size, &mtime);
+	header = g_strdup_printf ("<?xml version=\"1.0\" standalone=\"yes\"?>\n"
+				  "<rhythmdb-journal version=\"" RHYTHMDB_TREE_XML_VERSION "\""
+				  " size=\"%" G_GUINT64_FORMAT "\" mtime=\"%" G_GUINT64_FORMAT "\">\n",
+				  size, mtime);
+	RHYTHMDB_FWRITE (header, 1, strlen (header), ctx->handle, ctx->error);
+	g_free (header);
+}
+
+static gboolean
+journal_entry_is_committed (RhythmDBEntry *entry)
+{
+	return ((entry->flags & (RHYTHMDB_ENTRY_INSERTED |
+				 RHYTHMDB_ENTRY_TREE_LOADING |
+				 RHYTHMDB_ENTRY_TREE_REMOVED)) == RHYTHMDB_ENTRY_INSERTED);
+}
+
+/* only properties that are written to the XML file are journalled */
+static gboolean
+journal_prop_is_saved (RhythmDBPropType propid)
+{
+	switch (propid) {
+	case RHYTHMDB_PROP_TYPE:
+	case RHYTHMDB_PROP_ENTRY_ID:
+	case RHYTHMDB_PROP_KEYWORD:
+	case RHYTHMDB_PROP_TITLE_SORT_KEY:
+	case RHYTHMDB_PROP_GENRE_SORT_KEY:
+	case RHYTHMDB_PROP_ARTIST_SORT_KEY:
+	case RHYTHMDB_PROP_ALBUM_SORT_KEY:
+	case RHYTHMDB_PROP_ALBUM_ARTIST_SORT_KEY:
+	case RHYTHMDB_PROP_ARTIST_SORTNAME_SORT_KEY:
+	case RHYTHMDB_PROP_ALBUM_SORTNAME_SORT_KEY:
+	case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME_SORT_KEY:
+	case RHYTHMDB_PROP_TITLE_FOLDED:
+	case RHYTHMDB_PROP_GENRE_FOLDED:
+	case RHYTHMDB_PROP_ARTIST_FOLDED:
+	case RHYTHMDB_PROP_ALBUM_FOLDED:
+	case RHYTHMDB_PROP_ALBUM_ARTIST_FOLDED:
+	case RHYTHMDB_PROP_ARTIST_SORTNAME_FOLDED:
+	case RHYTHMDB_PROP_ALBUM_SORTNAME_FOLDED:
+	case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME_FOLDED:
+	case RHYTHMDB_PROP_LAST_PLAYED_STR:
+	case RHYTHMDB_PROP_PLAYBACK_ERROR:
+	case RHYTHMDB_PROP_FIRST_SEEN_STR:
+	case RHYTHMDB_PROP_LAST_SEEN_STR:
+	case RHYTHMDB_PROP_SEARCH_MATCH:
+	case RHYTHMDB_PROP_YEAR:
+	case RHYTHMDB_PROP_TRACK_GAIN:
+	case RHYTHMDB_PROP_TRACK_PEAK:
+	case RHYTHMDB_PROP_ALBUM_GAIN:
+	case RHYTHMDB_PROP_ALBUM_PEAK:
+	case RHYTHMDB_NUM_PROPERTIES:
+		return FALSE;
+	default:
+		return TRUE;
+	}
+}
+
+/* if there is an open journal and entries of the given type are saved,
+ * this acquires the journal lock and sets up @ctx to write a record.
+ */
+static gboolean
+journal_record_begin (RhythmDBTree *db,
+		      RhythmDBEntryType *type,
+		      struct RhythmDBTreeSaveContext *ctx)
+{
+	gboolean save_to_disk = FALSE;
+
+	g_mutex_lock (db->priv->journal_lock);
+	if (db->priv->journal != NULL)
+		g_object_get (type, "save-to-disk", &save_to_disk, NULL);
+
+	if (save_to_disk == FALSE) {
+		g_mutex_unlock (db->priv->journal_lock);
+		return FALSE;
+	}
+
+	ctx->db = db;
+	ctx->handle = db->priv->journal;
+	ctx->error = NULL;
+	ctx->snapshot = NULL;
+	return TRUE;
+}
+
+static void
+journal_record_end (RhythmDBTree *db,
+		    struct RhythmDBTreeSaveContext *ctx)
+{
+	if (ctx->error == NULL && fflush (ctx->handle) == EOF)
+		ctx->error = g_strdup (g_strerror (errno));
+
+	if (ctx->error != NULL) {
+		/* stop journalling; the next save will rewrite the XML file */
+		g_warning ("Writing to the database journal failed: %s", ctx->error);
+		g_free (ctx->error);
+		fclose (db->priv->journal);
+		db->priv->journal = NULL;
+	}
+	g_mutex_unlock (db->priv->journal_lock);
+}
+
+static void
+journal_write_location (struct RhythmDBTreeSaveContext *ctx,
+			const char *record,
+			RhythmDBEntry *entry)
+{
+	xmlChar *encoded;
+
+	RHYTHMDB_FWRITE_STATICSTR ("  <", ctx->handle, ctx->error);
+	RHYTHMDB_FWRITE (record, 1, strlen (record), ctx->handle, ctx->error);
+	RHYTHMDB_FWRITE_STATICSTR (" location=\"", ctx->handle, ctx->error);
+	encoded = xmlEncodeSpecialChars (NULL, BAD_CAST rb_refstring_get (entry->location));
+	RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx->handle, ctx->error);
+	g_free (encoded);
+	RHYTHMDB_FPUTC ('"', ctx->handle, ctx->error);
+}
+
+static void
+rhythmdb_tree_journal_change (RhythmDBTree *db,
+			      RhythmDBEntry *entry,
+			      RhythmDBPropType propid,
+			      const GValue *value)
+{
+	struct RhythmDBTreeSaveContext ctx;
+	const xmlChar *elt_name;
+	char buf[G_ASCII_DTOSTR_BUF_SIZE+1];
+	xmlChar *encoded = NULL;
+	const char *str;
+
+	if (journal_entry_is_committed (entry) == FALSE || journal_prop_is_saved (propid) == FALSE)
+		return;
+
+	switch (G_VALUE_TYPE (value)) {
+	case G_TYPE_STRING:
+		str = g_value_get_string (value);
+		encoded = xmlEncodeEntitiesReentrant (NULL, BAD_CAST (str ? str : ""));
+		str = (const char *) encoded;
+		break;
+	case G_TYPE_BOOLEAN:
+		str = g_value_get_boolean (value) ? "1" : "0";
+		break;
+	case G_TYPE_ULONG:
+		g_snprintf (buf, sizeof (buf), "%lu", g_value_get_ulong (value));
+		str = buf;
+		break;
+	case G_TYPE_UINT64:
+		g_snprintf (buf, sizeof (buf), "%" G_GUINT64_FORMAT, g_value_get_uint64 (value));
+		str = buf;
+		break;
+	case G_TYPE_DOUBLE:
+		g_ascii_dtostr (buf, sizeof (buf), g_value_get_double (value));
+		str = buf;
+		break;
+	default:
+		g_assert_not_reached ();
+		return;
+	}
+
+	if (journal_record_begin (db, entry->type, &ctx)) {
+		elt_name = rhythmdb_nice_elt_name_from_propid (RHYTHMDB (db), propid);
+
+		/* for location changes, this is the old location */
+		journal_write_location (&ctx, "change", entry);
+		RHYTHMDB_FWRITE_STATICSTR (">\n", ctx.handle, ctx.error);
+		write_elt_name_open (&ctx, elt_name);
+		RHYTHMDB_FWRITE (str, 1, strlen (str), ctx.handle, ctx.error);
+		write_elt_name_close (&ctx, elt_name);
+		RHYTHMDB_FWRITE_STATICSTR ("  </change>\n", ctx.handle, ctx.error);
+		journal_record_end (db, &ctx);
+	}
+	g_free (encoded);
+}
+
+static void
+rhythmdb_tree_journal_keyword (RhythmDBTree *db,
+			       RhythmDBEntry *entry,
+			       RBRefString *keyword,
+			       gboolean added)
+{
+	struct RhythmDBTreeSaveContext ctx;
+	xmlChar *encoded;
+
+	if (journal_entry_is_committed (entry) == FALSE)
+		return;
+
+	if (journal_record_begin (db, entry->type, &ctx)) {
+		journal_write_location (&ctx, added ? "keyword-add" : "keyword-remove", entry);
+		RHYTHMDB_FPUTC ('>', ctx.handle, ctx.error);
+		encoded = xmlEncodeEntitiesReentrant (NULL, BAD_CAST rb_refstring_get (keyword));
+		RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx.handle, ctx.error);
+		g_free (encoded);
+		if (added)
+			RHYTHMDB_FWRITE_STATICSTR ("</keyword-add>\n", ctx.handle, ctx.error);
+		else
+			RHYTHMDB_FWRITE_STATICSTR ("</keyword-remove>\n", ctx.handle, ctx.error);
+		journal_record_end (db, &ctx);
+	}
+}
+
+static void
+rhythmdb_tree_journal_delete (RhythmDBTree *db,
+			      RhythmDBEntry *entry)
+{
+	struct RhythmDBTreeSaveContext ctx;
+
+	if (journal_entry_is_committed (entry) == FALSE)
+		return;
+
+	if (journal_record_begin (db, entry->type, &ctx)) {
+		journal_write_location (&ctx, "delete", entry);
+		RHYTHMDB_FWRITE_STATICSTR ("/>\n", ctx.handle, ctx.error);
+		journal_record_end (db, &ctx);
+	}
+}
+
+static void
+rhythmdb_tree_journal_delete_type (RhythmDBTree *db,
+				   RhythmDBEntryType *type)
+{
+	struct RhythmDBTreeSaveContext ctx;
+	xmlChar *encoded;
+
+	if (journal_record_begin (db, type, &ctx)) {
+		RHYTHMDB_FWRITE_STATICSTR ("  <delete-type type=\"", ctx.handle, ctx.error);
+		encoded = xmlEncodeSpecialChars (NULL, BAD_CAST rhythmdb_entry_type_get_name (type));
+		RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx.handle, ctx.error);
+		g_free (encoded);
+		RHYTHMDB_FWRITE_STATICSTR ("\"/>\n", ctx.handle, ctx.error);
+		journal_record_end (db, &ctx);
+	}
+}
+
+static void
+rhythmdb_tree_entry_added (RhythmDB *rdb,
+			   RhythmDBEntry *entry)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
+	struct RhythmDBTreeSaveContext ctx;
+
+	/* entries read from the XML file and journal are already on disk, and
+	 * entries deleted before the signal was emitted don't need to be.
+	 */
+	if (entry->id < db->priv->journal_first_id || journal_entry_is_committed (entry) == FALSE)
+		return;
+
+	if (journal_record_begin (db, entry->type, &ctx)) {
+		GList *keywords;
+
+		keywords = rhythmdb_entry_keywords_get (rdb, entry);
+		save_entry (db, entry, keywords, &ctx);
+		journal_record_end (db, &ctx);
+
+		g_list_foreach (keywords, (GFunc) rb_refstring_unref, NULL);
+		g_list_free (keywords);
+	}
+}
+
+/* flushes the journal to disk if it's still small enough.  otherwise,
+ * or if there is no journal, returns FALSE and the XML file has to be
+ * rewritten.
+ */
+static gboolean
+rhythmdb_tree_journal_sync (RhythmDBTree *db,
+			    const char *name)
+{
+	struct stat journal_stat;
+	struct stat xml_stat;
+	off_t threshold;
+	gboolean synced = FALSE;
+
+	g_mutex_lock (db->priv->journal_lock);
+	db->priv->journal_compact_offset = -1;
+	if (db->priv->journal != NULL &&
+	    fflush (db->priv->journal) != EOF &&
+	    fstat (fileno (db->priv->journal), &journal_stat) == 0) {
+		threshold = RHYTHMDB_TREE_JOURNAL_MIN_COMPACT_SIZE;
+		if (stat (name, &xml_stat) == 0)
+			threshold = MAX (threshold, xml_stat.st_size / RHYTHMDB_TREE_JOURNAL_COMPACT_RATIO);
+
+		if (journal_stat.st_size < threshold) {
+			if (fsync (fileno (db->priv->journal)) < 0)
+				g_warning ("Couldn't sync the database journal: %s", g_strerror (errno));
+			else
+				synced = TRUE;
+		} else {
+			rb_debug ("database journal has grown to %lu bytes, rewriting database",
+				  (gulong) journal_stat.st_size);
+		}
+
+		/* records written after this point have to be carried over */
+		if (synced == FALSE)
+			db->priv->journal_compact_offset = journal_stat.st_size;
+	}
+	g_mutex_unlock (db->priv->journal_lock);
+
+	return synced;
+}
+
+/* called after the XML file has been rewritten (or failed to be).
+ * starts a new journal for the new XML file, containing the records
+ * appended to the old journal while the XML file was being written.
+ */
+static void
+rhythmdb_tree_journal_compacted (RhythmDBTree *db,
+				 const char *name,
+				 gboolean saved)
+{
+	struct RhythmDBTreeSaveContext ctx;
+	char buf[8192];
+	char *path;
+	char *tmppath;
+	size_t len;
+
+	g_mutex_lock (db->priv->journal_lock);
+	if (saved == FALSE) {
+		/* the old journal still applies to the old XML file */
+		db->priv->journal_compact_offset = -1;
+		g_mutex_unlock (db->priv->journal_lock);
+		return;
+	}
+
+	path = rhythmdb_tree_journal_path (name);
+	tmppath = g_strconcat (path, ".tmp", NULL);
+
+	ctx.db = db;
+	ctx.error = NULL;
+	ctx.snapshot = NULL;
+	ctx.handle = fopen (tmppath, "w");
+	if (ctx.handle == NULL) {
+		ctx.error = g_strdup (g_strerror (errno));
+	} else {
+		journal_write_header (&ctx, name);
+
+		if (db->priv->journal != NULL && db->priv->journal_compact_offset >= 0) {
+			if (ctx.error == NULL &&
+			    (fflush (db->priv->journal) == EOF ||
+			     fseek (db->priv->journal, db->priv->journal_compact_offset, SEEK_SET) < 0))
+				ctx.error = g_strdup (g_strerror (errno));
+
+			while (ctx.error == NULL && (len = fread (buf, 1, sizeof (buf), db->priv->journal)) > 0)
+				RHYTHMDB_FWRITE (buf, 1, len, ctx.handle, ctx.error);
+
+			if (ctx.error == NULL && ferror (db->priv->journal))
+				ctx.error = g_strdup (g_strerror (errno));
+		}
+
+		if (ctx.error == NULL &&
+		    (fflush (ctx.handle) == EOF || fsync (fileno (ctx.handle)) < 0))
+			ctx.error = g_strdup (g_strerror (errno));
+		if (fclose (ctx.handle) < 0 && ctx.error == NULL)
+			ctx.error = g_strdup (g_strerror (errno));
+	}
+
+	if (db->priv->journal != NULL) {
+		fclose (db->priv->journal);
+		db->priv->journal = NULL;
+	}
+
+	if (ctx.error == NULL && rename (tmppath, path) < 0)
+		ctx.error = g_strdup (g_strerror (errno));
+
+	if (ctx.error == NULL) {
+		db->priv->journal = fopen (path, "a+");
+		if (db->priv->journal == NULL)
+			ctx.error = g_strdup (g_strerror (errno));
+	}
+
+	if (ctx.error != NULL) {
+		g_warning ("Couldn't start a new database journal: %s", ctx.error);
+		g_free (ctx.error);
+		unlink (tmppath);
+		/* the old journal doesn't apply to the new XML file */
+		unlink (path);
+	}
+
+	db->priv->journal_compact_offset = -1;
+	g_mutex_unlock (db->priv->journal_lock);
+
+	g_free (tmppath);
+	g_free (path);
+}
+
+static void
+rhythmdb_tree_save (RhythmDB *rdb)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
+	char *name;
+	GString *savepath;
+	FILE *f;
+	struct RhythmDBTreeSaveContext ctx;
+	GList *unknown_entries = NULL;
+	gboolean saved = FALSE;
+	guint i;
+
+	g_object_get (G_OBJECT (db), "name", &name, NULL);
+
+	if (rhythmdb_tree_journal_sync (db, name)) {
+		rb_debug ("database journal synced");
+		g_free (name);
+		return;
+	}
+
+	savepath = g_string_new (name);
+	g_string_append (savepath, ".tmp");
+
+	ctx.db = db;
+	ctx.error = NULL;
+	ctx.snapshot = NULL;
+	ctx.records = g_ptr_array_new ();
+
+	rhythmdb_entry_type_foreach (rdb, (GHFunc) collect_entry_type, &ctx);
+	g_static_rw_lock_reader_lock (&db->priv->entries_lock);
+	g_hash_table_foreach (db->priv->unknown_entry_types,
+			      (GHFunc) collect_unknown_entry_type,
+			      &unknown_entries);
+	g_static_rw_lock_reader_unlock (&db->priv->entries_lock);
+	rb_debug ("saving %u entries", ctx.records->len);
+
+	f = fopen (savepath->str, "w");
+
+	if (!f) {
+		g_warning ("Can't save XML: %s", g_strerror (errno));
+		goto out;
+	}
+
+	ctx.handle = f;
+
+	/* entries of unregistered types are only kept in the XML file */
+	if (unknown_entries != NULL) {
+		char *snapshot_path = rhythmdb_tree_snapshot_path (name);
+		unlink (snapshot_path);
+		g_free (snapshot_path);
+	} else {
+		ctx.snapshot = snapshot_writer_new (name);
+	}
+	RHYTHMDB_FWRITE_STATICSTR ("<?xml version=\"1.0\" standalone=\"yes\"?>\n"
+				   "<rhythmdb version=\"" RHYTHMDB_TREE_XML_VERSION "\">\n",
+				   ctx.handle, ctx.error);
+
+	save_entries (&ctx);
+	save_unknown_entries (unknown_entries, &ctx);
+
+	RHYTHMDB_FWRITE_STATICSTR ("</rhythmdb>\n", ctx.handle, ctx.error);
+
+	/* make sure the data is on disk before replacing the old file */
+	if (ctx.error == NULL && (fflush (f) != 0 || fsync (fileno (f)) < 0))
+		ctx.error = g_strdup (g_strerror (errno));
+
+	if (fclose (f) < 0) {
+		g_warning ("Couldn't close %s: %s",
+			   savepath->str,
+			   g_strerror (errno));
+		unlink (savepath->str);
+		goto out;
+	}
+
+	if (ctx.error != NULL) {
+		g_warning ("Writing to the database failed: %s", ctx.error);
+		g_free (ctx.error);
+		unlink (savepath->str);
+	} else {
+		if (rename (savepath->str, name) < 0) {
+			g_warning ("Couldn't rename %s to %s: %s",
+				   name, savepath->str,
+				   g_strerror (errno));
+			unlink (savepath->str);
+		} else {
+			saved = TRUE;
+			if (ctx.snapshot != NULL)
+				snapshot_writer_finish (ctx.snapshot, name);
+		}
+	}
+
+out:
+	rhythmdb_tree_journal_compacted (db, name, saved);
+	if (ctx.snapshot != NULL)
+		snapshot_writer_free (ctx.snapshot);
+	for (i = 0; i < ctx.records->len; i++) {
+		free_save_record (g_ptr_array_index (ctx.records, i));
+	}
+	g_ptr_array_free (ctx.records, TRUE);
+	g_list_free (unknown_entries);
+	g_string_free (savepath, TRUE);
+	g_free (name);
+	return;
+}
+
+#undef RHYTHMDB_FWRITE_ENCODED_STR
+#undef RHYTHMDB_FWRITE_STATICSTR
+#undef RHYTHMDB_FPUTC
+#undef RHYTHMDB_FWRITE
+
+RhythmDB *
+rhythmdb_tree_new (const char *name)
+{
+	RhythmDBTree *db = g_object_new (RHYTHMDB_TYPE_TREE, "name", name, NULL);
+
+	g_return_val_if_fail (db->priv != NULL, NULL);
+
+	return RHYTHMDB (db);
+}
+
+/* must be called with the shard lock held */
+static void
+set_entry_album (RhythmDBTree *db,
+		 RhythmDBEntry *entry,
+		 RhythmDBTreeProperty *artist,
+		 RBRefString *name)
+{
+	struct RhythmDBTreeProperty *prop;
+
+	prop = get_or_create_album (db, artist, name);
+	g_hash_table_insert (prop->children, entry, NULL);
+	entry->data = prop;
+	count_tree_entry (prop, 1);
+}
+
+static void
+rhythmdb_tree_entry_new (RhythmDB *rdb,
+			 RhythmDBEntry *entry)
+{
+	g_static_rw_lock_writer_lock (&RHYTHMDB_TREE(rdb)->priv->entries_lock);
+	rhythmdb_tree_entry_new_internal (rdb, entry);
+	g_static_rw_lock_writer_unlock (&RHYTHMDB_TREE(rdb)->priv->entries_lock);
+}
+
+/* must be called with the entry lock held */
+static void
+rhythmdb_tree_entry_new_internal (RhythmDB *rdb, RhythmDBEntry *entry)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
+	RhythmDBTreeShard *shard;
+	RhythmDBTreeProperty *artist;
+	RhythmDBTreeProperty *genre;
+
+	rhythmdb_tree_assert_locked (&db->priv->entries_lock);
+	g_assert (entry != NULL);
+
+	g_return_if_fail (entry->location != NULL);
+
+	if (entry->title == NULL) {
+		g_warning ("Entry %s has missing title", rb_refstring_get (entry->location));
+		entry->title = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->artist == NULL) {
+		g_warning ("Entry %s has missing artist", rb_refstring_get (entry->location));
+		entry->artist = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->album == NULL) {
+		g_warning ("Entry %s has missing album", rb_refstring_get (entry->location));
+		entry->album = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->genre == NULL) {
+		g_warning ("Entry %s has missing genre", rb_refstring_get (entry->location));
+		entry->genre = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->mimetype == NULL) {
+		g_warning ("Entry %s has missing mimetype", rb_refstring_get (entry->location));
+		entry->mimetype = rb_refstring_new ("unknown/unknown");
+	}
+
+	/* Initialize the tree structure. */
+	shard = get_shard (db, entry->type);
+	g_static_rw_lock_writer_lock (&shard->lock);
+	genre = get_or_create_genre (db, entry->type, entry->genre);
+	artist = get_or_create_artist (db, genre, entry->artist);
+	set_entry_album (db, entry, artist, entry->album);
+	g_static_rw_lock_writer_unlock (&shard->lock);
+
+	search_index_add_entry (db, entry);
+	trigram_index_add_entry (db, entry);
+	range_index_add_entry (db, entry);
+
+	/* this accounts for the initial reference on the entry */
+	g_hash_table_insert (db->priv->entries, entry->location, entry);
+	g_hash_table_insert (db->priv->entry_ids, GINT_TO_POINTER (entry->id), entry);
+
+	entry->flags &= ~RHYTHMDB_ENTRY_TREE_LOADING;
+}
+
+static RhythmDBTreeProperty *
+rhythmdb_tree_property_new (RhythmDBTree *db)
+{
+	RhythmDBTreeProperty *ret = g_new0 (RhythmDBTreeProperty, 1);
+#ifndef G_DISABLE_ASSERT
+	ret->magic = 0xf00dbeef;
+#endif
+	return ret;
+}
+
+static GHashTable *
+shard_genres_new (void)
+{
+	return g_hash_table_new_full (rb_refstring_hash,
+				      rb_refstring_equal,
+				      (GDestroyNotify) rb_refstring_unref,
+				      NULL);
+}
+
+static RhythmDBTreeShard *
+get_shard (RhythmDBTree *db,
+	   RhythmDBEntryType *type)
+{
+	RhythmDBTreeShard *shard;
+
+	g_static_rw_lock_reader_lock (&db->priv->genres_lock);
+	shard = g_hash_table_lookup (db->priv->genres, type);
+	g_static_rw_lock_reader_unlock (&db->priv->genres_lock);
+	if (G_LIKELY (shard != NULL))
+		return shard;
+
+	g_static_rw_lock_writer_lock (&db->priv->genres_lock);
+	shard = g_hash_table_lookup (db->priv->genres, type);
+	if (shard == NULL) {
+		shard = g_new0 (RhythmDBTreeShard, 1);
+		g_static_rw_lock_init (&shard->lock);
+		shard->genres = shard_genres_new ();
+		g_hash_table_insert (db->priv->genres, type, shard);
+	}
+	g_static_rw_lock_writer_unlock (&db->priv->genres_lock);
+	return shard;
+}
+
+static void
+destroy_shard (gpointer data)
+{
+	RhythmDBTreeShard *shard = data;
+
+	g_hash_table_destroy (shard->genres);
+	g_static_rw_lock_free (&shard->lock);
+	g_free (shard);
+}
+
+/* must be called with the shard lock held */
+static GHashTable *
+get_genres_hash_for_type (RhythmDBTree *db,
+			  RhythmDBEntryType *type)
+{
+	return get_shard (db, type)->genres;
+}
+
+typedef void (*RBHFunc)(RhythmDBTree *db, GHashTable *genres, gpointer data);
+
+static void
+collect_shard (gpointer key,
+	       RhythmDBTreeShard *shard,
+	       GList **shards)
+{
+	*shards = g_list_prepend (*shards, shard);
+}
+
+/* calls func for the tree of each entry type in turn, holding its shard
+ * lock for reading.
+ */
+static void
+genres_hash_foreach (RhythmDBTree *db, RBHFunc func, gpointer data)
+{
+	GList *shards = NULL;
+	GList *l;
+
+	g_static_rw_lock_reader_lock (&db->priv->genres_lock);
+	g_hash_table_foreach (db->priv->genres, (GHFunc) collect_shard, &shards);
+	g_static_rw_lock_reader_unlock (&db->priv->genres_lock);
+
+	for (l = shards; l != NULL; l = l->next) {
+		RhythmDBTreeShard *shard = l->data;
+
+		g_static_rw_lock_reader_lock (&shard->lock);
+		func (db, shard->genres, data);
+		g_static_rw_lock_reader_unlock (&shard->lock);
+	}
+	g_list_free (shards);
+}
+
+/* must be called with the shard lock held */
+static RhythmDBTreeProperty *
+get_or_create_genre (RhythmDBTree *db,
+		     RhythmDBEntryType *type,
+		     RBRefString *name)
+{
+	RhythmDBTreeProperty *genre;
+	GHashTable *table;
+
+	table = get_genres_hash_for_type (db, type);
+	genre = g_hash_table_lookup (table, name);
+
+	if (G_UNLIKELY (genre == NULL)) {
+		genre = rhythmdb_tree_property_new (db);
+		genre->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
+							 (GDestroyNotify) rb_refstring_unref,
+							 NULL);
+		rb_refstring_ref (name);
+		g_hash_table_insert (table, name, genre);
+		genre->parent = NULL;
+	}
+
+	return genre;
+}
+
+/* must be called with the shard lock held */
+static RhythmDBTreeProperty *
+get_or_create_artist (RhythmDBTree *db,
+		      RhythmDBTreeProperty *genre,
+		      RBRefString *name)
+{
+	RhythmDBTreeProperty *artist;
+
+	artist = g_hash_table_lookup (genre->children, name);
+
+	if (G_UNLIKELY (artist == NULL)) {
+		artist = rhythmdb_tree_property_new (db);
+		artist->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
+							  (GDestroyNotify) rb_refstring_unref,
+							  NULL);
+		rb_refstring_ref (name);
+		g_hash_table_insert (genre->children, name, artist);
+		artist->parent = genre;
+	}
+
+	return artist;
+}
+
+/* must be called with the shard lock held */
+static RhythmDBTreeProperty *
+get_or_create_album (RhythmDBTree *db,
+		     RhythmDBTreeProperty *artist,
+		     RBRefString *name)
+{
+	RhythmDBTreeProperty *album;
+
+	album = g_hash_table_lookup (artist->children, name);
+
+	if (G_UNLIKELY (album == NULL)) {
+		album = rhythmdb_tree_property_new (db);
+		album->children = g_hash_table_new (g_direct_hash, g_direct_equal);
+		rb_refstring_ref (name);
+		g_hash_table_insert (artist->children, name, album);
+		album->parent = artist;
+	}
+
+	return album;
+}
+
+/* must be called with the shard lock held */
+static void
+count_tree_entry (RhythmDBTreeProperty *album,
+		  gint delta)
+{
+	RhythmDBTreeProperty *prop;
+
+	for (prop = album; prop != NULL; prop = prop->parent)
+		prop->n_entries += delta;
+}
+
+static gboolean
+remove_child (RhythmDBTreeProperty *parent,
+	      gconstpointer data)
+{
+	g_assert (g_hash_table_remove (parent->children, data));
+	if (g_hash_table_size (parent->children) <= 0) {
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* must be called with the shard lock held */
+static void
+remove_entry_from_album (RhythmDBTree *db,
+			 RhythmDBEntry *entry)
+{
+	GHashTable *table;
+
+	rhythmdb_tree_assert_locked (&get_shard (db, entry->type)->lock);
+
+	rb_refstring_ref (entry->genre);
+	rb_refstring_ref (entry->artist);
+	rb_refstring_ref (entry->album);
+
+	table = get_genres_hash_for_type (db, entry->type);
+	count_tree_entry (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry), -1);
+	if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry), entry)) {
+		if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent,
+				  entry->album)) {
+
+			if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent,
+					  entry->artist)) {
+				destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent);
+				g_assert (g_hash_table_remove (table, entry->genre));
 			}
-			break;
-		case RHYTHMDB_PROP_STATUS:
-			if (podcast)
-				save_entry_ulong (ctx, elt_name, podcast->status, FALSE);
-			break;
-		case RHYTHMDB_PROP_DESCRIPTION:
-			if (podcast && podcast->description)
-				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->description));
-			break;
-		case RHYTHMDB_PROP_SUBTITLE:
-			if (podcast && podcast->subtitle)
-				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->subtitle));
-			break;
-		case RHYTHMDB_PROP_SUMMARY:
-			if (podcast && podcast->summary)
-				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->summary));
-			break;
-		case RHYTHMDB_PROP_LANG:
-			if (podcast && podcast->lang)
-				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->lang));
-			break;
-		case RHYTHMDB_PROP_COPYRIGHT:
-			if (podcast && podcast->copyright)
-				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->copyright));
-			break;
-		case RHYTHMDB_PROP_IMAGE:
-			if (podcast && podcast->image)
-				save_entry_string(ctx, elt_name, rb_refstring_get (podcast->image));
-			break;
-		case RHYTHMDB_PROP_POST_TIME:
-			if (podcast)
-				save_entry_ulong (ctx, elt_name, podcast->post_time, FALSE);
-			break;
-		case RHYTHMDB_PROP_KEYWORD:
-			keywords = rhythmdb_entry_keywords_get (RHYTHMDB (db), entry);
+			destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent);
+		}
+
+		destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry));
+	}
+
+	rb_refstring_unref (entry->genre);
+	rb_refstring_unref (entry->artist);
+	rb_refstring_unref (entry->album);
+}
+
+static gboolean
+rhythmdb_tree_entry_set (RhythmDB *adb,
+			 RhythmDBEntry *entry,
+			 guint propid,
+			 const GValue *value)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	RhythmDBEntryType *type;
+	RhythmDBTreeShard *shard;
+
+	type = entry->type;
+
+	/* don't process changes to entries we're loading, we'll get them
+	 * when the entry is complete.  don't process changes for entries that
+	 * have been removed either.
+	 */
+	if (entry->flags & (RHYTHMDB_ENTRY_TREE_LOADING | RHYTHMDB_ENTRY_TREE_REMOVED))
+		return FALSE;
+
+	rhythmdb_tree_journal_change (db, entry, propid, value);
+
+	trigram_index_replace (db, entry, propid, value);
+	range_index_replace (db, entry, propid, value);
+
+	/* Handle special properties */
+	switch (propid)
+	{
+	case RHYTHMDB_PROP_LOCATION:
+	{
+		RBRefString *s;
+		/* We have to use the string in the entry itself as the hash key,
+		 * otherwise either we leak it, or the string vanishes when the
+		 * GValue is freed; this means we have to do the entry modification
+		 * here, rather than letting rhythmdb_entry_set_internal do it.
+		 */
+		g_static_rw_lock_writer_lock (&db->priv->entries_lock);
+		g_assert (g_hash_table_remove (db->priv->entries, entry->location));
+
+		s = rb_refstring_new (g_value_get_string (value));
+		rhythmdb_entry_fields_lock (adb, TRUE);
+		rb_refstring_unref (entry->location);
+		entry->location = s;
+		rhythmdb_entry_fields_unlock (adb, TRUE);
+		g_hash_table_insert (db->priv->entries, entry->location, entry);
+		g_static_rw_lock_writer_unlock (&db->priv->entries_lock);
+
+		return TRUE;
+	}
+	case RHYTHMDB_PROP_TITLE:
+		search_index_replace (db, entry, entry->title, g_value_get_string (value));
+		break;
+	case RHYTHMDB_PROP_ALBUM:
+	{
+		const char *albumname = g_value_get_string (value);
+
+		if (strcmp (rb_refstring_get (entry->album), albumname)) {
+			RhythmDBTreeProperty *artist;
+			RhythmDBTreeProperty *genre;
+
+			search_index_replace (db, entry, entry->album, albumname);
+
+			rb_refstring_ref (entry->genre);
+			rb_refstring_ref (entry->artist);
+			rb_refstring_ref (entry->album);
+
+			shard = get_shard (db, type);
+			g_static_rw_lock_writer_lock (&shard->lock);
+			remove_entry_from_album (db, entry);
+			genre = get_or_create_genre (db, type, entry->genre);
+			artist = get_or_create_artist (db, genre, entry->artist);
+			set_entry_album (db, entry, artist, rb_refstring_new (albumname));
+			g_static_rw_lock_writer_unlock (&shard->lock);
+
+			rb_refstring_unref (entry->genre);
+			rb_refstring_unref (entry->artist);
+			rb_refstring_unref (entry->album);
+		}
+		break;
+	}
+	case RHYTHMDB_PROP_ARTIST:
+	{
+		const char *artistname = g_value_get_string (value);
+
+		if (strcmp (rb_refstring_get (entry->artist), artistname)) {
+			RhythmDBTreeProperty *new_artist;
+			RhythmDBTreeProperty *genre;
+
+			search_index_replace (db, entry, entry->artist, artistname);
+
+			rb_refstring_ref (entry->genre);
+			rb_refstring_ref (entry->artist);
+			rb_refstring_ref (entry->album);
+
+			shard = get_shard (db, type);
+			g_static_rw_lock_writer_lock (&shard->lock);
+			remove_entry_from_album (db, entry);
+			genre = get_or_create_genre (db, type, entry->genre);
+			new_artist = get_or_create_artist (db, genre,
+							   rb_refstring_new (artistname));
+			set_entry_album (db, entry, new_artist, entry->album);
+			g_static_rw_lock_writer_unlock (&shard->lock);
+
+			rb_refstring_unref (entry->genre);
+			rb_refstring_unref (entry->artist);
+			rb_refstring_unref (entry->album);
+		}
+		break;
+	}
+	case RHYTHMDB_PROP_GENRE:
+	{
+		const char *genrename = g_value_get_string (value);
+
+		if (strcmp (rb_refstring_get (entry->genre), genrename)) {
+			RhythmDBTreeProperty *new_genre;
+			RhythmDBTreeProperty *new_artist;
+
+			search_index_replace (db, entry, entry->genre, genrename);
+
+			rb_refstring_ref (entry->genre);
+			rb_refstring_ref (entry->artist);
+			rb_refstring_ref (entry->album);
+
+			shard = get_shard (db, type);
+			g_static_rw_lock_writer_lock (&shard->lock);
+			remove_entry_from_album (db, entry);
+			new_genre = get_or_create_genre (db, type,
+							 rb_refstring_new (genrename));
+			new_artist = get_or_create_artist (db, new_genre, entry->artist);
+			set_entry_album (db, entry, new_artist, entry->album);
+			g_static_rw_lock_writer_unlock (&shard->lock);
+
+			rb_refstring_unref (entry->genre);
+			rb_refstring_unref (entry->artist);
+			rb_refstring_unref (entry->album);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	return FALSE;
+}
+
+static void
+rhythmdb_tree_entry_delete (RhythmDB *adb,
+			    RhythmDBEntry *entry)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	RhythmDBTreeShard *shard;
+
+	rhythmdb_tree_journal_delete (db, entry);
+
+	shard = get_shard (db, entry->type);
+	g_static_rw_lock_writer_lock (&shard->lock);
+	remove_entry_from_album (db, entry);
+	g_static_rw_lock_writer_unlock (&shard->lock);
+
+	/* remove all keywords */
+	g_static_rw_lock_writer_lock (&db->priv->keywords_lock);
+	remove_entry_from_keywords (db, entry);
+	g_static_rw_lock_writer_unlock (&db->priv->keywords_lock);
 
-			for (l = keywords; l != NULL; l = g_list_next (l)) {
-				RBRefString *keyword = (RBRefString*)l->data;
+	search_index_remove_entry (db, entry);
+	trigram_index_remove_entry (db, entry);
+	range_index_remove_entry (db, entry);
 
-				RHYTHMDB_FWRITE_STATICSTR ("    <keyword>", ctx->handle, ctx->error);
-				encoded	= xmlEncodeEntitiesReentrant (NULL, BAD_CAST rb_refstring_get (keyword));
-				RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx->handle, ctx->error);
-				g_free (encoded);
-				RHYTHMDB_FWRITE_STATICSTR ("</keyword>\n", ctx->handle, ctx->error);
+	g_static_rw_lock_writer_lock (&db->priv->entries_lock);
+	g_assert (g_hash_table_remove (db->priv->entries, entry->location));
+	g_assert (g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id)));
 
-				rb_refstring_unref (keyword);
-			}
+	entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
+	rhythmdb_entry_unref (entry);
+	g_static_rw_lock_writer_unlock (&db->priv->entries_lock);
+}
 
-			g_list_free (keywords);
-			break;
-		case RHYTHMDB_PROP_TITLE_SORT_KEY:
-		case RHYTHMDB_PROP_GENRE_SORT_KEY:
-		case RHYTHMDB_PROP_ARTIST_SORT_KEY:
-		case RHYTHMDB_PROP_ALBUM_SORT_KEY:
-		case RHYTHMDB_PROP_ALBUM_ARTIST_SORT_KEY:
-		case RHYTHMDB_PROP_ARTIST_SORTNAME_SORT_KEY:
-		case RHYTHMDB_PROP_ALBUM_SORTNAME_SORT_KEY:
-		case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME_SORT_KEY:
-		case RHYTHMDB_PROP_TITLE_FOLDED:
-		case RHYTHMDB_PROP_GENRE_FOLDED:
-		case RHYTHMDB_PROP_ARTIST_FOLDED:
-		case RHYTHMDB_PROP_ALBUM_FOLDED:
-		case RHYTHMDB_PROP_ALBUM_ARTIST_FOLDED:
-		case RHYTHMDB_PROP_ARTIST_SORTNAME_FOLDED:
-		case RHYTHMDB_PROP_ALBUM_SORTNAME_FOLDED:
-		case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME_FOLDED:
-		case RHYTHMDB_PROP_LAST_PLAYED_STR:
-		case RHYTHMDB_PROP_PLAYBACK_ERROR:
-		case RHYTHMDB_PROP_FIRST_SEEN_STR:
-		case RHYTHMDB_PROP_LAST_SEEN_STR:
-		case RHYTHMDB_PROP_SEARCH_MATCH:
-		case RHYTHMDB_PROP_YEAR:
-		case RHYTHMDB_NUM_PROPERTIES:
-		/* obsolete replaygain properties */
-		case RHYTHMDB_PROP_TRACK_GAIN:
-		case RHYTHMDB_PROP_TRACK_PEAK:
-		case RHYTHMDB_PROP_ALBUM_GAIN:
-		case RHYTHMDB_PROP_ALBUM_PEAK:
-			break;
+/* removes entries from the keyword, search, trigram and range indexes,
+ * taking each index lock once for the whole batch.
+ */
+static void
+remove_entries_from_indexes (RhythmDBTree *db,
+			     GPtrArray *entries)
+{
+	guint i;
+
+	g_static_rw_lock_writer_lock (&db->priv->keywords_lock);
+	if (g_hash_table_size (db->priv->keywords) > 0) {
+		for (i = 0; i < entries->len; i++) {
+			remove_entry_from_keywords (db, g_ptr_array_index (entries, i));
 		}
 	}
+	g_static_rw_lock_writer_unlock (&db->priv->keywords_lock);
 
-	RHYTHMDB_FWRITE_STATICSTR ("  </entry>\n", ctx->handle, ctx->error);
+	search_index_remove_entries (db, entries);
+	trigram_index_remove_entries (db, entries);
+	range_index_remove_entries (db, entries);
 }
 
 static void
-save_entry_type (const char *name,
-		 RhythmDBEntryType *entry_type,
-		 struct RhythmDBTreeSaveContext *ctx)
+rhythmdb_tree_entry_delete_many (RhythmDB *adb,
+				 GPtrArray *entries)
 {
-	gboolean save_to_disk = FALSE;
-	g_object_get (entry_type, "save-to-disk", &save_to_disk, NULL);
-	if (save_to_disk == FALSE)
-		return;
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	RhythmDBTreeShard *shard = NULL;
+	RhythmDBEntryType *type = NULL;
+	guint i;
 
-	rb_debug ("saving entries of type %s", name);
-	rhythmdb_hash_tree_foreach (RHYTHMDB (ctx->db), entry_type,
-				    (RBTreeEntryItFunc) save_entry,
-				    NULL, NULL, NULL, ctx);
+	for (i = 0; i < entries->len; i++) {
+		rhythmdb_tree_journal_delete (db, g_ptr_array_index (entries, i));
+	}
+
+	g_static_rw_lock_writer_lock (&db->priv->entries_lock);
+
+	/* entries being deleted together are usually of the same type, so
+	 * only switch shard locks when the type changes.
+	 */
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+
+		if (entry->type != type) {
+			if (shard != NULL)
+				g_static_rw_lock_writer_unlock (&shard->lock);
+			type = entry->type;
+			shard = get_shard (db, type);
+			g_static_rw_lock_writer_lock (&shard->lock);
+		}
+		remove_entry_from_album (db, entry);
+	}
+	if (shard != NULL)
+		g_static_rw_lock_writer_unlock (&shard->lock);
+
+	remove_entries_from_indexes (db, entries);
+
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+
+		g_assert (g_hash_table_remove (db->priv->entries, entry->location));
+		g_assert (g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id)));
+
+		entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
+		rhythmdb_entry_unref (entry);
+	}
+	g_static_rw_lock_writer_unlock (&db->priv->entries_lock);
+}
+
+typedef struct {
+	RhythmDBTree *db;
+	RhythmDBEntryType *type;
+	GPtrArray *entries;
+} RbEntryRemovalCtxt;
+
+/* must be called with the entries lock held */
+static gboolean
+remove_one_song (gpointer key,
+		 RhythmDBEntry *entry,
+		 RbEntryRemovalCtxt *ctxt)
+{
+	rhythmdb_tree_assert_locked (&ctxt->db->priv->entries_lock);
+
+	g_return_val_if_fail (entry != NULL, FALSE);
+
+	if (entry->type == ctxt->type) {
+		g_hash_table_remove (ctxt->db->priv->entry_ids, GINT_TO_POINTER (entry->id));
+		entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
+
+		/* the album is destroyed along with the rest of the type's tree */
+		entry->data = NULL;
+
+		/* the array takes over the reference held by the entries table */
+		g_ptr_array_add (ctxt->entries, entry);
+		return TRUE;
+	}
+	return FALSE;
 }
 
+/* destroys a detached genre/artist/album tree without unlinking
+ * each entry from its album first.
+ */
 static void
-save_unknown_entry_type (RBRefString *typename,
-			 GList *entries,
-			 struct RhythmDBTreeSaveContext *ctx)
+destroy_genres_tree (GHashTable *genres)
 {
-	GList *t;
+	GHashTableIter genre_iter;
+	gpointer genre;
+
+	g_hash_table_iter_init (&genre_iter, genres);
+	while (g_hash_table_iter_next (&genre_iter, NULL, &genre)) {
+		GHashTableIter artist_iter;
+		gpointer artist;
+
+		g_hash_table_iter_init (&artist_iter, ((RhythmDBTreeProperty *) genre)->children);
+		while (g_hash_table_iter_next (&artist_iter, NULL, &artist)) {
+			GHashTableIter album_iter;
+			gpointer album;
+
+			g_hash_table_iter_init (&album_iter, ((RhythmDBTreeProperty *) artist)->children);
+			while (g_hash_table_iter_next (&album_iter, NULL, &album)) {
+				destroy_tree_property (album);
+			}
+			destroy_tree_property (artist);
+		}
+		destroy_tree_property (genre);
+	}
+	g_hash_table_destroy (genres);
+}
 
-	for (t = entries; t != NULL; t = t->next) {
-		RhythmDBUnknownEntry *entry;
-		xmlChar *encoded;
-		GList *p;
+static void
+rhythmdb_tree_entry_delete_by_type (RhythmDB *adb,
+				    RhythmDBEntryType *type)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	RhythmDBTreeShard *shard;
+	RbEntryRemovalCtxt ctxt;
+	GHashTable *genres;
 
-		if (ctx->error)
-			return;
+	rhythmdb_tree_journal_delete_type (db, type);
 
-		entry = (RhythmDBUnknownEntry *)t->data;
+	ctxt.db = db;
+	ctxt.type = type;
+	ctxt.entries = g_ptr_array_new ();
+	shard = get_shard (db, type);
+	g_static_rw_lock_writer_lock (&db->priv->entries_lock);
+	g_hash_table_foreach_remove (db->priv->entries,
+				     (GHRFunc) remove_one_song, &ctxt);
 
-		RHYTHMDB_FWRITE_STATICSTR ("  <entry type=\"", ctx->handle, ctx->error);
-		encoded	= xmlEncodeEntitiesReentrant (NULL, BAD_CAST rb_refstring_get (entry->typename));
-		RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx->handle, ctx->error);
-		g_free (encoded);
+	/* all the entries in the type's tree are gone, so replace the
+	 * whole tree rather than removing entries one at a time.
+	 */
+	g_static_rw_lock_writer_lock (&shard->lock);
+	genres = shard->genres;
+	shard->genres = shard_genres_new ();
+	g_static_rw_lock_writer_unlock (&shard->lock);
 
-		RHYTHMDB_FWRITE_STATICSTR ("\">\n", ctx->handle, ctx->error);
+	remove_entries_from_indexes (db, ctxt.entries);
+	g_static_rw_lock_writer_unlock (&db->priv->entries_lock);
 
-		for (p = entry->properties; p != NULL; p = p->next) {
-			RhythmDBUnknownEntryProperty *prop;
-			prop = (RhythmDBUnknownEntryProperty *) p->data;
-			save_entry_string(ctx, (const xmlChar *)rb_refstring_get (prop->name), rb_refstring_get (prop->value));
-		}
+	destroy_genres_tree (genres);
 
-		RHYTHMDB_FWRITE_STATICSTR ("  </entry>\n", ctx->handle, ctx->error);
-	}
+	rb_debug ("deleted %d entries of type %s", ctxt.entries->len, rhythmdb_entry_type_get_name (type));
+	rhythmdb_emit_entries_deleted (adb, ctxt.entries);
+
+	g_ptr_array_foreach (ctxt.entries, (GFunc) rhythmdb_entry_unref, NULL);
+	g_ptr_array_free (ctxt.entries, TRUE);
 }
 
 static void
-rhythmdb_tree_save (RhythmDB *rdb)
+destroy_tree_property (RhythmDBTreeProperty *prop)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
-	char *name;
-	GString *savepath;
-	FILE *f;
-	struct RhythmDBTreeSaveContext ctx;
+#ifndef G_DISABLE_ASSERT
+	prop->magic = 0xf33df33d;
+#endif
+	g_hash_table_destroy (prop->children);
+	g_free (prop);
+}
 
-	g_object_get (G_OBJECT (db), "name", &name, NULL);
+typedef void (*RhythmDBTreeTraversalFunc) (RhythmDBTree *db, RhythmDBEntry *entry, gpointer data);
+typedef void (*RhythmDBTreeAlbumTraversalFunc) (RhythmDBTree *db, RhythmDBTreeProperty *album, gpointer data);
 
-	savepath = g_string_new (name);
-	g_string_append (savepath, ".tmp");
+struct RhythmDBTreeTraversalData
+{
+	RhythmDBTree *db;
+	RhythmDBCompiledQuery *compiled;
+	RhythmDBTreeTraversalFunc func;
+	gpointer data;
+	gboolean *cancel;
+};
 
-	f = fopen (savepath->str, "w");
+static gboolean
+rhythmdb_tree_evaluate_query (RhythmDB *adb,
+			      GPtrArray *query,
+			      RhythmDBEntry *entry)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	guint i;
+	guint last_disjunction;
 
-	if (!f) {
-		g_warning ("Can't save XML: %s", g_strerror (errno));
-		goto out;
-	}
+	for (i = 0, last_disjunction = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
 
-	ctx.db = db;
-	ctx.handle = f;
-	ctx.error = NULL;
-	RHYTHMDB_FWRITE_STATICSTR ("<?xml version=\"1.0\" standalone=\"yes\"?>\n"
-				   "<rhythmdb version=\"" RHYTHMDB_TREE_XML_VERSION "\">\n",
-				   ctx.handle, ctx.error);
+		if (data->type == RHYTHMDB_QUERY_DISJUNCTION) {
+			if (evaluate_conjunctive_subquery (db, query, last_disjunction, i, entry))
+				return TRUE;
 
-	rhythmdb_entry_type_foreach (rdb, (GHFunc) save_entry_type, &ctx);
-	g_mutex_lock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
-	g_hash_table_foreach (db->priv->unknown_entry_types,
-			      (GHFunc) save_unknown_entry_type,
-			      &ctx);
-	g_mutex_unlock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
+			last_disjunction = i + 1;
+		}
+	}
+	if (evaluate_conjunctive_subquery (db, query, last_disjunction, query->len, entry))
+		return TRUE;
+	return FALSE;
+}
 
-	RHYTHMDB_FWRITE_STATICSTR ("</rhythmdb>\n", ctx.handle, ctx.error);
+#define RHYTHMDB_PROPERTY_COMPARE(OP) \
+			switch (rhythmdb_get_property_type (db, data->propid)) { \
+			case G_TYPE_STRING: \
+				if (g_strcmp0 (rhythmdb_entry_get_string (entry, data->propid), \
+					    g_value_get_string (data->val)) OP 0) \
+					return FALSE; \
+				break; \
+			case G_TYPE_ULONG: \
+				if (rhythmdb_entry_get_ulong (entry, data->propid) OP \
+				    g_value_get_ulong (data->val)) \
+					return FALSE; \
+				break; \
+			case G_TYPE_BOOLEAN: \
+				if (rhythmdb_entry_get_boolean (entry, data->propid) OP \
+				    g_value_get_boolean (data->val)) \
+					return FALSE; \
+				break; \
+			case G_TYPE_UINT64: \
+				if (rhythmdb_entry_get_uint64 (entry, data->propid) OP \
+				    g_value_get_uint64 (data->val)) \
+					return FALSE; \
+				break; \
+			case G_TYPE_DOUBLE: \
+				if (rhythmdb_entry_get_double (entry, data->propid) OP \
+				    g_value_get_double (data->val)) \
+					return FALSE; \
+				break; \
+                        case G_TYPE_OBJECT: \
+                                if ((gpointer)rhythmdb_entry_get_object (entry, data->propid) OP \
+                                    g_value_get_object (data->val)) \
+                                        return FALSE; \
+                                break; \
+			default: \
+                                g_warning ("Unexpected type: %s", g_type_name (rhythmdb_get_property_type (db, data->propid))); \
+				g_assert_not_reached (); \
+			}
 
-	if (fclose (f) < 0) {
-		g_warning ("Couldn't close %s: %s",
-			   savepath->str,
-			   g_strerror (errno));
-		unlink (savepath->str);
-		goto out;
+/*
+ * Search word index
+ *
+ * RHYTHMDB_PROP_SEARCH_MATCH matches entries where each search word occurs
+ * in the folded title, album, artist or genre.  Search words never contain
+ * whitespace, so a match always lies within a single whitespace separated
+ * word of the property.  The index maps each such word to the entries that
+ * contain it (with a count, as an entry can contain the same word in more
+ * than one property), so a search only has to look at the distinct words
+ * in the library rather than at every entry.
+ */
+
+static gboolean
+search_index_is_separator (gunichar c)
+{
+	/* these are the characters rb_string_split_words splits on or drops */
+	switch (g_unichar_type (c)) {
+	case G_UNICODE_UNASSIGNED:
+	case G_UNICODE_CONTROL:
+	case G_UNICODE_FORMAT:
+	case G_UNICODE_PRIVATE_USE:
+	case G_UNICODE_SURROGATE:
+	case G_UNICODE_LINE_SEPARATOR:
+	case G_UNICODE_PARAGRAPH_SEPARATOR:
+	case G_UNICODE_SPACE_SEPARATOR:
+		return TRUE;
+	default:
+		return FALSE;
 	}
+}
 
-	if (ctx.error != NULL) {
-		g_warning ("Writing to the database failed: %s", ctx.error);
-		g_free (ctx.error);
-		unlink (savepath->str);
-	} else {
-		if (rename (savepath->str, name) < 0) {
-			g_warning ("Couldn't rename %s to %s: %s",
-				   name, savepath->str,
-				   g_strerror (errno));
-			unlink (savepath->str);
+/* must be called with the words lock held for writing */
+static void
+search_index_update (RhythmDBTree *db,
+		     RhythmDBEntry *entry,
+		     const char *folded,
+		     gboolean add)
+{
+	const char *p;
+	const char *start = NULL;
+
+	if (folded == NULL)
+		return;
+
+	for (p = folded; ; p = g_utf8_next_char (p)) {
+		GHashTable *postings;
+		char *word;
+		guint count;
+
+		if (*p != '\0' && !search_index_is_separator (g_utf8_get_char (p))) {
+			if (start == NULL)
+				start = p;
+			continue;
 		}
-	}
 
-out:
-	g_string_free (savepath, TRUE);
-	g_free (name);
-	return;
-}
+		if (start != NULL) {
+			word = g_strndup (start, p - start);
+			start = NULL;
 
-#undef RHYTHMDB_FWRITE_ENCODED_STR
-#undef RHYTHMDB_FWRITE_STATICSTR
-#undef RHYTHMDB_FPUTC
-#undef RHYTHMDB_FWRITE
+			postings = g_hash_table_lookup (db->priv->words, word);
+			if (add) {
+				if (postings == NULL) {
+					postings = g_hash_table_new (g_direct_hash, g_direct_equal);
+					g_hash_table_insert (db->priv->words, word, postings);
+					word = NULL;
+				}
+				count = GPOINTER_TO_UINT (g_hash_table_lookup (postings, entry));
+				g_hash_table_insert (postings, entry, GUINT_TO_POINTER (count + 1));
+			} else if (postings != NULL) {
+				count = GPOINTER_TO_UINT (g_hash_table_lookup (postings, entry));
+				if (count > 1)
+					g_hash_table_insert (postings, entry, GUINT_TO_POINTER (count - 1));
+				else
+					g_hash_table_remove (postings, entry);
 
-RhythmDB *
-rhythmdb_tree_new (const char *name)
+				if (g_hash_table_size (postings) == 0)
+					g_hash_table_remove (db->priv->words, word);
+			}
+			g_free (word);
+		}
+
+		if (*p == '\0')
+			break;
+	}
+}
+
+static void
+search_index_add_entry (RhythmDBTree *db,
+			RhythmDBEntry *entry)
 {
-	RhythmDBTree *db = g_object_new (RHYTHMDB_TYPE_TREE, "name", name, NULL);
+	g_static_rw_lock_writer_lock (&db->priv->words_lock);
+	search_index_update (db, entry, rb_refstring_get_folded (entry->title), TRUE);
+	search_index_update (db, entry, rb_refstring_get_folded (entry->album), TRUE);
+	search_index_update (db, entry, rb_refstring_get_folded (entry->artist), TRUE);
+	search_index_update (db, entry, rb_refstring_get_folded (entry->genre), TRUE);
+	g_static_rw_lock_writer_unlock (&db->priv->words_lock);
+}
 
-	g_return_val_if_fail (db->priv != NULL, NULL);
+/* must be called with the words lock held */
+static void
+search_index_remove_locked (RhythmDBTree *db,
+			    RhythmDBEntry *entry)
+{
+	search_index_update (db, entry, rb_refstring_get_folded (entry->title), FALSE);
+	search_index_update (db, entry, rb_refstring_get_folded (entry->album), FALSE);
+	search_index_update (db, entry, rb_refstring_get_folded (entry->artist), FALSE);
+	search_index_update (db, entry, rb_refstring_get_folded (entry->genre), FALSE);
+}
 
-	return RHYTHMDB (db);
+static void
+search_index_remove_entry (RhythmDBTree *db,
+			   RhythmDBEntry *entry)
+{
+	g_static_rw_lock_writer_lock (&db->priv->words_lock);
+	search_index_remove_locked (db, entry);
+	g_static_rw_lock_writer_unlock (&db->priv->words_lock);
 }
 
-/* must be called with the genres_lock held */
 static void
-set_entry_album (RhythmDBTree *db,
-		 RhythmDBEntry *entry,
-		 RhythmDBTreeProperty *artist,
-		 RBRefString *name)
+search_index_remove_entries (RhythmDBTree *db,
+			     GPtrArray *entries)
 {
-	struct RhythmDBTreeProperty *prop;
+	guint i;
 
-	prop = get_or_create_album (db, artist, name);
-	g_hash_table_insert (prop->children, entry, NULL);
-	entry->data = prop;
+	g_static_rw_lock_writer_lock (&db->priv->words_lock);
+	for (i = 0; i < entries->len; i++) {
+		search_index_remove_locked (db, g_ptr_array_index (entries, i));
+	}
+	g_static_rw_lock_writer_unlock (&db->priv->words_lock);
 }
 
 static void
-rhythmdb_tree_entry_new (RhythmDB *rdb,
-			 RhythmDBEntry *entry)
+search_index_replace (RhythmDBTree *db,
+		      RhythmDBEntry *entry,
+		      RBRefString *old_value,
+		      const char *new_value)
 {
-	g_mutex_lock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
-	rhythmdb_tree_entry_new_internal (rdb, entry);
-	g_mutex_unlock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
+	char *folded;
+
+	folded = rb_search_fold (new_value);
+	g_static_rw_lock_writer_lock (&db->priv->words_lock);
+	search_index_update (db, entry, rb_refstring_get_folded (old_value), FALSE);
+	search_index_update (db, entry, folded, TRUE);
+	g_static_rw_lock_writer_unlock (&db->priv->words_lock);
+	g_free (folded);
 }
 
-/* must be called with the entry lock held */
 static void
-rhythmdb_tree_entry_new_internal (RhythmDB *rdb, RhythmDBEntry *entry)
+search_index_union (RhythmDBEntry *entry,
+		    gpointer count,
+		    GHashTable *matches)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
-	RhythmDBTreeProperty *artist;
-	RhythmDBTreeProperty *genre;
+	g_hash_table_insert (matches, entry, entry);
+}
 
-	rb_assert_locked (db->priv->entries_lock);
-	g_assert (entry != NULL);
+/* must be called with the words lock held */
+static GHashTable *
+search_index_lookup_word (RhythmDBTree *db,
+			  const char *word)
+{
+	GHashTable *matches;
+	GHashTableIter iter;
+	gpointer key;
+	gpointer postings;
 
-	g_return_if_fail (entry->location != NULL);
+	matches = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-	if (entry->title == NULL) {
-		g_warning ("Entry %s has missing title", rb_refstring_get (entry->location));
-		entry->title = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->artist == NULL) {
-		g_warning ("Entry %s has missing artist", rb_refstring_get (entry->location));
-		entry->artist = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->album == NULL) {
-		g_warning ("Entry %s has missing album", rb_refstring_get (entry->location));
-		entry->album = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->genre == NULL) {
-		g_warning ("Entry %s has missing genre", rb_refstring_get (entry->location));
-		entry->genre = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->mimetype == NULL) {
-		g_warning ("Entry %s has missing mimetype", rb_refstring_get (entry->location));
-		entry->mimetype = rb_refstring_new ("unknown/unknown");
+	/* a whole word match goes straight to its posting list; anything
+	 * else is a substring of one or more indexed words, which we find by
+	 * scanning the list of distinct words.
+	 */
+	postings = g_hash_table_lookup (db->priv->words, word);
+	if (postings != NULL)
+		g_hash_table_foreach (postings, (GHFunc) search_index_union, matches);
+
+	g_hash_table_iter_init (&iter, db->priv->words);
+	while (g_hash_table_iter_next (&iter, &key, &postings)) {
+		if (strcmp (key, word) != 0 && strstr (key, word) != NULL)
+			g_hash_table_foreach (postings, (GHFunc) search_index_union, matches);
 	}
 
-	/* Initialize the tree structure. */
-	g_mutex_lock (db->priv->genres_lock);
-	genre = get_or_create_genre (db, entry->type, entry->genre);
-	artist = get_or_create_artist (db, genre, entry->artist);
-	set_entry_album (db, entry, artist, entry->album);
-	g_mutex_unlock (db->priv->genres_lock);
-
-	/* this accounts for the initial reference on the entry */
-	g_hash_table_insert (db->priv->entries, entry->location, entry);
-	g_hash_table_insert (db->priv->entry_ids, GINT_TO_POINTER (entry->id), entry);
-
-	entry->flags &= ~RHYTHMDB_ENTRY_TREE_LOADING;
+	return matches;
 }
 
-static RhythmDBTreeProperty *
-rhythmdb_tree_property_new (RhythmDBTree *db)
+static gboolean
+entry_set_intersect (RhythmDBEntry *entry,
+		     gpointer value,
+		     GHashTable *other)
 {
-	RhythmDBTreeProperty *ret = g_new0 (RhythmDBTreeProperty, 1);
-#ifndef G_DISABLE_ASSERT
-	ret->magic = 0xf00dbeef;
-#endif
-	return ret;
+	return (g_hash_table_lookup (other, entry) == NULL);
 }
 
+/* intersects two sets of entries, destroying one of them and returning the other */
 static GHashTable *
-get_genres_hash_for_type (RhythmDBTree *db,
-			  RhythmDBEntryType *type)
+entry_set_intersection (GHashTable *a,
+			GHashTable *b)
 {
-	GHashTable *table;
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+
+	/* keep the smaller set, drop anything not in the other one */
+	if (g_hash_table_size (b) < g_hash_table_size (a)) {
+		GHashTable *t = a;
+		a = b;
+		b = t;
+	}
+	g_hash_table_foreach_remove (a, (GHRFunc) entry_set_intersect, b);
+	g_hash_table_destroy (b);
+	return a;
+}
 
-	table = g_hash_table_lookup (db->priv->genres, type);
-	if (table == NULL) {
-		table = g_hash_table_new_full (rb_refstring_hash,
-					       rb_refstring_equal,
-					       (GDestroyNotify) rb_refstring_unref,
-					       NULL);
-		if (table == NULL) {
-			g_warning ("Out of memory\n");
+/*
+ * Returns the set of entries matching all the search words, or NULL if the
+ * index can't be used to answer the query.  Must be called with the words
+ * lock held.
+ */
+static GHashTable *
+search_index_lookup (RhythmDBTree *db,
+		     char **words)
+{
+	GHashTable *result = NULL;
+	char **word;
+
+	if (words == NULL || words[0] == NULL)
+		return NULL;
+	for (word = words; *word != NULL; word++) {
+		/* an empty word matches every entry */
+		if ((*word)[0] == '\0')
 			return NULL;
+	}
+
+	for (word = words; *word != NULL; word++) {
+		GHashTable *matches;
+
+		matches = search_index_lookup_word (db, *word);
+		result = entry_set_intersection (result, matches);
+		if (g_hash_table_size (result) == 0)
+			break;
+	}
+
+	return result;
+}
+
+/*
+ * Estimates how many postings search_index_lookup would have to go
+ * through to answer a search, giving up once it gets past @limit.  Returns
+ * G_MAXUINT if the index can't be used.  Must be called with the words
+ * lock held.
+ */
+static guint
+search_index_estimate (RhythmDBTree *db,
+		       char **words,
+		       guint limit)
+{
+	guint cost = 0;
+	char **word;
+
+	if (words == NULL || words[0] == NULL)
+		return G_MAXUINT;
+	for (word = words; *word != NULL; word++) {
+		if ((*word)[0] == '\0')
+			return G_MAXUINT;
+	}
+
+	for (word = words; *word != NULL; word++) {
+		GHashTableIter iter;
+		gpointer key;
+		gpointer postings;
+
+		/* comparing a word is a lot cheaper than evaluating the
+		 * query for an entry, so the vocabulary scan counts for less.
+		 */
+		cost += g_hash_table_size (db->priv->words) / 4;
+
+		g_hash_table_iter_init (&iter, db->priv->words);
+		while (g_hash_table_iter_next (&iter, &key, &postings)) {
+			if (strstr (key, *word) != NULL)
+				cost += g_hash_table_size (postings);
 		}
-		g_hash_table_insert (db->priv->genres,
-				     type,
-				     table);
+		if (cost > limit)
+			break;
 	}
-	return table;
+
+	return cost;
 }
 
-typedef void (*RBHFunc)(RhythmDBTree *db, GHashTable *genres, gpointer data);
+/*
+ * Trigram indexes
+ *
+ * LIKE on an arbitrary string property is a substring search, so it can't
+ * use the tree or the word index.  For properties that have a trigram
+ * index enabled, we keep a list of the entries containing each sequence of
+ * three bytes.  Any entry containing the search string must appear in the
+ * list of each of its trigrams, so the shortest of those lists is a
+ * candidate set, which is then checked with the normal query evaluation.
+ *
+ * The posting lists are plain arrays, as the index is mostly needed for
+ * long values like locations, and hash tables would take several times as
+ * much memory.  Entries are appended when a value is added; when a value is
+ * removed, the old postings are left behind and only counted.  Deleted
+ * entries are kept alive until the next compaction so the stale postings
+ * never point to freed memory.  Once enough of the index is stale it is
+ * rebuilt from scratch.
+ */
 
 typedef struct {
-	RhythmDBTree *db;
-	RBHFunc func;
-	gpointer data;
-} GenresIterCtxt;
+	guint propid;
+	GHashTable *trigrams;	/* GHashTable<guint32, GPtrArray<RhythmDBEntry>> */
+	GHashTable *members;	/* GHashTable<RhythmDBEntry, RhythmDBEntry>, entries in the database */
+	GPtrArray *dead;	/* deleted entries, one reference each */
+	guint n_postings;
+	guint n_stale;
+} RhythmDBTreeTrigramIndex;
 
-static void
-genres_process_one (gpointer key,
-		    gpointer value,
-		    gpointer user_data)
+#define TRIGRAM(s)			((((guint32)(guchar)(s)[0]) << 16) | (((guint32)(guchar)(s)[1]) << 8) | ((guint32)(guchar)(s)[2]))
+#define TRIGRAM_MIN_COMPACT_SIZE	1024
+
+static gboolean
+trigram_index_supported (guint propid)
 {
-	GenresIterCtxt *ctxt = (GenresIterCtxt *)user_data;
-	ctxt->func (ctxt->db, (GHashTable *)value, ctxt->data);
+	/* only properties whose values are stored in the entry and
+	 * changed through rhythmdb_tree_entry_set can be indexed.
+	 */
+	switch (propid) {
+	case RHYTHMDB_PROP_TITLE:
+	case RHYTHMDB_PROP_GENRE:
+	case RHYTHMDB_PROP_ARTIST:
+	case RHYTHMDB_PROP_ALBUM:
+	case RHYTHMDB_PROP_LOCATION:
+	case RHYTHMDB_PROP_MOUNTPOINT:
+	case RHYTHMDB_PROP_MIMETYPE:
+	case RHYTHMDB_PROP_DESCRIPTION:
+	case RHYTHMDB_PROP_SUBTITLE:
+	case RHYTHMDB_PROP_SUMMARY:
+	case RHYTHMDB_PROP_LANG:
+	case RHYTHMDB_PROP_COPYRIGHT:
+	case RHYTHMDB_PROP_IMAGE:
+	case RHYTHMDB_PROP_MUSICBRAINZ_TRACKID:
+	case RHYTHMDB_PROP_MUSICBRAINZ_ARTISTID:
+	case RHYTHMDB_PROP_MUSICBRAINZ_ALBUMID:
+	case RHYTHMDB_PROP_MUSICBRAINZ_ALBUMARTISTID:
+	case RHYTHMDB_PROP_ARTIST_SORTNAME:
+	case RHYTHMDB_PROP_ALBUM_SORTNAME:
+	case RHYTHMDB_PROP_COMMENT:
+	case RHYTHMDB_PROP_ALBUM_ARTIST:
+	case RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME:
+		return TRUE;
+	default:
+		return FALSE;
+	}
 }
 
+/* must be called with the trigram lock held for writing */
 static void
-genres_hash_foreach (RhythmDBTree *db, RBHFunc func, gpointer data)
+trigram_index_add_value (RhythmDBTreeTrigramIndex *index,
+			 RhythmDBEntry *entry,
+			 const char *value)
 {
-	GenresIterCtxt ctxt;
+	const char *p;
 
-	ctxt.db = db;
-	ctxt.func = func;
-	ctxt.data = data;
-	g_hash_table_foreach (db->priv->genres, genres_process_one, &ctxt);
+	if (value == NULL)
+		return;
+
+	for (p = value; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++) {
+		GPtrArray *postings;
+		guint32 trigram = TRIGRAM (p);
+
+		postings = g_hash_table_lookup (index->trigrams, GUINT_TO_POINTER (trigram));
+		if (postings == NULL) {
+			postings = g_ptr_array_sized_new (4);
+			g_hash_table_insert (index->trigrams, GUINT_TO_POINTER (trigram), postings);
+		} else if (postings->len > 0 && g_ptr_array_index (postings, postings->len - 1) == entry) {
+			/* repeated trigram within this value */
+			continue;
+		}
+		g_ptr_array_add (postings, entry);
+		index->n_postings++;
+	}
 }
 
-/* must be called with the genres lock held */
-static RhythmDBTreeProperty *
-get_or_create_genre (RhythmDBTree *db,
-		     RhythmDBEntryType *type,
-		     RBRefString *name)
+static guint
+trigram_count (const char *value)
 {
-	RhythmDBTreeProperty *genre;
-	GHashTable *table;
+	size_t len;
 
-	rb_assert_locked (db->priv->genres_lock);
+	if (value == NULL)
+		return 0;
+	len = strlen (value);
+	return (len > 2) ? len - 2 : 0;
+}
 
-	table = get_genres_hash_for_type (db, type);
-	genre = g_hash_table_lookup (table, name);
+static void
+free_posting_list (gpointer data)
+{
+	g_ptr_array_free ((GPtrArray *) data, TRUE);
+}
 
-	if (G_UNLIKELY (genre == NULL)) {
-		genre = rhythmdb_tree_property_new (db);
-		genre->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
-							 (GDestroyNotify) rb_refstring_unref,
-							 NULL);
-		rb_refstring_ref (name);
-		g_hash_table_insert (table, name, genre);
-		genre->parent = NULL;
+static void
+trigram_index_build (RhythmDBTreeTrigramIndex *index)
+{
+	GHashTableIter iter;
+	gpointer entry;
+
+	if (index->trigrams != NULL)
+		g_hash_table_destroy (index->trigrams);
+	index->trigrams = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free_posting_list);
+	index->n_postings = 0;
+	index->n_stale = 0;
+
+	g_hash_table_iter_init (&iter, index->members);
+	while (g_hash_table_iter_next (&iter, &entry, NULL)) {
+		trigram_index_add_value (index, entry, rhythmdb_entry_get_string (entry, index->propid));
 	}
-
-	return genre;
 }
 
-/* must be called with the genres lock held */
-static RhythmDBTreeProperty *
-get_or_create_artist (RhythmDBTree *db,
-		      RhythmDBTreeProperty *genre,
-		      RBRefString *name)
+static void
+trigram_index_compact (RhythmDBTree *db,
+		       RhythmDBTreeTrigramIndex *index)
 {
-	RhythmDBTreeProperty *artist;
-
-	rb_assert_locked (db->priv->genres_lock);
+	guint i;
 
-	artist = g_hash_table_lookup (genre->children, name);
+	rb_debug ("compacting trigram index for %s: %u stale postings, %u deleted entries",
+		  (const char *) rhythmdb_nice_elt_name_from_propid (RHYTHMDB (db), index->propid),
+		  index->n_stale, index->dead->len);
 
-	if (G_UNLIKELY (artist == NULL)) {
-		artist = rhythmdb_tree_property_new (db);
-		artist->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
-							  (GDestroyNotify) rb_refstring_unref,
-							  NULL);
-		rb_refstring_ref (name);
-		g_hash_table_insert (genre->children, name, artist);
-		artist->parent = genre;
+	trigram_index_build (index);
+	for (i = 0; i < index->dead->len; i++) {
+		rhythmdb_entry_unref (g_ptr_array_index (index->dead, i));
 	}
-
-	return artist;
+	g_ptr_array_set_size (index->dead, 0);
 }
 
-/* must be called with the genres lock held */
-static RhythmDBTreeProperty *
-get_or_create_album (RhythmDBTree *db,
-		     RhythmDBTreeProperty *artist,
-		     RBRefString *name)
+static void
+trigram_index_maybe_compact (RhythmDBTree *db,
+			     RhythmDBTreeTrigramIndex *index)
 {
-	RhythmDBTreeProperty *album;
-
-	rb_assert_locked (db->priv->genres_lock);
+	guint live;
+
+	live = index->n_postings - MIN (index->n_stale, index->n_postings);
+	if (index->n_stale > TRIGRAM_MIN_COMPACT_SIZE && index->n_stale > live) {
+		trigram_index_compact (db, index);
+	} else if (index->dead->len > TRIGRAM_MIN_COMPACT_SIZE / 8 &&
+		   index->dead->len > g_hash_table_size (index->members) / 4) {
+		trigram_index_compact (db, index);
+	}
+}
 
-	album = g_hash_table_lookup (artist->children, name);
+static void
+trigram_index_free (gpointer data)
+{
+	RhythmDBTreeTrigramIndex *index = data;
+	guint i;
 
-	if (G_UNLIKELY (album == NULL)) {
-		album = rhythmdb_tree_property_new (db);
-		album->children = g_hash_table_new (g_direct_hash, g_direct_equal);
-		rb_refstring_ref (name);
-		g_hash_table_insert (artist->children, name, album);
-		album->parent = artist;
+	for (i = 0; i < index->dead->len; i++) {
+		rhythmdb_entry_unref (g_ptr_array_index (index->dead, i));
 	}
-
-	return album;
+	g_ptr_array_free (index->dead, TRUE);
+	g_hash_table_destroy (index->trigrams);
+	g_hash_table_destroy (index->members);
+	g_free (index);
 }
 
-static gboolean
-remove_child (RhythmDBTreeProperty *parent,
-	      gconstpointer data)
+static gsize
+trigram_index_size (RhythmDBTreeTrigramIndex *index)
 {
-	g_assert (g_hash_table_remove (parent->children, data));
-	if (g_hash_table_size (parent->children) <= 0) {
-		return TRUE;
-	}
-	return FALSE;
+	/* approximate: a hash node per trigram and per member, plus the
+	 * posting arrays themselves.
+	 */
+	return g_hash_table_size (index->trigrams) * (3 * sizeof (gpointer) + sizeof (GPtrArray) + 2 * sizeof (gpointer)) +
+		g_hash_table_size (index->members) * 4 * sizeof (gpointer) +
+		index->n_postings * sizeof (gpointer) +
+		index->dead->len * sizeof (gpointer);
 }
 
-/* must be called with the genres lock held */
 static void
-remove_entry_from_album (RhythmDBTree *db,
+trigram_index_add_entry (RhythmDBTree *db,
 			 RhythmDBEntry *entry)
 {
-	GHashTable *table;
+	GHashTableIter iter;
+	gpointer index;
 
-	rb_assert_locked (db->priv->genres_lock);
+	g_static_rw_lock_writer_lock (&db->priv->trigram_lock);
+	g_hash_table_iter_init (&iter, db->priv->trigram_indexes);
+	while (g_hash_table_iter_next (&iter, NULL, &index)) {
+		RhythmDBTreeTrigramIndex *tindex = index;
 
-	rb_refstring_ref (entry->genre);
-	rb_refstring_ref (entry->artist);
-	rb_refstring_ref (entry->album);
+		g_hash_table_insert (tindex->members, entry, entry);
+		trigram_index_add_value (tindex, entry, rhythmdb_entry_get_string (entry, tindex->propid));
+	}
+	g_static_rw_lock_writer_unlock (&db->priv->trigram_lock);
+}
 
-	table = get_genres_hash_for_type (db, entry->type);
-	if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry), entry)) {
-		if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent,
-				  entry->album)) {
+/* must be called with the trigram lock held */
+static gboolean
+trigram_index_remove_member (RhythmDBTreeTrigramIndex *index,
+			     RhythmDBEntry *entry)
+{
+	if (g_hash_table_remove (index->members, entry) == FALSE)
+		return FALSE;
 
-			if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent,
-					  entry->artist)) {
-				destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent);
-				g_assert (g_hash_table_remove (table, entry->genre));
-			}
-			destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent);
-		}
+	g_ptr_array_add (index->dead, rhythmdb_entry_ref (entry));
+	index->n_stale += trigram_count (rhythmdb_entry_get_string (entry, index->propid));
+	return TRUE;
+}
 
-		destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry));
+static void
+trigram_index_remove_entry (RhythmDBTree *db,
+			    RhythmDBEntry *entry)
+{
+	GHashTableIter iter;
+	gpointer index;
+
+	g_static_rw_lock_writer_lock (&db->priv->trigram_lock);
+	g_hash_table_iter_init (&iter, db->priv->trigram_indexes);
+	while (g_hash_table_iter_next (&iter, NULL, &index)) {
+		if (trigram_index_remove_member (index, entry))
+			trigram_index_maybe_compact (db, index);
 	}
-
-	rb_refstring_unref (entry->genre);
-	rb_refstring_unref (entry->artist);
-	rb_refstring_unref (entry->album);
+	g_static_rw_lock_writer_unlock (&db->priv->trigram_lock);
 }
 
-static gboolean
-rhythmdb_tree_entry_set (RhythmDB *adb,
-			 RhythmDBEntry *entry,
-			 guint propid,
-			 const GValue *value)
+/* only considers compacting each index once, after the whole batch is removed */
+static void
+trigram_index_remove_entries (RhythmDBTree *db,
+			      GPtrArray *entries)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
-	RhythmDBEntryType *type;
+	GHashTableIter iter;
+	gpointer index;
+	guint i;
 
-	type = entry->type;
+	g_static_rw_lock_writer_lock (&db->priv->trigram_lock);
+	g_hash_table_iter_init (&iter, db->priv->trigram_indexes);
+	while (g_hash_table_iter_next (&iter, NULL, &index)) {
+		gboolean removed = FALSE;
 
-	/* don't process changes to entries we're loading, we'll get them
-	 * when the entry is complete.  don't process changes for entries that
-	 * have been removed either.
-	 */
-	if (entry->flags & (RHYTHMDB_ENTRY_TREE_LOADING | RHYTHMDB_ENTRY_TREE_REMOVED))
-		return FALSE;
+		for (i = 0; i < entries->len; i++) {
+			removed |= trigram_index_remove_member (index, g_ptr_array_index (entries, i));
+		}
+		if (removed)
+			trigram_index_maybe_compact (db, index);
+	}
+	g_static_rw_lock_writer_unlock (&db->priv->trigram_lock);
+}
 
-	/* Handle special properties */
-	switch (propid)
-	{
-	case RHYTHMDB_PROP_LOCATION:
-	{
-		RBRefString *s;
-		/* We have to use the string in the entry itself as the hash key,
-		 * otherwise either we leak it, or the string vanishes when the
-		 * GValue is freed; this means we have to do the entry modification
-		 * here, rather than letting rhythmdb_entry_set_internal do it.
-		 */
-		g_mutex_lock (db->priv->entries_lock);
-		g_assert (g_hash_table_remove (db->priv->entries, entry->location));
+static void
+trigram_index_replace (RhythmDBTree *db,
+		       RhythmDBEntry *entry,
+		       guint propid,
+		       const GValue *value)
+{
+	RhythmDBTreeTrigramIndex *index;
 
-		s = rb_refstring_new (g_value_get_string (value));
-		rb_refstring_unref (entry->location);
-		entry->location = s;
-		g_hash_table_insert (db->priv->entries, entry->location, entry);
-		g_mutex_unlock (db->priv->entries_lock);
+	if (G_LIKELY (g_hash_table_size (db->priv->trigram_indexes) == 0))
+		return;
 
-		return TRUE;
+	g_static_rw_lock_writer_lock (&db->priv->trigram_lock);
+	index = g_hash_table_lookup (db->priv->trigram_indexes, GUINT_TO_POINTER (propid));
+	if (index != NULL && g_hash_table_lookup (index->members, entry) != NULL) {
+		index->n_stale += trigram_count (rhythmdb_entry_get_string (entry, propid));
+		trigram_index_add_value (index, entry, g_value_get_string (value));
+		trigram_index_maybe_compact (db, index);
 	}
-	case RHYTHMDB_PROP_ALBUM:
-	{
-		const char *albumname = g_value_get_string (value);
+	g_static_rw_lock_writer_unlock (&db->priv->trigram_lock);
+}
 
-		if (strcmp (rb_refstring_get (entry->album), albumname)) {
-			RhythmDBTreeProperty *artist;
-			RhythmDBTreeProperty *genre;
+/*
+ * Returns the set of entries that may contain the string, or NULL if the
+ * index can't be used to answer the query.  Must be called with the
+ * trigram lock held.
+ */
+static GHashTable *
+trigram_index_lookup (RhythmDBTree *db,
+		      guint propid,
+		      const char *value)
+{
+	RhythmDBTreeTrigramIndex *index;
+	GPtrArray *shortest = NULL;
+	GHashTable *matches;
+	const char *p;
+	guint i;
 
-			rb_refstring_ref (entry->genre);
-			rb_refstring_ref (entry->artist);
-			rb_refstring_ref (entry->album);
+	index = g_hash_table_lookup (db->priv->trigram_indexes, GUINT_TO_POINTER (propid));
+	if (index == NULL || value == NULL || strlen (value) < 3)
+		return NULL;
 
-			g_mutex_lock (db->priv->genres_lock);
-			remove_entry_from_album (db, entry);
-			genre = get_or_create_genre (db, type, entry->genre);
-			artist = get_or_create_artist (db, genre, entry->artist);
-			set_entry_album (db, entry, artist, rb_refstring_new (albumname));
-			g_mutex_unlock (db->priv->genres_lock);
+	matches = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (p = value; p[2] != '\0'; p++) {
+		GPtrArray *postings;
 
-			rb_refstring_unref (entry->genre);
-			rb_refstring_unref (entry->artist);
-			rb_refstring_unref (entry->album);
+		postings = g_hash_table_lookup (index->trigrams, GUINT_TO_POINTER (TRIGRAM (p)));
+		if (postings == NULL) {
+			/* no entry contains this trigram */
+			return matches;
 		}
-		break;
+		if (shortest == NULL || postings->len < shortest->len)
+			shortest = postings;
 	}
-	case RHYTHMDB_PROP_ARTIST:
-	{
-		const char *artistname = g_value_get_string (value);
 
-		if (strcmp (rb_refstring_get (entry->artist), artistname)) {
-			RhythmDBTreeProperty *new_artist;
-			RhythmDBTreeProperty *genre;
+	for (i = 0; i < shortest->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (shortest, i);
 
-			rb_refstring_ref (entry->genre);
-			rb_refstring_ref (entry->artist);
-			rb_refstring_ref (entry->album);
+		/* skip postings for deleted entries */
+		if (g_hash_table_lookup (index->members, entry) != NULL)
+			g_hash_table_insert (matches, entry, entry);
+	}
+	return matches;
+}
 
-			g_mutex_lock (db->priv->genres_lock);
-			remove_entry_from_album (db, entry);
-			genre = get_or_create_genre (db, type, entry->genre);
-			new_artist = get_or_create_artist (db, genre,
-							   rb_refstring_new (artistname));
-			set_entry_album (db, entry, new_artist, entry->album);
-			g_mutex_unlock (db->priv->genres_lock);
+/*
+ * Returns the number of postings trigram_index_lookup would go through to
+ * find the entries that may contain the string, or G_MAXUINT if the index
+ * can't be used.  Must be called with the trigram lock held.
+ */
+static guint
+trigram_index_estimate (RhythmDBTree *db,
+			guint propid,
+			const char *value)
+{
+	RhythmDBTreeTrigramIndex *index;
+	guint shortest = G_MAXUINT;
+	const char *p;
 
-			rb_refstring_unref (entry->genre);
-			rb_refstring_unref (entry->artist);
-			rb_refstring_unref (entry->album);
+	index = g_hash_table_lookup (db->priv->trigram_indexes, GUINT_TO_POINTER (propid));
+	if (index == NULL || value == NULL || strlen (value) < 3)
+		return G_MAXUINT;
+
+	for (p = value; p[2] != '\0'; p++) {
+		GPtrArray *postings;
+
+		postings = g_hash_table_lookup (index->trigrams, GUINT_TO_POINTER (TRIGRAM (p)));
+		if (postings == NULL)
+			return 0;
+		shortest = MIN (shortest, postings->len);
+	}
+	return shortest;
+}
+
+/**
+ * rhythmdb_tree_set_trigram_index:
+ * @db: a #RhythmDBTree
+ * @propid: the string property to index
+ * @enabled: whether the property should be indexed
+ *
+ * Enables or disables a trigram index for a string property.  The index
+ * allows substring (LIKE) queries on the property to only look at the
+ * entries that could possibly match rather than every entry in the
+ * database, at the cost of some memory; see
+ * rhythmdb_tree_get_trigram_index_size().
+ *
+ * Only properties stored in the entries themselves can be indexed, not
+ * the folded or sort key versions of them.
+ */
+void
+rhythmdb_tree_set_trigram_index (RhythmDBTree *db,
+				 RhythmDBPropType propid,
+				 gboolean enabled)
+{
+	RhythmDBTreeTrigramIndex *index;
+	GHashTableIter iter;
+	gpointer entry;
+
+	g_return_if_fail (RHYTHMDB_IS_TREE (db));
+	g_return_if_fail (trigram_index_supported (propid));
+
+	g_static_rw_lock_reader_lock (&db->priv->entries_lock);
+	g_static_rw_lock_writer_lock (&db->priv->trigram_lock);
+
+	index = g_hash_table_lookup (db->priv->trigram_indexes, GUINT_TO_POINTER (propid));
+	if (enabled && index == NULL) {
+		index = g_new0 (RhythmDBTreeTrigramIndex, 1);
+		index->propid = propid;
+		index->members = g_hash_table_new (g_direct_hash, g_direct_equal);
+		index->dead = g_ptr_array_new ();
+
+		g_hash_table_iter_init (&iter, db->priv->entries);
+		while (g_hash_table_iter_next (&iter, NULL, &entry)) {
+			g_hash_table_insert (index->members, entry, entry);
 		}
-		break;
+		trigram_index_build (index);
+		g_hash_table_insert (db->priv->trigram_indexes, GUINT_TO_POINTER (propid), index);
+
+		rb_debug ("built trigram index for %s: %u trigrams, %u postings, about %" G_GSIZE_FORMAT " bytes",
+			  (const char *) rhythmdb_nice_elt_name_from_propid (RHYTHMDB (db), propid),
+			  g_hash_table_size (index->trigrams),
+			  index->n_postings,
+			  trigram_index_size (index));
+	} else if (!enabled && index != NULL) {
+		g_hash_table_remove (db->priv->trigram_indexes, GUINT_TO_POINTER (propid));
 	}
-	case RHYTHMDB_PROP_GENRE:
-	{
-		const char *genrename = g_value_get_string (value);
 
-		if (strcmp (rb_refstring_get (entry->genre), genrename)) {
-			RhythmDBTreeProperty *new_genre;
-			RhythmDBTreeProperty *new_artist;
+	g_static_rw_lock_writer_unlock (&db->priv->trigram_lock);
+	g_static_rw_lock_reader_unlock (&db->priv->entries_lock);
+}
 
-			rb_refstring_ref (entry->genre);
-			rb_refstring_ref (entry->artist);
-			rb_refstring_ref (entry->album);
+/**
+ * rhythmdb_tree_get_trigram_index_size:
+ * @db: a #RhythmDBTree
+ * @propid: a string property
+ *
+ * Returns the approximate amount of memory used by the trigram index for
+ * the property.
+ *
+ * Return value: the size of the index in bytes, or 0 if the property is
+ * not indexed
+ */
+gsize
+rhythmdb_tree_get_trigram_index_size (RhythmDBTree *db,
+				      RhythmDBPropType propid)
+{
+	RhythmDBTreeTrigramIndex *index;
+	gsize size = 0;
 
-			g_mutex_lock (db->priv->genres_lock);
-			remove_entry_from_album (db, entry);
-			new_genre = get_or_create_genre (db, type,
-							 rb_refstring_new (genrename));
-			new_artist = get_or_create_artist (db, new_genre, entry->artist);
-			set_entry_album (db, entry, new_artist, entry->album);
-			g_mutex_unlock (db->priv->genres_lock);
+	g_return_val_if_fail (RHYTHMDB_IS_TREE (db), 0);
 
-			rb_refstring_unref (entry->genre);
-			rb_refstring_unref (entry->artist);
-			rb_refstring_unref (entry->album);
-		}
-		break;
-	}
-	default:
-		break;
-	}
+	g_static_rw_lock_reader_lock (&db->priv->trigram_lock);
+	index = g_hash_table_lookup (db->priv->trigram_indexes, GUINT_TO_POINTER (propid));
+	if (index != NULL)
+		size = trigram_index_size (index);
+	g_static_rw_lock_reader_unlock (&db->priv->trigram_lock);
 
-	return FALSE;
+	return size;
 }
 
 static void
-rhythmdb_tree_entry_delete (RhythmDB *adb,
-			    RhythmDBEntry *entry)
+report_trigram_index (gpointer propid,
+		      gpointer data,
+		      RhythmDBTree *db)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	RhythmDBTreeTrigramIndex *index = data;
+
+	rb_debug ("trigram index for %s: %u trigrams, %u postings (%u stale), about %" G_GSIZE_FORMAT " bytes",
+		  (const char *) rhythmdb_nice_elt_name_from_propid (RHYTHMDB (db), index->propid),
+		  g_hash_table_size (index->trigrams),
+		  index->n_postings,
+		  index->n_stale,
+		  trigram_index_size (index));
+}
 
-	g_mutex_lock (db->priv->genres_lock);
-	remove_entry_from_album (db, entry);
-	g_mutex_unlock (db->priv->genres_lock);
+/*
+ * Range indexes
+ *
+ * Each property in range_index_props has a GSequence of all entries sorted
+ * by the property value, so range criteria (smart playlists like "rating
+ * at least 4" or "last played within 7 days") can find the matching
+ * entries in O(log n + k) rather than evaluating every entry.  The
+ * sequences hold the value with the entry, as rhythmdb_tree_entry_set is
+ * called before the new value is stored in the entry.
+ */
 
-	/* remove all keywords */
-	g_mutex_lock (db->priv->keywords_lock);
-	remove_entry_from_keywords (db, entry);
-	g_mutex_unlock (db->priv->keywords_lock);
+typedef struct {
+	RhythmDBEntry *entry;
+	gdouble key;
+	GSequenceIter *iter;
+} RhythmDBTreeRangeItem;
 
-	g_mutex_lock (db->priv->entries_lock);
-	g_assert (g_hash_table_remove (db->priv->entries, entry->location));
-	g_assert (g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id)));
+/* allows some clock drift between looking up and evaluating CURRENT_TIME_NOT_WITHIN */
+#define RANGE_INDEX_TIME_SLACK		3600
 
-	entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
-	rhythmdb_entry_unref (entry);
-	g_mutex_unlock (db->priv->entries_lock);
+static int
+range_index_slot (guint propid)
+{
+	guint i;
+
+	for (i = 0; i < RHYTHMDB_TREE_N_RANGE_INDEXES; i++) {
+		if (range_index_props[i] == propid)
+			return i;
+	}
+	return -1;
 }
 
-typedef struct {
-	RhythmDB *db;
-	RhythmDBEntryType *type;
-} RbEntryRemovalCtxt;
+static gdouble
+range_index_value (const GValue *value)
+{
+	if (G_VALUE_HOLDS_DOUBLE (value))
+		return g_value_get_double (value);
+	return g_value_get_ulong (value);
+}
 
-/* must be called with the entries and genres locks held */
-static gboolean
-remove_one_song (gpointer key,
-		 RhythmDBEntry *entry,
-		 RbEntryRemovalCtxt *ctxt)
+static gint
+range_item_compare (const RhythmDBTreeRangeItem *a,
+		    const RhythmDBTreeRangeItem *b,
+		    gpointer data)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE(ctxt->db);
+	if (a->key < b->key)
+		return -1;
+	if (a->key > b->key)
+		return 1;
 
-	rb_assert_locked (db->priv->entries_lock);
-	rb_assert_locked (db->priv->genres_lock);
+	/* entries with equal values are ordered by address, so lookups can
+	 * find either end of a run of equal values.
+	 */
+	if ((gsize) a->entry < (gsize) b->entry)
+		return -1;
+	if ((gsize) a->entry > (gsize) b->entry)
+		return 1;
+	return 0;
+}
 
-	g_return_val_if_fail (entry != NULL, FALSE);
+static void
+range_index_add_entry (RhythmDBTree *db,
+		       RhythmDBEntry *entry)
+{
+	RhythmDBTreeRangeItem *items;
+	guint i;
 
-	if (entry->type == ctxt->type) {
-		rhythmdb_emit_entry_deleted (ctxt->db, entry);
-		g_mutex_lock (db->priv->keywords_lock);
-		remove_entry_from_keywords (db, entry);
-		g_mutex_unlock (db->priv->keywords_lock);
-		remove_entry_from_album (db, entry);
-		g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id));
-		rhythmdb_entry_unref (entry);
-		return TRUE;
+	items = g_new (RhythmDBTreeRangeItem, RHYTHMDB_TREE_N_RANGE_INDEXES);
+
+	g_static_rw_lock_writer_lock (&db->priv->range_lock);
+	for (i = 0; i < RHYTHMDB_TREE_N_RANGE_INDEXES; i++) {
+		items[i].entry = entry;
+		if (range_index_props[i] == RHYTHMDB_PROP_RATING)
+			items[i].key = rhythmdb_entry_get_double (entry, range_index_props[i]);
+		else
+			items[i].key = rhythmdb_entry_get_ulong (entry, range_index_props[i]);
+		items[i].iter = g_sequence_insert_sorted (db->priv->range_indexes[i], &items[i],
+							  (GCompareDataFunc) range_item_compare, NULL);
 	}
-	return FALSE;
+	g_hash_table_insert (db->priv->range_items, entry, items);
+	g_static_rw_lock_writer_unlock (&db->priv->range_lock);
 }
 
+/* must be called with the range lock held */
 static void
-rhythmdb_tree_entry_delete_by_type (RhythmDB *adb,
-				    RhythmDBEntryType *type)
+range_index_remove_locked (RhythmDBTree *db,
+			   RhythmDBEntry *entry)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
-	RbEntryRemovalCtxt ctxt;
+	RhythmDBTreeRangeItem *items;
+	guint i;
 
-	ctxt.db = adb;
-	ctxt.type = type;
-	g_mutex_lock (db->priv->entries_lock);
-	g_mutex_lock (db->priv->genres_lock);
-	g_hash_table_foreach_remove (db->priv->entries,
-				     (GHRFunc) remove_one_song, &ctxt);
-	g_mutex_unlock (db->priv->genres_lock);
-	g_mutex_unlock (db->priv->entries_lock);
+	items = g_hash_table_lookup (db->priv->range_items, entry);
+	if (items != NULL) {
+		for (i = 0; i < RHYTHMDB_TREE_N_RANGE_INDEXES; i++) {
+			g_sequence_remove (items[i].iter);
+		}
+		g_hash_table_remove (db->priv->range_items, entry);
+	}
 }
 
 static void
-destroy_tree_property (RhythmDBTreeProperty *prop)
+range_index_remove_entry (RhythmDBTree *db,
+			  RhythmDBEntry *entry)
 {
-#ifndef G_DISABLE_ASSERT
-	prop->magic = 0xf33df33d;
-#endif
-	g_hash_table_destroy (prop->children);
-	g_free (prop);
+	g_static_rw_lock_writer_lock (&db->priv->range_lock);
+	range_index_remove_locked (db, entry);
+	g_static_rw_lock_writer_unlock (&db->priv->range_lock);
 }
 
-typedef void (*RhythmDBTreeTraversalFunc) (RhythmDBTree *db, RhythmDBEntry *entry, gpointer data);
-typedef void (*RhythmDBTreeAlbumTraversalFunc) (RhythmDBTree *db, RhythmDBTreeProperty *album, gpointer data);
-
-struct RhythmDBTreeTraversalData
+static void
+range_index_remove_entries (RhythmDBTree *db,
+			    GPtrArray *entries)
 {
-	RhythmDBTree *db;
-	GPtrArray *query;
-	RhythmDBTreeTraversalFunc func;
-	gpointer data;
-	gboolean *cancel;
-};
+	guint i;
 
-static gboolean
-rhythmdb_tree_evaluate_query (RhythmDB *adb,
-			      GPtrArray *query,
-			      RhythmDBEntry *entry)
+	g_static_rw_lock_writer_lock (&db->priv->range_lock);
+	for (i = 0; i < entries->len; i++) {
+		range_index_remove_locked (db, g_ptr_array_index (entries, i));
+	}
+	g_static_rw_lock_writer_unlock (&db->priv->range_lock);
+}
+
+static void
+range_index_replace (RhythmDBTree *db,
+		     RhythmDBEntry *entry,
+		     guint propid,
+		     const GValue *value)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
-	guint i;
-	guint last_disjunction;
+	RhythmDBTreeRangeItem *items;
+	int slot;
 
-	for (i = 0, last_disjunction = 0; i < query->len; i++) {
-		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+	slot = range_index_slot (propid);
+	if (slot < 0)
+		return;
 
-		if (data->type == RHYTHMDB_QUERY_DISJUNCTION) {
-			if (evaluate_conjunctive_subquery (db, query, last_disjunction, i, entry))
-				return TRUE;
+	g_static_rw_lock_writer_lock (&db->priv->range_lock);
+	items = g_hash_table_lookup (db->priv->range_items, entry);
+	if (items != NULL) {
+		items[slot].key = range_index_value (value);
+		g_sequence_sort_changed (items[slot].iter, (GCompareDataFunc) range_item_compare, NULL);
+	}
+	g_static_rw_lock_writer_unlock (&db->priv->range_lock);
+}
 
-			last_disjunction = i + 1;
-		}
+typedef struct {
+	gboolean has_lower;
+	gboolean lower_inclusive;
+	gdouble lower;
+	gboolean has_upper;
+	gboolean upper_inclusive;
+	gdouble upper;
+} RhythmDBTreeRange;
+
+static void
+range_set_lower (RhythmDBTreeRange *range,
+		 gdouble value,
+		 gboolean inclusive)
+{
+	if (!range->has_lower || value > range->lower ||
+	    (value == range->lower && !inclusive)) {
+		range->has_lower = TRUE;
+		range->lower = value;
+		range->lower_inclusive = inclusive;
 	}
-	if (evaluate_conjunctive_subquery (db, query, last_disjunction, query->len, entry))
-		return TRUE;
-	return FALSE;
 }
 
-#define RHYTHMDB_PROPERTY_COMPARE(OP) \
-			switch (rhythmdb_get_property_type (db, data->propid)) { \
-			case G_TYPE_STRING: \
-				if (g_strcmp0 (rhythmdb_entry_get_string (entry, data->propid), \
-					    g_value_get_string (data->val)) OP 0) \
-					return FALSE; \
-				break; \
-			case G_TYPE_ULONG: \
-				if (rhythmdb_entry_get_ulong (entry, data->propid) OP \
-				    g_value_get_ulong (data->val)) \
-					return FALSE; \
-				break; \
-			case G_TYPE_BOOLEAN: \
-				if (rhythmdb_entry_get_boolean (entry, data->propid) OP \
-				    g_value_get_boolean (data->val)) \
-					return FALSE; \
-				break; \
-			case G_TYPE_UINT64: \
-				if (rhythmdb_entry_get_uint64 (entry, data->propid) OP \
-				    g_value_get_uint64 (data->val)) \
-					return FALSE; \
-				break; \
-			case G_TYPE_DOUBLE: \
-				if (rhythmdb_entry_get_double (entry, data->propid) OP \
-				    g_value_get_double (data->val)) \
-					return FALSE; \
-				break; \
-                        case G_TYPE_OBJECT: \
-                                if ((gpointer)rhythmdb_entry_get_object (entry, data->propid) OP \
-                                    g_value_get_object (data->val)) \
-                                        return FALSE; \
-                                break; \
-			default: \
-                                g_warning ("Unexpected type: %s", g_type_name (rhythmdb_get_property_type (db, data->propid))); \
-				g_assert_not_reached (); \
-			}
+static void
+range_set_upper (RhythmDBTreeRange *range,
+		 gdouble value,
+		 gboolean inclusive)
+{
+	if (!range->has_upper || value < range->upper ||
+	    (value == range->upper && !inclusive)) {
+		range->has_upper = TRUE;
+		range->upper = value;
+		range->upper_inclusive = inclusive;
+	}
+}
+
+/* returns TRUE if the criteria restricts the value of a range indexed property */
+static gboolean
+range_query_criteria (RhythmDBQueryData *qdata,
+		      RhythmDBTreeRange *ranges)
+{
+	RhythmDBTreeRange *range;
+	GTimeVal now;
+	gulong bound;
+	int slot;
+
+	if (qdata->subquery != NULL)
+		return FALSE;
+	slot = range_index_slot (qdata->propid);
+	if (slot < 0)
+		return FALSE;
+	range = (ranges != NULL) ? &ranges[slot] : NULL;
+
+	/* these match the comparisons in evaluate_conjunctive_subquery */
+	switch (qdata->type) {
+	case RHYTHMDB_QUERY_PROP_EQUALS:
+		if (range != NULL) {
+			range_set_lower (range, range_index_value (qdata->val), TRUE);
+			range_set_upper (range, range_index_value (qdata->val), TRUE);
+		}
+		return TRUE;
+	case RHYTHMDB_QUERY_PROP_GREATER:
+		if (range != NULL)
+			range_set_lower (range, range_index_value (qdata->val), TRUE);
+		return TRUE;
+	case RHYTHMDB_QUERY_PROP_LESS:
+		if (range != NULL)
+			range_set_upper (range, range_index_value (qdata->val), TRUE);
+		return TRUE;
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+		if (!G_VALUE_HOLDS_ULONG (qdata->val))
+			return FALSE;
+		if (range != NULL) {
+			g_get_current_time (&now);
+			bound = now.tv_sec - g_value_get_ulong (qdata->val);
+			if (qdata->type == RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN)
+				range_set_lower (range, bound, TRUE);
+			else
+				range_set_upper (range, bound + RANGE_INDEX_TIME_SLACK, FALSE);
+		}
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static GSequenceIter *
+range_index_search (GSequence *seq,
+		    gdouble key,
+		    gboolean after)
+{
+	RhythmDBTreeRangeItem probe;
+
+	/* find the first item with a value greater than or equal to the key,
+	 * or strictly greater if 'after' is set.
+	 */
+	probe.key = key;
+	probe.entry = after ? (RhythmDBEntry *) G_MAXSIZE : NULL;
+	probe.iter = NULL;
+	return g_sequence_search (seq, &probe, (GCompareDataFunc) range_item_compare, NULL);
+}
+
+/*
+ * Finds the range criteria in a conjunctive query that selects the fewest
+ * entries.  Returns the number of entries it selects, which lie between
+ * @begin and @end in the index, or -1 if the query has no range criteria
+ * that can be answered from the indexes.  Must be called with the range
+ * lock held.
+ */
+static gint
+range_index_select (RhythmDBTree *db,
+		    GPtrArray *query,
+		    int *slot,
+		    GSequenceIter **begin,
+		    GSequenceIter **end)
+{
+	RhythmDBTreeRange ranges[RHYTHMDB_TREE_N_RANGE_INDEXES];
+	gint best_count = -1;
+	gboolean found = FALSE;
+	guint i;
+
+	memset (ranges, 0, sizeof (ranges));
+	for (i = 0; i < query->len; i++) {
+		if (range_query_criteria (g_ptr_array_index (query, i), ranges))
+			found = TRUE;
+	}
+	if (found == FALSE)
+		return -1;
+
+	for (i = 0; i < RHYTHMDB_TREE_N_RANGE_INDEXES; i++) {
+		GSequence *seq = db->priv->range_indexes[i];
+		GSequenceIter *range_begin;
+		GSequenceIter *range_end;
+		gint count;
+
+		if (!ranges[i].has_lower && !ranges[i].has_upper)
+			continue;
+
+		if (ranges[i].has_lower)
+			range_begin = range_index_search (seq, ranges[i].lower, !ranges[i].lower_inclusive);
+		else
+			range_begin = g_sequence_get_begin_iter (seq);
+		if (ranges[i].has_upper)
+			range_end = range_index_search (seq, ranges[i].upper, ranges[i].upper_inclusive);
+		else
+			range_end = g_sequence_get_end_iter (seq);
+
+		count = g_sequence_iter_get_position (range_end) - g_sequence_iter_get_position (range_begin);
+		if (count < 0)
+			count = 0;
+		if (best_count < 0 || count < best_count) {
+			best_count = count;
+			*slot = i;
+			*begin = range_begin;
+			*end = range_end;
+		}
+	}
+
+	return best_count;
+}
+
+/* returns the entries in a range found by range_index_select */
+static GHashTable *
+range_index_collect (GSequenceIter *begin,
+		     GSequenceIter *end,
+		     gint count)
+{
+	GHashTable *matches;
+	GSequenceIter *iter;
+
+	matches = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (iter = begin; count > 0 && iter != end; iter = g_sequence_iter_next (iter)) {
+		RhythmDBTreeRangeItem *item = g_sequence_get (iter);
+		g_hash_table_insert (matches, item->entry, item->entry);
+	}
+	return matches;
+}
 
 static gboolean
 search_match_properties (RhythmDB *db,
@@ -2017,171 +5519,667 @@ evaluate_conjunctive_subquery (RhythmDBTree *dbtree,
 	return TRUE;
 }
 
-static void
-do_conjunction (RhythmDBEntry *entry,
-		gpointer unused,
-		struct RhythmDBTreeTraversalData *data)
+/*
+ * Query planning
+ *
+ * A conjunctive query can be answered in a few different ways: walking the
+ * whole tree for the entry type (or all of them), descending the tree
+ * through the genre, artist and album nodes named in equality criteria, or
+ * looking one of the criteria up in the word, trigram or range indexes and
+ * evaluating the query for the entries found there.  The planner estimates
+ * the number of entries each of these would look at, using the entry
+ * counts kept in the tree nodes and the sizes of the index postings, and
+ * picks the cheapest.
+ */
+
+typedef enum {
+	QUERY_PLAN_EMPTY,
+	QUERY_PLAN_SCAN,
+	QUERY_PLAN_TREE,
+	QUERY_PLAN_INDEX
+} RhythmDBTreeQueryPlanType;
+
+static const char *query_plan_names[] = {
+	"empty",
+	"scan",
+	"tree",
+	"index"
+};
+
+/* building the candidate set from an index costs about as much as
+ * evaluating the query once more for each candidate.
+ */
+#define QUERY_PLAN_INDEX_COST	2
+
+typedef struct {
+	RhythmDBTreeQueryPlanType type;
+	RhythmDBEntryType *etype;
+	guint n_entries;	/* entries of the queried type(s) */
+	guint cost;		/* estimated number of entries and nodes visited */
+
+	/* tree plans */
+	gboolean tree_usable;
+	gboolean missing;	/* a genre, artist or album no entry has */
+	RBRefString *genre;
+	RBRefString *artist;
+	RBRefString *album;
+	guint tree_cost;
+
+	/* index plans */
+	int index_idx;		/* LIKE criteria answered from the word or trigram index */
+	int range_slot;		/* or the range index used */
+	gint range_count;
+	GSequenceIter *range_begin;
+	GSequenceIter *range_end;
+} RhythmDBTreeQueryPlan;
+
+/* must be called with the shard lock held */
+static guint
+query_plan_artist_cost (RhythmDBTreeProperty *artist,
+			RBRefString *album)
 {
-	if (G_UNLIKELY (*data->cancel))
-		return;
-	/* Finally, we actually evaluate the query! */
-	if (evaluate_conjunctive_subquery (data->db, data->query, 0, data->query->len,
-					   entry)) {
-		data->func (data->db, entry, data->data);
+	RhythmDBTreeProperty *node;
+
+	if (album == NULL)
+		return artist->n_entries;
+
+	node = g_hash_table_lookup (artist->children, album);
+	return 1 + (node ? node->n_entries : 0);
+}
+
+/* must be called with the shard lock held */
+static guint
+query_plan_genre_cost (RhythmDBTreeProperty *genre,
+		       RBRefString *artist,
+		       RBRefString *album)
+{
+	RhythmDBTreeProperty *node;
+	GHashTableIter iter;
+	guint cost;
+
+	if (artist != NULL) {
+		node = g_hash_table_lookup (genre->children, artist);
+		return 1 + (node ? query_plan_artist_cost (node, album) : 0);
 	}
+
+	if (album == NULL)
+		return genre->n_entries;
+
+	cost = 0;
+	g_hash_table_iter_init (&iter, genre->children);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &node))
+		cost += 1 + query_plan_artist_cost (node, album);
+	return cost;
 }
 
+/* must be called with the shard lock held */
 static void
-conjunctive_query_songs (const char *name,
-			 RhythmDBTreeProperty *album,
-			 struct RhythmDBTreeTraversalData *data)
+query_plan_estimate_tree (RhythmDBTree *db,
+			  GHashTable *genres,
+			  RhythmDBTreeQueryPlan *plan)
 {
-	if (G_UNLIKELY (*data->cancel))
-		return;
-	g_hash_table_foreach (album->children, (GHFunc) do_conjunction, data);
+	RhythmDBTreeProperty *genre;
+	GHashTableIter iter;
+
+	g_hash_table_iter_init (&iter, genres);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &genre)) {
+		plan->n_entries += genre->n_entries;
+		if (plan->genre == NULL)
+			plan->tree_cost += 1 + query_plan_genre_cost (genre, plan->artist, plan->album);
+	}
+
+	if (plan->genre != NULL) {
+		genre = g_hash_table_lookup (genres, plan->genre);
+		plan->tree_cost += 1;
+		if (genre != NULL)
+			plan->tree_cost += query_plan_genre_cost (genre, plan->artist, plan->album);
+	}
 }
 
-static GPtrArray *
-clone_remove_ptr_array_index (GPtrArray *arr,
-			      guint index)
+/* finds the value of the first equality criteria on a tree property */
+static gboolean
+query_plan_tree_value (GPtrArray *query,
+		       RhythmDBPropType propid,
+		       RBRefString **value,
+		       gboolean *missing)
 {
-	GPtrArray *ret = g_ptr_array_new ();
 	guint i;
-	for (i = 0; i < arr->len; i++)
-		if (i != index)
-			g_ptr_array_add (ret, g_ptr_array_index (arr, i));
 
-	return ret;
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *qdata = g_ptr_array_index (query, i);
+
+		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS && qdata->propid == propid) {
+			/* if nothing has ever used the string, no entry can have it */
+			*value = rb_refstring_find (g_value_get_string (qdata->val));
+			if (*value == NULL)
+				*missing = TRUE;
+			return TRUE;
+		}
+	}
+	return FALSE;
 }
 
-static void
-conjunctive_query_albums (const char *name,
-			  RhythmDBTreeProperty *artist,
-			  struct RhythmDBTreeTraversalData *data)
+/*
+ * Works out what it would cost to answer a conjunctive query by walking
+ * the tree.  Takes the shard locks as needed, so it must be called without
+ * any of the index locks held.  Returns FALSE if the query can't match
+ * anything.
+ */
+static gboolean
+query_plan_init (RhythmDBTree *db,
+		 GPtrArray *query,
+		 RhythmDBTreeQueryPlan *plan)
 {
 	guint i;
-	int album_query_idx = -1;
 
-	if (G_UNLIKELY (*data->cancel))
-		return;
+	memset (plan, 0, sizeof (*plan));
+	plan->index_idx = -1;
+	plan->range_slot = -1;
 
-	for (i = 0; i < data->query->len; i++) {
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, i);
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *qdata = g_ptr_array_index (query, i);
 		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
-		    && qdata->propid == RHYTHMDB_PROP_ALBUM) {
-			if (album_query_idx > 0)
-				return;
-			album_query_idx = i;
+		    && qdata->propid == RHYTHMDB_PROP_TYPE) {
+			RhythmDBEntryType *etype = g_value_get_object (qdata->val);
 
+			/* A song can't have two types. */
+			if (plan->etype != NULL && plan->etype != etype) {
+				plan->type = QUERY_PLAN_EMPTY;
+				return FALSE;
+			}
+			plan->etype = etype;
 		}
 	}
 
-	if (album_query_idx >= 0) {
-		RhythmDBTreeProperty *album;
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, album_query_idx);
-		RBRefString *albumname = rb_refstring_new (g_value_get_string (qdata->val));
-		GPtrArray *oldquery = data->query;
+	if (query_plan_tree_value (query, RHYTHMDB_PROP_GENRE, &plan->genre, &plan->missing))
+		plan->tree_usable = TRUE;
+	if (query_plan_tree_value (query, RHYTHMDB_PROP_ARTIST, &plan->artist, &plan->missing))
+		plan->tree_usable = TRUE;
+	if (query_plan_tree_value (query, RHYTHMDB_PROP_ALBUM, &plan->album, &plan->missing))
+		plan->tree_usable = TRUE;
 
-		data->query = clone_remove_ptr_array_index (data->query, album_query_idx);
+	if (plan->etype != NULL) {
+		RhythmDBTreeShard *shard = get_shard (db, plan->etype);
 
-		album = g_hash_table_lookup (artist->children, albumname);
+		g_static_rw_lock_reader_lock (&shard->lock);
+		query_plan_estimate_tree (db, shard->genres, plan);
+		g_static_rw_lock_reader_unlock (&shard->lock);
+	} else {
+		genres_hash_foreach (db, (RBHFunc) query_plan_estimate_tree, plan);
+	}
 
-		if (album != NULL) {
-			conjunctive_query_songs (rb_refstring_get (albumname), album, data);
-		}
-		g_ptr_array_free (data->query, TRUE);
-		data->query = oldquery;
-		return;
+	if (plan->missing) {
+		/* the tree walk won't get past the first lookup */
+		plan->tree_cost = 0;
 	}
 
-	g_hash_table_foreach (artist->children, (GHFunc) conjunctive_query_songs, data);
+	if (plan->tree_usable && plan->tree_cost < plan->n_entries) {
+		plan->type = QUERY_PLAN_TREE;
+		plan->cost = plan->tree_cost;
+	} else {
+		plan->type = QUERY_PLAN_SCAN;
+		plan->cost = plan->n_entries;
+	}
+	return TRUE;
 }
 
+/*
+ * Checks whether looking one of the criteria up in an index is cheaper
+ * than the tree plan.  Must be called with the words, trigram and range
+ * locks held.
+ */
 static void
-conjunctive_query_artists (const char *name,
-			   RhythmDBTreeProperty *genre,
-			   struct RhythmDBTreeTraversalData *data)
+query_plan_choose_index (RhythmDBTree *db,
+			 GPtrArray *query,
+			 RhythmDBTreeQueryPlan *plan)
 {
+	GSequenceIter *begin = NULL;
+	GSequenceIter *end = NULL;
+	int slot = -1;
+	gint count;
 	guint i;
-	int artist_query_idx = -1;
 
-	if (G_UNLIKELY (*data->cancel))
+	if (plan->type == QUERY_PLAN_EMPTY)
 		return;
 
-	for (i = 0; i < data->query->len; i++) {
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, i);
-		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
-		    && qdata->propid == RHYTHMDB_PROP_ARTIST) {
-			if (artist_query_idx > 0)
-				return;
-			artist_query_idx = i;
+	count = range_index_select (db, query, &slot, &begin, &end);
+	if (count >= 0 && (guint) count * QUERY_PLAN_INDEX_COST < plan->cost) {
+		plan->type = QUERY_PLAN_INDEX;
+		plan->cost = count * QUERY_PLAN_INDEX_COST;
+		plan->range_slot = slot;
+		plan->range_count = count;
+		plan->range_begin = begin;
+		plan->range_end = end;
+	}
+
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *qdata = g_ptr_array_index (query, i);
+		guint estimate;
+
+		if (qdata->type != RHYTHMDB_QUERY_PROP_LIKE)
+			continue;
+
+		if (qdata->propid == RHYTHMDB_PROP_SEARCH_MATCH) {
+			estimate = search_index_estimate (db, g_value_get_boxed (qdata->val),
+							  plan->cost / QUERY_PLAN_INDEX_COST);
+		} else if (G_VALUE_HOLDS_STRING (qdata->val)) {
+			estimate = trigram_index_estimate (db, qdata->propid, g_value_get_string (qdata->val));
+		} else {
+			continue;
+		}
 
+		if (estimate < plan->cost / QUERY_PLAN_INDEX_COST) {
+			plan->type = QUERY_PLAN_INDEX;
+			plan->cost = estimate * QUERY_PLAN_INDEX_COST;
+			plan->index_idx = i;
+			plan->range_slot = -1;
 		}
 	}
+}
+
+static void
+query_plan_clear (RhythmDBTreeQueryPlan *plan)
+{
+	rb_refstring_unref (plan->genre);
+	rb_refstring_unref (plan->artist);
+	rb_refstring_unref (plan->album);
+}
 
-	if (artist_query_idx >= 0) {
-		RhythmDBTreeProperty *artist;
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, artist_query_idx);
-		RBRefString *artistname = rb_refstring_new (g_value_get_string (qdata->val));
-		GPtrArray *oldquery = data->query;
+static void
+query_plan_describe (RhythmDBTree *db,
+		     GPtrArray *query,
+		     RhythmDBTreeQueryPlan *plan,
+		     GString *str)
+{
+	g_string_append (str, query_plan_names[plan->type]);
 
-		data->query = clone_remove_ptr_array_index (data->query, artist_query_idx);
+	switch (plan->type) {
+	case QUERY_PLAN_EMPTY:
+		return;
+	case QUERY_PLAN_SCAN:
+		break;
+	case QUERY_PLAN_TREE:
+		g_string_append_c (str, ':');
+		if (plan->genre != NULL)
+			g_string_append (str, " genre");
+		if (plan->artist != NULL)
+			g_string_append (str, " artist");
+		if (plan->album != NULL)
+			g_string_append (str, " album");
+		if (plan->missing)
+			g_string_append (str, " (missing value)");
+		break;
+	case QUERY_PLAN_INDEX:
+		if (plan->range_slot >= 0) {
+			g_string_append_printf (str, ": %s range",
+						rhythmdb_nice_elt_name_from_propid (RHYTHMDB (db), range_index_props[plan->range_slot]));
+		} else {
+			RhythmDBQueryData *qdata = g_ptr_array_index (query, plan->index_idx);
 
-		artist = g_hash_table_lookup (genre->children, artistname);
-		if (artist != NULL) {
-			conjunctive_query_albums (rb_refstring_get (artistname), artist, data);
+			if (qdata->propid == RHYTHMDB_PROP_SEARCH_MATCH)
+				g_string_append (str, ": search words");
+			else
+				g_string_append_printf (str, ": %s trigrams",
+							rhythmdb_nice_elt_name_from_propid (RHYTHMDB (db), qdata->propid));
 		}
-		g_ptr_array_free (data->query, TRUE);
-		data->query = oldquery;
-		return;
+		break;
 	}
 
-	g_hash_table_foreach (genre->children, (GHFunc) conjunctive_query_albums, data);
+	g_string_append_printf (str, "; cost %u of %u entries", plan->cost, plan->n_entries);
+}
+
+/*
+ * Returns the set of entries that may match a query, looked up in the
+ * index chosen by the planner.  Must be called with the words, trigram and
+ * range locks held.
+ */
+static GHashTable *
+query_plan_lookup (RhythmDBTree *db,
+		   GPtrArray *query,
+		   RhythmDBTreeQueryPlan *plan)
+{
+	RhythmDBQueryData *qdata;
+
+	if (plan->range_slot >= 0)
+		return range_index_collect (plan->range_begin, plan->range_end, plan->range_count);
+
+	qdata = g_ptr_array_index (query, plan->index_idx);
+	if (qdata->propid == RHYTHMDB_PROP_SEARCH_MATCH)
+		return search_index_lookup (db, g_value_get_boxed (qdata->val));
+	else
+		return trigram_index_lookup (db, qdata->propid, g_value_get_string (qdata->val));
+}
+
+/*
+ * Parallel query execution
+ *
+ * Once the plan is chosen, the entries it needs to look at are split into
+ * partitions: runs of album nodes from the tree walk, or slices of the
+ * candidates found in an index.  The partitions are evaluated by a pool
+ * of threads shared by all queries on the database, with the querying
+ * thread taking the first one itself.  Each thread collects the matching
+ * entries locally and passes them on in chunks, holding a lock so the
+ * traversal function (and so the query results) only ever sees one
+ * thread at a time.  The querying thread holds the shard or index locks
+ * until all the partitions are done, so the nodes and entries stay put.
+ */
+
+#define RHYTHMDB_TREE_QUERY_MAX_THREADS		16
+#define RHYTHMDB_TREE_QUERY_PARTITIONS_PER_THREAD	4
+#define RHYTHMDB_TREE_QUERY_MIN_PARTITION		1024	/* entries */
+
+typedef struct {
+	struct RhythmDBTreeTraversalData *traversal;
+	RhythmDBTreeQueryPlan *plan;
+
+	GPtrArray *items;	/* album nodes, or candidate entries */
+	gboolean albums;
+	guint n_entries;
+
+	GMutex *lock;
+	GCond *cond;
+	guint pending;
+} RhythmDBTreeParallelQuery;
+
+typedef struct {
+	RhythmDBTreeParallelQuery *job;
+	guint begin;
+	guint end;
+} RhythmDBTreeQueryPartition;
+
+static guint
+rhythmdb_tree_query_thread_count (RhythmDBTree *db)
+{
+	long n_cpus;
+
+	if (db->priv->query_threads > 0)
+		return db->priv->query_threads;
+
+	n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1)
+		return 1;
+	return MIN (n_cpus, RHYTHMDB_TREE_QUERY_MAX_THREADS);
 }
 
 static void
-conjunctive_query_genre (RhythmDBTree *db,
-			 GHashTable *genres,
-			 struct RhythmDBTreeTraversalData *data)
+parallel_query_deliver (RhythmDBTreeParallelQuery *job,
+			GPtrArray *matches)
 {
-	int genre_query_idx = -1;
+	struct RhythmDBTreeTraversalData *data = job->traversal;
 	guint i;
 
-	if (G_UNLIKELY (*data->cancel))
+	if (matches->len == 0)
 		return;
 
-	for (i = 0; i < data->query->len; i++) {
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, i);
-		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
-		    && qdata->propid == RHYTHMDB_PROP_GENRE) {
-			/* A song can't currently have two genres.  So
-			 * if we get a conjunctive query for that, we
-			 * know the result must be the empty set. */
-			if (genre_query_idx > 0)
-				return;
-			genre_query_idx = i;
+	g_mutex_lock (job->lock);
+	for (i = 0; i < matches->len; i++) {
+		data->func (data->db, g_ptr_array_index (matches, i), data->data);
+	}
+	g_mutex_unlock (job->lock);
+
+	g_ptr_array_set_size (matches, 0);
+}
+
+static void
+parallel_query_match (RhythmDBTreeParallelQuery *job,
+		      RhythmDBEntry *entry,
+		      GPtrArray *matches)
+{
+	if (rhythmdb_compiled_query_evaluate (job->traversal->compiled, entry) == FALSE)
+		return;
+
+	g_ptr_array_add (matches, entry);
+	if (matches->len >= RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK)
+		parallel_query_deliver (job, matches);
+}
+
+static void
+parallel_query_evaluate (RhythmDBTreeQueryPartition *part)
+{
+	RhythmDBTreeParallelQuery *job = part->job;
+	gboolean *cancel = job->traversal->cancel;
+	GPtrArray *matches;
+	guint i;
+
+	matches = g_ptr_array_new ();
+	for (i = part->begin; i < part->end; i++) {
+		if (G_UNLIKELY (*cancel))
+			break;
+
+		if (job->albums) {
+			RhythmDBTreeProperty *album = g_ptr_array_index (job->items, i);
+			GHashTableIter iter;
+			gpointer entry;
 
+			g_hash_table_iter_init (&iter, album->children);
+			while (g_hash_table_iter_next (&iter, &entry, NULL)) {
+				parallel_query_match (job, entry, matches);
+			}
+		} else {
+			parallel_query_match (job, g_ptr_array_index (job->items, i), matches);
 		}
 	}
+	parallel_query_deliver (job, matches);
+	g_ptr_array_free (matches, TRUE);
+}
+
+static void
+parallel_query_worker (RhythmDBTreeQueryPartition *part,
+		       RhythmDBTree *db)
+{
+	RhythmDBTreeParallelQuery *job = part->job;
+
+	parallel_query_evaluate (part);
+
+	g_mutex_lock (job->lock);
+	if (--job->pending == 0)
+		g_cond_signal (job->cond);
+	g_mutex_unlock (job->lock);
+}
+
+static GThreadPool *
+rhythmdb_tree_get_query_pool (RhythmDBTree *db)
+{
+	g_mutex_lock (db->priv->query_pool_lock);
+	if (db->priv->query_pool == NULL) {
+		guint n_threads = rhythmdb_tree_query_thread_count (db);
+
+		/* the querying thread makes up the numbers */
+		db->priv->query_pool = g_thread_pool_new ((GFunc) parallel_query_worker, db,
+							  MAX (n_threads, 2) - 1, FALSE, NULL);
+	}
+	g_mutex_unlock (db->priv->query_pool_lock);
+
+	return db->priv->query_pool;
+}
+
+static guint
+parallel_query_item_size (RhythmDBTreeParallelQuery *job,
+			  guint i)
+{
+	if (job->albums)
+		return ((RhythmDBTreeProperty *) g_ptr_array_index (job->items, i))->n_entries;
+	return 1;
+}
+
+/* evaluates the query for all the items collected in the job, and
+ * returns once it's done.
+ */
+static void
+parallel_query_run (RhythmDBTree *db,
+		    RhythmDBTreeParallelQuery *job)
+{
+	RhythmDBTreeQueryPartition *parts;
+	GThreadPool *pool;
+	guint n_threads;
+	guint n_parts;
+	guint target;
+	guint size;
+	guint i;
+
+	if (job->items->len == 0)
+		return;
 
-	if (genre_query_idx >= 0) {
-		RhythmDBTreeProperty *genre;
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, genre_query_idx);
-		RBRefString *genrename = rb_refstring_new (g_value_get_string (qdata->val));
-		GPtrArray *oldquery = data->query;
+	n_threads = rhythmdb_tree_query_thread_count (db);
+	if (n_threads < 2 || job->n_entries < 2 * RHYTHMDB_TREE_QUERY_MIN_PARTITION) {
+		RhythmDBTreeQueryPartition part;
 
-		data->query = clone_remove_ptr_array_index (data->query, genre_query_idx);
+		part.job = job;
+		part.begin = 0;
+		part.end = job->items->len;
+		parallel_query_evaluate (&part);
+		return;
+	}
 
-		genre = g_hash_table_lookup (genres, genrename);
-		if (genre != NULL) {
-			conjunctive_query_artists (rb_refstring_get (genrename), genre, data);
+	/* aim for a few partitions per thread so they even out */
+	target = job->n_entries / (n_threads * RHYTHMDB_TREE_QUERY_PARTITIONS_PER_THREAD);
+	target = MAX (target, RHYTHMDB_TREE_QUERY_MIN_PARTITION);
+
+	parts = g_new0 (RhythmDBTreeQueryPartition, job->items->len);
+	n_parts = 0;
+	size = 0;
+	for (i = 0; i < job->items->len; i++) {
+		if (size == 0) {
+			parts[n_parts].job = job;
+			parts[n_parts].begin = i;
+			n_parts++;
 		}
-		g_ptr_array_free (data->query, TRUE);
-		data->query = oldquery;
+		size += parallel_query_item_size (job, i);
+		parts[n_parts - 1].end = i + 1;
+		if (size >= target)
+			size = 0;
+	}
+	rb_debug ("evaluating query for %u entries in %u partitions", job->n_entries, n_parts);
+
+	job->lock = g_mutex_new ();
+	job->cond = g_cond_new ();
+	job->pending = n_parts - 1;
+
+	pool = rhythmdb_tree_get_query_pool (db);
+	for (i = 1; i < n_parts; i++) {
+		g_thread_pool_push (pool, &parts[i], NULL);
+	}
+	parallel_query_evaluate (&parts[0]);
+
+	g_mutex_lock (job->lock);
+	while (job->pending > 0)
+		g_cond_wait (job->cond, job->lock);
+	g_mutex_unlock (job->lock);
+
+	g_mutex_free (job->lock);
+	g_cond_free (job->cond);
+	job->lock = NULL;
+	job->cond = NULL;
+	g_free (parts);
+}
+
+static void
+parallel_query_add_album (RhythmDBTreeParallelQuery *job,
+			  RhythmDBTreeProperty *album)
+{
+	g_ptr_array_add (job->items, album);
+	job->n_entries += album->n_entries;
+}
+
+static void
+parallel_query_add_artist (RhythmDBTreeParallelQuery *job,
+			   RhythmDBTreeProperty *artist)
+{
+	RhythmDBTreeProperty *album;
+	GHashTableIter iter;
+
+	if (job->plan->album != NULL) {
+		album = g_hash_table_lookup (artist->children, job->plan->album);
+		if (album != NULL)
+			parallel_query_add_album (job, album);
+		return;
+	}
+
+	g_hash_table_iter_init (&iter, artist->children);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &album))
+		parallel_query_add_album (job, album);
+}
+
+static void
+parallel_query_add_genre (RhythmDBTreeParallelQuery *job,
+			  RhythmDBTreeProperty *genre)
+{
+	RhythmDBTreeProperty *artist;
+	GHashTableIter iter;
+
+	if (job->plan->artist != NULL) {
+		artist = g_hash_table_lookup (genre->children, job->plan->artist);
+		if (artist != NULL)
+			parallel_query_add_artist (job, artist);
+		return;
+	}
+
+	g_hash_table_iter_init (&iter, genre->children);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &artist))
+		parallel_query_add_artist (job, artist);
+}
+
+/*
+ * Walks the tree for one entry type, descending through the genre, artist
+ * and album named in the query, and evaluates the query for the entries
+ * in the albums it ends up at.  Must be called with the shard lock held.
+ */
+static void
+conjunctive_query_tree (RhythmDBTree *db,
+			GHashTable *genres,
+			RhythmDBTreeParallelQuery *job)
+{
+	RhythmDBTreeProperty *genre;
+	GHashTableIter iter;
+
+	if (G_UNLIKELY (*job->traversal->cancel))
 		return;
+
+	job->items = g_ptr_array_new ();
+	job->albums = TRUE;
+	job->n_entries = 0;
+
+	if (job->plan->genre != NULL) {
+		genre = g_hash_table_lookup (genres, job->plan->genre);
+		if (genre != NULL)
+			parallel_query_add_genre (job, genre);
+	} else {
+		g_hash_table_iter_init (&iter, genres);
+		while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &genre))
+			parallel_query_add_genre (job, genre);
+	}
+
+	parallel_query_run (db, job);
+
+	g_ptr_array_free (job->items, TRUE);
+	job->items = NULL;
+}
+
+/* must be called with the words, trigram and range locks held */
+static void
+conjunctive_query_candidates (RhythmDBTree *db,
+			      GHashTable *matches,
+			      RhythmDBTreeParallelQuery *job)
+{
+	RhythmDBEntryType *etype = job->plan->etype;
+	GHashTableIter iter;
+	gpointer entry;
+
+	job->items = g_ptr_array_sized_new (g_hash_table_size (matches));
+	job->albums = FALSE;
+
+	g_hash_table_iter_init (&iter, matches);
+	while (g_hash_table_iter_next (&iter, &entry, NULL)) {
+		if (etype != NULL && ((RhythmDBEntry *)entry)->type != etype)
+			continue;
+		g_ptr_array_add (job->items, entry);
 	}
+	job->n_entries = job->items->len;
 
-	g_hash_table_foreach (genres, (GHFunc) conjunctive_query_artists, data);
+	parallel_query_run (db, job);
+
+	g_ptr_array_free (job->items, TRUE);
+	job->items = NULL;
 }
 
 static void
@@ -2191,52 +6189,85 @@ conjunctive_query (RhythmDBTree *db,
 		   gpointer data,
 		   gboolean *cancel)
 {
-	int type_query_idx = -1;
+	RhythmDBTreeQueryPlan plan;
+	struct RhythmDBTreeTraversalData traversal_data;
+	RhythmDBTreeParallelQuery job;
+	GHashTable *matches = NULL;
 	guint i;
-	struct RhythmDBTreeTraversalData *traversal_data;
 
-	for (i = 0; i < query->len; i++) {
-		RhythmDBQueryData *qdata = g_ptr_array_index (query, i);
-		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
-		    && qdata->propid == RHYTHMDB_PROP_TYPE) {
-			/* A song can't have two types. */
-			if (type_query_idx > 0)
-				return;
-			type_query_idx = i;
-		}
+	if (query_plan_init (db, query, &plan) == FALSE) {
+		rb_debug ("conjunctive query can't match anything");
+		return;
 	}
 
-	traversal_data = g_new (struct RhythmDBTreeTraversalData, 1);
-	traversal_data->db = db;
-	traversal_data->query = query;
-	traversal_data->func = func;
-	traversal_data->data = data;
-	traversal_data->cancel = cancel;
-
-	g_mutex_lock (db->priv->genres_lock);
-	if (type_query_idx >= 0) {
-		GHashTable *genres;
-		RhythmDBEntryType *etype;
-		RhythmDBQueryData *qdata = g_ptr_array_index (query, type_query_idx);
-
-		g_ptr_array_remove_index_fast (query, type_query_idx);
+	/* the type criteria is dealt with by only looking at entries of
+	 * that type, whichever way the query is answered.
+	 */
+	if (plan.etype != NULL) {
+		for (i = 0; i < query->len; ) {
+			RhythmDBQueryData *qdata = g_ptr_array_index (query, i);
+			if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
+			    && qdata->propid == RHYTHMDB_PROP_TYPE)
+				g_ptr_array_remove_index_fast (query, i);
+			else
+				i++;
+		}
+	}
 
-		etype = g_value_get_object (qdata->val);
-		genres = get_genres_hash_for_type (db, etype);
-		if (genres != NULL) {
-			conjunctive_query_genre (db, genres, traversal_data);
+	traversal_data.db = db;
+	traversal_data.compiled = rhythmdb_query_compile (RHYTHMDB (db), query);
+	traversal_data.func = func;
+	traversal_data.data = data;
+	traversal_data.cancel = cancel;
+
+	memset (&job, 0, sizeof (job));
+	job.traversal = &traversal_data;
+	job.plan = &plan;
+
+	g_static_rw_lock_reader_lock (&db->priv->words_lock);
+	g_static_rw_lock_reader_lock (&db->priv->trigram_lock);
+	g_static_rw_lock_reader_lock (&db->priv->range_lock);
+	query_plan_choose_index (db, query, &plan);
+	rb_debug ("conjunctive query plan: %s, cost %u of %u entries",
+		  query_plan_names[plan.type], plan.cost, plan.n_entries);
+	if (plan.type == QUERY_PLAN_INDEX) {
+		/* only evaluate the query for the entries that may match the
+		 * criteria looked up in the index.  the criteria stay in the
+		 * query, which is cheap to evaluate for the few entries that
+		 * get this far.
+		 */
+		matches = query_plan_lookup (db, query, &plan);
+		if (matches != NULL) {
+			conjunctive_query_candidates (db, matches, &job);
+			g_hash_table_destroy (matches);
+		}
+	}
+	g_static_rw_lock_reader_unlock (&db->priv->range_lock);
+	g_static_rw_lock_reader_unlock (&db->priv->trigram_lock);
+	g_static_rw_lock_reader_unlock (&db->priv->words_lock);
+
+	/* the tree walk descends through any genre, artist and album
+	 * criteria by itself, so the tree and scan plans only differ in
+	 * how much of the tree they end up looking at.  the criteria are
+	 * still evaluated for each entry, which also takes care of any
+	 * conflicting ones.
+	 */
+	if (matches == NULL && plan.missing == FALSE) {
+		if (plan.etype != NULL) {
+			RhythmDBTreeShard *shard;
+
+			/* only the tree for this entry type needs to be locked */
+			shard = get_shard (db, plan.etype);
+			g_static_rw_lock_reader_lock (&shard->lock);
+			conjunctive_query_tree (db, shard->genres, &job);
+			g_static_rw_lock_reader_unlock (&shard->lock);
 		} else {
-			g_assert_not_reached ();
+			genres_hash_foreach (db, (RBHFunc) conjunctive_query_tree, &job);
 		}
-	} else {
-		/* FIXME */
-		/* No type was given; punt and query everything */
-		genres_hash_foreach (db, (RBHFunc)conjunctive_query_genre,
-				     traversal_data);
 	}
-	g_mutex_unlock (db->priv->genres_lock);
 
-	g_free (traversal_data);
+	query_plan_clear (&plan);
+	rhythmdb_compiled_query_free (traversal_data.compiled);
 }
 
 static GList *
@@ -2328,9 +6359,11 @@ handle_entry_match (RhythmDB *db,
 		    struct RhythmDBTreeQueryGatheringData *data)
 {
 
-	if (data->entries
-	    && g_hash_table_lookup (data->entries, entry))
-		return;
+	if (data->entries != NULL) {
+		if (g_hash_table_lookup (data->entries, entry))
+			return;
+		g_hash_table_insert (data->entries, entry, entry);
+	}
 
 	g_ptr_array_add (data->queue, entry);
 	if (data->queue->len > RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
@@ -2358,6 +6391,64 @@ rhythmdb_tree_do_full_query (RhythmDB *adb,
 	g_free (data);
 }
 
+/**
+ * rhythmdb_tree_explain_query:
+ * @db: a #RhythmDBTree
+ * @query: the query to explain
+ *
+ * Describes how the database would go about running a query, for
+ * debugging.  The query is split at its disjunctions, and for each part,
+ * the description has a line starting with the name of the chosen plan:
+ * "scan" to walk the whole tree for the entry type (or all types), "tree"
+ * to descend the tree through genre, artist or album criteria, "index" to
+ * look one of the criteria up in an index, or "empty" if the query can't
+ * match anything.  The rest of the line gives the details and the
+ * estimated cost.
+ *
+ * Return value: the description of the query plan, to be freed by the
+ * caller.
+ */
+char *
+rhythmdb_tree_explain_query (RhythmDBTree *db,
+			     GPtrArray *query)
+{
+	GPtrArray *processed;
+	GList *conjunctions;
+	GList *l;
+	GString *str;
+
+	g_return_val_if_fail (RHYTHMDB_IS_TREE (db), NULL);
+
+	processed = rhythmdb_query_copy (query);
+	rhythmdb_query_preprocess (RHYTHMDB (db), processed);
+
+	str = g_string_new (NULL);
+	conjunctions = g_list_reverse (split_query_by_disjunctions (db, processed));
+	for (l = conjunctions; l != NULL; l = l->next) {
+		RhythmDBTreeQueryPlan plan;
+
+		if (query_plan_init (db, l->data, &plan)) {
+			g_static_rw_lock_reader_lock (&db->priv->words_lock);
+			g_static_rw_lock_reader_lock (&db->priv->trigram_lock);
+			g_static_rw_lock_reader_lock (&db->priv->range_lock);
+			query_plan_choose_index (db, l->data, &plan);
+			g_static_rw_lock_reader_unlock (&db->priv->range_lock);
+			g_static_rw_lock_reader_unlock (&db->priv->trigram_lock);
+			g_static_rw_lock_reader_unlock (&db->priv->words_lock);
+		}
+
+		if (l != conjunctions)
+			g_string_append_c (str, '\n');
+		query_plan_describe (db, l->data, &plan, str);
+		query_plan_clear (&plan);
+		g_ptr_array_free (l->data, TRUE);
+	}
+	g_list_free (conjunctions);
+	rhythmdb_query_free (processed);
+
+	return g_string_free (str, FALSE);
+}
+
 static RhythmDBEntry *
 rhythmdb_tree_entry_lookup_by_location (RhythmDB *adb,
 					RBRefString *uri)
@@ -2365,9 +6456,9 @@ rhythmdb_tree_entry_lookup_by_location (RhythmDB *adb,
 	RhythmDBTree *db = RHYTHMDB_TREE (adb);
 	RhythmDBEntry *entry;
 
-	g_mutex_lock (db->priv->entries_lock);
+	g_static_rw_lock_reader_lock (&db->priv->entries_lock);
 	entry = g_hash_table_lookup (db->priv->entries, uri);
-	g_mutex_unlock (db->priv->entries_lock);
+	g_static_rw_lock_reader_unlock (&db->priv->entries_lock);
 
 	return entry;
 }
@@ -2379,9 +6470,9 @@ rhythmdb_tree_entry_lookup_by_id (RhythmDB *adb,
 	RhythmDBTree *db = RHYTHMDB_TREE (adb);
 	RhythmDBEntry *entry;
 
-	g_mutex_lock (db->priv->entries_lock);
+	g_static_rw_lock_reader_lock (&db->priv->entries_lock);
 	entry = g_hash_table_lookup (db->priv->entry_ids, GINT_TO_POINTER (id));
-	g_mutex_unlock (db->priv->entries_lock);
+	g_static_rw_lock_reader_unlock (&db->priv->entries_lock);
 
 	return entry;
 }
@@ -2407,11 +6498,11 @@ rhythmdb_tree_entry_foreach (RhythmDB *rdb, GFunc foreach_func, gpointer user_da
 	GPtrArray *list;
 	guint size, i;
 
-	g_mutex_lock (db->priv->entries_lock);
+	g_static_rw_lock_reader_lock (&db->priv->entries_lock);
 	size = g_hash_table_size (db->priv->entries);
 	list = g_ptr_array_sized_new (size);
 	g_hash_table_foreach (db->priv->entries, (GHFunc)rhythmdb_tree_entry_foreach_func, list);
-	g_mutex_unlock (db->priv->entries_lock);
+	g_static_rw_lock_reader_unlock (&db->priv->entries_lock);
 
 	for (i = 0; i < size; i++) {
 		RhythmDBEntry *entry = (RhythmDBEntry*)g_ptr_array_index (list, i);
@@ -2493,7 +6584,7 @@ rhythmdb_tree_entry_keyword_add (RhythmDB *rdb,
 	GHashTable *keyword_table;
 	gboolean present;
 
-	g_mutex_lock (db->priv->keywords_lock);
+	g_static_rw_lock_writer_lock (&db->priv->keywords_lock);
 	keyword_table = g_hash_table_lookup (db->priv->keywords, keyword);
 	if (keyword_table != NULL) {
 		/* it would be nice if _insert told us whether it was replacing a value */
@@ -2509,7 +6600,10 @@ rhythmdb_tree_entry_keyword_add (RhythmDB *rdb,
 		g_hash_table_insert (db->priv->keywords, rb_refstring_ref (keyword), keyword_table);
 	}
 
-	g_mutex_unlock (db->priv->keywords_lock);
+	g_static_rw_lock_writer_unlock (&db->priv->keywords_lock);
+
+	if (present == FALSE)
+		rhythmdb_tree_journal_keyword (db, entry, keyword, TRUE);
 
 	return present;
 }
@@ -2523,14 +6617,17 @@ rhythmdb_tree_entry_keyword_remove (RhythmDB *rdb,
 	GHashTable *keyword_table;
 	gboolean ret;
 
-	g_mutex_lock (db->priv->keywords_lock);
+	g_static_rw_lock_writer_lock (&db->priv->keywords_lock);
 	keyword_table = g_hash_table_lookup (db->priv->keywords, keyword);
 	if (keyword_table != NULL) {
 		ret = remove_entry_from_keyword_table (keyword, keyword_table, entry);
 	} else {
 		ret = FALSE;
 	}
-	g_mutex_unlock (db->priv->keywords_lock);
+	g_static_rw_lock_writer_unlock (&db->priv->keywords_lock);
+
+	if (ret)
+		rhythmdb_tree_journal_keyword (db, entry, keyword, FALSE);
 
 	return ret;
 }
@@ -2544,14 +6641,14 @@ rhythmdb_tree_entry_keyword_has (RhythmDB *rdb,
 	GHashTable *keyword_table;
 	gboolean ret;
 
-	g_mutex_lock (db->priv->keywords_lock);
+	g_static_rw_lock_reader_lock (&db->priv->keywords_lock);
 	keyword_table = g_hash_table_lookup (db->priv->keywords, keyword);
 	if (keyword_table != NULL) {
 		ret = (g_hash_table_lookup (keyword_table, entry) != NULL);
 	} else {
 		ret = FALSE;
 	}
-	g_mutex_unlock (db->priv->keywords_lock);
+	g_static_rw_lock_reader_unlock (&db->priv->keywords_lock);
 
 	return ret;
 }
@@ -2594,9 +6691,9 @@ rhythmdb_tree_entry_keywords_get (RhythmDB *rdb,
 	data.entry = entry;
 	data.keywords = NULL;
 
-	g_mutex_lock (db->priv->keywords_lock);
+	g_static_rw_lock_reader_lock (&db->priv->keywords_lock);
 	g_hash_table_foreach (db->priv->keywords, (GHFunc)check_entry_existance, &data);
-	g_mutex_unlock (db->priv->keywords_lock);
+	g_static_rw_lock_reader_unlock (&db->priv->keywords_lock);
 
 	return data.keywords;
 }
@@ -2691,7 +6788,7 @@ rhythmdb_hash_tree_foreach (RhythmDB *adb,
 			    gpointer data)
 {
 	struct HashTreeIteratorCtxt ctxt;
-	GHashTable *table;
+	RhythmDBTreeShard *shard;
 
 	ctxt.db = RHYTHMDB_TREE (adb);
 	ctxt.album_func = album_func;
@@ -2700,18 +6797,15 @@ rhythmdb_hash_tree_foreach (RhythmDB *adb,
 	ctxt.entry_func = entry_func;
 	ctxt.data = data;
 
-	g_mutex_lock (ctxt.db->priv->genres_lock);
-	table = get_genres_hash_for_type (RHYTHMDB_TREE (adb), type);
-	if (table == NULL) {
-		return;
-	}
+	shard = get_shard (ctxt.db, type);
 	if ((ctxt.album_func != NULL)
 	    || (ctxt.artist_func != NULL)
 	    || (ctxt.genres_func != NULL)
 	    || (ctxt.entry_func != NULL)) {
-		g_hash_table_foreach (table, hash_tree_genres_foreach, &ctxt);
+		g_static_rw_lock_reader_lock (&shard->lock);
+		g_hash_table_foreach (shard->genres, hash_tree_genres_foreach, &ctxt);
+		g_static_rw_lock_reader_unlock (&shard->lock);
 	}
-	g_mutex_unlock (ctxt.db->priv->genres_lock);
 }
 
 static void
@@ -2726,7 +6820,7 @@ rhythmdb_tree_entry_type_registered (RhythmDB *db,
 	RBRefString *rs_name;
 
 	rdb = RHYTHMDB_TREE (db);
-	g_mutex_lock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
+	g_static_rw_lock_writer_lock (&rdb->priv->entries_lock);
 
 	/* ugh, this sucks, maybe store the name as a refstring in the object? */
 	g_object_get (entry_type, "name", &name, NULL);
@@ -2736,7 +6830,7 @@ rhythmdb_tree_entry_type_registered (RhythmDB *db,
 	if (rs_name)
 		entries = g_hash_table_lookup (rdb->priv->unknown_entry_types, rs_name);
 	if (entries == NULL) {
-		g_mutex_unlock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
+		g_static_rw_lock_writer_unlock (&rdb->priv->entries_lock);
 		rb_refstring_unref (rs_name);
 		rb_debug ("no entries of newly registered type %s loaded from db", name);
 		return;
@@ -2770,7 +6864,7 @@ rhythmdb_tree_entry_type_registered (RhythmDB *db,
 	rhythmdb_commit (db);
 
 	g_hash_table_remove (rdb->priv->unknown_entry_types, rs_name);
-	g_mutex_unlock (RHYTHMDB_TREE(rdb)->priv->entries_lock);
+	g_static_rw_lock_writer_unlock (&rdb->priv->entries_lock);
 	free_unknown_entries (rs_name, entries, NULL);
 	rb_refstring_unref (rs_name);
 }
@@ -75,6 +75,15 @@ GType		rhythmdb_tree_get_type	(void);
 
 RhythmDB *	rhythmdb_tree_new	(const char *name);
 
+void		rhythmdb_tree_set_trigram_index		(RhythmDBTree *db,
+							 RhythmDBPropType propid,
+							 gboolean enabled);
+gsize		rhythmdb_tree_get_trigram_index_size	(RhythmDBTree *db,
+							 RhythmDBPropType propid);
+
+char *		rhythmdb_tree_explain_query		(RhythmDBTree *db,
+							 GPtrArray *query);
+
 G_END_DECLS
 
 #endif /* __RHYTHMBDB_TREE_H */
@@ -171,7 +171,10 @@ G_DEFINE_ABSTRACT_TYPE(RhythmDB, rhythmdb, G_TYPE_OBJECT)
 	G_FILE_ATTRIBUTE_STANDARD_SIZE ","		\
 	G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME ","	\
 	G_FILE_ATTRIBUTE_STANDARD_TYPE ","		\
-	G_FILE_ATTRIBUTE_TIME_MODIFIED
+	G_FILE_ATTRIBUTE_TIME_MODIFIED ","		\
+	G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC ","		\
+	G_FILE_ATTRIBUTE_UNIX_DEVICE ","		\
+	G_FILE_ATTRIBUTE_UNIX_INODE
 
 /* file attributes requested in RHYTHMDB_ACTION_ENUM_DIR */
 #define RHYTHMDB_FILE_CHILD_INFO_ATTRIBUTES		\
@@ -206,6 +209,9 @@ struct media_type_filter {
  */
 #define REALLY_SMALL_FILE_SIZE	(4096)
 
+/* number of files checked at once on each mount, unless overridden */
+#define RHYTHMDB_DEFAULT_STAT_THREADS	8
+
 
 typedef struct
 {
@@ -213,6 +219,7 @@ typedef struct
 	GPtrArray *query;
 	guint propid;
 	RhythmDBQueryResults *results;
+	gboolean cached;
 	gboolean cancel;
 } RhythmDBQueryThreadData;
 
@@ -234,6 +241,8 @@ typedef struct
 		RHYTHMDB_ACTION_QUIT,
 	} type;
 	RBRefString *uri;
+	gboolean background;	/* rescanning a file already in the db */
+	GClosure *load_complete;	/* LOAD only, see rhythmdb_queue_load */
 	union {
 		struct {
 			RhythmDBEntryType *entry_type;
@@ -261,6 +270,7 @@ static void rhythmdb_thread_create (RhythmDB *db,
 static void rhythmdb_read_enter (RhythmDB *db);
 static void rhythmdb_read_leave (RhythmDB *db);
 static void rhythmdb_process_one_event (RhythmDBEvent *event, RhythmDB *db);
+static void rhythmdb_event_queue_watch_cb (RhythmDBEvent *event, RhythmDB *db);
 static gpointer action_thread_main (RhythmDB *db);
 static gpointer query_thread_main (RhythmDBQueryThreadData *data);
 static void rhythmdb_entry_set_mount_point (RhythmDB *db,
@@ -292,6 +302,9 @@ static void rhythmdb_add_to_stat_list (RhythmDB *db,
 				       RhythmDBEntryType *ignore_type,
 				       RhythmDBEntryType *error_type);
 static void free_entry_changes (GSList *entry_changes);
+static void rhythmdb_entry_set_many_internal (RhythmDB *db,
+					      const RhythmDBEntryUpdate *updates,
+					      guint n_updates);
 
 static void perform_next_mount (RhythmDB *db);
 
@@ -301,6 +314,8 @@ enum
 	PROP_NAME,
 	PROP_DRY_RUN,
 	PROP_NO_UPDATE,
+	PROP_STAT_THREADS,
+	PROP_METADATA_CACHE,
 };
 
 enum
@@ -308,6 +323,8 @@ enum
 	ENTRY_ADDED,
 	ENTRY_CHANGED,
 	ENTRY_DELETED,
+	ENTRIES_CHANGED,
+	ENTRIES_DELETED,
 	ENTRY_KEYWORD_ADDED,
 	ENTRY_KEYWORD_REMOVED,
 	ENTRY_EXTRA_METADATA_REQUEST,
@@ -370,6 +387,37 @@ rhythmdb_class_init (RhythmDBClass *klass)
 							       "Whether or not to update the database",
 							       FALSE,
 							       G_PARAM_READWRITE));
+	/**
+	 * RhythmDB:stat-threads
+	 *
+	 * The number of files checked at the same time on each mount when
+	 * the library is revalidated at startup.  Network shares benefit
+	 * from a higher value; see rhythmdb_set_mount_stat_threads to
+	 * override this for a single mount.  The library_stat_threads and
+	 * library_mount_stat_threads settings override these when the
+	 * action thread is started.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_STAT_THREADS,
+					 g_param_spec_uint ("stat-threads",
+							    "stat threads",
+							    "Number of files to check at once on each mount",
+							    1, 64, RHYTHMDB_DEFAULT_STAT_THREADS,
+							    G_PARAM_READWRITE));
+	/**
+	 * RhythmDB:metadata-cache
+	 *
+	 * Path of the file in which metadata read from audio files is
+	 * cached, or %NULL to not cache it.  This must be set before
+	 * rhythmdb_start_action_thread is called to take effect.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_METADATA_CACHE,
+					 g_param_spec_string ("metadata-cache",
+							      "metadata cache",
+							      "Path of the metadata cache file",
+							      NULL,
+							      G_PARAM_READWRITE));
 	/**
 	 * RhythmDB::entry-added:
 	 * @db: the #RhythmDB
@@ -423,6 +471,47 @@ rhythmdb_class_init (RhythmDBClass *klass)
 			      G_TYPE_NONE, 2,
 			      RHYTHMDB_TYPE_ENTRY, G_TYPE_VALUE_ARRAY);
 
+	/**
+	 * RhythmDB::entries-changed:
+	 * @db: the #RhythmDB
+	 * @changes: a #RhythmDBEntryChangeSet describing the changes
+	 *
+	 * Emitted once for each batch of committed entry changes, before
+	 * the #RhythmDB::entry-changed signals for the individual entries.
+	 * Handling this signal is much cheaper than handling entry-changed,
+	 * which is only emitted when something is connected to it.
+	 */
+	rhythmdb_signals[ENTRIES_CHANGED] =
+		g_signal_new ("entries-changed",
+			      RHYTHMDB_TYPE,
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (RhythmDBClass, entries_changed),
+			      NULL, NULL,
+			      g_cclosure_marshal_VOID__BOXED,
+			      G_TYPE_NONE, 1,
+			      RHYTHMDB_TYPE_ENTRY_CHANGE_SET);
+
+	/**
+	 * RhythmDB::entries-deleted:
+	 * @db: the #RhythmDB
+	 * @entries: a #GPtrArray of the deleted #RhythmDBEntry structures, in no
+	 *   particular order
+	 *
+	 * Emitted once for each batch of deleted entries, before the
+	 * #RhythmDB::entry-deleted signals for the individual entries.
+	 * As with entry-changed, entry-deleted is only emitted when something
+	 * is connected to it.
+	 */
+	rhythmdb_signals[ENTRIES_DELETED] =
+		g_signal_new ("entries-deleted",
+			      RHYTHMDB_TYPE,
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (RhythmDBClass, entries_deleted),
+			      NULL, NULL,
+			      g_cclosure_marshal_VOID__POINTER,
+			      G_TYPE_NONE, 1,
+			      G_TYPE_POINTER);
+
 	/**
 	 * RhythmDB::entry-keyword-added:
 	 * @db: the #RhythmDB
@@ -435,7 +524,7 @@ rhythmdb_class_init (RhythmDBClass *klass)
 		g_signal_new ("entry_keyword_added",
 			      RHYTHMDB_TYPE,
 			      G_SIGNAL_RUN_LAST,
-			      G_STRUCT_OFFSET (RhythmDBClass, entry_added),
+			      G_STRUCT_OFFSET (RhythmDBClass, entry_keyword_added),
 			      NULL, NULL,
 			      rb_marshal_VOID__BOXED_BOXED,
 			      G_TYPE_NONE,
@@ -453,7 +542,7 @@ rhythmdb_class_init (RhythmDBClass *klass)
 		g_signal_new ("entry_keyword_removed",
 			      RHYTHMDB_TYPE,
 			      G_SIGNAL_RUN_LAST,
-			      G_STRUCT_OFFSET (RhythmDBClass, entry_deleted),
+			      G_STRUCT_OFFSET (RhythmDBClass, entry_keyword_removed),
 			      NULL, NULL,
 			      rb_marshal_VOID__BOXED_BOXED,
 			      G_TYPE_NONE,
@@ -699,10 +788,14 @@ rhythmdb_init (RhythmDB *db)
 	db->priv->delayed_write_queue = g_async_queue_new ();
 	db->priv->event_queue_watch_id = rb_async_queue_watch_new (db->priv->event_queue,
 								   G_PRIORITY_LOW,		/* really? */
-								   (RBAsyncQueueWatchFunc) rhythmdb_process_one_event,
+								   (RBAsyncQueueWatchFunc) rhythmdb_event_queue_watch_cb,
 								   db,
 								   NULL,
 								   NULL);
+	for (i = 0; i < RHYTHMDB_EVENT_N_LANES; i++) {
+		db->priv->event_lanes[i] = g_queue_new ();
+	}
+	db->priv->event_timer = g_timer_new ();
 
 	db->priv->restored_queue = g_async_queue_new ();
 
@@ -733,8 +826,11 @@ rhythmdb_init (RhythmDB *db)
 	rb_podcast_register_entry_types (db);
 
  	db->priv->stat_mutex = g_mutex_new ();
+	db->priv->stat_threads = RHYTHMDB_DEFAULT_STAT_THREADS;
+	db->priv->mount_stat_threads = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
 	db->priv->change_mutex = g_mutex_new ();
+	g_static_rw_lock_init (&db->priv->entry_fields_lock);
 
 	db->priv->changed_entries = g_hash_table_new_full (NULL,
 							   NULL,
@@ -763,6 +859,7 @@ rhythmdb_init (RhythmDB *db)
 	db->priv->next_entry_id = 1;
 
 	rhythmdb_init_monitoring (db);
+	rhythmdb_init_query_cache (db);
 
 	db->priv->monitor_notify_id = 
 		eel_gconf_notification_add (CONF_MONITOR_LIBRARY,
@@ -805,71 +902,227 @@ rhythmdb_ignore_media_type (const char *media_type)
 	return FALSE;
 }
 
+/* number of stat results collected before they are handed to the main thread */
+#define RHYTHMDB_STAT_BATCH_SIZE	32
+
 typedef struct {
 	RhythmDB *db;
 	GList *stat_list;
 } RhythmDBStatThreadData;
 
+typedef struct {
+	RhythmDB *db;
+	RhythmDBDirManifest *manifest;
+	char *mountpoint;
+	GList *events;
+	GThreadPool *pool;
+
+	GMutex *batch_lock;
+	GPtrArray *batch;
+} RhythmDBStatMount;
+
+static void
+rhythmdb_stat_push_batch (RhythmDB *db, GPtrArray *batch)
+{
+	guint i;
+
+	if (batch->len == 0)
+		return;
+
+	/* push the whole batch under one lock so the main thread
+	 * doesn't wake up for each result.
+	 */
+	g_async_queue_lock (db->priv->event_queue);
+	for (i = 0; i < batch->len; i++) {
+		g_async_queue_push_unlocked (db->priv->event_queue, g_ptr_array_index (batch, i));
+	}
+	g_async_queue_unlock (db->priv->event_queue);
+	g_ptr_array_set_size (batch, 0);
+}
+
+static void
+rhythmdb_stat_one (RhythmDBEvent *event, RhythmDBStatMount *mount)
+{
+	RhythmDB *db = mount->db;
+	GPtrArray *full = NULL;
+	GError *error = NULL;
+	GFile *file;
+	int done;
+
+	/* if we've been cancelled, just free the event.  this will
+	 * clean up the list and then we'll exit the thread.
+	 */
+	if (g_cancellable_is_cancelled (db->priv->exiting)) {
+		rhythmdb_event_free (db, event);
+		return;
+	}
+
+	file = g_file_new_for_uri (rb_refstring_get (event->uri));
+	event->real_uri = rb_refstring_ref (event->uri);		/* what? */
+	event->file_info = g_file_query_info (file,
+					      G_FILE_ATTRIBUTE_TIME_MODIFIED,	/* anything else? */
+					      G_FILE_QUERY_INFO_NONE,
+					      db->priv->exiting,
+					      &error);
+	if (error != NULL) {
+		event->error = make_access_failed_error (rb_refstring_get (event->uri), error);
+		g_clear_error (&error);
+
+		if (event->file_info != NULL) {
+			g_object_unref (event->file_info);
+			event->file_info = NULL;
+		}
+
+		if (mount->manifest != NULL)
+			rhythmdb_dir_manifest_stat_failed (mount->manifest, event);
+	}
+	g_object_unref (file);
+
+	g_mutex_lock (mount->batch_lock);
+	g_ptr_array_add (mount->batch, event);
+	if (mount->batch->len >= RHYTHMDB_STAT_BATCH_SIZE) {
+		full = mount->batch;
+		mount->batch = g_ptr_array_sized_new (RHYTHMDB_STAT_BATCH_SIZE);
+	}
+	g_mutex_unlock (mount->batch_lock);
+
+	if (full != NULL) {
+		rhythmdb_stat_push_batch (db, full);
+		g_ptr_array_free (full, TRUE);
+	}
+
+	done = g_atomic_int_exchange_and_add (&db->priv->stat_thread_done, 1) + 1;
+	if (done % 1000 == 0) {
+		rb_debug ("%d file info queries done", done);
+	}
+}
+
+static guint
+rhythmdb_get_stat_threads_for_mount (RhythmDB *db, const char *mountpoint)
+{
+	gpointer threads;
+
+	if (mountpoint != NULL &&
+	    g_hash_table_lookup_extended (db->priv->mount_stat_threads, mountpoint, NULL, &threads)) {
+		return GPOINTER_TO_UINT (threads);
+	}
+	return db->priv->stat_threads;
+}
+
 static gpointer
 stat_thread_main (RhythmDBStatThreadData *data)
 {
+	RhythmDB *db = data->db;
+	RhythmDBDirManifest *manifest;
+	GHashTable *mount_map;
+	GList *mounts = NULL;
 	GList *i;
-	GError *error = NULL;
 	RhythmDBEvent *result;
 
-	data->db->priv->stat_thread_count = g_list_length (data->stat_list);
-	data->db->priv->stat_thread_done = 0;
+	db->priv->stat_thread_count = g_list_length (data->stat_list);
+	db->priv->stat_thread_done = 0;
+
+	rb_debug ("entering stat thread: %d to process", db->priv->stat_thread_count);
+
+	/* skip files in directories that haven't changed since last time */
+	manifest = rhythmdb_dir_manifest_load (db);
+	if (manifest != NULL) {
+		GPtrArray *unchanged;
 
-	rb_debug ("entering stat thread: %d to process", data->db->priv->stat_thread_count);
+		unchanged = g_ptr_array_new ();
+		data->stat_list = rhythmdb_dir_manifest_check (manifest, db, data->stat_list, unchanged);
+		g_atomic_int_add (&db->priv->stat_thread_done, unchanged->len);
+		rhythmdb_stat_push_batch (db, unchanged);
+		g_ptr_array_free (unchanged, TRUE);
+	}
+
+	/* group the files by mountpoint, so each mount gets its own
+	 * set of workers and a slow network share doesn't hold up
+	 * files on local disks.
+	 */
+	mount_map = g_hash_table_new (g_str_hash, g_str_equal);
 	for (i = data->stat_list; i != NULL; i = i->next) {
 		RhythmDBEvent *event = (RhythmDBEvent *)i->data;
-		GFile *file;
+		RhythmDBStatMount *mount;
+		const char *mountpoint = NULL;
 
-		/* if we've been cancelled, just free the event.  this will
-		 * clean up the list and then we'll exit the thread.
-		 */
-		if (g_cancellable_is_cancelled (data->db->priv->exiting)) {
-			rhythmdb_event_free (data->db, event);
-			continue;
+		if (event->entry != NULL) {
+			mountpoint = rhythmdb_entry_get_string (event->entry, RHYTHMDB_PROP_MOUNTPOINT);
 		}
 
-		if (data->db->priv->stat_thread_done > 0 &&
-		    data->db->priv->stat_thread_done % 1000 == 0) {
-			rb_debug ("%d file info queries done",
-				  data->db->priv->stat_thread_done);
+		mount = g_hash_table_lookup (mount_map, mountpoint ? mountpoint : "");
+		if (mount == NULL) {
+			mount = g_new0 (RhythmDBStatMount, 1);
+			mount->db = db;
+			mount->manifest = manifest;
+			mount->mountpoint = g_strdup (mountpoint ? mountpoint : "");
+			g_hash_table_insert (mount_map, mount->mountpoint, mount);
+			mounts = g_list_prepend (mounts, mount);
 		}
+		mount->events = g_list_prepend (mount->events, event);
+	}
+	g_hash_table_destroy (mount_map);
+	g_list_free (data->stat_list);
 
-		file = g_file_new_for_uri (rb_refstring_get (event->uri));
-		event->real_uri = rb_refstring_ref (event->uri);		/* what? */
-		event->file_info = g_file_query_info (file,
-						      G_FILE_ATTRIBUTE_TIME_MODIFIED,	/* anything else? */
-						      G_FILE_QUERY_INFO_NONE,
-						      data->db->priv->exiting,
-						      &error);
-		if (error != NULL) {
-			event->error = make_access_failed_error (rb_refstring_get (event->uri), error);
-			g_clear_error (&error);
+	g_mutex_lock (db->priv->stat_mutex);
+	for (i = mounts; i != NULL; i = i->next) {
+		RhythmDBStatMount *mount = (RhythmDBStatMount *)i->data;
+		guint threads;
+
+		threads = rhythmdb_get_stat_threads_for_mount (db, mount->mountpoint[0] ? mount->mountpoint : NULL);
+		if (threads == 0)
+			threads = 1;
+
+		rb_debug ("checking %d files on %s using %u threads",
+			  g_list_length (mount->events),
+			  mount->mountpoint[0] ? mount->mountpoint : "local filesystems",
+			  threads);
+		mount->batch_lock = g_mutex_new ();
+		mount->batch = g_ptr_array_sized_new (RHYTHMDB_STAT_BATCH_SIZE);
+		mount->pool = g_thread_pool_new ((GFunc) rhythmdb_stat_one,
+						 mount,
+						 threads, FALSE, NULL);
+	}
+	g_mutex_unlock (db->priv->stat_mutex);
 
-			if (event->file_info != NULL) {
-				g_object_unref (event->file_info);
-				event->file_info = NULL;
-			}
+	for (i = mounts; i != NULL; i = i->next) {
+		RhythmDBStatMount *mount = (RhythmDBStatMount *)i->data;
+		GList *l;
+
+		for (l = mount->events; l != NULL; l = l->next) {
+			g_thread_pool_push (mount->pool, l->data, NULL);
 		}
+	}
 
-		g_async_queue_push (data->db->priv->event_queue, event);
-		g_object_unref (file);
-		g_atomic_int_inc (&data->db->priv->stat_thread_done);
+	/* wait for the workers to finish, then hand over what's left */
+	for (i = mounts; i != NULL; i = i->next) {
+		RhythmDBStatMount *mount = (RhythmDBStatMount *)i->data;
+
+		g_thread_pool_free (mount->pool, FALSE, TRUE);
+		rhythmdb_stat_push_batch (db, mount->batch);
+
+		g_ptr_array_free (mount->batch, TRUE);
+		g_mutex_free (mount->batch_lock);
+		g_list_free (mount->events);
+		g_free (mount->mountpoint);
+		g_free (mount);
 	}
+	g_list_free (mounts);
 
-	g_list_free (data->stat_list);
+	if (manifest != NULL) {
+		/* an interrupted check doesn't tell us anything about the directories */
+		if (g_cancellable_is_cancelled (db->priv->exiting) == FALSE)
+			rhythmdb_dir_manifest_save (manifest);
+		rhythmdb_dir_manifest_free (manifest);
+	}
 
-	data->db->priv->stat_thread_running = FALSE;
+	db->priv->stat_thread_running = FALSE;
 
 	rb_debug ("exiting stat thread");
 	result = g_slice_new0 (RhythmDBEvent);
-	result->db = data->db;			/* need to unref? */
+	result->db = db;			/* need to unref? */
 	result->type = RHYTHMDB_EVENT_THREAD_EXITED;
-	rhythmdb_push_event (data->db, result);
+	rhythmdb_push_event (db, result);
 
 	g_free (data);
 	return NULL;
@@ -921,6 +1174,45 @@ perform_next_mount (RhythmDB *db)
 				       db);
 }
 
+/* reads the settings for the number of files to check at once, overall
+ * and for particular mounts.  called with the stat mutex held.
+ */
+static void
+rhythmdb_read_stat_thread_settings (RhythmDB *db)
+{
+	GSList *mounts;
+	GSList *l;
+	int threads;
+
+	threads = eel_gconf_get_integer (CONF_LIBRARY_STAT_THREADS);
+	if (threads > 0)
+		db->priv->stat_threads = MIN (threads, 64);
+
+	mounts = eel_gconf_get_string_list (CONF_LIBRARY_MOUNT_STAT_THREADS);
+	for (l = mounts; l != NULL; l = l->next) {
+		char *setting = l->data;
+		char *eq;
+		guint64 n;
+
+		eq = strrchr (setting, '=');
+		if (eq == NULL || eq == setting) {
+			rb_debug ("ignoring stat thread setting \"%s\"", setting);
+			continue;
+		}
+		n = g_ascii_strtoull (eq + 1, NULL, 10);
+		if (n == 0) {
+			rb_debug ("ignoring stat thread setting \"%s\"", setting);
+			continue;
+		}
+
+		*eq = '\0';
+		g_hash_table_insert (db->priv->mount_stat_threads,
+				     g_strdup (setting),
+				     GUINT_TO_POINTER ((guint) MIN (n, 64)));
+	}
+	rb_slist_deep_free (mounts);
+}
+
 /**
  * rhythmdb_start_action_thread:
  * @db: the #RhythmDB
@@ -931,6 +1223,7 @@ void
 rhythmdb_start_action_thread (RhythmDB *db)
 {
 	g_mutex_lock (db->priv->stat_mutex);
+	rhythmdb_read_stat_thread_settings (db);
 	db->priv->action_thread_running = TRUE;
 	rhythmdb_thread_create (db, NULL, (GThreadFunc) action_thread_main, db);
 
@@ -950,6 +1243,39 @@ rhythmdb_start_action_thread (RhythmDB *db)
 	g_mutex_unlock (db->priv->stat_mutex);
 }
 
+/**
+ * rhythmdb_set_mount_stat_threads:
+ * @db: the #RhythmDB
+ * @mountpoint: the mountpoint URI
+ * @threads: number of files to check at once, or 0 to use the default
+ *
+ * Sets how many files on @mountpoint are checked at the same time when
+ * the library is revalidated at startup, overriding the
+ * #RhythmDB:stat-threads property for that mount.  Slow network
+ * shares usually benefit from a higher value than local disks.
+ * This must be called before rhythmdb_start_action_thread to take
+ * effect, and mounts listed in the library_mount_stat_threads
+ * setting take their values from there instead.
+ */
+void
+rhythmdb_set_mount_stat_threads (RhythmDB *db,
+				 const char *mountpoint,
+				 guint threads)
+{
+	g_return_if_fail (RHYTHMDB_IS (db));
+	g_return_if_fail (mountpoint != NULL);
+
+	g_mutex_lock (db->priv->stat_mutex);
+	if (threads == 0) {
+		g_hash_table_remove (db->priv->mount_stat_threads, mountpoint);
+	} else {
+		g_hash_table_insert (db->priv->mount_stat_threads,
+				     g_strdup (mountpoint),
+				     GUINT_TO_POINTER (threads));
+	}
+	g_mutex_unlock (db->priv->stat_mutex);
+}
+
 static void
 rhythmdb_action_free (RhythmDB *db,
 		      RhythmDBAction *action)
@@ -958,6 +1284,8 @@ rhythmdb_action_free (RhythmDB *db,
 	if (action->type == RHYTHMDB_ACTION_SYNC) {
 		free_entry_changes (action->data.changes);
 	}
+	if (action->load_complete != NULL)
+		g_closure_unref (action->load_complete);
 	g_slice_free (RhythmDBAction, action);
 }
 
@@ -981,6 +1309,18 @@ rhythmdb_event_free (RhythmDB *db,
 	case RHYTHMDB_EVENT_ENTRY_SET:
 		g_value_unset (&result->change.new);
 		break;
+	case RHYTHMDB_EVENT_ENTRY_SET_MANY:
+	{
+		guint i;
+
+		for (i = 0; i < result->n_updates; i++) {
+			rhythmdb_entry_unref (result->updates[i].entry);
+			g_value_unset (&result->update_values[i]);
+		}
+		g_free (result->updates);
+		g_free (result->update_values);
+		break;
+	}
 	}
 	if (result->error)
 		g_error_free (result->error);
@@ -995,6 +1335,8 @@ rhythmdb_event_free (RhythmDB *db,
 	if (result->entry != NULL) {
 		rhythmdb_entry_unref (result->entry);
 	}
+	if (result->load_complete != NULL)
+		g_closure_unref (result->load_complete);
 	g_slice_free (RhythmDBEvent, result);
 }
 
@@ -1016,6 +1358,7 @@ rhythmdb_shutdown (RhythmDB *db)
 {
 	RhythmDBEvent *result;
 	RhythmDBAction *action;
+	guint i;
 
 	g_return_if_fail (RHYTHMDB_IS (db));
 
@@ -1042,6 +1385,12 @@ rhythmdb_shutdown (RhythmDB *db)
 	db->priv->outstanding_stats = NULL;
 	g_mutex_unlock (db->priv->stat_mutex);
 
+	/* events already taken from the event queue may include thread exit events */
+	for (i = 0; i < RHYTHMDB_EVENT_N_LANES; i++) {
+		while ((result = g_queue_pop_head (db->priv->event_lanes[i])) != NULL)
+			rhythmdb_event_free (db, result);
+	}
+
 	rb_debug ("%d outstanding threads", g_atomic_int_get (&db->priv->outstanding_threads));
 	while (g_atomic_int_get (&db->priv->outstanding_threads) > 0) {
 		result = g_async_queue_pop (db->priv->event_queue);
@@ -1080,6 +1429,11 @@ rhythmdb_dispose (GObject *object)
 		db->priv->event_queue_watch_id = 0;
 	}
 
+	if (db->priv->event_lanes_id != 0) {
+		g_source_remove (db->priv->event_lanes_id);
+		db->priv->event_lanes_id = 0;
+	}
+
 	if (db->priv->save_timeout_id != 0) {
 		g_source_remove (db->priv->save_timeout_id);
 		db->priv->save_timeout_id = 0;
@@ -1113,6 +1467,7 @@ static void
 rhythmdb_finalize (GObject *object)
 {
 	RhythmDB *db;
+	guint i;
 
 	g_return_if_fail (object != NULL);
 	g_return_if_fail (RHYTHMDB_IS (object));
@@ -1125,8 +1480,13 @@ rhythmdb_finalize (GObject *object)
 	rhythmdb_finalize_monitoring (db);
 
 	g_thread_pool_free (db->priv->query_thread_pool, FALSE, TRUE);
+	rhythmdb_finalize_query_cache (db);
 	g_async_queue_unref (db->priv->action_queue);
 	g_async_queue_unref (db->priv->event_queue);
+	for (i = 0; i < RHYTHMDB_EVENT_N_LANES; i++) {
+		g_queue_free (db->priv->event_lanes[i]);
+	}
+	g_timer_destroy (db->priv->event_timer);
 	g_async_queue_unref (db->priv->restored_queue);
 	g_async_queue_unref (db->priv->delayed_write_queue);
 
@@ -1135,8 +1495,10 @@ rhythmdb_finalize (GObject *object)
 
 	g_list_free (db->priv->stat_list);
  	g_mutex_free (db->priv->stat_mutex);
+	g_hash_table_destroy (db->priv->mount_stat_threads);
 
 	g_mutex_free (db->priv->change_mutex);
+	g_static_rw_lock_free (&db->priv->entry_fields_lock);
 
 	g_hash_table_destroy (db->priv->propname_map);
 
@@ -1152,6 +1514,7 @@ rhythmdb_finalize (GObject *object)
 	g_mutex_free (db->priv->entry_type_mutex);
 
 	g_free (db->priv->name);
+	g_free (db->priv->metadata_cache_path);
 
 	G_OBJECT_CLASS (rhythmdb_parent_class)->finalize (object);
 }
@@ -1175,6 +1538,15 @@ rhythmdb_set_property (GObject *object,
 	case PROP_NO_UPDATE:
 		db->priv->no_update = g_value_get_boolean (value);
 		break;
+	case PROP_STAT_THREADS:
+		g_mutex_lock (db->priv->stat_mutex);
+		db->priv->stat_threads = g_value_get_uint (value);
+		g_mutex_unlock (db->priv->stat_mutex);
+		break;
+	case PROP_METADATA_CACHE:
+		g_free (db->priv->metadata_cache_path);
+		db->priv->metadata_cache_path = g_value_dup_string (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1199,6 +1571,12 @@ rhythmdb_get_property (GObject *object,
 	case PROP_NO_UPDATE:
 		g_value_set_boolean (value, source->priv->no_update);
 		break;
+	case PROP_STAT_THREADS:
+		g_value_set_uint (value, source->priv->stat_threads);
+		break;
+	case PROP_METADATA_CACHE:
+		g_value_set_string (value, source->priv->metadata_cache_path);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1313,6 +1691,238 @@ copy_entry_changes (GSList *entry_changes)
 	return g_slist_reverse (r);
 }
 
+/* entry change sets */
+
+#define RHYTHMDB_ENTRY_CHANGE_SET_PROP_WORDS	((RHYTHMDB_NUM_PROPERTIES + 31) / 32)
+
+typedef struct {
+	RhythmDBEntry *entry;
+	guint first_change;
+	guint n_changes;
+	guint32 props[RHYTHMDB_ENTRY_CHANGE_SET_PROP_WORDS];
+} RhythmDBEntryChangeSetItem;
+
+struct _RhythmDBEntryChangeSet
+{
+	gint refcount;
+	GArray *entries;		/* RhythmDBEntryChangeSetItem */
+	GArray *changes;		/* RhythmDBEntryChange */
+};
+
+static RhythmDBEntryChangeSet *
+rhythmdb_entry_change_set_new (guint n_entries)
+{
+	RhythmDBEntryChangeSet *changes;
+
+	changes = g_slice_new0 (RhythmDBEntryChangeSet);
+	changes->refcount = 1;
+	changes->entries = g_array_sized_new (FALSE, FALSE, sizeof (RhythmDBEntryChangeSetItem), n_entries);
+	changes->changes = g_array_sized_new (FALSE, FALSE, sizeof (RhythmDBEntryChange), n_entries * 2);
+	return changes;
+}
+
+/* takes the change structures from the list, moving their values into the set */
+static void
+rhythmdb_entry_change_set_take (RhythmDBEntryChangeSet *changes,
+				RhythmDBEntry *entry,
+				GSList *entry_changes)
+{
+	RhythmDBEntryChangeSetItem item;
+	GSList *c;
+
+	memset (&item, 0, sizeof (item));
+	item.entry = rhythmdb_entry_ref (entry);
+	item.first_change = changes->changes->len;
+
+	for (c = entry_changes; c != NULL; c = c->next) {
+		RhythmDBEntryChange *change = c->data;
+
+		g_array_append_vals (changes->changes, change, 1);
+		item.props[change->prop / 32] |= (1U << (change->prop % 32));
+		item.n_changes++;
+		g_slice_free (RhythmDBEntryChange, change);
+	}
+
+	g_array_append_val (changes->entries, item);
+}
+
+/**
+ * rhythmdb_entry_change_set_ref:
+ * @changes: a #RhythmDBEntryChangeSet
+ *
+ * Increases the reference count of the change set.
+ *
+ * Return value: the change set
+ */
+RhythmDBEntryChangeSet *
+rhythmdb_entry_change_set_ref (RhythmDBEntryChangeSet *changes)
+{
+	g_atomic_int_inc (&changes->refcount);
+	return changes;
+}
+
+/**
+ * rhythmdb_entry_change_set_unref:
+ * @changes: a #RhythmDBEntryChangeSet
+ *
+ * Decreases the reference count of the change set, freeing it
+ * when the last reference is dropped.
+ */
+void
+rhythmdb_entry_change_set_unref (RhythmDBEntryChangeSet *changes)
+{
+	guint i;
+
+	if (g_atomic_int_dec_and_test (&changes->refcount) == FALSE)
+		return;
+
+	for (i = 0; i < changes->entries->len; i++) {
+		rhythmdb_entry_unref (g_array_index (changes->entries, RhythmDBEntryChangeSetItem, i).entry);
+	}
+	for (i = 0; i < changes->changes->len; i++) {
+		RhythmDBEntryChange *change = &g_array_index (changes->changes, RhythmDBEntryChange, i);
+		g_value_unset (&change->old);
+		g_value_unset (&change->new);
+	}
+	g_array_free (changes->entries, TRUE);
+	g_array_free (changes->changes, TRUE);
+	g_slice_free (RhythmDBEntryChangeSet, changes);
+}
+
+/**
+ * rhythmdb_entry_change_set_get_n_entries:
+ * @changes: a #RhythmDBEntryChangeSet
+ *
+ * Return value: the number of entries changed
+ */
+guint
+rhythmdb_entry_change_set_get_n_entries (RhythmDBEntryChangeSet *changes)
+{
+	return changes->entries->len;
+}
+
+/**
+ * rhythmdb_entry_change_set_get_entry:
+ * @changes: a #RhythmDBEntryChangeSet
+ * @index: index of the changed entry
+ *
+ * Return value: the changed entry at @index, not referenced
+ */
+RhythmDBEntry *
+rhythmdb_entry_change_set_get_entry (RhythmDBEntryChangeSet *changes,
+				     guint index)
+{
+	return g_array_index (changes->entries, RhythmDBEntryChangeSetItem, index).entry;
+}
+
+/**
+ * rhythmdb_entry_change_set_get_n_changes:
+ * @changes: a #RhythmDBEntryChangeSet
+ * @index: index of the changed entry
+ *
+ * Return value: the number of property changes made to the entry at @index
+ */
+guint
+rhythmdb_entry_change_set_get_n_changes (RhythmDBEntryChangeSet *changes,
+					 guint index)
+{
+	return g_array_index (changes->entries, RhythmDBEntryChangeSetItem, index).n_changes;
+}
+
+/**
+ * rhythmdb_entry_change_set_get_change:
+ * @changes: a #RhythmDBEntryChangeSet
+ * @index: index of the changed entry
+ * @change: index of the change to the entry
+ *
+ * Returns one of the property changes made to an entry, in the order
+ * the changes were made.  The change belongs to the change set.
+ *
+ * Return value: the change
+ */
+RhythmDBEntryChange *
+rhythmdb_entry_change_set_get_change (RhythmDBEntryChangeSet *changes,
+				      guint index,
+				      guint change)
+{
+	RhythmDBEntryChangeSetItem *item;
+
+	item = &g_array_index (changes->entries, RhythmDBEntryChangeSetItem, index);
+	g_assert (change < item->n_changes);
+	return &g_array_index (changes->changes, RhythmDBEntryChange, item->first_change + change);
+}
+
+/**
+ * rhythmdb_entry_change_set_has_prop:
+ * @changes: a #RhythmDBEntryChangeSet
+ * @index: index of the changed entry
+ * @prop: a #RhythmDBPropType
+ *
+ * Checks whether a property of the entry at @index was changed.
+ *
+ * Return value: %TRUE if @prop was changed
+ */
+gboolean
+rhythmdb_entry_change_set_has_prop (RhythmDBEntryChangeSet *changes,
+				    guint index,
+				    RhythmDBPropType prop)
+{
+	RhythmDBEntryChangeSetItem *item;
+
+	item = &g_array_index (changes->entries, RhythmDBEntryChangeSetItem, index);
+	return (item->props[prop / 32] & (1U << (prop % 32))) != 0;
+}
+
+/* emits the old per-entry signal, pointing at the changes held in the set */
+static void
+rhythmdb_emit_entry_changed (RhythmDB *db,
+			     RhythmDBEntryChangeSet *changes)
+{
+	GValueArray *emit_changes;
+	guint i;
+
+	emit_changes = g_value_array_new (0);
+	for (i = 0; i < changes->entries->len; i++) {
+		RhythmDBEntryChangeSetItem *item;
+		guint c;
+
+		item = &g_array_index (changes->entries, RhythmDBEntryChangeSetItem, i);
+		for (c = 0; c < item->n_changes; c++) {
+			GValue v = {0,};
+			g_value_init (&v, RHYTHMDB_TYPE_ENTRY_CHANGE);
+			g_value_set_static_boxed (&v, &g_array_index (changes->changes,
+								      RhythmDBEntryChange,
+								      item->first_change + c));
+			g_value_array_append (emit_changes, &v);
+			g_value_unset (&v);
+		}
+
+		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_CHANGED], 0, item->entry, emit_changes);
+
+		while (emit_changes->n_values > 0)
+			g_value_array_remove (emit_changes, emit_changes->n_values - 1);
+	}
+	g_value_array_free (emit_changes);
+}
+
+/* emits the batched deletion signal, then the old per-entry signal if anything uses it */
+static void
+rhythmdb_emit_entries_deleted_signals (RhythmDB *db,
+				       GPtrArray *entries)
+{
+	guint i;
+
+	g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRIES_DELETED], 0, entries);
+
+	if (RHYTHMDB_GET_CLASS (db)->entry_deleted != NULL ||
+	    g_signal_has_handler_pending (db, rhythmdb_signals[ENTRY_DELETED], 0, TRUE)) {
+		for (i = 0; i < entries->len; i++) {
+			g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_DELETED], 0,
+				       g_ptr_array_index (entries, i));
+		}
+	}
+}
+
 static gboolean
 rhythmdb_emit_entry_signals_idle (RhythmDB *db)
 {
@@ -1323,6 +1933,7 @@ rhythmdb_emit_entry_signals_idle (RhythmDB *db)
 	GHashTableIter iter;
 	RhythmDBEntry *entry;
 	GSList *entry_changes;
+	RhythmDBEntryChangeSet *changes = NULL;
 
 	/* get lists of entries to emit, reset source id value */
 	g_mutex_lock (db->priv->change_mutex);
@@ -1340,27 +1951,28 @@ rhythmdb_emit_entry_signals_idle (RhythmDB *db)
 
 	g_mutex_unlock (db->priv->change_mutex);
 
-	GDK_THREADS_ENTER ();
-
-	/* emit changed entries */
+	/* collect the changes into a single set, taking the change structures */
 	if (changed_entries != NULL) {
+		changes = rhythmdb_entry_change_set_new (g_hash_table_size (changed_entries));
 		g_hash_table_iter_init (&iter, changed_entries);
 		while (g_hash_table_iter_next (&iter, (gpointer *)&entry, (gpointer *)&entry_changes)) {
-			GValueArray *emit_changes;
-			GSList *c;
-
-			emit_changes = g_value_array_new (g_slist_length (entry_changes));
-			for (c = entry_changes; c != NULL; c = c->next) {
-				GValue v = {0,};
-				g_value_init (&v, RHYTHMDB_TYPE_ENTRY_CHANGE);
-				g_value_take_boxed (&v, c->data);
-				g_value_array_append (emit_changes, &v);
-				g_value_unset (&v);
-			}
-			g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_CHANGED], 0, entry, emit_changes);
-			g_value_array_free (emit_changes);
-			g_hash_table_iter_remove (&iter);
+			rhythmdb_entry_change_set_take (changes, entry, entry_changes);
+		}
+		g_hash_table_destroy (changed_entries);
+	}
+
+	GDK_THREADS_ENTER ();
+
+	/* emit changed entries */
+	if (changes != NULL) {
+		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRIES_CHANGED], 0, changes);
+
+		/* only bother with the per-entry signal if something still uses it */
+		if (RHYTHMDB_GET_CLASS (db)->entry_changed != NULL ||
+		    g_signal_has_handler_pending (db, rhythmdb_signals[ENTRY_CHANGED], 0, TRUE)) {
+			rhythmdb_emit_entry_changed (db, changes);
 		}
+		rhythmdb_entry_change_set_unref (changes);
 	}
 
 	/* emit added entries */
@@ -1370,18 +1982,25 @@ rhythmdb_emit_entry_signals_idle (RhythmDB *db)
 		rhythmdb_entry_unref (entry);
 	}
 
-	/* emit deleted entries */
-	for (l = deleted_entries; l; l = g_list_next (l)) {
-		entry = (RhythmDBEntry *)l->data;
-		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_DELETED], 0, entry);
-		rhythmdb_entry_unref (entry);
+	/* emit deleted entries.  these are collected from the table of
+	 * deleted entries, so they're in no particular order.
+	 */
+	if (deleted_entries != NULL) {
+		GPtrArray *deleted;
+
+		deleted = g_ptr_array_sized_new (g_list_length (deleted_entries));
+		for (l = deleted_entries; l; l = g_list_next (l)) {
+			g_ptr_array_add (deleted, l->data);
+		}
+
+		rhythmdb_emit_entries_deleted_signals (db, deleted);
+
+		g_ptr_array_foreach (deleted, (GFunc) rhythmdb_entry_unref, NULL);
+		g_ptr_array_free (deleted, TRUE);
 	}
 
 	GDK_THREADS_LEAVE ();
 
-	if (changed_entries != NULL) {
-		g_hash_table_destroy (changed_entries);
-	}
 	g_list_free (added_entries);
 	g_list_free (deleted_entries);
 	return FALSE;
@@ -1453,6 +2072,8 @@ process_added_entries_cb (RhythmDBEntry *entry,
 	g_assert ((entry->flags & RHYTHMDB_ENTRY_INSERTED) == 0);
 	entry->flags |= RHYTHMDB_ENTRY_INSERTED;
 
+	rhythmdb_query_cache_entry_changed (db, entry, FALSE);
+
 	rhythmdb_entry_ref (entry);
 	db->priv->added_entries_to_emit = g_list_prepend (db->priv->added_entries_to_emit, entry);
 
@@ -1467,6 +2088,8 @@ process_deleted_entries_cb (RhythmDBEntry *entry,
 	if (thread != g_thread_self ())
 		return FALSE;
 
+	rhythmdb_query_cache_entry_changed (db, entry, TRUE);
+
 	rhythmdb_entry_ref (entry);
 	g_assert ((entry->flags & RHYTHMDB_ENTRY_INSERTED) != 0);
 	entry->flags &= ~(RHYTHMDB_ENTRY_INSERTED);
@@ -1481,6 +2104,9 @@ process_changed_entries_cb (RhythmDBEntry *entry,
 			    RhythmDB *db)
 {
 	GSList *existing;
+
+	rhythmdb_query_cache_entry_changed (db, entry, FALSE);
+
 	if (db->priv->changed_entries_to_emit == NULL) {
 		/* the value destroy function is just g_slist_free because we
 		 * steal the actual change structures to build the value array.
@@ -1626,11 +2252,6 @@ rhythmdb_error_quark (void)
 	return quark;
 }
 
-/* structure alignment magic, stolen from glib */
-#define STRUCT_ALIGNMENT	(2 * sizeof (gsize))
-#define ALIGN_STRUCT(offset) \
-	((offset + (STRUCT_ALIGNMENT - 1)) & -STRUCT_ALIGNMENT)
-
 /**
  * rhythmdb_entry_allocate:
  * @db: a #RhythmDB.
@@ -2152,6 +2773,7 @@ rhythmdb_process_stat_event (RhythmDB *db,
 				action->data.types.entry_type = event->entry_type;
 				action->data.types.ignore_type = event->ignore_type;
 				action->data.types.error_type = event->error_type;
+				action->background = event->background;
 				g_async_queue_push (db->priv->action_queue, action);
 			}
 		} else {
@@ -2162,6 +2784,7 @@ rhythmdb_process_stat_event (RhythmDB *db,
 			action->data.types.entry_type = event->entry_type;
 			action->data.types.ignore_type = event->ignore_type;
 			action->data.types.error_type = event->error_type;
+			action->background = event->background;
 			rb_debug ("queuing a RHYTHMDB_ACTION_LOAD: %s", rb_refstring_get (action->uri));
 			g_async_queue_push (db->priv->action_queue, action);
 		}
@@ -2176,6 +2799,7 @@ rhythmdb_process_stat_event (RhythmDB *db,
 		action->data.types.entry_type = event->entry_type;
 		action->data.types.ignore_type = event->ignore_type;
 		action->data.types.error_type = event->error_type;
+		action->background = event->background;
 		rb_debug ("queuing a RHYTHMDB_ACTION_ENUM_DIR: %s", rb_refstring_get (action->uri));
 		g_async_queue_push (db->priv->action_queue, action);
 		break;
@@ -2494,7 +3118,8 @@ rhythmdb_process_one_event (RhythmDBEvent *event, RhythmDB *db)
 	if (rhythmdb_get_readonly (db) &&
 	    ((event->type == RHYTHMDB_EVENT_STAT)
 	     || (event->type == RHYTHMDB_EVENT_METADATA_LOAD)
-	     || (event->type == RHYTHMDB_EVENT_ENTRY_SET))) {
+	     || (event->type == RHYTHMDB_EVENT_ENTRY_SET)
+	     || (event->type == RHYTHMDB_EVENT_ENTRY_SET_MANY))) {
 		rb_debug ("Database is read-only, delaying event processing");
 		g_async_queue_push (db->priv->delayed_write_queue, event);
 		return;
@@ -2508,39 +3133,154 @@ rhythmdb_process_one_event (RhythmDBEvent *event, RhythmDB *db)
 	case RHYTHMDB_EVENT_METADATA_LOAD:
 		rb_debug ("processing RHYTHMDB_EVENT_METADATA_LOAD");
 		free = rhythmdb_process_metadata_load (db, event);
+		g_atomic_int_add (&db->priv->outstanding_loads, -1);
+		if (event->load_complete != NULL) {
+			GValue instance = {0,};
+
+			g_value_init (&instance, RHYTHMDB_TYPE);
+			g_value_set_object (&instance, db);
+			g_closure_invoke (event->load_complete, NULL, 1, &instance, NULL);
+			g_value_unset (&instance);
+
+			g_closure_unref (event->load_complete);
+			event->load_complete = NULL;
+		}
 		break;
 	case RHYTHMDB_EVENT_ENTRY_SET:
 		rb_debug ("processing RHYTHMDB_EVENT_ENTRY_SET");
 		rhythmdb_process_queued_entry_set_event (db, event);
 		break;
+	case RHYTHMDB_EVENT_ENTRY_SET_MANY:
+		rb_debug ("processing RHYTHMDB_EVENT_ENTRY_SET_MANY");
+		rhythmdb_entry_set_many_internal (db, event->updates, event->n_updates);
+		rhythmdb_commit (db);
+		break;
 	case RHYTHMDB_EVENT_DB_LOAD:
 		rb_debug ("processing RHYTHMDB_EVENT_DB_LOAD");
 		g_signal_emit (G_OBJECT (db), rhythmdb_signals[LOAD_COMPLETE], 0);
 
-		/* save the db every five minutes */
-		if (db->priv->save_timeout_id > 0) {
-			g_source_remove (db->priv->save_timeout_id);
-		}
-		db->priv->save_timeout_id = g_timeout_add_seconds_full (G_PRIORITY_LOW,
-									5 * 60,
-									(GSourceFunc) rhythmdb_idle_save,
-									db,
-									NULL);
-		break;
-	case RHYTHMDB_EVENT_THREAD_EXITED:
-		rb_debug ("processing RHYTHMDB_EVENT_THREAD_EXITED");
-		break;
-	case RHYTHMDB_EVENT_DB_SAVED:
-		rb_debug ("processing RHYTHMDB_EVENT_DB_SAVED");
-		rhythmdb_read_leave (db);
-		break;
-	case RHYTHMDB_EVENT_QUERY_COMPLETE:
-		rb_debug ("processing RHYTHMDB_EVENT_QUERY_COMPLETE");
-		rhythmdb_read_leave (db);
-		break;
+		/* save the db every five minutes */
+		if (db->priv->save_timeout_id > 0) {
+			g_source_remove (db->priv->save_timeout_id);
+		}
+		db->priv->save_timeout_id = g_timeout_add_seconds_full (G_PRIORITY_LOW,
+									5 * 60,
+									(GSourceFunc) rhythmdb_idle_save,
+									db,
+									NULL);
+		break;
+	case RHYTHMDB_EVENT_THREAD_EXITED:
+		rb_debug ("processing RHYTHMDB_EVENT_THREAD_EXITED");
+		break;
+	case RHYTHMDB_EVENT_DB_SAVED:
+		rb_debug ("processing RHYTHMDB_EVENT_DB_SAVED");
+		rhythmdb_read_leave (db);
+		break;
+	case RHYTHMDB_EVENT_QUERY_COMPLETE:
+		rb_debug ("processing RHYTHMDB_EVENT_QUERY_COMPLETE");
+		rhythmdb_read_leave (db);
+		break;
+	}
+	if (free)
+		rhythmdb_event_free (db, event);
+}
+
+/* how long the main thread spends processing events before letting the
+ * rest of the main loop run again
+ */
+#define RHYTHMDB_EVENT_TIME_BUDGET	0.004
+
+static RhythmDBEventLane
+rhythmdb_event_lane (RhythmDBEvent *event)
+{
+	switch (event->type) {
+	case RHYTHMDB_EVENT_STAT:
+	case RHYTHMDB_EVENT_METADATA_LOAD:
+		if (event->background)
+			return RHYTHMDB_EVENT_LANE_BACKGROUND;
+		return RHYTHMDB_EVENT_LANE_IMPORT;
+	default:
+		return RHYTHMDB_EVENT_LANE_INTERACTIVE;
+	}
+}
+
+static gboolean
+rhythmdb_event_lanes_pending (RhythmDB *db)
+{
+	guint i;
+
+	for (i = 0; i < RHYTHMDB_EVENT_N_LANES; i++) {
+		if (g_queue_is_empty (db->priv->event_lanes[i]) == FALSE)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* moves everything the worker threads have produced so far into the lanes */
+static void
+rhythmdb_fill_event_lanes (RhythmDB *db)
+{
+	RhythmDBEvent *event;
+
+	while ((event = g_async_queue_try_pop (db->priv->event_queue)) != NULL) {
+		g_queue_push_tail (db->priv->event_lanes[rhythmdb_event_lane (event)], event);
+	}
+}
+
+static gboolean
+rhythmdb_process_event_lanes (RhythmDB *db)
+{
+	guint lane = 0;
+
+	rhythmdb_fill_event_lanes (db);
+
+	/* interactive events come first, then imports, then rescans.  at least
+	 * one event is processed each time, however long it takes.
+	 */
+	g_timer_start (db->priv->event_timer);
+	do {
+		RhythmDBEvent *event;
+
+		/* higher priority events may have arrived while processing the last one */
+		if (lane > RHYTHMDB_EVENT_LANE_INTERACTIVE && g_async_queue_length (db->priv->event_queue) > 0) {
+			rhythmdb_fill_event_lanes (db);
+			lane = 0;
+		}
+
+		while (lane < RHYTHMDB_EVENT_N_LANES && g_queue_is_empty (db->priv->event_lanes[lane]))
+			lane++;
+		if (lane == RHYTHMDB_EVENT_N_LANES)
+			break;
+
+		event = g_queue_pop_head (db->priv->event_lanes[lane]);
+		rhythmdb_process_one_event (event, db);
+	} while (g_timer_elapsed (db->priv->event_timer, NULL) < RHYTHMDB_EVENT_TIME_BUDGET);
+
+	if (rhythmdb_event_lanes_pending (db))
+		return TRUE;
+
+	db->priv->event_lanes_id = 0;
+	return FALSE;
+}
+
+static void
+rhythmdb_event_queue_watch_cb (RhythmDBEvent *event,
+			       RhythmDB *db)
+{
+	g_queue_push_tail (db->priv->event_lanes[rhythmdb_event_lane (event)], event);
+
+	if (db->priv->event_lanes_id != 0)
+		return;
+
+	/* if the time budget runs out, the rest of the events are processed
+	 * from an idle handler at the same priority as the event queue watch.
+	 */
+	if (rhythmdb_process_event_lanes (db)) {
+		db->priv->event_lanes_id = g_idle_add_full (G_PRIORITY_LOW,
+							    (GSourceFunc) rhythmdb_process_event_lanes,
+							    db,
+							    NULL);
 	}
-	if (free)
-		rhythmdb_event_free (db, event);
 }
 
 
@@ -2644,8 +3384,12 @@ rhythmdb_execute_stat (RhythmDB *db,
 	g_object_unref (file);
 }
 
-static void
-rhythmdb_execute_load (RhythmDB *db,
+/* resolves symlinks and reads file information for a load.  returns TRUE
+ * if the metadata still needs to be read, or FALSE if the event is
+ * complete.
+ */
+static gboolean
+rhythmdb_prepare_load (RhythmDB *db,
 		       const char *uri,
 		       RhythmDBEvent *event)
 {
@@ -2676,14 +3420,10 @@ rhythmdb_execute_load (RhythmDB *db,
 			g_object_unref (event->file_info);
 			event->file_info = NULL;
 		}
-	} else if (event->type == RHYTHMDB_EVENT_METADATA_LOAD) {
-		event->metadata = rb_metadata_new ();
-		rb_metadata_load (event->metadata,
-				  rb_refstring_get (event->real_uri),
-				  &event->error);
+		return FALSE;
 	}
 
-	rhythmdb_push_event (db, event);
+	return (event->type == RHYTHMDB_EVENT_METADATA_LOAD);
 }
 
 static void
@@ -2747,6 +3487,7 @@ rhythmdb_execute_enum_dir (RhythmDB *db,
 		result->entry_type = action->data.types.entry_type;
 		result->error_type = action->data.types.error_type;
 		result->ignore_type = action->data.types.ignore_type;
+		result->background = action->background;
 		result->real_uri = rb_refstring_new (child_uri);
 		result->file_info = file_info;
 		result->error = error;
@@ -2831,10 +3572,147 @@ emit_save_error_idle (RhythmDBSaveErrorData *data)
 	return FALSE;
 }
 
+/* maximum number of files read by a single metadata helper request */
+#define RHYTHMDB_LOAD_BATCH_SIZE	16
+
+typedef struct
+{
+	RhythmDB *db;
+	GPtrArray *events;
+} RhythmDBLoadBatch;
+
+static void
+load_batch_result_cb (RBMetaData *md, guint index, GError *error, RhythmDBLoadBatch *batch)
+{
+	RhythmDBEvent *event;
+
+	event = g_ptr_array_index (batch->events, index);
+	event->metadata = md;
+	event->error = error;
+	if (error == NULL && batch->db->priv->metadata_cache != NULL) {
+		rhythmdb_metadata_cache_store (batch->db->priv->metadata_cache,
+					       rb_refstring_get (event->real_uri),
+					       event->file_info,
+					       md);
+	}
+	rhythmdb_push_event (batch->db, event);
+}
+
+static void
+load_thread_main (gpointer task, RhythmDB *db)
+{
+	RhythmDBLoadBatch batch;
+	RhythmDBAction *action;
+	GPtrArray *actions;
+	GPtrArray *uris;
+	guint i;
+
+	/* each task only means that a load has been queued.  take as many
+	 * loads as fit in a batch, so the metadata helper can read them all
+	 * from a single request.  if other threads have already taken them,
+	 * there's nothing to do.
+	 */
+	actions = g_ptr_array_new ();
+	while (actions->len < RHYTHMDB_LOAD_BATCH_SIZE &&
+	       (action = g_async_queue_try_pop (db->priv->load_queue)) != NULL) {
+		g_ptr_array_add (actions, action);
+	}
+
+	batch.db = db;
+	batch.events = g_ptr_array_new ();
+	uris = g_ptr_array_new ();
+	for (i = 0; i < actions->len; i++) {
+		RhythmDBEvent *result;
+
+		if (g_cancellable_is_cancelled (db->priv->exiting))
+			break;
+
+		action = g_ptr_array_index (actions, i);
+		result = g_slice_new0 (RhythmDBEvent);
+		result->db = db;
+		result->type = RHYTHMDB_EVENT_METADATA_LOAD;
+		result->entry_type = action->data.types.entry_type;
+		result->error_type = action->data.types.error_type;
+		result->ignore_type = action->data.types.ignore_type;
+		result->background = action->background;
+		if (action->load_complete != NULL)
+			result->load_complete = g_closure_ref (action->load_complete);
+
+		rb_debug ("executing RHYTHMDB_ACTION_LOAD for \"%s\"", rb_refstring_get (action->uri));
+
+		if (rhythmdb_prepare_load (db, rb_refstring_get (action->uri), result) == FALSE) {
+			rhythmdb_push_event (db, result);
+			continue;
+		}
+
+		if (db->priv->metadata_cache != NULL) {
+			result->metadata = rhythmdb_metadata_cache_lookup (db->priv->metadata_cache,
+									   rb_refstring_get (result->real_uri),
+									   result->file_info);
+		}
+
+		if (result->metadata != NULL) {
+			rb_debug ("using cached metadata for \"%s\"", rb_refstring_get (result->real_uri));
+			rhythmdb_push_event (db, result);
+		} else {
+			g_ptr_array_add (batch.events, result);
+			g_ptr_array_add (uris, g_strdup (rb_refstring_get (result->real_uri)));
+		}
+	}
+
+	if (uris->len > 0) {
+		g_ptr_array_add (uris, NULL);
+		rb_metadata_load_batch ((const char **) uris->pdata,
+					(RBMetaDataLoadFunc) load_batch_result_cb,
+					&batch);
+	}
+
+	/* a load stays outstanding until its event has been processed in
+	 * the main thread, so only the loads skipped because we're exiting
+	 * are finished here.
+	 */
+	g_atomic_int_add (&db->priv->outstanding_loads, -(int)(actions->len - i));
+	for (i = 0; i < actions->len; i++) {
+		rhythmdb_action_free (db, g_ptr_array_index (actions, i));
+	}
+	g_ptr_array_foreach (uris, (GFunc) g_free, NULL);
+	g_ptr_array_free (uris, TRUE);
+	g_ptr_array_free (batch.events, TRUE);
+	g_ptr_array_free (actions, TRUE);
+}
+
+static gpointer
+metadata_cache_prune_thread_main (RhythmDB *db)
+{
+	rhythmdb_metadata_cache_prune (db->priv->metadata_cache, db->priv->exiting);
+	return NULL;
+}
+
 static gpointer
 action_thread_main (RhythmDB *db)
 {
 	RhythmDBEvent *result;
+	GThreadPool *load_pool;
+	GThread *prune_thread = NULL;
+
+	/* metadata loads are handed off to a pool with one thread per
+	 * metadata helper process, so files are read in parallel while
+	 * this thread carries on with stats and directory scans.
+	 */
+	db->priv->load_queue = g_async_queue_new ();
+	if (db->priv->no_update == FALSE && db->priv->metadata_cache_path != NULL) {
+		db->priv->metadata_cache = rhythmdb_metadata_cache_new (db->priv->metadata_cache_path);
+
+		/* checking for deleted files takes a while, so do it in a
+		 * thread of its own rather than holding up loads.
+		 */
+		prune_thread = g_thread_create ((GThreadFunc) metadata_cache_prune_thread_main,
+						db, TRUE, NULL);
+	}
+	load_pool = g_thread_pool_new ((GFunc) load_thread_main,
+				       db,
+				       rb_metadata_get_max_parallel (),
+				       FALSE, NULL);
 
 	while (!g_cancellable_is_cancelled (db->priv->exiting)) {
 		RhythmDBAction *action;
@@ -2851,6 +3729,7 @@ action_thread_main (RhythmDB *db)
 				result->entry_type = action->data.types.entry_type;
 				result->error_type = action->data.types.error_type;
 				result->ignore_type = action->data.types.ignore_type;
+				result->background = action->background;
 
 				rb_debug ("executing RHYTHMDB_ACTION_STAT for \"%s\"", rb_refstring_get (action->uri));
 
@@ -2858,16 +3737,10 @@ action_thread_main (RhythmDB *db)
 				break;
 
 			case RHYTHMDB_ACTION_LOAD:
-				result = g_slice_new0 (RhythmDBEvent);
-				result->db = db;
-				result->type = RHYTHMDB_EVENT_METADATA_LOAD;
-				result->entry_type = action->data.types.entry_type;
-				result->error_type = action->data.types.error_type;
-				result->ignore_type = action->data.types.ignore_type;
-
-				rb_debug ("executing RHYTHMDB_ACTION_LOAD for \"%s\"", rb_refstring_get (action->uri));
-
-				rhythmdb_execute_load (db, rb_refstring_get (action->uri), result);
+				g_atomic_int_inc (&db->priv->outstanding_loads);
+				g_async_queue_push (db->priv->load_queue, action);
+				g_thread_pool_push (load_pool, db, NULL);
+				action = NULL;
 				break;
 
 			case RHYTHMDB_ACTION_ENUM_DIR:
@@ -2918,7 +3791,19 @@ action_thread_main (RhythmDB *db)
 			}
 		}
 
-		rhythmdb_action_free (db, action);
+		if (action != NULL)
+			rhythmdb_action_free (db, action);
+	}
+
+	/* loads still queued see that we're exiting and just free their actions */
+	g_thread_pool_free (load_pool, FALSE, TRUE);
+	g_async_queue_unref (db->priv->load_queue);
+	db->priv->load_queue = NULL;
+	if (prune_thread != NULL)
+		g_thread_join (prune_thread);
+	if (db->priv->metadata_cache != NULL) {
+		rhythmdb_metadata_cache_free (db->priv->metadata_cache);
+		db->priv->metadata_cache = NULL;
 	}
 
 	rb_debug ("exiting action thread");
@@ -2967,8 +3852,10 @@ rhythmdb_add_to_stat_list (RhythmDB *db,
 	result->ignore_type = ignore_type;
 	result->error_type = error_type;
 
+	/* files already in the database are being rescanned rather than imported */
 	if (entry != NULL) {
 		result->entry = rhythmdb_entry_ref (entry);
+		result->background = TRUE;
 	}
 
 	/* do we really need to check for duplicate requests here?  .. nah. */
@@ -3017,6 +3904,7 @@ rhythmdb_add_uri_with_types (RhythmDB *db,
 		action = g_slice_new0 (RhythmDBAction);
 		action->type = RHYTHMDB_ACTION_STAT;
 		action->uri = rb_refstring_new (uri);
+		action->background = (rhythmdb_entry_lookup_by_location (db, uri) != NULL);
 		action->data.types.entry_type = type;
 		action->data.types.ignore_type = ignore_type;
 		action->data.types.error_type = error_type;
@@ -3032,6 +3920,65 @@ rhythmdb_add_uri_with_types (RhythmDB *db,
 	}
 }
 
+/* queues a metadata load for a file that isn't in the database yet,
+ * without checking it first.  this is for callers that have just found
+ * the file by listing its directory, so a stat would tell us nothing new;
+ * the load still reads the file information before the metadata.
+ *
+ * if load_complete is not NULL, it is invoked (with the database as its
+ * only parameter) in the main thread once the result of the load has
+ * been processed.  it isn't invoked if the load is abandoned because the
+ * database is shutting down, or if the action thread isn't running and
+ * the file is added normally instead.
+ */
+void
+rhythmdb_queue_load (RhythmDB *db,
+		     const char *uri,
+		     RhythmDBEntryType *type,
+		     RhythmDBEntryType *ignore_type,
+		     RhythmDBEntryType *error_type,
+		     GClosure *load_complete)
+{
+	RhythmDBAction *action;
+
+	g_mutex_lock (db->priv->stat_mutex);
+	if (db->priv->action_thread_running == FALSE) {
+		g_mutex_unlock (db->priv->stat_mutex);
+		if (load_complete != NULL) {
+			g_closure_ref (load_complete);
+			g_closure_sink (load_complete);
+			g_closure_unref (load_complete);
+		}
+		rhythmdb_add_uri_with_types (db, uri, type, ignore_type, error_type);
+		return;
+	}
+	g_mutex_unlock (db->priv->stat_mutex);
+
+	rb_debug ("queueing load for \"%s\"", uri);
+	action = g_slice_new0 (RhythmDBAction);
+	action->type = RHYTHMDB_ACTION_LOAD;
+	action->uri = rb_refstring_new (uri);
+	action->data.types.entry_type = type;
+	action->data.types.ignore_type = ignore_type;
+	action->data.types.error_type = error_type;
+	if (load_complete != NULL) {
+		action->load_complete = g_closure_ref (load_complete);
+		g_closure_sink (load_complete);
+	}
+	g_async_queue_push (db->priv->action_queue, action);
+}
+
+/* returns roughly how many loads are waiting to be done: those handed to
+ * the load threads and not yet processed in the main thread, plus
+ * everything still waiting for the action thread.
+ */
+int
+rhythmdb_get_pending_loads (RhythmDB *db)
+{
+	return g_atomic_int_get (&db->priv->outstanding_loads) +
+	       MAX (g_async_queue_length (db->priv->action_queue), 0);
+}
+
 
 static gboolean
 rhythmdb_sync_library_idle (RhythmDB *db)
@@ -3264,7 +4211,8 @@ record_entry_change (RhythmDB *db,
 		     RhythmDBEntry *entry,
 		     guint propid,
 		     const GValue *old_value,
-		     const GValue *new_value)
+		     const GValue *new_value,
+		     GHashTable *batch)
 {
 	RhythmDBEntryChange *changedata;
 	GSList *changelist;
@@ -3277,6 +4225,13 @@ record_entry_change (RhythmDB *db,
 	g_value_copy (old_value, &changedata->old);
 	g_value_copy (new_value, &changedata->new);
 
+	/* batched changes are added to the set of changes all at once later */
+	if (batch != NULL) {
+		changelist = g_hash_table_lookup (batch, entry);
+		g_hash_table_insert (batch, entry, g_slist_prepend (changelist, changedata));
+		return;
+	}
+
 	g_mutex_lock (db->priv->change_mutex);
 	/* ref the entry before adding to hash, it is unreffed when removed */
 	rhythmdb_entry_ref (entry);
@@ -3286,12 +4241,13 @@ record_entry_change (RhythmDB *db,
 	g_mutex_unlock (db->priv->change_mutex);
 }
 
-void
-rhythmdb_entry_set_internal (RhythmDB *db,
-			     RhythmDBEntry *entry,
-			     gboolean notify_if_inserted,
-			     guint propid,
-			     const GValue *value)
+static void
+rhythmdb_entry_set_internal_batched (RhythmDB *db,
+				     RhythmDBEntry *entry,
+				     gboolean notify_if_inserted,
+				     guint propid,
+				     const GValue *value,
+				     GHashTable *batch)
 {
 	RhythmDBClass *klass = RHYTHMDB_GET_CLASS (db);
 	gboolean handled;
@@ -3335,7 +4291,7 @@ rhythmdb_entry_set_internal (RhythmDB *db,
 	}
 
 	if (nop == FALSE && (entry->flags & RHYTHMDB_ENTRY_INSERTED) && notify_if_inserted) {
-		record_entry_change (db, entry, propid, &old_value, value);
+		record_entry_change (db, entry, propid, &old_value, value, batch);
 	}
 	g_value_unset (&old_value);
 
@@ -3349,6 +4305,8 @@ rhythmdb_entry_set_internal (RhythmDB *db,
 		    entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST)
 			podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
 
+		rhythmdb_entry_fields_lock (db, TRUE);
+
 		switch (propid) {
 		case RHYTHMDB_PROP_TYPE:
 		case RHYTHMDB_PROP_ENTRY_ID:
@@ -3556,12 +4514,145 @@ rhythmdb_entry_set_internal (RhythmDB *db,
 			g_assert_not_reached ();
 			break;
 		}
+		rhythmdb_entry_fields_unlock (db, TRUE);
 	}
 
 	/* set the dirty state */
 	db->priv->dirty = TRUE;
 }
 
+/* entry properties are only changed in the main thread, with the entry
+ * fields lock held for writing.  other threads (the database save thread,
+ * for one) take it for reading while they copy entry fields, so they never
+ * see a string that is being replaced.
+ */
+void
+rhythmdb_entry_fields_lock (RhythmDB *db, gboolean write)
+{
+	if (write)
+		g_static_rw_lock_writer_lock (&db->priv->entry_fields_lock);
+	else
+		g_static_rw_lock_reader_lock (&db->priv->entry_fields_lock);
+}
+
+void
+rhythmdb_entry_fields_unlock (RhythmDB *db, gboolean write)
+{
+	if (write)
+		g_static_rw_lock_writer_unlock (&db->priv->entry_fields_lock);
+	else
+		g_static_rw_lock_reader_unlock (&db->priv->entry_fields_lock);
+}
+
+void
+rhythmdb_entry_set_internal (RhythmDB *db,
+			     RhythmDBEntry *entry,
+			     gboolean notify_if_inserted,
+			     guint propid,
+			     const GValue *value)
+{
+	rhythmdb_entry_set_internal_batched (db, entry, notify_if_inserted, propid, value, NULL);
+}
+static void
+rhythmdb_entry_set_many_internal (RhythmDB *db,
+				  const RhythmDBEntryUpdate *updates,
+				  guint n_updates)
+{
+	GHashTable *batch;
+	GHashTableIter iter;
+	RhythmDBEntry *entry;
+	GSList *changes;
+	guint i;
+
+	/* collect the changes for each entry first, so the change
+	 * lock only has to be taken once to add them all.
+	 */
+	batch = g_hash_table_new (NULL, NULL);
+	for (i = 0; i < n_updates; i++) {
+		const RhythmDBEntryUpdate *update = &updates[i];
+		gboolean inserted;
+
+		inserted = ((update->entry->flags & RHYTHMDB_ENTRY_INSERTED) != 0);
+		rhythmdb_entry_set_internal_batched (db, update->entry, inserted,
+						     update->prop, update->value, batch);
+	}
+
+	if (g_hash_table_size (batch) > 0) {
+		g_mutex_lock (db->priv->change_mutex);
+		g_hash_table_iter_init (&iter, batch);
+		while (g_hash_table_iter_next (&iter, (gpointer *)&entry, (gpointer *)&changes)) {
+			GSList *existing;
+
+			existing = g_hash_table_lookup (db->priv->changed_entries, entry);
+			changes = g_slist_concat (existing, g_slist_reverse (changes));
+
+			/* ref the entry before adding to hash, it is unreffed when removed */
+			rhythmdb_entry_ref (entry);
+			g_hash_table_insert (db->priv->changed_entries, entry, changes);
+		}
+		g_mutex_unlock (db->priv->change_mutex);
+	}
+	g_hash_table_destroy (batch);
+}
+
+/**
+ * rhythmdb_entry_set_many:
+ * @db: a #RhythmDB.
+ * @updates: an array of #RhythmDBEntryUpdate structures
+ * @n_updates: the number of updates in @updates
+ *
+ * Applies a number of property changes, possibly to several entries,
+ * and commits them.  This is much quicker than calling rhythmdb_entry_set()
+ * for each change: the changes are added to the database's set of
+ * pending changes at once, are reported in a single
+ * #RhythmDB::entries-changed signal, and all the changes to a file's
+ * metadata are written to it together.
+ *
+ * As with rhythmdb_entry_set(), when called from a thread other than the
+ * main thread or while the database is read-only, the changes are
+ * queued and take effect later.  The values are copied in that case, so
+ * the caller can always free them once this returns.
+ */
+void
+rhythmdb_entry_set_many (RhythmDB *db,
+			 const RhythmDBEntryUpdate *updates,
+			 guint n_updates)
+{
+	RhythmDBEvent *result;
+	guint i;
+
+	g_return_if_fail (RHYTHMDB_IS (db));
+
+	if (n_updates == 0)
+		return;
+
+	if (!rhythmdb_get_readonly (db) && rb_is_main_thread ()) {
+		rhythmdb_entry_set_many_internal (db, updates, n_updates);
+		rhythmdb_commit (db);
+		return;
+	}
+
+	result = g_slice_new0 (RhythmDBEvent);
+	result->db = db;
+	result->type = RHYTHMDB_EVENT_ENTRY_SET_MANY;
+
+	rb_debug ("queuing RHYTHMDB_EVENT_ENTRY_SET_MANY with %u updates", n_updates);
+
+	result->n_updates = n_updates;
+	result->updates = g_new0 (RhythmDBEntryUpdate, n_updates);
+	result->update_values = g_new0 (GValue, n_updates);
+	for (i = 0; i < n_updates; i++) {
+		g_value_init (&result->update_values[i], G_VALUE_TYPE (updates[i].value));
+		g_value_copy (updates[i].value, &result->update_values[i]);
+
+		result->updates[i].entry = rhythmdb_entry_ref (updates[i].entry);
+		result->updates[i].prop = updates[i].prop;
+		result->updates[i].value = &result->update_values[i];
+	}
+	rhythmdb_push_event (db, result);
+}
+
+
 /**
  * rhythmdb_entry_sync_mirrored:
  * @db: a #RhythmDB.
@@ -3702,6 +4793,58 @@ rhythmdb_entry_delete (RhythmDB *db,
 	db->priv->dirty = TRUE;
 }
 
+/**
+ * rhythmdb_entry_delete_many:
+ * @db: a #RhythmDB.
+ * @entries: a #GList of #RhythmDBEntry structures to delete.
+ *
+ * Deletes all of the entries in @entries from the database.  This is
+ * equivalent to calling #rhythmdb_entry_delete for each entry, but the
+ * database only needs to be locked once, and the deletions are reported
+ * in a single #RhythmDB::entries-deleted signal after the next commit.
+ */
+void
+rhythmdb_entry_delete_many (RhythmDB *db,
+			    GList *entries)
+{
+	RhythmDBClass *klass = RHYTHMDB_GET_CLASS (db);
+	GPtrArray *array;
+	GList *l;
+	guint i;
+
+	g_return_if_fail (RHYTHMDB_IS (db));
+
+	if (entries == NULL)
+		return;
+
+	array = g_ptr_array_new ();
+	for (l = entries; l != NULL; l = l->next) {
+		/* ref the entry before adding to hash, it is unreffed when removed */
+		g_ptr_array_add (array, rhythmdb_entry_ref (l->data));
+	}
+	rb_debug ("deleting %d entries", array->len);
+
+	if (klass->impl_entry_delete_many != NULL) {
+		klass->impl_entry_delete_many (db, array);
+	} else {
+		for (i = 0; i < array->len; i++) {
+			klass->impl_entry_delete (db, g_ptr_array_index (array, i));
+		}
+	}
+
+	g_mutex_lock (db->priv->change_mutex);
+	for (i = 0; i < array->len; i++) {
+		g_hash_table_insert (db->priv->deleted_entries,
+				     g_ptr_array_index (array, i),
+				     g_thread_self ());
+	}
+	g_mutex_unlock (db->priv->change_mutex);
+	g_ptr_array_free (array, TRUE);
+
+	/* deleting an entry makes the db dirty */
+	db->priv->dirty = TRUE;
+}
+
 /**
  * rhythmdb_entry_move_to_trash:
  * @db: the #RhythmDB
@@ -3972,7 +5115,10 @@ rhythmdb_entry_count_by_type (RhythmDB *db,
  * @query: a query.
  * @entry: a @RhythmDBEntry.
  *
- * Evaluates the given entry against the given query.
+ * Evaluates the given entry against the given query.  This interprets
+ * the query directly, which is cheapest for a one-off evaluation.  To
+ * evaluate the same query against many entries, compile it once with
+ * rhythmdb_query_compile and use rhythmdb_compiled_query_evaluate.
  *
  * Returns: whether the given entry matches the criteria of the given query.
  */
@@ -3992,13 +5138,18 @@ rhythmdb_query_internal (RhythmDBQueryThreadData *data)
 	RhythmDBEvent *result;
 	RhythmDBClass *klass = RHYTHMDB_GET_CLASS (data->db);
 
-	rhythmdb_query_preprocess (data->db, data->query);
-
 	rb_debug ("doing query");
 
-	klass->impl_do_full_query (data->db, data->query,
-				   data->results,
-				   &data->cancel);
+	if (data->cached) {
+		rhythmdb_query_cache_do_full_query (data->db, data->query,
+						    data->results,
+						    &data->cancel);
+	} else {
+		rhythmdb_query_preprocess (data->db, data->query);
+		klass->impl_do_full_query (data->db, data->query,
+					   data->results,
+					   &data->cancel);
+	}
 
 	rb_debug ("completed");
 	rhythmdb_query_results_query_complete (data->results);
@@ -4039,6 +5190,10 @@ query_thread_main (RhythmDBQueryThreadData *data)
  * entries to @results in chunks.  This can only be called from the
  * main thread.
  *
+ * The results are cached and kept up to date as changes are committed, so
+ * running the same query again later is much quicker.  Changes that
+ * haven't been committed yet may not be reflected in the results.
+ *
  * Since @results is always a @RhythmDBQueryModel,
  * use the RhythmDBQueryModel::complete signal to identify when the
  * query is complete.
@@ -4054,6 +5209,7 @@ rhythmdb_do_full_query_async_parsed (RhythmDB *db,
 	data->db = db;
 	data->query = rhythmdb_query_copy (query);
 	data->results = results;
+	data->cached = TRUE;
 	data->cancel = FALSE;
 
 	rhythmdb_read_enter (db);
@@ -4238,9 +5394,35 @@ void
 rhythmdb_emit_entry_deleted (RhythmDB *db,
 			     RhythmDBEntry *entry)
 {
+	rhythmdb_query_cache_entry_changed (db, entry, TRUE);
 	g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_DELETED], 0, entry);
 }
 
+/**
+ * rhythmdb_emit_entries_deleted:
+ * @db: the #RhythmDB
+ * @entries: a #GPtrArray of deleted #RhythmDBEntry structures
+ *
+ * Emits #RhythmDB::entries-deleted for a batch of entries that have been
+ * removed from the database by a backend, followed by the entry-deleted
+ * signals for each entry.  Backends use this instead of
+ * #rhythmdb_emit_entry_deleted when they remove many entries at once.
+ */
+void
+rhythmdb_emit_entries_deleted (RhythmDB *db,
+			       GPtrArray *entries)
+{
+	guint i;
+
+	if (entries->len == 0)
+		return;
+
+	for (i = 0; i < entries->len; i++) {
+		rhythmdb_query_cache_entry_changed (db, g_ptr_array_index (entries, i), TRUE);
+	}
+	rhythmdb_emit_entries_deleted_signals (db, entries);
+}
+
 static gboolean
 rhythmdb_entry_extra_metadata_accumulator (GSignalInvocationHint *ihint,
 					   GValue *return_accu,
@@ -4420,7 +5602,9 @@ rhythmdb_is_busy (RhythmDB *db)
 	return (!db->priv->action_thread_running ||
 		db->priv->stat_thread_running ||
 		!queue_is_empty (db->priv->event_queue) ||
+		rhythmdb_event_lanes_pending (db) ||
 		!queue_is_empty (db->priv->action_queue) ||
+		(g_atomic_int_get (&db->priv->outstanding_loads) > 0) ||
 		(db->priv->outstanding_stats != NULL));
 }
 
@@ -5347,6 +6531,27 @@ rhythmdb_entry_change_get_type (void)
 	return type;
 }
 
+/**
+ * rhythmdb_entry_change_set_get_type:
+ *
+ * Returns the #GType for #RhythmDBEntryChangeSet.  Change sets are
+ * reference counted, so copying the value only adds a reference.
+ *
+ * Return value: entry change set value type
+ */
+GType
+rhythmdb_entry_change_set_get_type (void)
+{
+	static GType type = 0;
+
+	if (G_UNLIKELY (type == 0)) {
+		type = g_boxed_type_register_static ("RhythmDBEntryChangeSet",
+						     (GBoxedCopyFunc)rhythmdb_entry_change_set_ref,
+						     (GBoxedFreeFunc)rhythmdb_entry_change_set_unref);
+	}
+	return type;
+}
+
 /**
  * rhythmdb_entry_is_lossless:
  * @entry: a #RhythmDBEntry
@@ -54,6 +54,7 @@ typedef struct _RhythmDBClass RhythmDBClass;
 
 
 typedef GPtrArray RhythmDBQuery;
+typedef struct _RhythmDBCompiledQuery RhythmDBCompiledQuery;
 GType rhythmdb_query_get_type (void);
 #define RHYTHMDB_TYPE_QUERY	(rhythmdb_query_get_type ())
 #define RHYTHMDB_QUERY(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), RHYTHMDB_TYPE_QUERY, RhythmDBQuery))
@@ -205,6 +206,19 @@ typedef struct {
 	GValue new;
 } RhythmDBEntryChange;
 
+typedef struct _RhythmDBEntryChangeSet RhythmDBEntryChangeSet;
+
+GType rhythmdb_entry_change_set_get_type (void);
+#define RHYTHMDB_TYPE_ENTRY_CHANGE_SET (rhythmdb_entry_change_set_get_type ())
+
+RhythmDBEntryChangeSet *rhythmdb_entry_change_set_ref	(RhythmDBEntryChangeSet *changes);
+void rhythmdb_entry_change_set_unref			(RhythmDBEntryChangeSet *changes);
+guint rhythmdb_entry_change_set_get_n_entries		(RhythmDBEntryChangeSet *changes);
+RhythmDBEntry *rhythmdb_entry_change_set_get_entry	(RhythmDBEntryChangeSet *changes, guint index);
+guint rhythmdb_entry_change_set_get_n_changes		(RhythmDBEntryChangeSet *changes, guint index);
+RhythmDBEntryChange *rhythmdb_entry_change_set_get_change (RhythmDBEntryChangeSet *changes, guint index, guint change);
+gboolean rhythmdb_entry_change_set_has_prop		(RhythmDBEntryChangeSet *changes, guint index, RhythmDBPropType prop);
+
 const char *rhythmdb_entry_get_string	(RhythmDBEntry *entry, RhythmDBPropType propid);
 RBRefString *rhythmdb_entry_get_refstring (RhythmDBEntry *entry, RhythmDBPropType propid);
 char *rhythmdb_entry_dup_string	(RhythmDBEntry *entry, RhythmDBPropType propid);
@@ -252,6 +266,8 @@ struct _RhythmDBClass
 	void	(*load_error)		(RhythmDB *db, const char *uri, const char *msg);
 	void	(*save_error)		(RhythmDB *db, const char *uri, const GError *error);
 	void	(*read_only)		(RhythmDB *db, gboolean readonly);
+	void	(*entries_changed)	(RhythmDB *db, RhythmDBEntryChangeSet *changes);
+	void	(*entries_deleted)	(RhythmDB *db, GPtrArray *entries);
 
 	/* virtual methods */
 
@@ -270,6 +286,8 @@ struct _RhythmDBClass
 
 	void            (*impl_entry_delete_by_type) (RhythmDB *db, RhythmDBEntryType *type);
 
+	void		(*impl_entry_delete_many) (RhythmDB *db, GPtrArray *entries);
+
 	RhythmDBEntry *	(*impl_lookup_by_location)(RhythmDB *db, RBRefString *uri);
 
 	RhythmDBEntry *	(*impl_lookup_by_id)    (RhythmDB *db, gint id);
@@ -314,6 +332,9 @@ void		rhythmdb_save		(RhythmDB *db);
 void		rhythmdb_save_async	(RhythmDB *db);
 
 void		rhythmdb_start_action_thread	(RhythmDB *db);
+void		rhythmdb_set_mount_stat_threads	(RhythmDB *db,
+						 const char *mountpoint,
+						 guint threads);
 
 void		rhythmdb_commit		(RhythmDB *db);
 
@@ -331,12 +352,21 @@ void		rhythmdb_entry_get	(RhythmDB *db, RhythmDBEntry *entry, RhythmDBPropType p
 void		rhythmdb_entry_set	(RhythmDB *db, RhythmDBEntry *entry,
 					 guint propid, const GValue *value);
 
+typedef struct {
+	RhythmDBEntry *entry;
+	RhythmDBPropType prop;
+	const GValue *value;
+} RhythmDBEntryUpdate;
+
+void		rhythmdb_entry_set_many	(RhythmDB *db, const RhythmDBEntryUpdate *updates, guint n_updates);
+
 gboolean	rhythmdb_entry_is_lossless (RhythmDBEntry *entry);
 
 gpointer	rhythmdb_entry_get_type_data (RhythmDBEntry *entry, guint expected_size);
 #define		RHYTHMDB_ENTRY_GET_TYPE_DATA(e,t)	((t*)rhythmdb_entry_get_type_data((e),sizeof(t)))
 
 void		rhythmdb_entry_delete	(RhythmDB *db, RhythmDBEntry *entry);
+void		rhythmdb_entry_delete_many (RhythmDB *db, GList *entries);
 void            rhythmdb_entry_delete_by_type (RhythmDB *db,
 					       RhythmDBEntryType *type);
 void		rhythmdb_entry_move_to_trash (RhythmDB *db,
@@ -421,6 +451,10 @@ void		rhythmdb_query_free			(RhythmDBQuery *query);
 RhythmDBQuery *	rhythmdb_query_copy			(RhythmDBQuery *array);
 void		rhythmdb_query_preprocess		(RhythmDB *db, RhythmDBQuery *query);
 
+RhythmDBCompiledQuery *	rhythmdb_query_compile		(RhythmDB *db, RhythmDBQuery *query);
+gboolean	rhythmdb_compiled_query_evaluate	(RhythmDBCompiledQuery *compiled, RhythmDBEntry *entry);
+void		rhythmdb_compiled_query_free		(RhythmDBCompiledQuery *compiled);
+
 void		rhythmdb_query_serialize		(RhythmDB *db, RhythmDBQuery *query,
 							 xmlNodePtr parent);
 
@@ -435,6 +469,7 @@ int		rhythmdb_propid_from_nice_elt_name	(RhythmDB *db, const xmlChar *name);
 
 void		rhythmdb_emit_entry_added		(RhythmDB *db, RhythmDBEntry *entry);
 void		rhythmdb_emit_entry_deleted		(RhythmDB *db, RhythmDBEntry *entry);
+void		rhythmdb_emit_entries_deleted		(RhythmDB *db, GPtrArray *entries);
 
 GValue *	rhythmdb_entry_request_extra_metadata	(RhythmDB *db, RhythmDBEntry *entry, const gchar *property_name);
 RBStringValueMap* rhythmdb_entry_gather_metadata	(RhythmDB *db, RhythmDBEntry *entry);
@@ -91,9 +91,9 @@ static void rb_shell_clipboard_set (RBShellClipboard *clipboard,
 static void rb_shell_clipboard_playlist_added_cb (RBPlaylistManager *mgr,
 						  RBPlaylistSource *source,
 						  RBShellClipboard *clipboard);
-static void rb_shell_clipboard_entry_deleted_cb (RhythmDB *db,
-						 RhythmDBEntry *entry,
-						 RBShellClipboard *clipboard);
+static void rb_shell_clipboard_entries_deleted_cb (RhythmDB *db,
+						   GPtrArray *entries,
+						   RBShellClipboard *clipboard);
 static void rb_shell_clipboard_entryview_changed_cb (RBEntryView *view,
 						     RBShellClipboard *clipboard);
 static void rb_shell_clipboard_entries_changed_cb (RBEntryView *view,
@@ -427,8 +427,8 @@ rb_shell_clipboard_set_property (GObject *object,
 	case PROP_DB:
 		clipboard->priv->db = g_value_get_object (value);
 		g_signal_connect_object (clipboard->priv->db,
-					 "entry_deleted",
-					 G_CALLBACK (rb_shell_clipboard_entry_deleted_cb),
+					 "entries-deleted",
+					 G_CALLBACK (rb_shell_clipboard_entries_deleted_cb),
 					 clipboard, 0);
 		break;
 	case PROP_UI_MANAGER:
@@ -783,20 +783,40 @@ rb_shell_clipboard_set (RBShellClipboard *clipboard,
 }
 
 static void
-rb_shell_clipboard_entry_deleted_cb (RhythmDB *db,
-				     RhythmDBEntry *entry,
-				     RBShellClipboard *clipboard)
+rb_shell_clipboard_entries_deleted_cb (RhythmDB *db,
+				       GPtrArray *entries,
+				       RBShellClipboard *clipboard)
 {
+	GHashTable *deleted;
+	gboolean changed = FALSE;
 	GList *l;
+	guint i;
+
+	if (clipboard->priv->entries == NULL)
+		return;
+
+	deleted = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (i = 0; i < entries->len; i++) {
+		g_hash_table_insert (deleted, g_ptr_array_index (entries, i), NULL);
+	}
 
 	GDK_THREADS_ENTER ();
-	l = g_list_find (clipboard->priv->entries, entry);
-	if (l != NULL) {
-		clipboard->priv->entries = g_list_delete_link (clipboard->priv->entries, l);
-		rhythmdb_entry_unref (entry);
-		rb_shell_clipboard_sync (clipboard);
+	l = clipboard->priv->entries;
+	while (l != NULL) {
+		GList *next = l->next;
+
+		if (g_hash_table_lookup_extended (deleted, l->data, NULL, NULL)) {
+			rhythmdb_entry_unref (l->data);
+			clipboard->priv->entries = g_list_delete_link (clipboard->priv->entries, l);
+			changed = TRUE;
+		}
+		l = next;
 	}
+	if (changed)
+		rb_shell_clipboard_sync (clipboard);
 	GDK_THREADS_LEAVE ();
+
+	g_hash_table_destroy (deleted);
 }
 
 static void
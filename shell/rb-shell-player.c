@@ -136,10 +136,9 @@ static void rb_shell_player_set_playing_source_internal (RBShellPlayer *player,
 							 gboolean sync_entry_view);
 static void rb_shell_player_sync_with_source (RBShellPlayer *player);
 static void rb_shell_player_sync_with_selected_source (RBShellPlayer *player);
-static void rb_shell_player_entry_changed_cb (RhythmDB *db,
-					      RhythmDBEntry *entry,
-					      GValueArray *changes,
-					      RBShellPlayer *player);
+static void rb_shell_player_entries_changed_cb (RhythmDB *db,
+						RhythmDBEntryChangeSet *changes,
+						RBShellPlayer *player);
 
 static void rb_shell_player_entry_activated_cb (RBEntryView *view,
 						RhythmDBEntry *entry,
@@ -1157,7 +1156,7 @@ rb_shell_player_set_db_internal (RBShellPlayer *player,
 {
 	if (player->priv->db != NULL) {
 		g_signal_handlers_disconnect_by_func (player->priv->db,
-						      G_CALLBACK (rb_shell_player_entry_changed_cb),
+						      G_CALLBACK (rb_shell_player_entries_changed_cb),
 						      player);
 		g_signal_handlers_disconnect_by_func (player->priv->db,
 						      G_CALLBACK (rb_shell_player_extra_metadata_cb),
@@ -1169,8 +1168,8 @@ rb_shell_player_set_db_internal (RBShellPlayer *player,
 	if (player->priv->db != NULL) {
 		/* Listen for changed entries to update metadata display */
 		g_signal_connect_object (G_OBJECT (player->priv->db),
-					 "entry_changed",
-					 G_CALLBACK (rb_shell_player_entry_changed_cb),
+					 "entries-changed",
+					 G_CALLBACK (rb_shell_player_entries_changed_cb),
 					 player, 0);
 		g_signal_connect_object (G_OBJECT (player->priv->db),
 					 "entry_extra_metadata_notify",
@@ -2842,30 +2841,37 @@ rb_shell_player_property_row_activated_cb (RBPropertyView *view,
 }
 
 static void
-rb_shell_player_entry_changed_cb (RhythmDB *db,
-				  RhythmDBEntry *entry,
-				  GValueArray *changes,
-				  RBShellPlayer *player)
+rb_shell_player_entries_changed_cb (RhythmDB *db,
+				    RhythmDBEntryChangeSet *changes,
+				    RBShellPlayer *player)
 {
 	gboolean synced = FALSE;
 	const char *location;
 	RhythmDBEntry *playing_entry;
-	int i;
+	guint n_entries;
+	guint n_changes;
+	guint index;
+	guint i;
 
 	playing_entry = rb_shell_player_get_playing_entry (player);
+	if (playing_entry == NULL)
+		return;
 
-	/* We try to update only if the changed entry is currently playing */
-	if (entry != playing_entry) {
-		if (playing_entry != NULL) {
-			rhythmdb_entry_unref (playing_entry);
-		}
+	/* We try to update only if the currently playing entry has changed */
+	n_entries = rhythmdb_entry_change_set_get_n_entries (changes);
+	for (index = 0; index < n_entries; index++) {
+		if (rhythmdb_entry_change_set_get_entry (changes, index) == playing_entry)
+			break;
+	}
+	if (index == n_entries) {
+		rhythmdb_entry_unref (playing_entry);
 		return;
 	}
 
-	location = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION);
-	for (i = 0; i < changes->n_values; i++) {
-		GValue *v = g_value_array_get_nth (changes, i);
-		RhythmDBEntryChange *change = g_value_get_boxed (v);
+	location = rhythmdb_entry_get_string (playing_entry, RHYTHMDB_PROP_LOCATION);
+	n_changes = rhythmdb_entry_change_set_get_n_changes (changes, index);
+	for (i = 0; i < n_changes; i++) {
+		RhythmDBEntryChange *change = rhythmdb_entry_change_set_get_change (changes, index, i);
 
 		/* update UI if the artist, title or album has changed */
 		switch (change->prop) {
@@ -2900,9 +2906,7 @@ rb_shell_player_entry_changed_cb (RhythmDB *db,
 		}
 	}
 
-	if (playing_entry != NULL) {
-		rhythmdb_entry_unref (playing_entry);
-	}
+	rhythmdb_entry_unref (playing_entry);
 }
 
 static void
@@ -1240,6 +1240,10 @@ construct_db (RBShell *shell)
 	if (shell->priv->no_update)
 		g_object_set (shell->priv->db, "no-update", TRUE, NULL);
 
+	pathname = g_build_filename (rb_user_cache_dir (), "metadata", NULL);
+	g_object_set (shell->priv->db, "metadata-cache", pathname, NULL);
+	g_free (pathname);
+
 	g_signal_connect_object (G_OBJECT (shell->priv->db), "load-complete",
 				 G_CALLBACK (rb_shell_load_complete_cb), shell,
 				 0);
@@ -363,13 +363,11 @@ static void
 impl_delete (RBSource *asource)
 {
 	RBImportErrorsSource *source = RB_IMPORT_ERRORS_SOURCE (asource);
-	GList *sel, *tem;
+	GList *sel;
 
 	sel = rb_entry_view_get_selected_entries (source->priv->view);
-	for (tem = sel; tem != NULL; tem = tem->next) {
-		rhythmdb_entry_delete (source->priv->db, tem->data);
-		rhythmdb_commit (source->priv->db);
-	}
+	rhythmdb_entry_delete_many (source->priv->db, sel);
+	rhythmdb_commit (source->priv->db);
 
 	g_list_foreach (sel, (GFunc)rhythmdb_entry_unref, NULL);
 	g_list_free (sel);
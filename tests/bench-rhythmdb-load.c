@@ -31,6 +31,7 @@
 
 #include <gtk/gtk.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "rb-debug.h"
 #include "rb-file-helpers.h"
@@ -83,12 +84,46 @@ static void wait_for_signal (void)
 }
 
 
+static double
+time_loads (RhythmDB *db, guint threads, int loads)
+{
+	GTimer *timer;
+	double elapsed = 0.0;
+	int i;
+
+	g_object_set (G_OBJECT (db), "load-threads", threads, NULL);
+	timer = g_timer_new ();
+	for (i = 0; i < loads; i++) {
+		g_timer_start (timer);
+		set_waiting_signal (G_OBJECT (db), "load-complete");
+		rhythmdb_load (db);
+		wait_for_signal ();
+		g_timer_stop (timer);
+		elapsed += g_timer_elapsed (timer, NULL);
+
+		rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_SONG);
+		rhythmdb_entry_delete_by_type (db, rhythmdb_entry_type_get_by_name (db, "iradio"));
+		rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_FEED);
+		rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_POST);
+		rhythmdb_commit (db);
+	}
+	g_timer_destroy (timer);
+
+	return elapsed / loads;
+}
+
 int 
 main (int argc, char **argv)
 {
 	RhythmDB *db;
 	char *name;
-	int i;
+	char *copy;
+	char *contents;
+	gsize length;
+	GError *error = NULL;
+	double serial_time = 0.0;
+	long n_cpus;
+	guint threads;
 
 	if (argc < 2) {
 		name = g_build_filename (rb_user_data_dir(), "rhythmdb.xml", NULL);
@@ -108,33 +143,46 @@ main (int argc, char **argv)
 	rb_refstring_system_init ();
 	rb_file_helpers_init (TRUE);
 
+	/* load a copy of the database, so the XML file is always parsed (rather
+	 * than a snapshot) and the journal isn't touched.
+	 */
+	if (g_file_get_contents (name, &contents, &length, &error) == FALSE) {
+		g_print ("unable to read %s: %s\n", name, error->message);
+		return 1;
+	}
+	copy = g_strdup_printf ("%s/bench-rhythmdb-load-%d.xml", g_get_tmp_dir (), getpid ());
+	if (g_file_set_contents (copy, contents, length, &error) == FALSE) {
+		g_print ("unable to write %s: %s\n", copy, error->message);
+		return 1;
+	}
+	g_free (contents);
+	g_free (name);
+
 	GDK_THREADS_ENTER ();
 
 	db = rhythmdb_tree_new ("test");
-	g_object_set (G_OBJECT (db), "name", name, NULL);
-	g_free (name);
+	g_object_set (G_OBJECT (db), "name", copy, NULL);
+
+	n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1)
+		n_cpus = 1;
+
+	g_print ("threads\tload time\tspeedup\n");
+	for (threads = 1; threads <= MAX (n_cpus, 2); threads *= 2) {
+		double load_time;
 
-	for (i = 1; i <= 10; i++) {
-		int j;
-		rb_profile_start ("10 rhythmdb loads");
-		for (j = 1; j <= 10; j++) {
-			set_waiting_signal (G_OBJECT (db), "load-complete");
-			rhythmdb_load (db);
-			wait_for_signal ();
-
-			rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_SONG);
-			rhythmdb_entry_delete_by_type (db, rhythmdb_entry_type_get_by_name (db, "iradio"));
-			rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_FEED);
-			rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_POST);
-		}
-		rb_profile_end ("10 rhythmdb loads");
-		g_print ("completed %d loads\n", i * 10);
+		load_time = time_loads (db, threads, 10);
+		if (threads == 1)
+			serial_time = load_time;
+		g_print ("%u\t%.3fs\t\t%.2fx\n", threads, load_time, serial_time / load_time);
 	}
 
 	rhythmdb_shutdown (db);
 	g_object_unref (G_OBJECT (db));
 	db = NULL;
 
+	unlink (copy);
+	g_free (copy);
 	
 	rb_file_helpers_shutdown ();
         rb_refstring_system_shutdown ();
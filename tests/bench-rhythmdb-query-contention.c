@@ -0,0 +1,286 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Runs several full queries in parallel while another thread imports
+ * entries, and reports query throughput and latency.  Half of the query
+ * threads search the song library, the other half the ignored files, so
+ * the effect of locking each entry type separately is visible.
+ *
+ * usage: bench-rhythmdb-query-contention [number of entries] [seconds]
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "rhythmdb-query-results.h"
+#include "locale.h"
+
+/* query results object that only counts the entries it is given */
+
+typedef struct {
+	GObject parent;
+	guint count;
+} BenchResults;
+
+typedef struct {
+	GObjectClass parent_class;
+} BenchResultsClass;
+
+static void bench_results_iface_init (RhythmDBQueryResultsIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (BenchResults, bench_results, G_TYPE_OBJECT,
+			 G_IMPLEMENT_INTERFACE (RHYTHMDB_TYPE_QUERY_RESULTS,
+						bench_results_iface_init))
+
+static void
+bench_results_set_query (RhythmDBQueryResults *results, GPtrArray *query)
+{
+}
+
+static void
+bench_results_add_results (RhythmDBQueryResults *results, GPtrArray *entries)
+{
+	((BenchResults *)results)->count += entries->len;
+}
+
+static void
+bench_results_query_complete (RhythmDBQueryResults *results)
+{
+}
+
+static void
+bench_results_iface_init (RhythmDBQueryResultsIface *iface)
+{
+	iface->set_query = bench_results_set_query;
+	iface->add_results = bench_results_add_results;
+	iface->query_complete = bench_results_query_complete;
+}
+
+static void
+bench_results_init (BenchResults *results)
+{
+}
+
+static void
+bench_results_class_init (BenchResultsClass *klass)
+{
+}
+
+typedef struct
+{
+	RhythmDB *db;
+	GTimer *timer;
+	gint stop;
+} BenchData;
+
+typedef struct
+{
+	BenchData *bench;
+	RhythmDBEntryType *type;
+
+	guint queries;
+	double total_latency;
+	double max_latency;
+} QueryData;
+
+static gpointer
+query_thread (QueryData *data)
+{
+	BenchResults *results;
+
+	results = g_object_new (bench_results_get_type (), NULL);
+	while (g_atomic_int_get (&data->bench->stop) == 0) {
+		double start;
+		double latency;
+
+		start = g_timer_elapsed (data->bench->timer, NULL);
+		rhythmdb_do_full_query (data->bench->db, RHYTHMDB_QUERY_RESULTS (results),
+					RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, data->type,
+					RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_TITLE, "7",
+					RHYTHMDB_QUERY_END);
+		latency = g_timer_elapsed (data->bench->timer, NULL) - start;
+
+		data->queries++;
+		data->total_latency += latency;
+		data->max_latency = MAX (data->max_latency, latency);
+	}
+	g_object_unref (results);
+
+	return NULL;
+}
+
+static void
+add_entry (RhythmDB *db, RhythmDBEntryType *type, const char *uri, int i)
+{
+	RhythmDBEntry *entry;
+	GValue v = {0,};
+	char *str;
+
+	entry = rhythmdb_entry_new (db, type, uri);
+
+	g_value_init (&v, G_TYPE_STRING);
+	str = g_strdup_printf ("Track %d", i);
+	g_value_take_string (&v, str);
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_TITLE, &v);
+	str = g_strdup_printf ("Album %d", i / 10);
+	g_value_take_string (&v, str);
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ALBUM, &v);
+	str = g_strdup_printf ("Artist %d", i / 100);
+	g_value_take_string (&v, str);
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ARTIST, &v);
+	g_value_unset (&v);
+}
+
+static gpointer
+import_thread (BenchData *data)
+{
+	int i = 0;
+
+	while (g_atomic_int_get (&data->stop) == 0) {
+		char *uri;
+
+		uri = g_strdup_printf ("file:///bench/import/%d/%d.ogg", i / 100, i);
+		add_entry (data->db, RHYTHMDB_ENTRY_TYPE_SONG, uri, i);
+		g_free (uri);
+
+		if (++i % 100 == 0)
+			rhythmdb_commit (data->db);
+	}
+	rhythmdb_commit (data->db);
+
+	return GINT_TO_POINTER (i);
+}
+
+static void
+populate (RhythmDB *db, int n_entries)
+{
+	int i;
+
+	for (i = 0; i < n_entries; i++) {
+		char *uri;
+
+		uri = g_strdup_printf ("file:///bench/music/%d/%d.ogg", i / 100, i);
+		add_entry (db, RHYTHMDB_ENTRY_TYPE_SONG, uri, i);
+		g_free (uri);
+
+		uri = g_strdup_printf ("file:///bench/ignore/%d/%d.txt", i / 100, i);
+		add_entry (db, RHYTHMDB_ENTRY_TYPE_IGNORE, uri, i);
+		g_free (uri);
+
+		if (i % 1000 == 999)
+			rhythmdb_commit (db);
+	}
+	rhythmdb_commit (db);
+}
+
+int
+main (int argc, char **argv)
+{
+	int n_entries = 20000;
+	int seconds = 3;
+	int n_threads;
+
+	if (argc > 1)
+		n_entries = atoi (argv[1]);
+	if (argc > 2)
+		seconds = atoi (argv[2]);
+
+	g_thread_init (NULL);
+	rb_threads_init ();
+	setlocale(LC_ALL, "");
+	gtk_init (&argc, &argv);
+	rb_debug_init (FALSE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
+
+	GDK_THREADS_ENTER ();
+
+	g_print ("threads\tqueries/s\tmean latency\tmax latency\timported/s\n");
+	for (n_threads = 1; n_threads <= 8; n_threads *= 2) {
+		BenchData bench;
+		QueryData *queries;
+		GThread **threads;
+		GThread *importer;
+		guint total_queries = 0;
+		double total_latency = 0.0;
+		double max_latency = 0.0;
+		int imported;
+		int i;
+
+		memset (&bench, 0, sizeof (bench));
+		bench.db = rhythmdb_tree_new ("test");
+		populate (bench.db, n_entries);
+		bench.timer = g_timer_new ();
+
+		queries = g_new0 (QueryData, n_threads);
+		threads = g_new0 (GThread *, n_threads);
+		for (i = 0; i < n_threads; i++) {
+			queries[i].bench = &bench;
+			queries[i].type = (i % 2) ? RHYTHMDB_ENTRY_TYPE_IGNORE : RHYTHMDB_ENTRY_TYPE_SONG;
+			threads[i] = g_thread_create ((GThreadFunc) query_thread, &queries[i], TRUE, NULL);
+		}
+		importer = g_thread_create ((GThreadFunc) import_thread, &bench, TRUE, NULL);
+
+		g_usleep (seconds * G_USEC_PER_SEC);
+		g_atomic_int_set (&bench.stop, 1);
+
+		imported = GPOINTER_TO_INT (g_thread_join (importer));
+		for (i = 0; i < n_threads; i++) {
+			g_thread_join (threads[i]);
+			total_queries += queries[i].queries;
+			total_latency += queries[i].total_latency;
+			max_latency = MAX (max_latency, queries[i].max_latency);
+		}
+
+		g_print ("%d\t%.1f\t\t%.2fms\t\t%.1fms\t\t%.0f\n",
+			 n_threads,
+			 total_queries / (double) seconds,
+			 total_queries ? (total_latency * 1000.0) / total_queries : 0.0,
+			 max_latency * 1000.0,
+			 imported / (double) seconds);
+
+		g_free (threads);
+		g_free (queries);
+		rhythmdb_shutdown (bench.db);
+		g_object_unref (G_OBJECT (bench.db));
+		g_timer_destroy (bench.timer);
+	}
+
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
+
+	return 0;
+}
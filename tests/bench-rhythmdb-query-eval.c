@@ -0,0 +1,263 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Compares evaluating queries against single entries with the query
+ * interpreter and with compiled queries, as done by query models when
+ * entries are added or changed.
+ *
+ * usage: bench-rhythmdb-query-eval [number of entries] [rounds]
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "locale.h"
+
+typedef struct
+{
+	const char *name;
+	GPtrArray *query;
+} BenchQuery;
+
+static void
+collect_entry (RhythmDBEntry *entry, GPtrArray *entries)
+{
+	g_ptr_array_add (entries, rhythmdb_entry_ref (entry));
+}
+
+static void
+populate (RhythmDB *db, int n_entries)
+{
+	int i;
+
+	for (i = 0; i < n_entries; i++) {
+		RhythmDBEntry *entry;
+		GValue v = {0,};
+		char *str;
+
+		str = g_strdup_printf ("file:///bench/music/%d/%d.ogg", i / 100, i);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, str);
+		g_free (str);
+
+		g_value_init (&v, G_TYPE_STRING);
+		str = g_strdup_printf ("Track %d", i);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_TITLE, &v);
+		str = g_strdup_printf ("Album %d", i / 10);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ALBUM, &v);
+		str = g_strdup_printf ("Artist %d", i / 100);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ARTIST, &v);
+		str = g_strdup_printf ("Genre %d", i % 7);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_GENRE, &v);
+		g_value_unset (&v);
+
+		g_value_init (&v, G_TYPE_ULONG);
+		g_value_set_ulong (&v, i % 50);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_PLAY_COUNT, &v);
+		g_value_set_ulong (&v, time (NULL) - (i % 60) * 86400);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_LAST_PLAYED, &v);
+		g_value_unset (&v);
+
+		g_value_init (&v, G_TYPE_DOUBLE);
+		g_value_set_double (&v, i % 6);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_RATING, &v);
+		g_value_unset (&v);
+
+		if (i % 1000 == 999)
+			rhythmdb_commit (db);
+	}
+	rhythmdb_commit (db);
+}
+
+static double
+time_interpreter (RhythmDB *db, GPtrArray *query, GPtrArray *entries, int rounds, guint *matches)
+{
+	RhythmDBClass *klass = RHYTHMDB_GET_CLASS (db);
+	GTimer *timer;
+	double elapsed;
+	int round;
+	guint i;
+
+	*matches = 0;
+	timer = g_timer_new ();
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < entries->len; i++) {
+			if (klass->impl_evaluate_query (db, query, g_ptr_array_index (entries, i)))
+				(*matches)++;
+		}
+	}
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+	return elapsed;
+}
+
+static double
+time_compiled (RhythmDB *db, GPtrArray *query, GPtrArray *entries, int rounds, guint *matches)
+{
+	RhythmDBCompiledQuery *compiled;
+	GTimer *timer;
+	double elapsed;
+	int round;
+	guint i;
+
+	*matches = 0;
+	timer = g_timer_new ();
+	compiled = rhythmdb_query_compile (db, query);
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < entries->len; i++) {
+			if (rhythmdb_compiled_query_evaluate (compiled, g_ptr_array_index (entries, i)))
+				(*matches)++;
+		}
+	}
+	rhythmdb_compiled_query_free (compiled);
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+	return elapsed;
+}
+
+int
+main (int argc, char **argv)
+{
+	RhythmDB *db;
+	GPtrArray *entries;
+	GPtrArray *subquery;
+	BenchQuery queries[5];
+	int n_entries = 20000;
+	int rounds = 10;
+	int failed = 0;
+	guint q;
+
+	if (argc > 1)
+		n_entries = atoi (argv[1]);
+	if (argc > 2)
+		rounds = atoi (argv[2]);
+
+	g_thread_init (NULL);
+	rb_threads_init ();
+	setlocale(LC_ALL, "");
+	gtk_init (&argc, &argv);
+	rb_debug_init (FALSE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
+
+	GDK_THREADS_ENTER ();
+
+	db = rhythmdb_tree_new ("test");
+	populate (db, n_entries);
+
+	entries = g_ptr_array_new ();
+	rhythmdb_entry_foreach (db, (GFunc) collect_entry, entries);
+
+	queries[0].name = "equals";
+	queries[0].query = rhythmdb_query_parse (db,
+						 RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						 RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ALBUM, "Album 42",
+						 RHYTHMDB_QUERY_END);
+	queries[1].name = "like";
+	queries[1].query = rhythmdb_query_parse (db,
+						 RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						 RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_TITLE, "track 7",
+						 RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 10,
+						 RHYTHMDB_QUERY_END);
+	queries[2].name = "search";
+	queries[2].query = rhythmdb_query_parse (db,
+						 RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						 RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_SEARCH_MATCH, "artist 1 track",
+						 RHYTHMDB_QUERY_END);
+
+	subquery = rhythmdb_query_parse (db,
+					 RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Genre 1",
+					 RHYTHMDB_QUERY_DISJUNCTION,
+					 RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Genre 3",
+					 RHYTHMDB_QUERY_DISJUNCTION,
+					 RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_RATING, 3.5,
+					 RHYTHMDB_QUERY_END);
+	queries[3].name = "subquery";
+	queries[3].query = rhythmdb_query_parse (db,
+						 RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						 RHYTHMDB_QUERY_SUBQUERY, subquery,
+						 RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 40,
+						 RHYTHMDB_QUERY_END);
+	queries[4].name = "time";
+	queries[4].query = rhythmdb_query_parse (db,
+						 RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						 RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN, RHYTHMDB_PROP_LAST_PLAYED, (gulong) (7 * 86400),
+						 RHYTHMDB_QUERY_END);
+
+	g_print ("query\t\tmatches\tinterpreted\tcompiled\tspeedup\n");
+	for (q = 0; q < G_N_ELEMENTS (queries); q++) {
+		double interpreted;
+		double compiled;
+		guint interpreted_matches;
+		guint compiled_matches;
+
+		rhythmdb_query_preprocess (db, queries[q].query);
+		interpreted = time_interpreter (db, queries[q].query, entries, rounds, &interpreted_matches);
+		compiled = time_compiled (db, queries[q].query, entries, rounds, &compiled_matches);
+
+		if (interpreted_matches != compiled_matches) {
+			g_print ("%s: interpreter matched %u entries, compiled query matched %u\n",
+				 queries[q].name, interpreted_matches, compiled_matches);
+			failed = 1;
+		}
+
+		g_print ("%s\t%s%u\t%.1fms\t\t%.1fms\t\t%.1fx\n",
+			 queries[q].name,
+			 strlen (queries[q].name) < 8 ? "\t" : "",
+			 compiled_matches / rounds,
+			 interpreted * 1000.0,
+			 compiled * 1000.0,
+			 compiled > 0.0 ? interpreted / compiled : 0.0);
+
+		rhythmdb_query_free (queries[q].query);
+	}
+	rhythmdb_query_free (subquery);
+
+	g_ptr_array_foreach (entries, (GFunc) rhythmdb_entry_unref, NULL);
+	g_ptr_array_free (entries, TRUE);
+
+	rhythmdb_shutdown (db);
+	g_object_unref (G_OBJECT (db));
+
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
+
+	return failed;
+}
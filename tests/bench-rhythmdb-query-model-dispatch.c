@@ -0,0 +1,315 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Measures how long it takes to commit entry changes and additions with
+ * many query models (auto playlists, browser views) open.  Each round is
+ * run twice: once with changes dispatched only to the models they could
+ * affect, and once with RHYTHMDB_QUERY_MODEL_DISPATCH_ALL set, which
+ * passes every change to every model.
+ *
+ * usage: bench-rhythmdb-query-model-dispatch [number of entries] [number of changes]
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "rhythmdb-query-model.h"
+#include "locale.h"
+
+#define N_GENRES	20
+
+static void
+set_string (RhythmDB *db, RhythmDBEntry *entry, RhythmDBPropType prop, char *str)
+{
+	GValue v = {0,};
+
+	g_value_init (&v, G_TYPE_STRING);
+	g_value_take_string (&v, str);
+	rhythmdb_entry_set (db, entry, prop, &v);
+	g_value_unset (&v);
+}
+
+static void
+add_entry (RhythmDB *db, const char *uri, int i)
+{
+	RhythmDBEntry *entry;
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, uri);
+	set_string (db, entry, RHYTHMDB_PROP_TITLE, g_strdup_printf ("Track %d", i));
+	set_string (db, entry, RHYTHMDB_PROP_ALBUM, g_strdup_printf ("Album %d", i / 10));
+	set_string (db, entry, RHYTHMDB_PROP_ARTIST, g_strdup_printf ("Artist %d", i / 100));
+	set_string (db, entry, RHYTHMDB_PROP_GENRE, g_strdup_printf ("Genre %d", i % N_GENRES));
+}
+
+static void
+populate (RhythmDB *db, int n_entries)
+{
+	int i;
+
+	for (i = 0; i < n_entries; i++) {
+		char *uri;
+
+		uri = g_strdup_printf ("file:///bench/music/%d/%d.ogg", i / 100, i);
+		add_entry (db, uri, i);
+		g_free (uri);
+
+		if (i % 1000 == 999)
+			rhythmdb_commit (db);
+	}
+	rhythmdb_commit (db);
+}
+
+/* a mix of the sort of models a running session has open */
+static GPtrArray *
+create_models (RhythmDB *db, int n_models)
+{
+	GPtrArray *models;
+	int i;
+
+	models = g_ptr_array_new ();
+	for (i = 0; i < n_models; i++) {
+		RhythmDBQueryModel *model;
+		GPtrArray *query;
+		char *str;
+
+		switch (i % 3) {
+		case 0:
+			/* genre auto playlist */
+			str = g_strdup_printf ("Genre %d", (i / 3) % N_GENRES);
+			query = rhythmdb_query_parse (db,
+						      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, str,
+						      RHYTHMDB_QUERY_END);
+			g_free (str);
+			break;
+		case 1:
+			/* highly rated songs */
+			query = rhythmdb_query_parse (db,
+						      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						      RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_RATING, (double) (i % 5),
+						      RHYTHMDB_QUERY_END);
+			break;
+		default:
+			/* search */
+			str = g_strdup_printf ("%d", i);
+			query = rhythmdb_query_parse (db,
+						      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						      RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_SEARCH_MATCH, str,
+						      RHYTHMDB_QUERY_END);
+			g_free (str);
+			break;
+		}
+
+		model = rhythmdb_query_model_new (db, query, NULL, NULL, NULL, FALSE);
+		rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+		rhythmdb_query_free (query);
+		g_ptr_array_add (models, model);
+	}
+
+	return models;
+}
+
+static void
+flush_events (RhythmDB *db)
+{
+	rhythmdb_commit (db);
+	while (g_main_context_iteration (NULL, FALSE))
+		;
+}
+
+/* changes a property no model's query depends on */
+static double
+change_play_counts (RhythmDB *db, int n_entries, int n_changes)
+{
+	GTimer *timer;
+	double elapsed;
+	int i;
+
+	timer = g_timer_new ();
+	for (i = 0; i < n_changes; i++) {
+		RhythmDBEntry *entry;
+		GValue v = {0,};
+		char *uri;
+
+		uri = g_strdup_printf ("file:///bench/music/%d/%d.ogg", (i % n_entries) / 100, i % n_entries);
+		entry = rhythmdb_entry_lookup_by_location (db, uri);
+		g_free (uri);
+
+		g_value_init (&v, G_TYPE_ULONG);
+		g_value_set_ulong (&v, rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_PLAY_COUNT) + 1);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_PLAY_COUNT, &v);
+		g_value_unset (&v);
+
+		if (i % 100 == 99)
+			flush_events (db);
+	}
+	flush_events (db);
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	return elapsed;
+}
+
+/* changes a property some models' queries depend on */
+static double
+change_ratings (RhythmDB *db, int n_entries, int n_changes)
+{
+	GTimer *timer;
+	double elapsed;
+	int i;
+
+	timer = g_timer_new ();
+	for (i = 0; i < n_changes; i++) {
+		RhythmDBEntry *entry;
+		GValue v = {0,};
+		char *uri;
+
+		uri = g_strdup_printf ("file:///bench/music/%d/%d.ogg", (i % n_entries) / 100, i % n_entries);
+		entry = rhythmdb_entry_lookup_by_location (db, uri);
+		g_free (uri);
+
+		g_value_init (&v, G_TYPE_DOUBLE);
+		g_value_set_double (&v, (double) (i % 6));
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_RATING, &v);
+		g_value_unset (&v);
+
+		if (i % 100 == 99)
+			flush_events (db);
+	}
+	flush_events (db);
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	return elapsed;
+}
+
+static double
+add_entries (RhythmDB *db, int n_entries, int n_changes)
+{
+	GTimer *timer;
+	double elapsed;
+	int i;
+
+	timer = g_timer_new ();
+	for (i = 0; i < n_changes; i++) {
+		char *uri;
+
+		uri = g_strdup_printf ("file:///bench/added/%d/%d.ogg", i / 100, i);
+		add_entry (db, uri, n_entries + i);
+		g_free (uri);
+
+		if (i % 100 == 99)
+			flush_events (db);
+	}
+	flush_events (db);
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	return elapsed;
+}
+
+int
+main (int argc, char **argv)
+{
+	int n_entries = 20000;
+	int n_changes = 2000;
+	int model_counts[] = { 1, 10, 60 };
+	int m;
+
+	if (argc > 1)
+		n_entries = atoi (argv[1]);
+	if (argc > 2)
+		n_changes = atoi (argv[2]);
+
+	g_thread_init (NULL);
+	rb_threads_init ();
+	setlocale(LC_ALL, "");
+	gtk_init (&argc, &argv);
+	rb_debug_init (FALSE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
+
+	GDK_THREADS_ENTER ();
+
+	g_print ("models\tdispatch\tplay count\trating\t\tadded\n");
+	for (m = 0; m < G_N_ELEMENTS (model_counts); m++) {
+		int all;
+
+		for (all = 0; all <= 1; all++) {
+			RhythmDB *db;
+			GPtrArray *models;
+			double play_count_time;
+			double rating_time;
+			double add_time;
+			int i;
+
+			if (all)
+				g_setenv ("RHYTHMDB_QUERY_MODEL_DISPATCH_ALL", "1", TRUE);
+			else
+				g_unsetenv ("RHYTHMDB_QUERY_MODEL_DISPATCH_ALL");
+
+			db = rhythmdb_tree_new ("test");
+			populate (db, n_entries);
+			models = create_models (db, model_counts[m]);
+			flush_events (db);
+
+			play_count_time = change_play_counts (db, n_entries, n_changes);
+			rating_time = change_ratings (db, n_entries, n_changes);
+			add_time = add_entries (db, n_entries, n_changes);
+
+			g_print ("%d\t%s\t\t%.1fus\t\t%.1fus\t\t%.1fus\n",
+				 model_counts[m],
+				 all ? "all" : "routed",
+				 (play_count_time * G_USEC_PER_SEC) / n_changes,
+				 (rating_time * G_USEC_PER_SEC) / n_changes,
+				 (add_time * G_USEC_PER_SEC) / n_changes);
+
+			for (i = 0; i < models->len; i++) {
+				g_object_unref (g_ptr_array_index (models, i));
+			}
+			g_ptr_array_free (models, TRUE);
+
+			rhythmdb_shutdown (db);
+			g_object_unref (G_OBJECT (db));
+		}
+	}
+	g_unsetenv ("RHYTHMDB_QUERY_MODEL_DISPATCH_ALL");
+
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
+
+	return 0;
+}
@@ -0,0 +1,224 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Times full queries over a large library with different numbers of
+ * query threads: a full scan of the song library, an unindexed substring
+ * match, and a genre.
+ *
+ * usage: bench-rhythmdb-query-threads [number of entries] [rounds]
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "rhythmdb-query-results.h"
+#include "locale.h"
+
+/* query results object that only counts the entries it is given */
+
+typedef struct {
+	GObject parent;
+	guint count;
+} BenchResults;
+
+typedef struct {
+	GObjectClass parent_class;
+} BenchResultsClass;
+
+static void bench_results_iface_init (RhythmDBQueryResultsIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (BenchResults, bench_results, G_TYPE_OBJECT,
+			 G_IMPLEMENT_INTERFACE (RHYTHMDB_TYPE_QUERY_RESULTS,
+						bench_results_iface_init))
+
+static void
+bench_results_set_query (RhythmDBQueryResults *results, GPtrArray *query)
+{
+}
+
+static void
+bench_results_add_results (RhythmDBQueryResults *results, GPtrArray *entries)
+{
+	((BenchResults *)results)->count += entries->len;
+	g_ptr_array_free (entries, TRUE);
+}
+
+static void
+bench_results_query_complete (RhythmDBQueryResults *results)
+{
+}
+
+static void
+bench_results_iface_init (RhythmDBQueryResultsIface *iface)
+{
+	iface->set_query = bench_results_set_query;
+	iface->add_results = bench_results_add_results;
+	iface->query_complete = bench_results_query_complete;
+}
+
+static void
+bench_results_init (BenchResults *results)
+{
+}
+
+static void
+bench_results_class_init (BenchResultsClass *klass)
+{
+}
+
+static void
+populate (RhythmDB *db, int n_entries)
+{
+	int i;
+
+	for (i = 0; i < n_entries; i++) {
+		RhythmDBEntry *entry;
+		GValue v = {0,};
+		char *str;
+
+		str = g_strdup_printf ("file:///bench/music/%d/%d.ogg", i / 100, i);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, str);
+		g_free (str);
+
+		g_value_init (&v, G_TYPE_STRING);
+		str = g_strdup_printf ("Track %d", i);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_TITLE, &v);
+		str = g_strdup_printf ("Album %d", i / 10);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ALBUM, &v);
+		str = g_strdup_printf ("Artist %d", i / 100);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ARTIST, &v);
+		str = g_strdup_printf ("Genre %d", i % 7);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_GENRE, &v);
+		g_value_unset (&v);
+
+		if (i % 1000 == 999)
+			rhythmdb_commit (db);
+	}
+	rhythmdb_commit (db);
+}
+
+static double
+time_query (RhythmDB *db, GPtrArray *query, int rounds, guint *count)
+{
+	BenchResults *results;
+	GTimer *timer;
+	double elapsed;
+	int round;
+
+	results = g_object_new (bench_results_get_type (), NULL);
+	timer = g_timer_new ();
+	for (round = 0; round < rounds; round++) {
+		rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (results), query);
+	}
+	elapsed = g_timer_elapsed (timer, NULL) / rounds;
+	*count = results->count / rounds;
+
+	g_timer_destroy (timer);
+	g_object_unref (results);
+	return elapsed;
+}
+
+int
+main (int argc, char **argv)
+{
+	RhythmDB *db;
+	GPtrArray *queries[3];
+	int n_entries = 200000;
+	int rounds = 5;
+	guint n_threads;
+	guint q;
+
+	if (argc > 1)
+		n_entries = atoi (argv[1]);
+	if (argc > 2)
+		rounds = atoi (argv[2]);
+
+	g_thread_init (NULL);
+	rb_threads_init ();
+	setlocale(LC_ALL, "");
+	gtk_init (&argc, &argv);
+	rb_debug_init (FALSE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
+
+	GDK_THREADS_ENTER ();
+
+	db = rhythmdb_tree_new ("test");
+	populate (db, n_entries);
+
+	queries[0] = rhythmdb_query_parse (db,
+					   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+					   RHYTHMDB_QUERY_END);
+	queries[1] = rhythmdb_query_parse (db,
+					   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+					   RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_TITLE, "track 7",
+					   RHYTHMDB_QUERY_END);
+	queries[2] = rhythmdb_query_parse (db,
+					   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+					   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Genre 3",
+					   RHYTHMDB_QUERY_END);
+
+	g_print ("threads\tlibrary\t\tsubstring\tgenre\n");
+	for (n_threads = 1; n_threads <= 16; n_threads *= 2) {
+		g_object_set (G_OBJECT (db), "query-threads", n_threads, NULL);
+
+		g_print ("%u", n_threads);
+		for (q = 0; q < G_N_ELEMENTS (queries); q++) {
+			guint count;
+			double elapsed;
+
+			elapsed = time_query (db, queries[q], rounds, &count);
+			g_print ("\t%.1fms (%u)", elapsed * 1000.0, count);
+		}
+		g_print ("\n");
+	}
+
+	for (q = 0; q < G_N_ELEMENTS (queries); q++) {
+		rhythmdb_query_free (queries[q]);
+	}
+
+	rhythmdb_shutdown (db);
+	g_object_unref (G_OBJECT (db));
+
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
+
+	return 0;
+}
@@ -0,0 +1,215 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Measures how long a thread adding entries to the database is blocked
+ * while the database is being saved.
+ *
+ * usage: bench-rhythmdb-save [number of entries]
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "locale.h"
+
+#define N_ROUNDS	3
+
+typedef struct
+{
+	RhythmDB *db;
+	int round;
+	GTimer *timer;
+	gint stop;
+	gint saving;
+
+	guint ops;
+	double max_latency;
+	guint saving_ops;
+	double saving_max_latency;
+	double saving_total_latency;
+} WriterData;
+
+static gpointer
+writer_thread (WriterData *data)
+{
+	int i = 0;
+
+	while (g_atomic_int_get (&data->stop) == 0) {
+		gboolean saving;
+		double start;
+		double latency;
+		char *uri;
+
+		uri = g_strdup_printf ("file:///bench/writer/%d/%d.ogg", data->round, i++);
+		saving = g_atomic_int_get (&data->saving);
+
+		start = g_timer_elapsed (data->timer, NULL);
+		rhythmdb_entry_new (data->db, RHYTHMDB_ENTRY_TYPE_SONG, uri);
+		rhythmdb_commit (data->db);
+		latency = g_timer_elapsed (data->timer, NULL) - start;
+		g_free (uri);
+
+		if (saving) {
+			data->saving_ops++;
+			data->saving_total_latency += latency;
+			data->saving_max_latency = MAX (data->saving_max_latency, latency);
+		} else {
+			data->ops++;
+			data->max_latency = MAX (data->max_latency, latency);
+		}
+
+		g_usleep (1000);
+	}
+
+	return NULL;
+}
+
+static void
+populate (RhythmDB *db, int n_entries)
+{
+	int i;
+
+	for (i = 0; i < n_entries; i++) {
+		RhythmDBEntry *entry;
+		GValue v = {0,};
+		char *str;
+
+		str = g_strdup_printf ("file:///bench/music/%d/%d.ogg", i / 100, i);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, str);
+		g_free (str);
+
+		g_value_init (&v, G_TYPE_STRING);
+		str = g_strdup_printf ("Track %d", i);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_TITLE, &v);
+		str = g_strdup_printf ("Album %d", i / 10);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ALBUM, &v);
+		str = g_strdup_printf ("Artist %d", i / 100);
+		g_value_take_string (&v, str);
+		rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ARTIST, &v);
+		g_value_unset (&v);
+
+		if (i % 1000 == 999)
+			rhythmdb_commit (db);
+	}
+	rhythmdb_commit (db);
+}
+
+static void
+remove_files (const char *name)
+{
+	char *path;
+
+	unlink (name);
+	path = g_strconcat (name, ".snapshot", NULL);
+	unlink (path);
+	g_free (path);
+	path = g_strconcat (name, ".journal", NULL);
+	unlink (path);
+	g_free (path);
+}
+
+int
+main (int argc, char **argv)
+{
+	int n_entries = 50000;
+	int round;
+
+	if (argc > 1)
+		n_entries = atoi (argv[1]);
+
+	g_thread_init (NULL);
+	rb_threads_init ();
+	setlocale(LC_ALL, "");
+	gtk_init (&argc, &argv);
+	rb_debug_init (FALSE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
+
+	GDK_THREADS_ENTER ();
+
+	g_print ("round\tsave time\twrites\tmax blocked\tmean blocked\tmax blocked (idle)\n");
+	for (round = 1; round <= N_ROUNDS; round++) {
+		WriterData data;
+		GThread *thread;
+		double save_time;
+		char *name;
+
+		name = g_strdup_printf ("%s/bench-rhythmdb-save-%d.xml", g_get_tmp_dir (), getpid ());
+
+		memset (&data, 0, sizeof (data));
+		data.db = rhythmdb_tree_new ("test");
+		data.round = round;
+		data.timer = g_timer_new ();
+		g_object_set (G_OBJECT (data.db), "name", name, NULL);
+		populate (data.db, n_entries);
+
+		thread = g_thread_create ((GThreadFunc) writer_thread, &data, TRUE, NULL);
+
+		/* measure the writer on its own for a bit first */
+		g_usleep (G_USEC_PER_SEC / 4);
+
+		g_atomic_int_set (&data.saving, 1);
+		save_time = g_timer_elapsed (data.timer, NULL);
+		rhythmdb_save (data.db);
+		save_time = g_timer_elapsed (data.timer, NULL) - save_time;
+		g_atomic_int_set (&data.saving, 0);
+
+		g_atomic_int_set (&data.stop, 1);
+		g_thread_join (thread);
+
+		g_print ("%d\t%.3fs\t\t%u\t%.1fms\t\t%.2fms\t\t%.1fms\n",
+			 round,
+			 save_time,
+			 data.saving_ops,
+			 data.saving_max_latency * 1000.0,
+			 data.saving_ops ? (data.saving_total_latency * 1000.0) / data.saving_ops : 0.0,
+			 data.max_latency * 1000.0);
+
+		rhythmdb_shutdown (data.db);
+		g_object_unref (G_OBJECT (data.db));
+		g_timer_destroy (data.timer);
+		remove_files (name);
+		g_free (name);
+	}
+
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
+
+	return 0;
+}
@@ -0,0 +1,855 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Tests for the native tag readers.  Small files in each supported format
+ * are generated and read directly; then each of those files, and each file
+ * in the directory named by RB_METADATA_TEST_CORPUS, is read both with and
+ * without the native readers to check that they produce the same fields
+ * as the GStreamer pipeline.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <check.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gst/tag/tag.h>
+
+#include "rb-metadata.h"
+#include "rb-metadata-native.h"
+#include "rb-debug.h"
+#include "rb-util.h"
+
+static char *test_dir = NULL;
+static GPtrArray *test_files = NULL;
+
+/* file construction helpers */
+
+static void
+put_u16be (GByteArray *buf, guint16 v)
+{
+	guint8 b[2] = { v >> 8, v };
+	g_byte_array_append (buf, b, sizeof (b));
+}
+
+static void
+put_u32be (GByteArray *buf, guint32 v)
+{
+	guint8 b[4] = { v >> 24, v >> 16, v >> 8, v };
+	g_byte_array_append (buf, b, sizeof (b));
+}
+
+static void
+put_u32le (GByteArray *buf, guint32 v)
+{
+	guint8 b[4] = { v, v >> 8, v >> 16, v >> 24 };
+	g_byte_array_append (buf, b, sizeof (b));
+}
+
+static void
+put_bytes (GByteArray *buf, const void *data, gsize len)
+{
+	g_byte_array_append (buf, data, len);
+}
+
+static void
+put_zeros (GByteArray *buf, gsize len)
+{
+	guint8 zero = 0;
+	gsize i;
+
+	for (i = 0; i < len; i++)
+		g_byte_array_append (buf, &zero, 1);
+}
+
+static void
+set_u32be (GByteArray *buf, gsize pos, guint32 v)
+{
+	buf->data[pos] = v >> 24;
+	buf->data[pos + 1] = v >> 16;
+	buf->data[pos + 2] = v >> 8;
+	buf->data[pos + 3] = v;
+}
+
+static char *
+write_test_file (const char *name, GByteArray *buf)
+{
+	char *path;
+	char *uri;
+
+	path = g_build_filename (test_dir, name, NULL);
+	fail_unless (g_file_set_contents (path, (const char *) buf->data, buf->len, NULL));
+	uri = g_filename_to_uri (path, NULL, NULL);
+	g_free (path);
+	g_byte_array_free (buf, TRUE);
+
+	g_ptr_array_add (test_files, g_strdup (uri));
+	return uri;
+}
+
+static void
+id3v2_frame (GByteArray *buf, const char *id, const void *data, gsize len)
+{
+	put_bytes (buf, id, 4);
+	put_u32be (buf, len);
+	put_u16be (buf, 0);
+	put_bytes (buf, data, len);
+}
+
+static void
+id3v2_text_frame (GByteArray *buf, const char *id, const char *text)
+{
+	GByteArray *frame = g_byte_array_new ();
+
+	put_zeros (frame, 1);		/* latin1 */
+	put_bytes (frame, text, strlen (text));
+	id3v2_frame (buf, id, frame->data, frame->len);
+	g_byte_array_free (frame, TRUE);
+}
+
+static char *
+make_mp3 (const char *name, int id3_version, gboolean ape)
+{
+	GByteArray *buf = g_byte_array_new ();
+	GByteArray *frame;
+	const guint8 artist_utf16[] = {
+		0x01, 0xff, 0xfe, 'A', 0, 'r', 0, 't', 0, 'i', 0, 's', 0, 't', 0, 0xe9, 0
+	};
+	const guint8 header[] = { 0xff, 0xfb, 0x90, 0x00 };	/* MPEG 1 layer III, 128kbps, 44.1kHz */
+	gsize tag_start;
+	int i;
+
+	put_bytes (buf, "ID3", 3);
+	put_bytes (buf, (guint8[]) { id3_version, 0, 0 }, 3);
+	put_u32be (buf, 0);		/* size, filled in later */
+	tag_start = buf->len;
+
+	id3v2_text_frame (buf, "TIT2", "MP3 Title");
+	id3v2_frame (buf, "TPE1", artist_utf16, sizeof (artist_utf16));
+	id3v2_text_frame (buf, "TALB", "MP3 Album");
+	id3v2_text_frame (buf, "TRCK", "3/12");
+	id3v2_text_frame (buf, "TPOS", "1/2");
+	id3v2_text_frame (buf, "TYER", "2004");
+	id3v2_text_frame (buf, "TCON", "(17)");
+
+	frame = g_byte_array_new ();
+	put_zeros (frame, 1);
+	put_bytes (frame, "eng", 3);
+	put_zeros (frame, 1);		/* empty description */
+	put_bytes (frame, "MP3 Comment", 11);
+	id3v2_frame (buf, "COMM", frame->data, frame->len);
+	g_byte_array_set_size (frame, 0);
+
+	put_zeros (frame, 1);
+	put_bytes (frame, "MusicBrainz Artist Id", 22);
+	put_bytes (frame, "9c9f1380-2516-4fc9-a3e6-f9f61941d090", 36);
+	id3v2_frame (buf, "TXXX", frame->data, frame->len);
+	g_byte_array_free (frame, TRUE);
+
+	put_zeros (buf, 64);		/* padding */
+
+	/* sizes are syncsafe in the tag header, and for 2.4 frames too;
+	 * all the frames here are small enough that it doesn't matter.
+	 */
+	i = buf->len - tag_start;
+	buf->data[tag_start - 4] = (i >> 21) & 0x7f;
+	buf->data[tag_start - 3] = (i >> 14) & 0x7f;
+	buf->data[tag_start - 2] = (i >> 7) & 0x7f;
+	buf->data[tag_start - 1] = i & 0x7f;
+
+	/* first frame carries a Xing header: 100 frames of 417 bytes */
+	put_bytes (buf, header, sizeof (header));
+	put_zeros (buf, 32);
+	put_bytes (buf, "Xing", 4);
+	put_u32be (buf, 0x3);
+	put_u32be (buf, 100);
+	put_u32be (buf, 100 * 417);
+	put_zeros (buf, 417 - 4 - 32 - 16);
+	for (i = 1; i < 100; i++) {
+		put_bytes (buf, header, sizeof (header));
+		put_zeros (buf, 417 - 4);
+	}
+
+	if (ape) {
+		put_bytes (buf, "APETAGEX", 8);
+		put_zeros (buf, 24);
+	}
+
+	return write_test_file (name, buf);
+}
+
+static void
+vorbis_comment (GByteArray *buf, const char **comments)
+{
+	int i;
+
+	put_u32le (buf, 4);
+	put_bytes (buf, "test", 4);
+	put_u32le (buf, g_strv_length ((char **) comments));
+	for (i = 0; comments[i] != NULL; i++) {
+		put_u32le (buf, strlen (comments[i]));
+		put_bytes (buf, comments[i], strlen (comments[i]));
+	}
+}
+
+static char *
+make_flac (const char *name)
+{
+	GByteArray *buf = g_byte_array_new ();
+	GByteArray *block = g_byte_array_new ();
+	const char *comments[] = {
+		"TITLE=FLAC Title",
+		"ARTIST=FLAC Artist",
+		"ALBUM=FLAC Album",
+		"TRACKNUMBER=5",
+		"DATE=1999-05-06",
+		"MUSICBRAINZ_TRACKID=0b8a5b34-9df3-4f12-9c44-d2a5d7c0b7a1",
+		NULL
+	};
+
+	put_bytes (buf, "fLaC", 4);
+
+	/* STREAMINFO: 44.1kHz stereo 16 bit, 441000 samples */
+	put_bytes (buf, (guint8[]) { 0x00, 0x00, 0x00, 34 }, 4);
+	put_u16be (buf, 4096);
+	put_u16be (buf, 4096);
+	put_zeros (buf, 6);
+	put_bytes (buf, (guint8[]) { 0x0a, 0xc4, 0x42, 0xf0 }, 4);
+	put_u32be (buf, 441000);
+	put_zeros (buf, 16);
+
+	vorbis_comment (block, comments);
+	put_bytes (buf, (guint8[]) { 0x84, block->len >> 16, block->len >> 8, block->len }, 4);
+	put_bytes (buf, block->data, block->len);
+	g_byte_array_free (block, TRUE);
+
+	return write_test_file (name, buf);
+}
+
+static guint32
+ogg_crc (const guint8 *data, gsize len)
+{
+	guint32 crc = 0;
+	gsize i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i] << 24;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+	}
+	return crc;
+}
+
+static void
+ogg_page (GByteArray *buf, guint8 flags, guint64 granule, guint32 seq, const guint8 *data, gsize len)
+{
+	gsize start = buf->len;
+	guint32 crc;
+	gsize left;
+
+	put_bytes (buf, "OggS", 4);
+	put_zeros (buf, 1);
+	put_bytes (buf, &flags, 1);
+	put_u32le (buf, granule);
+	put_u32le (buf, granule >> 32);
+	put_u32le (buf, 0x1234);
+	put_u32le (buf, seq);
+	put_u32le (buf, 0);		/* crc */
+
+	put_bytes (buf, (guint8[]) { len / 255 + 1 }, 1);
+	for (left = len; left >= 255; left -= 255)
+		put_bytes (buf, (guint8[]) { 255 }, 1);
+	put_bytes (buf, (guint8[]) { left }, 1);
+	put_bytes (buf, data, len);
+
+	crc = ogg_crc (buf->data + start, buf->len - start);
+	buf->data[start + 22] = crc;
+	buf->data[start + 23] = crc >> 8;
+	buf->data[start + 24] = crc >> 16;
+	buf->data[start + 25] = crc >> 24;
+}
+
+static char *
+make_ogg (const char *name, gboolean opus)
+{
+	GByteArray *buf = g_byte_array_new ();
+	GByteArray *packet = g_byte_array_new ();
+	const char *comments[] = {
+		"TITLE=Ogg Title",
+		"ARTIST=Ogg Artist",
+		"GENRE=Jazz",
+		NULL
+	};
+
+	if (opus) {
+		put_bytes (packet, "OpusHead", 8);
+		put_bytes (packet, (guint8[]) { 1, 2, 0x38, 0x01 }, 4);	/* pre-skip 312 */
+		put_u32le (packet, 48000);
+		put_zeros (packet, 3);
+	} else {
+		put_bytes (packet, "\001vorbis", 7);
+		put_u32le (packet, 0);
+		put_bytes (packet, (guint8[]) { 2 }, 1);
+		put_u32le (packet, 44100);
+		put_u32le (packet, 0);
+		put_u32le (packet, 160000);
+		put_u32le (packet, 0);
+		put_bytes (packet, (guint8[]) { 0xb8, 0x01 }, 2);
+	}
+	ogg_page (buf, 0x02, 0, 0, packet->data, packet->len);
+	g_byte_array_set_size (packet, 0);
+
+	if (opus)
+		put_bytes (packet, "OpusTags", 8);
+	else
+		put_bytes (packet, "\003vorbis", 7);
+	vorbis_comment (packet, comments);
+	if (opus == FALSE)
+		put_bytes (packet, (guint8[]) { 1 }, 1);
+	ogg_page (buf, 0x00, 0, 1, packet->data, packet->len);
+	g_byte_array_free (packet, TRUE);
+
+	/* 3 seconds of audio, plus the opus pre-skip */
+	ogg_page (buf, 0x04, opus ? 3 * 48000 + 312 : 3 * 44100, 2, (guint8 *) "", 0);
+
+	return write_test_file (name, buf);
+}
+
+static gsize
+mp4_box_start (GByteArray *buf, const char *type)
+{
+	gsize start = buf->len;
+
+	put_u32be (buf, 0);
+	put_bytes (buf, type, 4);
+	return start;
+}
+
+static void
+mp4_box_end (GByteArray *buf, gsize start)
+{
+	set_u32be (buf, start, buf->len - start);
+}
+
+static void
+mp4_item (GByteArray *buf, const char *type, guint32 data_type, const void *value, gsize len)
+{
+	gsize item;
+	gsize data;
+
+	item = mp4_box_start (buf, type);
+	data = mp4_box_start (buf, "data");
+	put_u32be (buf, data_type);
+	put_u32be (buf, 0);
+	put_bytes (buf, value, len);
+	mp4_box_end (buf, data);
+	mp4_box_end (buf, item);
+}
+
+static char *
+make_mp4 (const char *name, const char *brand, const char *handler)
+{
+	GByteArray *buf = g_byte_array_new ();
+	gsize boxes[8];
+
+	boxes[0] = mp4_box_start (buf, "ftyp");
+	put_bytes (buf, brand, 4);
+	put_u32be (buf, 0);
+	put_bytes (buf, "isom", 4);
+	mp4_box_end (buf, boxes[0]);
+
+	boxes[0] = mp4_box_start (buf, "moov");
+
+	boxes[1] = mp4_box_start (buf, "mvhd");
+	put_u32be (buf, 0);
+	put_u32be (buf, 0);
+	put_u32be (buf, 0);
+	put_u32be (buf, 1000);		/* timescale */
+	put_u32be (buf, 5000);		/* duration */
+	put_zeros (buf, 80);
+	mp4_box_end (buf, boxes[1]);
+
+	boxes[1] = mp4_box_start (buf, "trak");
+	boxes[2] = mp4_box_start (buf, "mdia");
+	boxes[3] = mp4_box_start (buf, "hdlr");
+	put_u32be (buf, 0);
+	put_u32be (buf, 0);
+	put_bytes (buf, handler, 4);
+	put_zeros (buf, 13);
+	mp4_box_end (buf, boxes[3]);
+	boxes[3] = mp4_box_start (buf, "minf");
+	boxes[4] = mp4_box_start (buf, "stbl");
+	boxes[5] = mp4_box_start (buf, "stsd");
+	put_u32be (buf, 0);
+	put_u32be (buf, 1);
+	boxes[6] = mp4_box_start (buf, "mp4a");
+	put_zeros (buf, 6);
+	put_u16be (buf, 1);
+	put_zeros (buf, 8);
+	put_u16be (buf, 2);
+	put_u16be (buf, 16);
+	put_zeros (buf, 4);
+	put_u32be (buf, 44100 << 16);
+	boxes[7] = mp4_box_start (buf, "esds");
+	put_u32be (buf, 0);
+	put_bytes (buf, (guint8[]) { 0x03, 21, 0, 1, 0 }, 5);
+	put_bytes (buf, (guint8[]) { 0x04, 13, 0x40, 0x15, 0, 0, 0 }, 7);
+	put_u32be (buf, 192000);
+	put_u32be (buf, 128000);
+	put_bytes (buf, (guint8[]) { 0x06, 1, 2 }, 3);
+	mp4_box_end (buf, boxes[7]);
+	mp4_box_end (buf, boxes[6]);
+	mp4_box_end (buf, boxes[5]);
+	mp4_box_end (buf, boxes[4]);
+	mp4_box_end (buf, boxes[3]);
+	mp4_box_end (buf, boxes[2]);
+	mp4_box_end (buf, boxes[1]);
+
+	boxes[1] = mp4_box_start (buf, "udta");
+	boxes[2] = mp4_box_start (buf, "meta");
+	put_u32be (buf, 0);
+	boxes[3] = mp4_box_start (buf, "hdlr");
+	put_u32be (buf, 0);
+	put_u32be (buf, 0);
+	put_bytes (buf, "mdir", 4);
+	put_zeros (buf, 13);
+	mp4_box_end (buf, boxes[3]);
+	boxes[3] = mp4_box_start (buf, "ilst");
+	mp4_item (buf, "\251nam", 1, "M4A Title", 9);
+	mp4_item (buf, "\251ART", 1, "M4A Artist", 10);
+	mp4_item (buf, "\251day", 1, "2008-10-11T00:00:00Z", 20);
+	mp4_item (buf, "trkn", 0, (guint8[]) { 0, 0, 0, 7, 0, 9, 0, 0 }, 8);
+	mp4_item (buf, "gnre", 0, (guint8[]) { 0, 10 }, 2);		/* Metal */
+	mp4_box_end (buf, boxes[3]);
+	mp4_box_end (buf, boxes[2]);
+	mp4_box_end (buf, boxes[1]);
+
+	mp4_box_end (buf, boxes[0]);
+
+	boxes[0] = mp4_box_start (buf, "mdat");
+	put_zeros (buf, 64);
+	mp4_box_end (buf, boxes[0]);
+
+	return write_test_file (name, buf);
+}
+
+/* checks */
+
+static GstTagList *
+native_load (const char *uri, const char *expected_type, const char *expected_caps)
+{
+	GstTagList *tags;
+	char *type;
+	char *caps;
+
+	fail_unless (rb_metadata_native_load (uri, &type, &caps, &tags), "native read failed for %s", uri);
+	fail_unless (strcmp (type, expected_type) == 0, "expected type %s, got %s", expected_type, type);
+	fail_unless (strcmp (caps, expected_caps) == 0, "expected caps %s, got %s", expected_caps, caps);
+	g_free (type);
+	g_free (caps);
+	return tags;
+}
+
+static void
+check_string (GstTagList *tags, const char *tag, const char *expected)
+{
+	char *value = NULL;
+
+	fail_unless (gst_tag_list_get_string (tags, tag, &value), "no value for %s", tag);
+	fail_unless (strcmp (value, expected) == 0, "expected %s \"%s\", got \"%s\"", tag, expected, value);
+	g_free (value);
+}
+
+static void
+check_uint (GstTagList *tags, const char *tag, guint expected)
+{
+	guint value = 0;
+
+	fail_unless (gst_tag_list_get_uint (tags, tag, &value), "no value for %s", tag);
+	fail_unless (value == expected, "expected %s %u, got %u", tag, expected, value);
+}
+
+static void
+check_duration (GstTagList *tags, guint64 expected_ms)
+{
+	guint64 value = 0;
+
+	fail_unless (gst_tag_list_get_uint64 (tags, GST_TAG_DURATION, &value));
+	fail_unless (value / GST_MSECOND == expected_ms,
+		     "expected duration %" G_GUINT64_FORMAT "ms, got %" G_GUINT64_FORMAT "ms",
+		     expected_ms, value / GST_MSECOND);
+}
+
+static void
+check_date (GstTagList *tags, int year, int month, int day)
+{
+	GDate *date = NULL;
+
+	fail_unless (gst_tag_list_get_date (tags, GST_TAG_DATE, &date));
+	fail_unless (g_date_get_year (date) == year &&
+		     g_date_get_month (date) == month &&
+		     g_date_get_day (date) == day);
+	g_date_free (date);
+}
+
+START_TEST (test_native_mp3)
+{
+	GstTagList *tags;
+	char *uri;
+
+	uri = make_mp3 ("test.mp3", 3, FALSE);
+	tags = native_load (uri, "application/x-id3", "audio/mpeg, mpegversion=(int)1, layer=(int)3");
+
+	check_string (tags, GST_TAG_TITLE, "MP3 Title");
+	check_string (tags, GST_TAG_ARTIST, "Artist\303\251");
+	check_string (tags, GST_TAG_ALBUM, "MP3 Album");
+	check_string (tags, GST_TAG_GENRE, "Rock");
+	check_string (tags, GST_TAG_COMMENT, "MP3 Comment");
+	check_string (tags, GST_TAG_MUSICBRAINZ_ARTISTID, "9c9f1380-2516-4fc9-a3e6-f9f61941d090");
+	check_uint (tags, GST_TAG_TRACK_NUMBER, 3);
+	check_uint (tags, GST_TAG_TRACK_COUNT, 12);
+	check_uint (tags, GST_TAG_ALBUM_VOLUME_NUMBER, 1);
+	check_uint (tags, GST_TAG_ALBUM_VOLUME_COUNT, 2);
+	check_date (tags, 2004, 1, 1);
+
+	/* 100 frames of 1152 samples at 44.1kHz, in 41700 bytes */
+	check_duration (tags, 2612);
+	check_uint (tags, GST_TAG_BITRATE, 127706);
+
+	gst_tag_list_free (tags);
+	g_free (uri);
+}
+END_TEST
+
+START_TEST (test_native_flac)
+{
+	GstTagList *tags;
+	char *uri;
+
+	uri = make_flac ("test.flac");
+	tags = native_load (uri, "audio/x-flac", "audio/x-flac");
+
+	check_string (tags, GST_TAG_TITLE, "FLAC Title");
+	check_string (tags, GST_TAG_ARTIST, "FLAC Artist");
+	check_string (tags, GST_TAG_ALBUM, "FLAC Album");
+	check_string (tags, GST_TAG_MUSICBRAINZ_TRACKID, "0b8a5b34-9df3-4f12-9c44-d2a5d7c0b7a1");
+	check_uint (tags, GST_TAG_TRACK_NUMBER, 5);
+	check_date (tags, 1999, 5, 6);
+	check_duration (tags, 10000);
+
+	gst_tag_list_free (tags);
+	g_free (uri);
+}
+END_TEST
+
+START_TEST (test_native_ogg)
+{
+	GstTagList *tags;
+	char *uri;
+
+	uri = make_ogg ("test.ogg", FALSE);
+	tags = native_load (uri, "application/ogg", "audio/x-vorbis");
+	check_string (tags, GST_TAG_TITLE, "Ogg Title");
+	check_string (tags, GST_TAG_ARTIST, "Ogg Artist");
+	check_string (tags, GST_TAG_GENRE, "Jazz");
+	check_duration (tags, 3000);
+	check_uint (tags, GST_TAG_BITRATE, 160000);
+	gst_tag_list_free (tags);
+	g_free (uri);
+
+	uri = make_ogg ("test.opus", TRUE);
+	tags = native_load (uri, "application/ogg", "audio/x-opus");
+	check_string (tags, GST_TAG_TITLE, "Ogg Title");
+	check_duration (tags, 3000);
+	gst_tag_list_free (tags);
+	g_free (uri);
+}
+END_TEST
+
+START_TEST (test_native_mp4)
+{
+	GstTagList *tags;
+	char *uri;
+
+	uri = make_mp4 ("test.m4a", "M4A ", "soun");
+	tags = native_load (uri, "audio/x-m4a", "audio/mpeg, mpegversion=(int)4");
+
+	check_string (tags, GST_TAG_TITLE, "M4A Title");
+	check_string (tags, GST_TAG_ARTIST, "M4A Artist");
+	check_string (tags, GST_TAG_GENRE, "Metal");
+	check_uint (tags, GST_TAG_TRACK_NUMBER, 7);
+	check_uint (tags, GST_TAG_TRACK_COUNT, 9);
+	check_uint (tags, GST_TAG_BITRATE, 128000);
+	check_date (tags, 2008, 10, 11);
+	check_duration (tags, 5000);
+
+	gst_tag_list_free (tags);
+	g_free (uri);
+}
+END_TEST
+
+START_TEST (test_native_fallback)
+{
+	GstTagList *tags;
+	char *type;
+	char *caps;
+	char *uri;
+
+	/* ID3v2.2 */
+	uri = make_mp3 ("v22.mp3", 2, FALSE);
+	fail_if (rb_metadata_native_load (uri, &type, &caps, &tags));
+	g_free (uri);
+
+	/* APE tags */
+	uri = make_mp3 ("ape.mp3", 3, TRUE);
+	fail_if (rb_metadata_native_load (uri, &type, &caps, &tags));
+	g_free (uri);
+
+	/* MP4 that doesn't claim to be audio only */
+	uri = make_mp4 ("video.mp4", "mp42", "soun");
+	fail_if (rb_metadata_native_load (uri, &type, &caps, &tags));
+	g_free (uri);
+
+	/* M4A with a video track */
+	uri = make_mp4 ("video.m4a", "M4A ", "vide");
+	fail_if (rb_metadata_native_load (uri, &type, &caps, &tags));
+	g_free (uri);
+
+	/* not a local file */
+	fail_if (rb_metadata_native_load ("http://example.com/test.mp3", &type, &caps, &tags));
+}
+END_TEST
+
+/* parity with the pipeline */
+
+static RBMetaData *
+load_metadata (const char *uri, gboolean native)
+{
+	RBMetaData *md;
+	GError *error = NULL;
+
+	if (native)
+		g_unsetenv ("RB_METADATA_NO_NATIVE");
+	else
+		g_setenv ("RB_METADATA_NO_NATIVE", "1", TRUE);
+
+	md = rb_metadata_new ();
+	rb_metadata_load (md, uri, &error);
+	g_unsetenv ("RB_METADATA_NO_NATIVE");
+
+	if (error != NULL) {
+		rb_debug ("unable to read %s: %s", uri, error->message);
+		g_error_free (error);
+		g_object_unref (md);
+		return NULL;
+	}
+	return md;
+}
+
+static void
+check_parity (const char *uri)
+{
+	RBMetaData *native;
+	RBMetaData *pipeline;
+	RBMetaDataField field;
+
+	pipeline = load_metadata (uri, FALSE);
+	if (pipeline == NULL)
+		return;			/* probably missing a plugin */
+	native = load_metadata (uri, TRUE);
+	fail_unless (native != NULL, "native read failed for %s", uri);
+
+	fail_unless (strcmp (rb_metadata_get_mime (native), rb_metadata_get_mime (pipeline)) == 0,
+		     "%s: type %s, pipeline found %s",
+		     uri, rb_metadata_get_mime (native), rb_metadata_get_mime (pipeline));
+
+	for (field = 0; field < RB_METADATA_FIELD_LAST; field++) {
+		GValue nv = {0,};
+		GValue pv = {0,};
+		gboolean has_native;
+		gboolean has_pipeline;
+		const char *name;
+
+		switch (field) {
+		case RB_METADATA_FIELD_CODEC:
+		case RB_METADATA_FIELD_TRACK_GAIN:
+		case RB_METADATA_FIELD_TRACK_PEAK:
+		case RB_METADATA_FIELD_ALBUM_GAIN:
+		case RB_METADATA_FIELD_ALBUM_PEAK:
+			/* not read by the native readers */
+			continue;
+		default:
+			break;
+		}
+
+		name = rb_metadata_get_field_name (field);
+		has_native = rb_metadata_get (native, field, &nv);
+		has_pipeline = rb_metadata_get (pipeline, field, &pv);
+
+		if (field == RB_METADATA_FIELD_BITRATE) {
+			/* decoders report the nominal or average bitrate,
+			 * which may differ from the one in the headers.
+			 */
+			if (has_native && has_pipeline) {
+				gulong n = g_value_get_ulong (&nv);
+				gulong p = g_value_get_ulong (&pv);
+				fail_unless (n * 10 >= p * 9 && n * 9 <= p * 10,
+					     "%s: bitrate %lu, pipeline found %lu", uri, n, p);
+			}
+		} else {
+			fail_unless (has_native == has_pipeline,
+				     "%s: field %s %s by the native reader only",
+				     uri, name, has_native ? "found" : "missed");
+		}
+
+		if (has_native && has_pipeline && field != RB_METADATA_FIELD_BITRATE) {
+			if (field == RB_METADATA_FIELD_DURATION) {
+				gulong n = g_value_get_ulong (&nv);
+				gulong p = g_value_get_ulong (&pv);
+				fail_unless (n + 1 >= p && n <= p + 1,
+					     "%s: duration %lu, pipeline found %lu", uri, n, p);
+			} else {
+				char *ns = g_strdup_value_contents (&nv);
+				char *ps = g_strdup_value_contents (&pv);
+				fail_unless (strcmp (ns, ps) == 0,
+					     "%s: field %s is %s, pipeline found %s", uri, name, ns, ps);
+				g_free (ns);
+				g_free (ps);
+			}
+		}
+
+		if (has_native)
+			g_value_unset (&nv);
+		if (has_pipeline)
+			g_value_unset (&pv);
+	}
+
+	g_object_unref (native);
+	g_object_unref (pipeline);
+}
+
+START_TEST (test_native_parity)
+{
+	const char *corpus;
+	int i;
+
+	for (i = 0; i < test_files->len; i++) {
+		check_parity (g_ptr_array_index (test_files, i));
+	}
+
+	corpus = g_getenv ("RB_METADATA_TEST_CORPUS");
+	if (corpus != NULL) {
+		GDir *dir;
+		const char *name;
+
+		dir = g_dir_open (corpus, 0, NULL);
+		fail_unless (dir != NULL, "unable to open corpus directory %s", corpus);
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			char *path;
+			char *uri;
+
+			path = g_build_filename (corpus, name, NULL);
+			uri = g_filename_to_uri (path, NULL, NULL);
+			if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+				check_parity (uri);
+			g_free (uri);
+			g_free (path);
+		}
+		g_dir_close (dir);
+	}
+}
+END_TEST
+
+static Suite *
+rb_metadata_native_suite ()
+{
+	Suite *s = suite_create ("rb-metadata-native");
+	TCase *tc_chain = tcase_create ("rb-metadata-native-core");
+
+	suite_add_tcase (s, tc_chain);
+	tcase_set_timeout (tc_chain, 60);
+
+	tcase_add_test (tc_chain, test_native_mp3);
+	tcase_add_test (tc_chain, test_native_flac);
+	tcase_add_test (tc_chain, test_native_ogg);
+	tcase_add_test (tc_chain, test_native_mp4);
+	tcase_add_test (tc_chain, test_native_fallback);
+	tcase_add_test (tc_chain, test_native_parity);
+
+	return s;
+}
+
+int
+main (int argc, char **argv)
+{
+	int ret;
+	SRunner *sr;
+	Suite *s;
+	const char *name;
+	GDir *dir;
+
+	g_thread_init (NULL);
+	rb_threads_init ();
+	gst_init (&argc, &argv);
+	rb_debug_init (argc > 1 && strcmp (argv[1], "--debug") == 0);
+
+	test_dir = g_build_filename (g_get_tmp_dir (), "rb-test-metadata-native-XXXXXX", NULL);
+	if (g_mkdtemp (test_dir) == NULL) {
+		g_warning ("unable to create test directory %s", test_dir);
+		return 1;
+	}
+	test_files = g_ptr_array_new ();
+
+	/* the files are created and read in the same process */
+	s = rb_metadata_native_suite ();
+	sr = srunner_create (s);
+	srunner_set_fork_status (sr, CK_NOFORK);
+	srunner_run_all (sr, CK_NORMAL);
+	ret = srunner_ntests_failed (sr);
+	srunner_free (sr);
+
+	dir = g_dir_open (test_dir, 0, NULL);
+	while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+		char *path = g_build_filename (test_dir, name, NULL);
+		g_unlink (path);
+		g_free (path);
+	}
+	if (dir != NULL)
+		g_dir_close (dir);
+	g_rmdir (test_dir);
+	g_free (test_dir);
+
+	g_ptr_array_foreach (test_files, (GFunc) g_free, NULL);
+	g_ptr_array_free (test_files, TRUE);
+
+	return ret;
+}
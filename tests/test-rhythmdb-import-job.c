@@ -0,0 +1,247 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+
+#include "config.h"
+
+#include <check.h>
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include "test-utils.h"
+#include "rhythmdb-import-job.h"
+
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+/* files in the top directory and in the subdirectory of the test tree */
+#define N_TOP_FILES	12
+#define N_SUB_FILES	5
+
+static char *test_dir;
+static char *test_subdir;
+
+static void
+create_test_files (const char *dir, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		char *name;
+		char *path;
+
+		name = g_strdup_printf ("file%d.txt", i);
+		path = g_build_filename (dir, name, NULL);
+		fail_unless (g_file_set_contents (path, "not audio\n", -1, NULL),
+			     "unable to create test file");
+		g_free (path);
+		g_free (name);
+	}
+}
+
+static void
+remove_test_files (const char *dir, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		char *name;
+		char *path;
+
+		name = g_strdup_printf ("file%d.txt", i);
+		path = g_build_filename (dir, name, NULL);
+		g_unlink (path);
+		g_free (path);
+		g_free (name);
+	}
+}
+
+static void
+import_job_setup (void)
+{
+	test_rhythmdb_setup ();
+
+	test_dir = g_build_filename (g_get_tmp_dir (), "rb-test-import-job-XXXXXX", NULL);
+	fail_unless (g_mkdtemp (test_dir) != NULL, "unable to create test directory");
+	test_subdir = g_build_filename (test_dir, "sub", NULL);
+	fail_unless (g_mkdir (test_subdir, 0700) == 0, "unable to create test subdirectory");
+
+	create_test_files (test_dir, N_TOP_FILES);
+	create_test_files (test_subdir, N_SUB_FILES);
+}
+
+static void
+import_job_shutdown (void)
+{
+	remove_test_files (test_subdir, N_SUB_FILES);
+	remove_test_files (test_dir, N_TOP_FILES);
+	g_rmdir (test_subdir);
+	g_rmdir (test_dir);
+	g_free (test_subdir);
+	g_free (test_dir);
+
+	test_rhythmdb_shutdown ();
+}
+
+/* imports the test tree and waits for the job to finish */
+static RhythmDBImportJob *
+run_import_job (void)
+{
+	RhythmDBImportJob *job;
+	char *uri;
+
+	job = rhythmdb_import_job_new (db,
+				       RHYTHMDB_ENTRY_TYPE_SONG,
+				       RHYTHMDB_ENTRY_TYPE_IGNORE,
+				       RHYTHMDB_ENTRY_TYPE_IMPORT_ERROR);
+	uri = g_filename_to_uri (test_dir, NULL, NULL);
+	rhythmdb_import_job_add_uri (job, uri);
+	g_free (uri);
+
+	set_waiting_signal (G_OBJECT (job), "complete");
+	rhythmdb_import_job_start (job);
+	wait_for_signal ();
+
+	fail_unless (rhythmdb_import_job_complete (job), "import job not complete");
+	return job;
+}
+
+START_TEST (test_rhythmdb_import_job_stages)
+{
+	RhythmDBImportJob *job;
+	RhythmDBImportJobStageStats stats;
+	guint n_files = N_TOP_FILES + N_SUB_FILES;
+
+	job = run_import_job ();
+	end_step ();
+
+	fail_unless (rhythmdb_import_job_get_total (job) == n_files, "wrong number of files to import");
+	fail_unless (rhythmdb_import_job_get_imported (job) == n_files, "wrong number of files imported");
+
+	rhythmdb_import_job_get_stage_stats (job, RHYTHMDB_IMPORT_JOB_STAGE_ENUMERATE, &stats);
+	fail_unless (stats.processed == n_files, "wrong number of files found");
+	fail_unless (stats.queued == 0, "directories left to scan");
+
+	rhythmdb_import_job_get_stage_stats (job, RHYTHMDB_IMPORT_JOB_STAGE_FEED, &stats);
+	fail_unless (stats.processed == n_files, "wrong number of files handed to the database");
+	fail_unless (stats.queued == 0, "files left in the queue of files found");
+
+	rhythmdb_import_job_get_stage_stats (job, RHYTHMDB_IMPORT_JOB_STAGE_LOAD, &stats);
+	fail_unless (stats.processed == n_files, "wrong number of files loaded");
+	fail_unless (stats.queued == 0, "loads left waiting");
+	fail_unless (stats.workers > 0, "no load workers");
+
+	rhythmdb_import_job_get_stage_stats (job, RHYTHMDB_IMPORT_JOB_STAGE_INSERT, &stats);
+	fail_unless (stats.processed == n_files, "wrong number of entries inserted");
+	fail_unless (stats.queued == 0, "loaded files not inserted");
+
+	g_object_unref (job);
+}
+END_TEST
+
+/* files already in the database are only checked for changes, so they
+ * go through the feed stage but not the load and insert stages.
+ */
+START_TEST (test_rhythmdb_import_job_existing_files)
+{
+	RhythmDBImportJob *job;
+	RhythmDBImportJobStageStats stats;
+	guint n_files = N_TOP_FILES + N_SUB_FILES;
+
+	job = run_import_job ();
+	g_object_unref (job);
+	end_step ();
+
+	job = run_import_job ();
+	end_step ();
+
+	fail_unless (rhythmdb_import_job_get_total (job) == 0, "existing files counted as new");
+
+	rhythmdb_import_job_get_stage_stats (job, RHYTHMDB_IMPORT_JOB_STAGE_ENUMERATE, &stats);
+	fail_unless (stats.processed == n_files, "wrong number of files found");
+
+	rhythmdb_import_job_get_stage_stats (job, RHYTHMDB_IMPORT_JOB_STAGE_FEED, &stats);
+	fail_unless (stats.processed == n_files, "wrong number of files handed to the database");
+
+	rhythmdb_import_job_get_stage_stats (job, RHYTHMDB_IMPORT_JOB_STAGE_LOAD, &stats);
+	fail_unless (stats.processed == 0, "files only checked for changes counted as loaded");
+
+	rhythmdb_import_job_get_stage_stats (job, RHYTHMDB_IMPORT_JOB_STAGE_INSERT, &stats);
+	fail_unless (stats.processed == 0, "existing entries counted as inserted");
+
+	g_object_unref (job);
+}
+END_TEST
+
+static Suite *
+rhythmdb_import_job_suite (void)
+{
+	Suite *s = suite_create ("rhythmdb-import-job");
+	TCase *tc_chain = tcase_create ("rhythmdb-import-job-core");
+
+	suite_add_tcase (s, tc_chain);
+	tcase_add_checked_fixture (tc_chain, import_job_setup, import_job_shutdown);
+
+	tcase_add_test (tc_chain, test_rhythmdb_import_job_stages);
+	tcase_add_test (tc_chain, test_rhythmdb_import_job_existing_files);
+
+	return s;
+}
+
+int
+main (int argc, char **argv)
+{
+	int ret;
+	SRunner *sr;
+	Suite *s;
+
+	/* init stuff */
+	rb_profile_start ("rhythmdb-import-job test suite");
+
+	g_thread_init (NULL);
+	rb_threads_init ();
+	gtk_set_locale ();
+	rb_debug_init (TRUE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
+
+	/* setup tests */
+	s = rhythmdb_import_job_suite ();
+	sr = srunner_create (s);
+
+	init_setup (sr, argc, argv);
+	init_once (FALSE);
+
+	srunner_run_all (sr, CK_NORMAL);
+	ret = srunner_ntests_failed (sr);
+	srunner_free (sr);
+
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
+
+	rb_profile_end ("rhythmdb-import-job test suite");
+	return ret;
+}
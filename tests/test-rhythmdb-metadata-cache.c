@@ -0,0 +1,406 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/stat.h>
+#include <check.h>
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include "test-utils.h"
+#include "rb-metadata.h"
+#include "rhythmdb-private.h"
+
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+#define TEST_MIMETYPE	"audio/x-vorbis"
+#define TEST_TITLE	"tab\there"
+#define TEST_TRACK	7
+
+static char *test_dir;
+static char *cache_path;
+
+static void
+metadata_cache_setup (void)
+{
+	test_dir = g_build_filename (g_get_tmp_dir (), "rb-test-metadata-cache-XXXXXX", NULL);
+	fail_unless (g_mkdtemp (test_dir) != NULL, "unable to create test directory");
+	cache_path = g_build_filename (test_dir, "metadata-cache", NULL);
+}
+
+static void
+metadata_cache_shutdown (void)
+{
+	GDir *dir;
+	const char *name;
+
+	dir = g_dir_open (test_dir, 0, NULL);
+	if (dir != NULL) {
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			char *path;
+
+			path = g_build_filename (test_dir, name, NULL);
+			g_unlink (path);
+			g_free (path);
+		}
+		g_dir_close (dir);
+	}
+	g_rmdir (test_dir);
+
+	g_free (cache_path);
+	g_free (test_dir);
+}
+
+/* creates a file in the test directory, returning its URI */
+static char *
+create_test_file (const char *name, const char *contents)
+{
+	char *path;
+	char *uri;
+
+	path = g_build_filename (test_dir, name, NULL);
+	fail_unless (g_file_set_contents (path, contents, -1, NULL), "unable to create test file");
+	uri = g_filename_to_uri (path, NULL, NULL);
+	g_free (path);
+	return uri;
+}
+
+static GFileInfo *
+query_test_file (const char *uri)
+{
+	GFile *file;
+	GFileInfo *info;
+
+	file = g_file_new_for_uri (uri);
+	info = g_file_query_info (file,
+				  G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+				  G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+				  G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC ","
+				  G_FILE_ATTRIBUTE_UNIX_DEVICE ","
+				  G_FILE_ATTRIBUTE_UNIX_INODE,
+				  G_FILE_QUERY_INFO_NONE,
+				  NULL,
+				  NULL);
+	g_object_unref (file);
+	fail_unless (info != NULL, "unable to query test file");
+	return info;
+}
+
+static RBMetaData *
+create_test_metadata (void)
+{
+	RBMetaData *md;
+	GValue value = {0,};
+
+	md = rb_metadata_new ();
+	rb_metadata_reset (md);
+	rb_metadata_set_audio_type (md, TEST_MIMETYPE);
+
+	g_value_init (&value, G_TYPE_STRING);
+	g_value_set_static_string (&value, TEST_TITLE);
+	rb_metadata_set (md, RB_METADATA_FIELD_TITLE, &value);
+	g_value_unset (&value);
+
+	g_value_init (&value, G_TYPE_ULONG);
+	g_value_set_ulong (&value, TEST_TRACK);
+	rb_metadata_set (md, RB_METADATA_FIELD_TRACK_NUMBER, &value);
+	g_value_unset (&value);
+
+	return md;
+}
+
+static void
+store_test_metadata (const char *uri)
+{
+	RhythmDBMetadataCache *cache;
+	GFileInfo *info;
+	RBMetaData *md;
+
+	cache = rhythmdb_metadata_cache_new (cache_path);
+	info = query_test_file (uri);
+	md = create_test_metadata ();
+	rhythmdb_metadata_cache_store (cache, uri, info, md);
+	g_object_unref (md);
+	g_object_unref (info);
+	rhythmdb_metadata_cache_free (cache);
+}
+
+/* returns the lines of the cache file, without the trailing empty line */
+static char **
+read_cache_lines (void)
+{
+	char *contents;
+	char **lines;
+	guint n;
+
+	fail_unless (g_file_get_contents (cache_path, &contents, NULL, NULL), "unable to read cache file");
+	fail_unless (g_str_has_suffix (contents, "\n"), "cache file doesn't end with a newline");
+	lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+
+	n = g_strv_length (lines);
+	g_free (lines[n - 1]);
+	lines[n - 1] = NULL;
+	return lines;
+}
+
+START_TEST (test_rhythmdb_metadata_cache_format)
+{
+	GFileInfo *info;
+	char **lines;
+	char **fields;
+	char *uri;
+	char *expected;
+	guint64 mtime;
+	int i;
+	gboolean found_title = FALSE;
+	gboolean found_track = FALSE;
+
+	uri = create_test_file ("one.ogg", "not really audio\n");
+	store_test_metadata (uri);
+
+	lines = read_cache_lines ();
+	fail_unless (g_strv_length (lines) == 2, "wrong number of lines in cache file");
+	fail_unless (strcmp (lines[0], "rhythmdb-metadata 2") == 0, "wrong version line");
+
+	info = query_test_file (uri);
+	mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+		g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+
+	fields = g_strsplit (lines[1], "\t", -1);
+	fail_unless (g_strv_length (fields) == 7, "wrong number of fields in record");
+	expected = g_strdup_printf ("inode:%u:%" G_GUINT64_FORMAT,
+				    g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE),
+				    g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE));
+	fail_unless (strcmp (fields[0], expected) == 0, "wrong key");
+	g_free (expected);
+	fail_unless (g_ascii_strtoull (fields[1], NULL, 10) == strlen ("not really audio\n"), "wrong size");
+	fail_unless (g_ascii_strtoull (fields[2], NULL, 10) == mtime, "wrong modification time");
+	fail_unless (strcmp (fields[3], uri) == 0, "wrong uri");
+	fail_unless (strcmp (fields[4], TEST_MIMETYPE) == 0, "wrong media type");
+
+	for (i = 5; fields[i] != NULL; i++) {
+		expected = g_strdup_printf ("%s=tab\\there", rb_metadata_get_field_name (RB_METADATA_FIELD_TITLE));
+		if (strcmp (fields[i], expected) == 0)
+			found_title = TRUE;
+		g_free (expected);
+
+		expected = g_strdup_printf ("%s=%d", rb_metadata_get_field_name (RB_METADATA_FIELD_TRACK_NUMBER), TEST_TRACK);
+		if (strcmp (fields[i], expected) == 0)
+			found_track = TRUE;
+		g_free (expected);
+	}
+	fail_unless (found_title, "escaped title not found in record");
+	fail_unless (found_track, "track number not found in record");
+
+	g_strfreev (fields);
+	g_strfreev (lines);
+	g_object_unref (info);
+	g_free (uri);
+}
+END_TEST
+
+START_TEST (test_rhythmdb_metadata_cache_lookup)
+{
+	RhythmDBMetadataCache *cache;
+	GFileInfo *info;
+	RBMetaData *md;
+	GValue value = {0,};
+	char *uri;
+
+	uri = create_test_file ("one.ogg", "not really audio\n");
+	store_test_metadata (uri);
+
+	cache = rhythmdb_metadata_cache_new (cache_path);
+	info = query_test_file (uri);
+	md = rhythmdb_metadata_cache_lookup (cache, uri, info);
+	g_object_unref (info);
+	fail_unless (md != NULL, "stored metadata not found");
+	fail_unless (strcmp (rb_metadata_get_mime (md), TEST_MIMETYPE) == 0, "wrong media type");
+	fail_unless (rb_metadata_get (md, RB_METADATA_FIELD_TITLE, &value), "title not found");
+	fail_unless (strcmp (g_value_get_string (&value), TEST_TITLE) == 0, "wrong title");
+	g_value_unset (&value);
+	fail_unless (rb_metadata_get (md, RB_METADATA_FIELD_TRACK_NUMBER, &value), "track number not found");
+	fail_unless (g_value_get_ulong (&value) == TEST_TRACK, "wrong track number");
+	g_value_unset (&value);
+	g_object_unref (md);
+
+	/* results for the file aren't used once it changes */
+	g_free (create_test_file ("one.ogg", "still not really audio\n"));
+	info = query_test_file (uri);
+	md = rhythmdb_metadata_cache_lookup (cache, uri, info);
+	g_object_unref (info);
+	fail_unless (md == NULL, "metadata for a changed file found");
+
+	rhythmdb_metadata_cache_free (cache);
+	g_free (uri);
+}
+END_TEST
+
+START_TEST (test_rhythmdb_metadata_cache_prune)
+{
+	RhythmDBMetadataCache *cache;
+	GFileInfo *info;
+	RBMetaData *md;
+	char **lines;
+	char *keep_uri;
+	char *gone_uri;
+	char *path;
+
+	keep_uri = create_test_file ("keep.ogg", "not really audio\n");
+	gone_uri = create_test_file ("gone.ogg", "not really audio either\n");
+	store_test_metadata (keep_uri);
+	store_test_metadata (gone_uri);
+
+	path = g_filename_from_uri (gone_uri, NULL, NULL);
+	g_unlink (path);
+	g_free (path);
+
+	cache = rhythmdb_metadata_cache_new (cache_path);
+	rhythmdb_metadata_cache_prune (cache, NULL);
+	info = query_test_file (keep_uri);
+	md = rhythmdb_metadata_cache_lookup (cache, keep_uri, info);
+	g_object_unref (info);
+	fail_unless (md != NULL, "metadata for existing file dropped");
+	g_object_unref (md);
+	rhythmdb_metadata_cache_free (cache);
+
+	/* the deleted file's record is dropped by appending a line for it */
+	lines = read_cache_lines ();
+	fail_unless (g_strv_length (lines) == 4, "record for deleted file not dropped");
+	fail_unless (g_str_has_suffix (lines[3], "\t0\t0\t"), "wrong record for deleted file");
+	fail_unless (strncmp (lines[3], lines[2], strlen (lines[3]) - strlen ("0\t0\t")) == 0,
+		     "wrong record dropped");
+	g_strfreev (lines);
+
+	/* most lines in the file are now out of date, so it's rewritten
+	 * when it's next opened.
+	 */
+	cache = rhythmdb_metadata_cache_new (cache_path);
+	info = query_test_file (keep_uri);
+	md = rhythmdb_metadata_cache_lookup (cache, keep_uri, info);
+	g_object_unref (info);
+	fail_unless (md != NULL, "metadata for existing file dropped");
+	g_object_unref (md);
+	rhythmdb_metadata_cache_free (cache);
+
+	lines = read_cache_lines ();
+	fail_unless (g_strv_length (lines) == 2, "cache file not rewritten");
+	fail_unless (strstr (lines[1], keep_uri) != NULL, "wrong record kept");
+	g_strfreev (lines);
+
+	g_free (keep_uri);
+	g_free (gone_uri);
+}
+END_TEST
+
+/* files that can't be found on a device other than the one they were on
+ * are probably on a volume that isn't mounted, so they're kept.
+ */
+START_TEST (test_rhythmdb_metadata_cache_prune_unmounted)
+{
+	RhythmDBMetadataCache *cache;
+	struct stat st;
+	char **lines;
+	char *contents;
+	char *path;
+	char *uri;
+
+	fail_unless (g_stat (test_dir, &st) == 0, "unable to stat test directory");
+	path = g_build_filename (test_dir, "unmounted", "missing.ogg", NULL);
+	uri = g_filename_to_uri (path, NULL, NULL);
+	contents = g_strdup_printf ("rhythmdb-metadata 2\n"
+				    "inode:%u:12345\t10\t0\t%s\t" TEST_MIMETYPE "\n",
+				    (guint32) st.st_dev + 1, uri);
+	fail_unless (g_file_set_contents (cache_path, contents, -1, NULL), "unable to write cache file");
+	g_free (contents);
+	g_free (uri);
+	g_free (path);
+
+	cache = rhythmdb_metadata_cache_new (cache_path);
+	rhythmdb_metadata_cache_prune (cache, NULL);
+	rhythmdb_metadata_cache_free (cache);
+
+	lines = read_cache_lines ();
+	fail_unless (g_strv_length (lines) == 2, "record for file on unmounted volume dropped");
+	g_strfreev (lines);
+}
+END_TEST
+
+static Suite *
+rhythmdb_metadata_cache_suite (void)
+{
+	Suite *s = suite_create ("rhythmdb-metadata-cache");
+	TCase *tc_chain = tcase_create ("rhythmdb-metadata-cache-core");
+
+	suite_add_tcase (s, tc_chain);
+	tcase_add_checked_fixture (tc_chain, metadata_cache_setup, metadata_cache_shutdown);
+
+	tcase_add_test (tc_chain, test_rhythmdb_metadata_cache_format);
+	tcase_add_test (tc_chain, test_rhythmdb_metadata_cache_lookup);
+	tcase_add_test (tc_chain, test_rhythmdb_metadata_cache_prune);
+	tcase_add_test (tc_chain, test_rhythmdb_metadata_cache_prune_unmounted);
+
+	return s;
+}
+
+int
+main (int argc, char **argv)
+{
+	int ret;
+	SRunner *sr;
+	Suite *s;
+
+	/* init stuff */
+	rb_profile_start ("rhythmdb-metadata-cache test suite");
+
+	g_thread_init (NULL);
+	rb_threads_init ();
+	gtk_set_locale ();
+	rb_debug_init (TRUE);
+	rb_file_helpers_init (TRUE);
+
+	/* setup tests */
+	s = rhythmdb_metadata_cache_suite ();
+	sr = srunner_create (s);
+
+	init_setup (sr, argc, argv);
+	init_once (FALSE);
+
+	srunner_run_all (sr, CK_NORMAL);
+	ret = srunner_ntests_failed (sr);
+	srunner_free (sr);
+
+	rb_file_helpers_shutdown ();
+
+	rb_profile_end ("rhythmdb-metadata-cache test suite");
+	return ret;
+}
@@ -285,6 +285,334 @@ START_TEST (test_hidden_chain_filter)
 }
 END_TEST
 
+/* this tests that changes reach the query models they affect once
+ * they're only dispatched to those models */
+START_TEST (test_query_model_dispatch)
+{
+	RhythmDBQueryModel *genre_model;
+	RhythmDBQueryModel *title_model;
+	RhythmDBQuery *query;
+	RhythmDBEntry *entry;
+	RhythmDBEntry *entry2;
+	GtkTreeIter iter;
+	GValue val = {0,};
+
+	start_test_case ();
+
+	/* setup */
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Rock",
+				      RHYTHMDB_QUERY_END);
+	genre_model = rhythmdb_query_model_new (db, query, NULL, NULL, NULL, FALSE);
+	rhythmdb_query_free (query);
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_SEARCH_MATCH, "sin",
+				      RHYTHMDB_QUERY_END);
+	title_model = rhythmdb_query_model_new (db, query, NULL, NULL, NULL, FALSE);
+	rhythmdb_query_free (query);
+
+	g_value_init (&val, G_TYPE_STRING);
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///whee.ogg");
+	g_value_set_static_string (&val, "Jazz");
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_GENRE, &val);
+	set_waiting_signal (G_OBJECT (db), "entry-added");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_if (rhythmdb_query_model_entry_to_iter (genre_model, entry, &iter));
+	fail_if (rhythmdb_query_model_entry_to_iter (title_model, entry, &iter));
+
+	end_step ();
+
+	/* changing the genre should add it to the genre model */
+	g_value_set_static_string (&val, "Rock");
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_GENRE, &val);
+	set_waiting_signal (G_OBJECT (db), "entry-changed");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_unless (rhythmdb_query_model_entry_to_iter (genre_model, entry, &iter));
+	fail_if (rhythmdb_query_model_entry_to_iter (title_model, entry, &iter));
+
+	end_step ();
+
+	/* the title is part of the search match, so this should add it to the title model */
+	g_value_set_static_string (&val, "Sin");
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_TITLE, &val);
+	set_waiting_signal (G_OBJECT (db), "entry-changed");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_unless (rhythmdb_query_model_entry_to_iter (genre_model, entry, &iter));
+	fail_unless (rhythmdb_query_model_entry_to_iter (title_model, entry, &iter));
+
+	end_step ();
+
+	/* changing the genre back should remove it from the genre model */
+	g_value_set_static_string (&val, "Jazz");
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_GENRE, &val);
+	set_waiting_signal (G_OBJECT (db), "entry-changed");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_if (rhythmdb_query_model_entry_to_iter (genre_model, entry, &iter));
+	fail_unless (rhythmdb_query_model_entry_to_iter (title_model, entry, &iter));
+
+	end_step ();
+
+	/* new entries should reach the models they match */
+	entry2 = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///whee2.ogg");
+	g_value_set_static_string (&val, "Rock");
+	rhythmdb_entry_set (db, entry2, RHYTHMDB_PROP_GENRE, &val);
+	set_waiting_signal (G_OBJECT (db), "entry-added");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_unless (rhythmdb_query_model_entry_to_iter (genre_model, entry2, &iter));
+	fail_if (rhythmdb_query_model_entry_to_iter (title_model, entry2, &iter));
+
+	end_step ();
+
+	/* and deleted entries should be removed */
+	set_waiting_signal (G_OBJECT (db), "entry-deleted");
+	rhythmdb_entry_delete (db, entry2);
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_if (rhythmdb_query_model_entry_to_iter (genre_model, entry2, &iter));
+
+	end_step ();
+
+	/* tidy up */
+	rhythmdb_entry_delete (db, entry);
+	g_object_unref (genre_model);
+	g_object_unref (title_model);
+	g_value_unset (&val);
+
+	end_test_case ();
+}
+END_TEST
+
+static void
+count_signal_cb (GObject *object, gpointer a, gpointer b, int *count)
+{
+	(*count)++;
+}
+
+static RhythmDBEntry *
+first_entry (RhythmDBQueryModel *model)
+{
+	GtkTreeIter iter;
+
+	if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (model), &iter) == FALSE)
+		return NULL;
+	return rhythmdb_query_model_iter_to_entry (model, &iter);
+}
+
+/* this tests that changes to properties the query and sort order don't
+ * depend on only update the row, and changes to ones they do still move it */
+START_TEST (test_query_model_irrelevant_changes)
+{
+	RhythmDBQueryModel *model;
+	RhythmDBQuery *query;
+	RhythmDBEntry *a;
+	RhythmDBEntry *b;
+	RhythmDBEntry *first;
+	GValue val = {0,};
+	int row_changed = 0;
+	int reordered = 0;
+
+	start_test_case ();
+
+	/* setup */
+	a = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///a.ogg");
+	g_value_init (&val, G_TYPE_STRING);
+	g_value_set_static_string (&val, "A");
+	rhythmdb_entry_set (db, a, RHYTHMDB_PROP_TITLE, &val);
+	g_value_unset (&val);
+
+	b = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///b.ogg");
+	g_value_init (&val, G_TYPE_STRING);
+	g_value_set_static_string (&val, "B");
+	rhythmdb_entry_set (db, b, RHYTHMDB_PROP_TITLE, &val);
+	g_value_unset (&val);
+	rhythmdb_commit (db);
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+				      RHYTHMDB_QUERY_END);
+	model = rhythmdb_query_model_new (db, query,
+					  (GCompareDataFunc) rhythmdb_query_model_title_sort_func,
+					  NULL, NULL, FALSE);
+	rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	rhythmdb_query_free (query);
+
+	g_signal_connect (model, "row-changed", G_CALLBACK (count_signal_cb), &row_changed);
+	g_signal_connect (model, "rows-reordered", G_CALLBACK (count_signal_cb), &reordered);
+
+	first = first_entry (model);
+	fail_unless (first == a);
+	rhythmdb_entry_unref (first);
+
+	end_step ();
+
+	/* play count changes should only update the row */
+	g_value_init (&val, G_TYPE_ULONG);
+	g_value_set_ulong (&val, 5);
+	rhythmdb_entry_set (db, a, RHYTHMDB_PROP_PLAY_COUNT, &val);
+	g_value_unset (&val);
+	set_waiting_signal (G_OBJECT (db), "entries-changed");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_unless (row_changed == 1);
+	fail_unless (reordered == 0);
+	first = first_entry (model);
+	fail_unless (first == a);
+	rhythmdb_entry_unref (first);
+
+	end_step ();
+
+	/* title changes should move it */
+	g_value_init (&val, G_TYPE_STRING);
+	g_value_set_static_string (&val, "C");
+	rhythmdb_entry_set (db, a, RHYTHMDB_PROP_TITLE, &val);
+	g_value_unset (&val);
+	set_waiting_signal (G_OBJECT (db), "entries-changed");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_unless (reordered == 1);
+	first = first_entry (model);
+	fail_unless (first == b);
+	rhythmdb_entry_unref (first);
+
+	end_step ();
+
+	/* tidy up */
+	rhythmdb_entry_delete (db, a);
+	rhythmdb_entry_delete (db, b);
+	g_object_unref (model);
+
+	end_test_case ();
+}
+END_TEST
+
+/* this tests that deleting many entries at once, or all the entries of a
+ * type, removes them from query models and the models chained to them */
+START_TEST (test_query_model_bulk_delete)
+{
+	RhythmDBQueryModel *model;
+	RhythmDBQueryModel *child_model;
+	RhythmDBQuery *query;
+	RhythmDBEntry *entries[10];
+	GList *deleted = NULL;
+	GtkTreeIter iter;
+	GValue val = {0,};
+	int row_deleted = 0;
+	int removed = 0;
+	int i;
+
+	start_test_case ();
+
+	/* setup */
+	g_value_init (&val, G_TYPE_STRING);
+	for (i = 0; i < G_N_ELEMENTS (entries); i++) {
+		char *uri;
+		char *title;
+
+		uri = g_strdup_printf ("file:///whee%d.ogg", i);
+		title = g_strdup_printf ("%d", i);
+		entries[i] = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, uri);
+		g_value_set_string (&val, title);
+		rhythmdb_entry_set (db, entries[i], RHYTHMDB_PROP_TITLE, &val);
+		g_free (uri);
+		g_free (title);
+	}
+	g_value_unset (&val);
+	set_waiting_signal (G_OBJECT (db), "entry-added");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+				      RHYTHMDB_QUERY_END);
+	model = rhythmdb_query_model_new (db, query,
+					  (GCompareDataFunc) rhythmdb_query_model_title_sort_func,
+					  NULL, NULL, FALSE);
+	rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	rhythmdb_query_free (query);
+
+	child_model = rhythmdb_query_model_new_empty (db);
+	query = g_ptr_array_new ();
+	g_object_set (child_model, "query", query, "base-model", model, NULL);
+	rhythmdb_query_free (query);
+
+	g_signal_connect (model, "row-deleted", G_CALLBACK (count_signal_cb), &row_deleted);
+	g_signal_connect (model, "entry-removed", G_CALLBACK (count_signal_cb), &removed);
+
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL) == G_N_ELEMENTS (entries));
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (child_model), NULL) == G_N_ELEMENTS (entries));
+
+	end_step ();
+
+	/* delete every other entry */
+	for (i = 0; i < G_N_ELEMENTS (entries); i += 2) {
+		deleted = g_list_prepend (deleted, entries[i]);
+	}
+	rhythmdb_entry_delete_many (db, deleted);
+	g_list_free (deleted);
+	set_waiting_signal (G_OBJECT (db), "entries-deleted");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_unless (row_deleted == G_N_ELEMENTS (entries) / 2);
+	fail_unless (removed == G_N_ELEMENTS (entries) / 2);
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL) == G_N_ELEMENTS (entries) / 2);
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (child_model), NULL) == G_N_ELEMENTS (entries) / 2);
+	for (i = 0; i < G_N_ELEMENTS (entries); i++) {
+		gboolean expected = (i % 2) != 0;
+
+		fail_unless (rhythmdb_query_model_entry_to_iter (model, entries[i], &iter) == expected);
+		fail_unless (rhythmdb_query_model_entry_to_iter (child_model, entries[i], &iter) == expected);
+	}
+	fail_unless (rhythmdb_entry_lookup_by_location (db, "file:///whee0.ogg") == NULL);
+	fail_unless (rhythmdb_entry_lookup_by_location (db, "file:///whee1.ogg") == entries[1]);
+
+	end_step ();
+
+	/* delete the rest by type */
+	rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_IGNORE);
+
+	fail_unless (row_deleted == G_N_ELEMENTS (entries));
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL) == 0);
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (child_model), NULL) == 0);
+	fail_unless (rhythmdb_entry_lookup_by_location (db, "file:///whee1.ogg") == NULL);
+	fail_unless (rhythmdb_entry_count_by_type (db, RHYTHMDB_ENTRY_TYPE_IGNORE) == 0);
+
+	end_step ();
+
+	/* the type's tree should still work for new entries */
+	entries[0] = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///whee0.ogg");
+	set_waiting_signal (G_OBJECT (db), "entry-added");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	fail_unless (rhythmdb_query_model_entry_to_iter (model, entries[0], &iter));
+
+	end_step ();
+
+	/* tidy up */
+	rhythmdb_entry_delete (db, entries[0]);
+	g_object_unref (child_model);
+	g_object_unref (model);
+
+	end_test_case ();
+}
+END_TEST
+
 static Suite *
 rhythmdb_query_model_suite (void)
 {
@@ -299,6 +627,9 @@ rhythmdb_query_model_suite (void)
 
 	/* test core functionality */
 	tcase_add_test (tc_chain, test_rhythmdb_db_queries);
+	tcase_add_test (tc_chain, test_query_model_dispatch);
+	tcase_add_test (tc_chain, test_query_model_irrelevant_changes);
+	tcase_add_test (tc_chain, test_query_model_bulk_delete);
 
 	/* tests for breakable bug fixes */
 	tcase_add_test (tc_bugs, test_hidden_chain_filter);
@@ -26,532 +26,495 @@
 
 #include "config.h"
 
-#include <glib.h>
+#include <check.h>
 #include <gtk/gtk.h>
-#include <stdlib.h>
 #include <string.h>
+#include "test-utils.h"
 #include "rhythmdb-query-model.h"
 #include "rhythmdb-tree.h"
+
 #include "rb-debug.h"
-#include "rb-thread-helpers.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
 
 static RhythmDBEntry *
-create_entry (RhythmDB *db,
+create_entry (RhythmDB *db, RhythmDBEntryType *type,
 	      const char *location, const char *name, const char *album,
 	      const char *artist, const char *genre)
 {
 	RhythmDBEntry *entry;
-	GValue val = {0, };
-
-	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, location);
-	g_assert (entry);
-	g_value_init (&val, G_TYPE_STRING);
-	g_value_set_static_string (&val, genre);
-	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_GENRE, &val);
-	g_value_unset (&val);
-
-	g_value_init (&val, G_TYPE_STRING);
-	g_value_set_static_string (&val, artist);
-	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ARTIST, &val);
-	g_value_unset (&val);
-
-	g_value_init (&val, G_TYPE_STRING);
-	g_value_set_static_string (&val, album);
-	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ALBUM, &val);
-	g_value_unset (&val);
-
-	g_value_init (&val, G_TYPE_STRING);
-	g_value_set_static_string (&val, name);
-	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_TITLE, &val);
-	g_value_unset (&val);
+
+	entry = rhythmdb_entry_new (db, type, location);
+	fail_unless (entry != NULL, "failed to create entry");
+
+	set_entry_string (db, entry, RHYTHMDB_PROP_GENRE, genre);
+	set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, artist);
+	set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, album);
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, name);
 
 	return entry;
 }
 
-#define DESTROY_MODELS()			\
-G_STMT_START {					\
-g_object_unref (G_OBJECT (main_model));		\
-} G_STMT_END
+static RhythmDBQueryModel *
+run_query (RhythmDBQuery *query)
+{
+	RhythmDBQueryModel *model;
+
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (G_OBJECT (model), "show-hidden", TRUE, NULL);
+	set_waiting_signal (G_OBJECT (model), "complete");
+	rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	wait_for_signal ();
+	return model;
+}
+
+static int
+count_matches_async (RhythmDBQuery *query)
+{
+	RhythmDBQueryModel *model;
+	int count;
+
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (G_OBJECT (model), "show-hidden", TRUE, NULL);
+	set_waiting_signal (G_OBJECT (model), "complete");
+	rhythmdb_do_full_query_async_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	wait_for_signal ();
+	count = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
+	g_object_unref (model);
+	return count;
+}
+
+static int
+count_matches (RhythmDBQuery *query)
+{
+	RhythmDBQueryModel *model;
+	int count;
+
+	model = run_query (query);
+	count = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
+	g_object_unref (model);
+	return count;
+}
 
+/* checks the matching entries, and frees the query */
 static void
-assert_entry_in_model (GtkTreeModel *model, RhythmDBEntry *entry)
+check_query_entries (RhythmDBQuery *query, RhythmDBEntry **entries, int n_entries, const char *what)
 {
+	RhythmDBQueryModel *model;
 	GtkTreeIter iter;
-	RhythmDBEntry *tree_entry;
-	g_assert (gtk_tree_model_get_iter_first (model, &iter));
-	gtk_tree_model_get (model, &iter, 0, &tree_entry, -1);
-	while (tree_entry != entry) {
-		g_assert (gtk_tree_model_iter_next (model, &iter));
-		gtk_tree_model_get (model, &iter, 0, &tree_entry, -1);
-	}
+	int i;
+
+	model = run_query (query);
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL) == n_entries, what);
+	for (i = 0; i < n_entries; i++)
+		fail_unless (rhythmdb_query_model_entry_to_iter (model, entries[i], &iter), what);
+	g_object_unref (model);
+	rhythmdb_query_free (query);
 }
 
-/* static void */
-/* assert_string_in_model (GtkTreeModel *model, const char *str) */
-/* { */
-/* 	GtkTreeIter iter; */
-/* 	char *tree_str; */
-/* 	g_assert (gtk_tree_model_get_iter_first (model, &iter)); */
-/* 	gtk_tree_model_get (model, &iter, 0, &tree_str, -1); */
-/* 	while (strcmp (tree_str, str)) { */
-/* 		g_free (tree_str); */
-/* 		g_assert (gtk_tree_model_iter_next (model, &iter)); */
-/* 		gtk_tree_model_get (model, &iter, 0, &tree_str, -1); */
-/* 	} */
-/* 	g_free (tree_str); */
-/* } */
-
-#define VERIFY_MAIN_MODEL(ENTRY) assert_entry_in_model (main_model, ENTRY);
-
-#define VERIFY_META_MODELS(ALBUM, ARTIST, GENRE)
-/* #define VERIFY_META_MODELS(ALBUM, ARTIST, GENRE)		\ */
-/* G_STMT_START {							\ */
-/* assert_string_in_model (genre_model, GENRE);			\ */
-/* assert_string_in_model (artist_model, ARTIST);			\ */
-/* assert_string_in_model (album_model, ALBUM);			\ */
-/* } G_STMT_END */
-
+/* checks the plan chosen for a query and the number of matches, and frees the query */
 static void
-completed_cb (RhythmDBQueryModel *model, gboolean *complete)
+check_query_plan (RhythmDBQuery *query, const char *plan, int expected, const char *what)
 {
-	rb_debug ("query complete");
-	*complete = TRUE;
+	char *explanation;
+
+	explanation = rhythmdb_tree_explain_query (RHYTHMDB_TREE (db), query);
+	rb_debug ("%s: %s", what, explanation);
+	fail_unless (g_str_has_prefix (explanation, plan), what);
+	g_free (explanation);
+
+	fail_unless (count_matches (query) == expected, what);
+	rhythmdb_query_free (query);
 }
 
+START_TEST (test_rhythmdb_query_tree)
+{
+	RhythmDBEntry *entries[4];
+
+	start_test_case ();
+
+	entries[0] = create_entry (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///sin.mp3",
+				   "Sin", "Pretty Hate Machine", "Nine Inch Nails", "Rock");
+	rhythmdb_commit (db);
+
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						   RHYTHMDB_QUERY_END),
+			     entries, 1, "query for all entries of the type");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Sin",
+						   RHYTHMDB_QUERY_END),
+			     entries, 1, "query for a title");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Cow",
+						   RHYTHMDB_QUERY_END),
+			     entries, 0, "query for a missing title");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Cow",
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Sin",
+						   RHYTHMDB_QUERY_END),
+			     entries, 0, "conjunction of two titles");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Cow",
+						   RHYTHMDB_QUERY_DISJUNCTION,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Sin",
+						   RHYTHMDB_QUERY_END),
+			     entries, 1, "disjunction of two titles");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Rock",
+						   RHYTHMDB_QUERY_END),
+			     entries, 1, "query for a genre");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Nine Inch Nails",
+						   RHYTHMDB_QUERY_END),
+			     entries, 0, "query for a missing genre");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ALBUM, "Pretty Hate Machine",
+						   RHYTHMDB_QUERY_END),
+			     entries, 1, "query for an album");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ARTIST, "Nine Inch Nails",
+						   RHYTHMDB_QUERY_END),
+			     entries, 1, "query for an artist");
+	end_step ();
+
+	entries[1] = create_entry (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///head like a hole.mp3",
+				   "Head Like A Hole", "Pretty Hate Machine", "Nine Inch Nails", "Rock");
+	rhythmdb_commit (db);
+
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ARTIST, "Nine Inch Nails",
+						   RHYTHMDB_QUERY_END),
+			     entries, 2, "query for an artist with two entries");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ALBUM, "Pretty Hate Machine",
+						   RHYTHMDB_QUERY_END),
+			     entries, 2, "query for an album with two entries");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Rock",
+						   RHYTHMDB_QUERY_END),
+			     entries, 2, "query for a genre with two entries");
+	end_step ();
+
+	entries[2] = create_entry (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///angel.ogg",
+				   "Angel", "Mezzanine", "Massive Attack", "Electronica");
+	entries[3] = create_entry (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///killa bees.ogg",
+				   "Killa Bees", "Armageddon", "Usual Suspects", "Drum N' Bass");
+	rhythmdb_commit (db);
+
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Electronica",
+						   RHYTHMDB_QUERY_END),
+			     entries + 2, 1, "query for a genre with other genres present");
+	check_query_entries (rhythmdb_query_parse (db,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Angel",
+						   RHYTHMDB_QUERY_DISJUNCTION,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Sin",
+						   RHYTHMDB_QUERY_DISJUNCTION,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Head Like A Hole",
+						   RHYTHMDB_QUERY_DISJUNCTION,
+						   RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TITLE, "Killa Bees",
+						   RHYTHMDB_QUERY_END),
+			     entries, 4, "disjunction of four titles");
+
+	end_test_case ();
+}
+END_TEST
+
+START_TEST (test_rhythmdb_query_plan)
+{
+	char *explanation;
+	RhythmDBQuery *query;
+	int i;
+
+	start_test_case ();
+
+	/* 200 ignored entries in 4 genres, 20 artists and 40 albums */
+	for (i = 0; i < 200; i++) {
+		RhythmDBEntry *entry;
+		char *uri;
+		char *title;
+		char *album;
+		char *artist;
+		char *genre;
+
+		uri = g_strdup_printf ("file:///plan/%d.ogg", i);
+		title = (i == 123) ? g_strdup ("Unmistakable") : g_strdup_printf ("Track %d", i);
+		album = g_strdup_printf ("Album %d", i % 40);
+		artist = g_strdup_printf ("Artist %d", i % 20);
+		genre = g_strdup_printf ("Genre %d", i % 4);
+		entry = create_entry (db, RHYTHMDB_ENTRY_TYPE_IGNORE, uri, title, album, artist, genre);
+		set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, (i == 7) ? 1000 : i % 5);
+		g_free (uri);
+		g_free (title);
+		g_free (album);
+		g_free (artist);
+		g_free (genre);
+	}
+
+	/* and a few songs */
+	for (i = 0; i < 10; i++) {
+		char *uri;
+
+		uri = g_strdup_printf ("file:///plan/songs/%d.ogg", i);
+		create_entry (db, RHYTHMDB_ENTRY_TYPE_SONG, uri, "Song", "Album 0", "Artist 0", "Genre 0");
+		g_free (uri);
+	}
+	rhythmdb_commit (db);
+	rhythmdb_tree_set_trigram_index (RHYTHMDB_TREE (db), RHYTHMDB_PROP_TITLE, TRUE);
+
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						RHYTHMDB_QUERY_END),
+			  "scan", 200, "query for all entries of the type");
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ARTIST, "Artist 3",
+						RHYTHMDB_QUERY_END),
+			  "tree: artist", 10, "query for an artist");
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Genre 1",
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ALBUM, "Album 5",
+						RHYTHMDB_QUERY_END),
+			  "tree: genre album", 5, "query for a genre and album without a type");
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ARTIST, "Nobody At All",
+						RHYTHMDB_QUERY_END),
+			  "tree", 0, "query for a missing artist");
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						RHYTHMDB_QUERY_END),
+			  "empty", 0, "query for two types");
+	end_step ();
+
+	/* selective criteria go to the indexes, others are cheaper to check while walking the tree */
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 500,
+						RHYTHMDB_QUERY_END),
+			  "index: play-count range", 1, "selective range query");
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 4,
+						RHYTHMDB_QUERY_END),
+			  "scan", 199, "unselective range query");
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_TITLE, "mistak",
+						RHYTHMDB_QUERY_END),
+			  "index: title trigrams", 1, "selective substring query");
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_SEARCH_MATCH, "unmistakable",
+						RHYTHMDB_QUERY_END),
+			  "index: search words", 1, "selective search");
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_SEARCH_MATCH, "track",
+						RHYTHMDB_QUERY_END),
+			  "scan", 199, "unselective search");
+	check_query_plan (rhythmdb_query_parse (db,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Genre 3",
+						RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 500,
+						RHYTHMDB_QUERY_END),
+			  "index", 1, "range more selective than the tree");
+	end_step ();
+
+	/* each part of a disjunction is planned separately */
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ARTIST, "Artist 3",
+				      RHYTHMDB_QUERY_DISJUNCTION,
+				      RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 500,
+				      RHYTHMDB_QUERY_END);
+	explanation = rhythmdb_tree_explain_query (RHYTHMDB_TREE (db), query);
+	rb_debug ("disjunction: %s", explanation);
+	fail_unless (g_str_has_prefix (explanation, "tree"), "wrong plan for the first part of a disjunction");
+	fail_unless (strchr (explanation, '\n') != NULL &&
+		     g_str_has_prefix (strchr (explanation, '\n') + 1, "index"),
+		     "wrong plan for the second part of a disjunction");
+	g_free (explanation);
+	fail_unless (count_matches (query) == 11, "wrong number of matches for a disjunction");
+	rhythmdb_query_free (query);
+
+	end_test_case ();
+}
+END_TEST
+
+/* runs the query serially and in parallel, checks both find the same
+ * number of entries, and frees the query */
 static void
-wait_for_model_completion (RhythmDBQueryModel *model)
+check_query_parallel (RhythmDBQuery *query, int expected, const char *what)
 {
-	gboolean complete = FALSE;
-	GTimeVal timeout;
-	g_signal_connect (G_OBJECT (model), "complete",
-			  G_CALLBACK (completed_cb), &complete);
-
-	while (!complete) {
-		g_get_current_time (&timeout);
-		g_time_val_add (&timeout, G_USEC_PER_SEC);
-
-		rb_debug ("polling model for changes");
-		rhythmdb_query_model_sync (model, &timeout);
-		g_usleep (G_USEC_PER_SEC / 10.0);
+	int serial;
+	int parallel;
+
+	g_object_set (G_OBJECT (db), "query-threads", 1, NULL);
+	serial = count_matches (query);
+	g_object_set (G_OBJECT (db), "query-threads", 4, NULL);
+	parallel = count_matches (query);
+	rb_debug ("%s: %d serial, %d parallel", what, serial, parallel);
+
+	fail_unless (serial == parallel, what);
+	if (expected >= 0)
+		fail_unless (parallel == expected, what);
+	rhythmdb_query_free (query);
+}
+
+START_TEST (test_rhythmdb_query_parallel)
+{
+	int i;
+
+	start_test_case ();
+
+	/* enough entries to be split into partitions */
+	for (i = 0; i < 6000; i++) {
+		char *location;
+		char *title;
+		char *album;
+		char *artist;
+		char *genre;
+
+		location = g_strdup_printf ("file:///parallel/%d.ogg", i);
+		title = g_strdup_printf ("Track %d", i);
+		album = g_strdup_printf ("Album %d", i / 10);
+		artist = g_strdup_printf ("Artist %d", i % 30);
+		genre = g_strdup_printf ("Genre %d", i % 4);
+		create_entry (db, RHYTHMDB_ENTRY_TYPE_SONG, location, title, album, artist, genre);
+		g_free (location);
+		g_free (title);
+		g_free (album);
+		g_free (artist);
+		g_free (genre);
 	}
+	rhythmdb_commit (db);
+	end_step ();
+
+	check_query_parallel (rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						    RHYTHMDB_QUERY_END),
+			      6000, "wrong number of songs");
+	end_step ();
+
+	check_query_parallel (rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						    RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_TITLE, "track 1",
+						    RHYTHMDB_QUERY_END),
+			      -1, "parallel substring query doesn't match the serial one");
+	end_step ();
+
+	check_query_parallel (rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Genre 1",
+						    RHYTHMDB_QUERY_END),
+			      1500, "wrong number of entries in a genre");
+	end_step ();
+
+	/* entries matching both parts must only be reported once */
+	check_query_parallel (rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Genre 1",
+						    RHYTHMDB_QUERY_DISJUNCTION,
+						    RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ARTIST, "Artist 3",
+						    RHYTHMDB_QUERY_END),
+			      1600, "wrong number of matches for a disjunction");
+
+	end_test_case ();
 }
+END_TEST
 
-typedef void (*query_func) (RhythmDB *db, GtkTreeModel *model, ...);
+START_TEST (test_rhythmdb_query_cache)
+{
+	RhythmDBQuery *query;
+	RhythmDBEntry *a1, *a2, *a3, *b1;
+
+	start_test_case ();
+
+	a1 = create_entry (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///cache/a1.ogg", "Title 1", "Album A", "Artist A", "Genre A");
+	a2 = create_entry (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///cache/a2.ogg", "Title 2", "Album A", "Artist A", "Genre A");
+	a3 = create_entry (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///cache/a3.ogg", "Title 3", "Album A", "Artist A", "Genre A");
+	b1 = create_entry (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///cache/b1.ogg", "Title 4", "Album B", "Artist B", "Genre B");
+	rhythmdb_commit (db);
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_GENRE, "Genre A",
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_matches_async (query) == 3, "wrong number of matches filling the cache");
+	fail_unless (count_matches_async (query) == 3, "wrong number of cached matches");
+	end_step ();
+
+	/* entries starting to match */
+	set_entry_string (db, b1, RHYTHMDB_PROP_GENRE, "Genre A");
+	create_entry (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///cache/a4.ogg", "Title 5", "Album A", "Artist A", "Genre A");
+	rhythmdb_commit (db);
+	fail_unless (count_matches_async (query) == 5, "cached matches not updated for new matches");
+	end_step ();
+
+	/* entries no longer matching */
+	set_entry_string (db, a1, RHYTHMDB_PROP_GENRE, "Genre B");
+	rhythmdb_entry_delete (db, a2);
+	rhythmdb_commit (db);
+	fail_unless (count_matches_async (query) == 3, "cached matches not updated for changed and deleted entries");
+	fail_unless (count_matches (query) == 3, "cached matches differ from the database");
+	end_step ();
+
+	/* changes that don't affect the result */
+	set_entry_string (db, a3, RHYTHMDB_PROP_TITLE, "Another title");
+	rhythmdb_commit (db);
+	fail_unless (count_matches_async (query) == 3, "cached matches changed by an unrelated change");
+
+	rhythmdb_query_free (query);
+	end_test_case ();
+}
+END_TEST
+
+static Suite *
+rhythmdb_query_suite (void)
+{
+	Suite *s = suite_create ("rhythmdb-query");
+	TCase *tc_chain = tcase_create ("rhythmdb-query-core");
+
+	suite_add_tcase (s, tc_chain);
+	tcase_add_checked_fixture (tc_chain, test_rhythmdb_setup, test_rhythmdb_shutdown);
+
+	tcase_add_test (tc_chain, test_rhythmdb_query_tree);
+	tcase_add_test (tc_chain, test_rhythmdb_query_plan);
+	tcase_add_test (tc_chain, test_rhythmdb_query_parallel);
+	tcase_add_test (tc_chain, test_rhythmdb_query_cache);
+
+	return s;
+}
 
 int
 main (int argc, char **argv)
 {
-	RhythmDB *db;
-	RhythmDBEntry *entry, *entry2, *entry3, *entry4;
-	GtkTreeModel *main_model;
-	GtkTreeIter iter;
-	guint testnum = 1;
-	query_func qfunc;
+	int ret;
+	SRunner *sr;
+	Suite *s;
+
+	/* init stuff */
+	rb_profile_start ("rhythmdb-query test suite");
 
-	gtk_init (&argc, &argv);
 	g_thread_init (NULL);
-	gdk_threads_init ();
-	rb_thread_helpers_init ();
+	rb_threads_init ();
+	gtk_set_locale ();
 	rb_debug_init (TRUE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
 
-	GDK_THREADS_ENTER ();
-
-	qfunc = rhythmdb_do_full_query;
-
-begin:	
-
-	db = rhythmdb_tree_new ("test");
-
-	/*
-	 *  TEST 1: Entry creation with album
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_write_lock (db);
-
-	entry = create_entry (db, "file:///sin.mp3",
-			      "Sin", "Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	
-	rhythmdb_write_unlock (db);
-	g_print ("Test %d\n", testnum);
-	
-	testnum++;
-	/*
-	 *  TEST 2: Do a query for all songs, verify our single song is in it
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_read_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	qfunc (db, main_model,
-	       RHYTHMDB_QUERY_PROP_EQUALS,
-	       RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
-	       RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	/* We should only have one entry. */
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	DESTROY_MODELS ();
-
-	rhythmdb_read_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	/*
-	 *  TEST 3: Do a query for songs named "Sin"
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_read_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Sin",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	/* We should only have one entry. */
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	DESTROY_MODELS ();
-
-	rhythmdb_read_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	/*
-	 *  TEST 4: Do a query for songs named "Cow", should be empty
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_read_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Cow",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (!gtk_tree_model_get_iter_first (main_model, &iter));
-
-	DESTROY_MODELS ();
-
-	rhythmdb_read_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	/*
-	 *  TEST 5
-	 *  Do a query for songs named "Cow" and "Sin", should be empty.
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_read_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Cow",
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Sin",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (!gtk_tree_model_get_iter_first (main_model, &iter));
-
-	DESTROY_MODELS ();
-	rhythmdb_read_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	/*
-	 *  TEST 6
-	 *  Do a query for songs named "Cow" or "Sin", should have our song.
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_read_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Cow",
-				RHYTHMDB_QUERY_DISJUNCTION,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Sin",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	/* We should only have one entry. */
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	DESTROY_MODELS ();
-
-	rhythmdb_read_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	/*
-	 *  TEST 7
-	 *  Do a query for songs with Genre "Rock", should have our song.
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_read_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_GENRE, "Rock",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	/* We should only have one entry. */
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	DESTROY_MODELS ();
-
-	rhythmdb_read_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	/*
-	 *  TEST 8
-	 *  Do a query for songs with Genre "Nine Inch Nails",
-	 *  should be empty.
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_read_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_GENRE, "Nine Inch Nails",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (!gtk_tree_model_get_iter_first (main_model, &iter));
-
-	DESTROY_MODELS ();
-
-	rhythmdb_read_unlock (db);
-	g_print ("Test %d\n", testnum);
-	
-	testnum++;
-	/*
-	 *  TEST 9
-	 *  Do a query for songs with album "Pretty Hate Machine",
-	 *  should have our song.
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_read_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_ALBUM, "Pretty Hate Machine",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	/* We should only have one entry. */
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	DESTROY_MODELS ();
-
-	rhythmdb_read_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	/*
-	 *  TEST 10
-	 *  Do a query for songs with artist "Nine Inch Nails",
-	 *  should have our song.
-	 */
-	g_print ("Test %d\n", testnum);
-	rhythmdb_read_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_ARTIST, "Nine Inch Nails",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	/* We should only have one entry. */
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	DESTROY_MODELS ();
-
-	rhythmdb_read_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	g_print ("Test %d\n", testnum);
-	rhythmdb_write_lock (db);
-
-	entry2 = create_entry (db, "file:///head like a hole.mp3",
-			       "Head Like A Hole", "Pretty Hate Machine",
-			       "Nine Inch Nails", "Rock");
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_ARTIST, "Nine Inch Nails",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	g_assert (gtk_tree_model_iter_next (main_model, &iter));
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	VERIFY_MAIN_MODEL (entry2);
-	DESTROY_MODELS ();
-	
-	rhythmdb_write_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	g_print ("Test %d\n", testnum);
-	rhythmdb_write_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_ALBUM, "Pretty Hate Machine",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	g_assert (gtk_tree_model_iter_next (main_model, &iter));
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	VERIFY_MAIN_MODEL (entry2);
-	DESTROY_MODELS ();
-	
-	rhythmdb_write_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	g_print ("Test %d\n", testnum);
-	rhythmdb_write_lock (db);
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_GENRE, "Rock",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	g_assert (gtk_tree_model_iter_next (main_model, &iter));
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	VERIFY_MAIN_MODEL (entry2);
-	DESTROY_MODELS ();
-	
-	rhythmdb_write_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	g_print ("Test %d\n", testnum);
-	rhythmdb_write_lock (db);
-
-	entry3 = create_entry (db, "file:///angel.ogg",
-			       "Angel", "Mezzanine", "Massive Attack", "Electronica");
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_GENRE, "Electronica",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Mezzanine", "Massive Attack", "Electronica");
-	VERIFY_MAIN_MODEL (entry3);
-	DESTROY_MODELS ();
-	
-	rhythmdb_write_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-	g_print ("Test %d\n", testnum);
-	rhythmdb_write_lock (db);
-
-	entry4 = create_entry (db, "file:///killa bees.ogg",
-			       "Killa Bees", "Armageddon", "Usual Suspects", "Drum N' Bass");
-
-	main_model = GTK_TREE_MODEL (rhythmdb_query_model_new_empty (db));
-	rhythmdb_do_full_query (db, main_model,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Angel",
-				RHYTHMDB_QUERY_DISJUNCTION,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Sin",
-				RHYTHMDB_QUERY_DISJUNCTION,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Head Like A Hole",
-				RHYTHMDB_QUERY_DISJUNCTION,
-				RHYTHMDB_QUERY_PROP_EQUALS,
-				RHYTHMDB_PROP_TITLE, "Killa Bees",
-				RHYTHMDB_QUERY_END);
-	wait_for_model_completion (RHYTHMDB_QUERY_MODEL (main_model));
-
-	g_assert (gtk_tree_model_get_iter_first (main_model, &iter));
-	g_assert (gtk_tree_model_iter_next (main_model, &iter));
-	g_assert (gtk_tree_model_iter_next (main_model, &iter));
-	g_assert (gtk_tree_model_iter_next (main_model, &iter));
-	g_assert (!gtk_tree_model_iter_next (main_model, &iter));
-
-	VERIFY_META_MODELS ("Mezzanine", "Massive Attack", "Electronica");
-	VERIFY_META_MODELS ("Armageddon", "Usual Suspects", "Drum N' Bass");
-	VERIFY_META_MODELS ("Pretty Hate Machine", "Nine Inch Nails", "Rock");
-	VERIFY_MAIN_MODEL (entry);
-	VERIFY_MAIN_MODEL (entry2);
-	VERIFY_MAIN_MODEL (entry3);
-	VERIFY_MAIN_MODEL (entry4);
-	DESTROY_MODELS ();
-	
-	rhythmdb_write_unlock (db);
-	g_print ("Test %d\n", testnum);
-
-	testnum++;
-
-	if (qfunc == rhythmdb_do_full_query) {
-		rhythmdb_shutdown (db);
-		g_object_unref (G_OBJECT (db));
-		qfunc = rhythmdb_do_full_query_async;
-		goto begin;
-	}
+	/* setup tests */
+	s = rhythmdb_query_suite ();
+	sr = srunner_create (s);
+
+	init_setup (sr, argc, argv);
+	init_once (FALSE);
+
+	srunner_run_all (sr, CK_NORMAL);
+	ret = srunner_ntests_failed (sr);
+	srunner_free (sr);
+
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
 
-	/*
-	 * THE END
-	 */
-	rhythmdb_shutdown (db);
-	g_object_unref (G_OBJECT (db));
-	GDK_THREADS_LEAVE ();
-	
-	exit (0);
+	rb_profile_end ("rhythmdb-query test suite");
+	return ret;
 }
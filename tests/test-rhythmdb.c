@@ -30,6 +30,8 @@
 #include <check.h>
 #include <gtk/gtk.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <glib/gi18n.h>
 
 #include "test-utils.h"
@@ -508,6 +510,608 @@ START_TEST (test_rhythmdb_commit_change_merging)
 }
 END_TEST
 
+static void
+commit_change_set_cb (RhythmDB *db, RhythmDBEntryChangeSet *changes, RhythmDBEntry *entry)
+{
+	RhythmDBEntryChange *change;
+
+	fail_unless (rhythmdb_entry_change_set_get_n_entries (changes) == 1, "wrong number of changed entries");
+	fail_unless (rhythmdb_entry_change_set_get_entry (changes, 0) == entry, "wrong changed entry");
+	fail_unless (rhythmdb_entry_change_set_get_n_changes (changes, 0) == 3, "commit change lists not merged");
+
+	fail_unless (rhythmdb_entry_change_set_has_prop (changes, 0, RHYTHMDB_PROP_GENRE));
+	fail_unless (rhythmdb_entry_change_set_has_prop (changes, 0, RHYTHMDB_PROP_ARTIST));
+	fail_if (rhythmdb_entry_change_set_has_prop (changes, 0, RHYTHMDB_PROP_TITLE));
+
+	/* changes are kept in the order they were made */
+	change = rhythmdb_entry_change_set_get_change (changes, 0, 0);
+	fail_unless (change->prop == RHYTHMDB_PROP_GENRE);
+	fail_unless (strcmp (g_value_get_string (&change->new), "Anything") == 0);
+	change = rhythmdb_entry_change_set_get_change (changes, 0, 2);
+	fail_unless (change->prop == RHYTHMDB_PROP_GENRE);
+	fail_unless (strcmp (g_value_get_string (&change->old), "Anything") == 0);
+	fail_unless (strcmp (g_value_get_string (&change->new), "Something") == 0);
+}
+
+START_TEST (test_rhythmdb_commit_change_set)
+{
+	RhythmDBEntry *entry;
+	GValue val = {0,};
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///whee.ogg");
+	fail_unless (entry != NULL, "failed to create entry");
+
+	rhythmdb_commit (db);
+
+	g_value_init (&val, G_TYPE_STRING);
+	g_value_set_static_string (&val, "Anything");
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_GENRE, &val);
+	rhythmdb_commit (db);
+
+	g_value_set_static_string (&val, "Nothing");
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ARTIST, &val);
+	g_value_set_static_string (&val, "Something");
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_GENRE, &val);
+	g_value_unset (&val);
+
+	g_signal_connect (G_OBJECT (db), "entries-changed", G_CALLBACK (commit_change_set_cb), entry);
+	set_waiting_signal (G_OBJECT (db), "entries-changed");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+}
+END_TEST
+
+static void
+set_many_cb (RhythmDB *db, RhythmDBEntryChangeSet *changes, gpointer data)
+{
+	guint i;
+
+	fail_unless (rhythmdb_entry_change_set_get_n_entries (changes) == 2, "changes not coalesced");
+	for (i = 0; i < 2; i++) {
+		fail_unless (rhythmdb_entry_change_set_get_n_changes (changes, i) == 2, "wrong number of changes");
+		fail_unless (rhythmdb_entry_change_set_has_prop (changes, i, RHYTHMDB_PROP_ALBUM));
+		fail_unless (rhythmdb_entry_change_set_has_prop (changes, i, RHYTHMDB_PROP_RATING));
+	}
+}
+
+START_TEST (test_rhythmdb_set_many)
+{
+	RhythmDBEntry *a;
+	RhythmDBEntry *b;
+	RhythmDBEntryUpdate updates[4];
+	GValue album = {0,};
+	GValue rating = {0,};
+
+	a = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///a.ogg");
+	b = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///b.ogg");
+	rhythmdb_commit (db);
+
+	g_value_init (&album, G_TYPE_STRING);
+	g_value_set_static_string (&album, "Album");
+	g_value_init (&rating, G_TYPE_DOUBLE);
+	g_value_set_double (&rating, 4.0);
+
+	updates[0].entry = a;
+	updates[0].prop = RHYTHMDB_PROP_ALBUM;
+	updates[0].value = &album;
+	updates[1].entry = b;
+	updates[1].prop = RHYTHMDB_PROP_ALBUM;
+	updates[1].value = &album;
+	updates[2].entry = a;
+	updates[2].prop = RHYTHMDB_PROP_RATING;
+	updates[2].value = &rating;
+	updates[3].entry = b;
+	updates[3].prop = RHYTHMDB_PROP_RATING;
+	updates[3].value = &rating;
+
+	g_signal_connect (G_OBJECT (db), "entries-changed", G_CALLBACK (set_many_cb), NULL);
+	set_waiting_signal (G_OBJECT (db), "entries-changed");
+	rhythmdb_entry_set_many (db, updates, G_N_ELEMENTS (updates));
+	g_value_unset (&album);
+	g_value_unset (&rating);
+
+	/* the changes take effect immediately */
+	fail_unless (strcmp (rhythmdb_entry_get_string (a, RHYTHMDB_PROP_ALBUM), "Album") == 0);
+	fail_unless (strcmp (rhythmdb_entry_get_string (b, RHYTHMDB_PROP_ALBUM), "Album") == 0);
+	fail_unless (rhythmdb_entry_get_double (a, RHYTHMDB_PROP_RATING) == 4.0);
+	fail_unless (rhythmdb_entry_get_double (b, RHYTHMDB_PROP_RATING) == 4.0);
+
+	/* and are committed together */
+	wait_for_signal ();
+}
+END_TEST
+
+START_TEST (test_rhythmdb_snapshot)
+{
+	RhythmDBEntry *entry;
+	RBRefString *keyword;
+	char *name;
+	char *snapshot;
+	char *journal;
+
+	name = g_strdup_printf ("%s/rhythmdb-snapshot-test-%d.xml", g_get_tmp_dir (), getpid ());
+	snapshot = g_strconcat (name, ".snapshot", NULL);
+	journal = g_strconcat (name, ".journal", NULL);
+	keyword = rb_refstring_new ("snapshot-keyword");
+
+	g_object_set (G_OBJECT (db), "name", name, NULL);
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///snapshot.ogg");
+	fail_unless (entry != NULL, "failed to create entry");
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, "Title");
+	set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, "Artist");
+	set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, "Album");
+	set_entry_string (db, entry, RHYTHMDB_PROP_GENRE, "Genre");
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, 3);
+	set_entry_hidden (db, entry, TRUE);
+	rhythmdb_entry_keyword_add (db, entry, keyword);
+	rhythmdb_commit (db);
+
+	rhythmdb_save (db);
+	fail_unless (g_file_test (snapshot, G_FILE_TEST_EXISTS), "snapshot not written");
+
+	/* load it back into a new database */
+	test_rhythmdb_shutdown ();
+	test_rhythmdb_setup ();
+	g_object_set (G_OBJECT (db), "name", name, NULL);
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+
+	entry = rhythmdb_entry_lookup_by_location (db, "file:///snapshot.ogg");
+	fail_unless (entry != NULL, "entry missing after loading snapshot");
+	fail_unless (rhythmdb_entry_get_entry_type (entry) == RHYTHMDB_ENTRY_TYPE_SONG, "wrong entry type");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE), "Title") == 0, "wrong title");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ARTIST), "Artist") == 0, "wrong artist");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ALBUM), "Album") == 0, "wrong album");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_GENRE), "Genre") == 0, "wrong genre");
+	fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_PLAY_COUNT) == 3, "wrong play count");
+	fail_unless (rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN), "entry not hidden");
+	fail_unless (rhythmdb_entry_keyword_has (db, entry, keyword), "keyword missing");
+
+	rb_refstring_unref (keyword);
+	unlink (journal);
+	unlink (snapshot);
+	unlink (name);
+	g_free (journal);
+	g_free (snapshot);
+	g_free (name);
+}
+END_TEST
+
+START_TEST (test_rhythmdb_journal)
+{
+	RhythmDBEntry *entry;
+	struct stat journal_stat;
+	char *name;
+	char *journal;
+	char *snapshot;
+	off_t journal_size;
+
+	name = g_strdup_printf ("%s/rhythmdb-journal-test-%d.xml", g_get_tmp_dir (), getpid ());
+	journal = g_strconcat (name, ".journal", NULL);
+	snapshot = g_strconcat (name, ".snapshot", NULL);
+
+	g_object_set (G_OBJECT (db), "name", name, NULL);
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///journal1.ogg");
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, "First");
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///journal2.ogg");
+	rhythmdb_commit (db);
+
+	/* the first save writes the XML file and starts the journal */
+	rhythmdb_save (db);
+	fail_unless (stat (journal, &journal_stat) == 0, "journal not created");
+	journal_size = journal_stat.st_size;
+
+	/* after that, changes are appended to the journal */
+	entry = rhythmdb_entry_lookup_by_location (db, "file:///journal1.ogg");
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, 7);
+	entry = rhythmdb_entry_lookup_by_location (db, "file:///journal2.ogg");
+	rhythmdb_entry_delete (db, entry);
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, "file:///journal3.ogg");
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, "Third");
+	set_waiting_signal (G_OBJECT (db), "entry-added");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	rhythmdb_save (db);
+	fail_unless (stat (journal, &journal_stat) == 0, "journal missing");
+	fail_unless (journal_stat.st_size > journal_size, "journal not appended to");
+
+	/* load it back into a new database */
+	test_rhythmdb_shutdown ();
+	test_rhythmdb_setup ();
+	g_object_set (G_OBJECT (db), "name", name, NULL);
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+
+	entry = rhythmdb_entry_lookup_by_location (db, "file:///journal1.ogg");
+	fail_unless (entry != NULL, "entry missing after replaying journal");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE), "First") == 0, "wrong title");
+	fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_PLAY_COUNT) == 7, "play count change not replayed");
+	entry = rhythmdb_entry_lookup_by_location (db, "file:///journal2.ogg");
+	fail_unless (entry == NULL, "deletion not replayed");
+	entry = rhythmdb_entry_lookup_by_location (db, "file:///journal3.ogg");
+	fail_unless (entry != NULL, "addition not replayed");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE), "Third") == 0, "wrong title");
+
+	unlink (journal);
+	unlink (snapshot);
+	unlink (name);
+	g_free (journal);
+	g_free (snapshot);
+	g_free (name);
+}
+END_TEST
+
+static void
+describe_entry (RhythmDBEntry *entry, GHashTable *entries)
+{
+	RBRefString *keyword;
+	char *description;
+
+	keyword = rb_refstring_new ("parallel-keyword");
+	description = g_strdup_printf ("%s|%s|%s|%lu|%d",
+				       rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE),
+				       rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ARTIST),
+				       rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ALBUM),
+				       rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_TRACK_NUMBER),
+				       rhythmdb_entry_keyword_has (db, entry, keyword));
+	g_hash_table_insert (entries,
+			     g_strdup (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION)),
+			     description);
+	rb_refstring_unref (keyword);
+}
+
+static GHashTable *
+load_and_describe (const char *name, guint threads)
+{
+	GHashTable *entries;
+
+	test_rhythmdb_shutdown ();
+	test_rhythmdb_setup ();
+	g_object_set (G_OBJECT (db), "name", name, "load-threads", threads, NULL);
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+
+	entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	rhythmdb_entry_foreach (db, (GFunc) describe_entry, entries);
+	return entries;
+}
+
+START_TEST (test_rhythmdb_parallel_load)
+{
+	RhythmDBEntry *entry;
+	RBRefString *keyword;
+	GHashTable *serial;
+	GHashTable *parallel;
+	GHashTableIter iter;
+	gpointer location;
+	gpointer description;
+	char *name;
+	char *snapshot;
+	char *journal;
+	int i;
+
+	name = g_strdup_printf ("%s/rhythmdb-parallel-test-%d.xml", g_get_tmp_dir (), getpid ());
+	snapshot = g_strconcat (name, ".snapshot", NULL);
+	journal = g_strconcat (name, ".journal", NULL);
+	keyword = rb_refstring_new ("parallel-keyword");
+
+	/* enough entries for the file to be split into several chunks */
+	g_object_set (G_OBJECT (db), "name", name, NULL);
+	for (i = 0; i < 2000; i++) {
+		char *uri;
+		char *str;
+
+		uri = g_strdup_printf ("file:///parallel/%d.ogg", i);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, uri);
+		g_free (uri);
+
+		str = g_strdup_printf ("Title <%d> & more", i);
+		set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, str);
+		g_free (str);
+		str = g_strdup_printf ("Album %d", i / 10);
+		set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, str);
+		g_free (str);
+		set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, (i % 2) ? "Artist A" : "Artist B");
+		set_entry_ulong (db, entry, RHYTHMDB_PROP_TRACK_NUMBER, (i % 10) + 1);
+		if (i % 3 == 0)
+			rhythmdb_entry_keyword_add (db, entry, keyword);
+	}
+	rhythmdb_commit (db);
+	rhythmdb_save (db);
+
+	/* make sure the XML file is parsed */
+	unlink (snapshot);
+	unlink (journal);
+	serial = load_and_describe (name, 1);
+	unlink (snapshot);
+	unlink (journal);
+	parallel = load_and_describe (name, 4);
+
+	fail_unless (g_hash_table_size (serial) == 2000, "wrong number of entries loaded serially");
+	fail_unless (g_hash_table_size (parallel) == g_hash_table_size (serial), "wrong number of entries loaded in parallel");
+	g_hash_table_iter_init (&iter, serial);
+	while (g_hash_table_iter_next (&iter, &location, &description)) {
+		const char *other = g_hash_table_lookup (parallel, location);
+
+		fail_unless (other != NULL, "entry missing from parallel load");
+		fail_unless (strcmp (description, other) == 0, "entry differs between serial and parallel loads");
+	}
+
+	g_hash_table_destroy (serial);
+	g_hash_table_destroy (parallel);
+	rb_refstring_unref (keyword);
+	unlink (journal);
+	unlink (snapshot);
+	unlink (name);
+	g_free (journal);
+	g_free (snapshot);
+	g_free (name);
+}
+END_TEST
+
+static RhythmDBEntry *
+add_search_entry (const char *uri, const char *title, const char *artist, const char *album)
+{
+	RhythmDBEntry *entry;
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, uri);
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, title);
+	set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, artist);
+	set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, album);
+	set_entry_string (db, entry, RHYTHMDB_PROP_GENRE, "Rock");
+	return entry;
+}
+
+static int
+count_search_matches (const char *text)
+{
+	RhythmDBQueryModel *model;
+	int count;
+
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (G_OBJECT (model), "show-hidden", TRUE, NULL);
+	set_waiting_signal (G_OBJECT (model), "complete");
+	rhythmdb_do_full_query (db, RHYTHMDB_QUERY_RESULTS (model),
+				RHYTHMDB_QUERY_PROP_EQUALS,
+				RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+				RHYTHMDB_QUERY_PROP_LIKE,
+				RHYTHMDB_PROP_SEARCH_MATCH, text,
+				RHYTHMDB_QUERY_END);
+	wait_for_signal ();
+	count = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
+	g_object_unref (model);
+	return count;
+}
+
+START_TEST (test_rhythmdb_search_index)
+{
+	RhythmDBEntry *sun;
+	RhythmDBEntry *sunday;
+
+	add_search_entry ("file:///search/1.ogg", "Wish You Were Here", "Pink Floyd", "Wish You Were Here");
+	sun = add_search_entry ("file:///search/2.ogg", "Here Comes the Sun", "The Beatles", "Abbey Road");
+	sunday = add_search_entry ("file:///search/3.ogg", "Sunday Morning", "The Velvet Underground", "The Velvet Underground & Nico");
+	rhythmdb_commit (db);
+
+	/* whole words, substrings of words, and words from different properties */
+	fail_unless (count_search_matches ("here") == 2, "wrong number of matches for a whole word");
+	fail_unless (count_search_matches ("sun") == 2, "wrong number of matches for a word prefix");
+	fail_unless (count_search_matches ("elve") == 1, "wrong number of matches for a substring");
+	fail_unless (count_search_matches ("rock") == 3, "wrong number of matches for the genre");
+	fail_unless (count_search_matches ("BEATLES  sun") == 1, "wrong number of matches for two words");
+	fail_unless (count_search_matches ("floyd sun") == 0, "matched words from different entries");
+	fail_unless (count_search_matches ("zeppelin") == 0, "matched a word that isn't there");
+
+	/* the index follows changes */
+	set_entry_string (db, sun, RHYTHMDB_PROP_TITLE, "Something");
+	rhythmdb_commit (db);
+	fail_unless (count_search_matches ("sun") == 1, "index not updated after a title change");
+	fail_unless (count_search_matches ("something beatles") == 1, "new title not indexed");
+
+	set_entry_string (db, sun, RHYTHMDB_PROP_ARTIST, "Wish");
+	rhythmdb_commit (db);
+	fail_unless (count_search_matches ("wish") == 2, "new artist not indexed");
+	fail_unless (count_search_matches ("beatles") == 0, "old artist still indexed");
+
+	rhythmdb_entry_delete (db, sunday);
+	rhythmdb_commit (db);
+	fail_unless (count_search_matches ("sun") == 0, "deleted entry still indexed");
+	fail_unless (count_search_matches ("rock") == 2, "wrong number of matches after deleting an entry");
+}
+END_TEST
+
+static int
+count_like_matches (RhythmDBPropType propid, const char *text)
+{
+	RhythmDBQueryModel *model;
+	int count;
+
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (G_OBJECT (model), "show-hidden", TRUE, NULL);
+	set_waiting_signal (G_OBJECT (model), "complete");
+	rhythmdb_do_full_query (db, RHYTHMDB_QUERY_RESULTS (model),
+				RHYTHMDB_QUERY_PROP_EQUALS,
+				RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+				RHYTHMDB_QUERY_PROP_LIKE,
+				propid, text,
+				RHYTHMDB_QUERY_END);
+	wait_for_signal ();
+	count = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
+	g_object_unref (model);
+	return count;
+}
+
+START_TEST (test_rhythmdb_trigram_index)
+{
+	RhythmDBEntry *entry;
+	RhythmDBEntry *podcast = NULL;
+	GValue val = {0,};
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		char *uri;
+
+		uri = g_strdup_printf ("file:///music/%s/%d.ogg", (i % 10) ? "albums" : "podcasts", i);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, uri);
+		g_free (uri);
+		set_entry_string (db, entry, RHYTHMDB_PROP_COMMENT, (i % 4) ? "studio" : "recorded live");
+		if (i == 10)
+			podcast = entry;
+	}
+	rhythmdb_commit (db);
+
+	/* one index is built from existing entries, the other maintained as they are added */
+	rhythmdb_tree_set_trigram_index (RHYTHMDB_TREE (db), RHYTHMDB_PROP_LOCATION, TRUE);
+	rhythmdb_tree_set_trigram_index (RHYTHMDB_TREE (db), RHYTHMDB_PROP_COMMENT, TRUE);
+	fail_unless (rhythmdb_tree_get_trigram_index_size (RHYTHMDB_TREE (db), RHYTHMDB_PROP_LOCATION) > 0,
+		     "trigram index size not reported");
+	fail_unless (rhythmdb_tree_get_trigram_index_size (RHYTHMDB_TREE (db), RHYTHMDB_PROP_TITLE) == 0,
+		     "size reported for a property that isn't indexed");
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///music/podcasts/extra.ogg");
+	set_entry_string (db, entry, RHYTHMDB_PROP_COMMENT, "live");
+	rhythmdb_commit (db);
+
+	fail_unless (count_like_matches (RHYTHMDB_PROP_LOCATION, "/podcasts/") == 11, "wrong number of location matches");
+	fail_unless (count_like_matches (RHYTHMDB_PROP_LOCATION, "s/1") == 11, "wrong number of matches for a short string");
+	fail_unless (count_like_matches (RHYTHMDB_PROP_LOCATION, "/7.ogg") == 1, "wrong number of matches for a suffix");
+	fail_unless (count_like_matches (RHYTHMDB_PROP_LOCATION, "/videos/") == 0, "matched a missing string");
+	fail_unless (count_like_matches (RHYTHMDB_PROP_COMMENT, "live") == 26, "wrong number of comment matches");
+	fail_unless (count_like_matches (RHYTHMDB_PROP_COMMENT, "li") == 26, "wrong number of matches for a string shorter than a trigram");
+
+	/* changes and deletions */
+	g_value_init (&val, G_TYPE_STRING);
+	g_value_set_static_string (&val, "file:///music/albums/moved.ogg");
+	rhythmdb_entry_set (db, podcast, RHYTHMDB_PROP_LOCATION, &val);
+	g_value_unset (&val);
+	set_entry_string (db, entry, RHYTHMDB_PROP_COMMENT, "studio");
+	rhythmdb_commit (db);
+	fail_unless (count_like_matches (RHYTHMDB_PROP_LOCATION, "/podcasts/") == 10, "index not updated after a location change");
+	fail_unless (count_like_matches (RHYTHMDB_PROP_LOCATION, "moved") == 1, "new location not indexed");
+	fail_unless (count_like_matches (RHYTHMDB_PROP_COMMENT, "live") == 25, "index not updated after a comment change");
+
+	rhythmdb_entry_delete (db, entry);
+	rhythmdb_commit (db);
+	fail_unless (count_like_matches (RHYTHMDB_PROP_LOCATION, "/podcasts/") == 9, "deleted entry still matched");
+
+	rhythmdb_tree_set_trigram_index (RHYTHMDB_TREE (db), RHYTHMDB_PROP_LOCATION, FALSE);
+	fail_unless (rhythmdb_tree_get_trigram_index_size (RHYTHMDB_TREE (db), RHYTHMDB_PROP_LOCATION) == 0,
+		     "index not removed");
+	fail_unless (count_like_matches (RHYTHMDB_PROP_LOCATION, "/podcasts/") == 9, "wrong number of matches without the index");
+}
+END_TEST
+
+static int
+count_parsed_query_matches (GPtrArray *query)
+{
+	RhythmDBQueryModel *model;
+	int count;
+
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (G_OBJECT (model), "show-hidden", TRUE, NULL);
+	set_waiting_signal (G_OBJECT (model), "complete");
+	rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	wait_for_signal ();
+	count = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
+	g_object_unref (model);
+	rhythmdb_query_free (query);
+	return count;
+}
+
+static void
+set_entry_rating (RhythmDBEntry *entry, double rating)
+{
+	GValue val = {0,};
+
+	g_value_init (&val, G_TYPE_DOUBLE);
+	g_value_set_double (&val, rating);
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_RATING, &val);
+	g_value_unset (&val);
+}
+
+START_TEST (test_rhythmdb_range_index)
+{
+	RhythmDBEntry *entries[100];
+	GTimeVal now;
+	GPtrArray *query;
+	int i;
+
+	g_get_current_time (&now);
+	for (i = 0; i < 100; i++) {
+		char *uri;
+
+		uri = g_strdup_printf ("file:///range/%d.ogg", i);
+		entries[i] = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, uri);
+		g_free (uri);
+
+		set_entry_ulong (db, entries[i], RHYTHMDB_PROP_PLAY_COUNT, i % 10);
+		set_entry_rating (entries[i], i % 5);
+		if (i < 10)
+			set_entry_ulong (db, entries[i], RHYTHMDB_PROP_LAST_PLAYED, now.tv_sec - i * 3600);
+		else
+			set_entry_ulong (db, entries[i], RHYTHMDB_PROP_LAST_PLAYED, now.tv_sec - 30 * 24 * 3600);
+	}
+	rhythmdb_commit (db);
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+				      RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 1,
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_parsed_query_matches (query) == 20, "wrong number of matches for play count <= 1");
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_RATING, 4.0,
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_parsed_query_matches (query) == 20, "wrong number of matches for rating >= 4");
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 3,
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_parsed_query_matches (query) == 10, "wrong number of matches for play count == 3");
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_RATING, 1.0,
+				      RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 1,
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_parsed_query_matches (query) == 10, "wrong number of matches for two ranges");
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN, RHYTHMDB_PROP_LAST_PLAYED, (gulong) (7 * 24 * 3600),
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_parsed_query_matches (query) == 10, "wrong number of matches for last played within 7 days");
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN, RHYTHMDB_PROP_LAST_PLAYED, (gulong) (7 * 24 * 3600),
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_parsed_query_matches (query) == 90, "wrong number of matches for last played not within 7 days");
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 8,
+				      RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 7,
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_parsed_query_matches (query) == 0, "matched an empty range");
+
+	/* changes and deletions */
+	set_entry_ulong (db, entries[5], RHYTHMDB_PROP_PLAY_COUNT, 0);
+	rhythmdb_commit (db);
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 1,
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_parsed_query_matches (query) == 21, "index not updated after a change");
+
+	rhythmdb_entry_delete (db, entries[0]);
+	rhythmdb_commit (db);
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 1,
+				      RHYTHMDB_QUERY_END);
+	fail_unless (count_parsed_query_matches (query) == 20, "deleted entry still matched");
+}
+END_TEST
+
 static Suite *
 rhythmdb_suite (void)
 {
@@ -532,12 +1136,20 @@ rhythmdb_suite (void)
 	tcase_add_test (tc_chain, test_rhythmdb_deserialisation1);
 	tcase_add_test (tc_chain, test_rhythmdb_deserialisation2);
 	tcase_add_test (tc_chain, test_rhythmdb_deserialisation3);
+	tcase_add_test (tc_chain, test_rhythmdb_snapshot);
+	tcase_add_test (tc_chain, test_rhythmdb_journal);
+	tcase_add_test (tc_chain, test_rhythmdb_parallel_load);
+	tcase_add_test (tc_chain, test_rhythmdb_search_index);
+	tcase_add_test (tc_chain, test_rhythmdb_trigram_index);
+	tcase_add_test (tc_chain, test_rhythmdb_range_index);
 	/*tcase_add_test (tc_chain, test_rhythmdb_serialisation);*/
 
 	/* tests for breakable bug fixes */
 	tcase_add_test (tc_chain, test_rhythmdb_podcast_upgrade);
 	tcase_add_test (tc_chain, test_rhythmdb_modify_after_delete);
 	tcase_add_test (tc_chain, test_rhythmdb_commit_change_merging);
+	tcase_add_test (tc_chain, test_rhythmdb_commit_change_set);
+	tcase_add_test (tc_chain, test_rhythmdb_set_many);
 
 	return s;
 }
@@ -1505,20 +1505,29 @@ rb_song_info_update_date_added (RBSongInfo *song_info)
 	gtk_label_set_text (GTK_LABEL (song_info->priv->date_added), str);
 }
 
-static gboolean
-sync_string_property (RBSongInfo *dialog, RhythmDBPropType property, GtkWidget *entry)
+static void
+queue_update (GArray *updates, RhythmDBEntry *entry, RhythmDBPropType property, const GValue *val)
+{
+	RhythmDBEntryUpdate update;
+
+	update.entry = entry;
+	update.prop = property;
+	update.value = val;
+	g_array_append_val (updates, update);
+}
+
+static void
+sync_string_property (RBSongInfo *dialog, RhythmDBPropType property, GtkWidget *entry, GValue *val, GArray *updates)
 {
 	const char *new_text;
-	GValue val = {0,};
 	GList *t;
-	gboolean changed = FALSE;
 
 	new_text = gtk_entry_get_text (GTK_ENTRY (entry));
 	if (strlen (new_text) == 0)
-		return FALSE;
+		return;
 
-	g_value_init (&val, G_TYPE_STRING);
-	g_value_set_string (&val, new_text);
+	g_value_init (val, G_TYPE_STRING);
+	g_value_set_string (val, new_text);
 	for (t = dialog->priv->selected_entries; t != NULL; t = t->next) {
 		const char *entry_value;
 		RhythmDBEntry *dbentry;
@@ -1528,13 +1537,12 @@ sync_string_property (RBSongInfo *dialog, RhythmDBPropType property, GtkWidget *
 
 		if (g_strcmp0 (new_text, entry_value) == 0)
 			continue;
-		rhythmdb_entry_set (dialog->priv->db, dbentry, property, &val);
-		changed = TRUE;
+		queue_update (updates, dbentry, property, val);
 	}
-	g_value_unset (&val);
-	return changed;
 }
 
+#define N_MULTIPLE_PROPERTIES	9
+
 static void
 rb_song_info_sync_entries_multiple (RBSongInfo *dialog)
 {
@@ -1542,20 +1550,26 @@ rb_song_info_sync_entries_multiple (RBSongInfo *dialog)
 	const char *discn_str = gtk_entry_get_text (GTK_ENTRY (dialog->priv->disc_cur));
 
 	char *endptr;
-	GValue val = {0,};
+	GValue vals[N_MULTIPLE_PROPERTIES];
+	GValue *val = vals;
+	GArray *updates;
 	GList *tem;
 	gint year;
 	gint discn;
-	gboolean changed = FALSE;
 	RhythmDBEntry *entry;
+	int i;
 
-	changed |= sync_string_property (dialog, RHYTHMDB_PROP_ALBUM, dialog->priv->album);
-	changed |= sync_string_property (dialog, RHYTHMDB_PROP_ARTIST, dialog->priv->artist);
-	changed |= sync_string_property (dialog, RHYTHMDB_PROP_ALBUM_ARTIST, dialog->priv->album_artist);
-	changed |= sync_string_property (dialog, RHYTHMDB_PROP_GENRE, dialog->priv->genre);
-	changed |= sync_string_property (dialog, RHYTHMDB_PROP_ARTIST_SORTNAME, dialog->priv->artist_sortname);
-	changed |= sync_string_property (dialog, RHYTHMDB_PROP_ALBUM_SORTNAME, dialog->priv->album_sortname);
-	changed |= sync_string_property (dialog, RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME, dialog->priv->album_artist_sortname);
+	/* all the changes are applied together, so the values have to last until then */
+	memset (vals, 0, sizeof (vals));
+	updates = g_array_new (FALSE, FALSE, sizeof (RhythmDBEntryUpdate));
+
+	sync_string_property (dialog, RHYTHMDB_PROP_ALBUM, dialog->priv->album, val++, updates);
+	sync_string_property (dialog, RHYTHMDB_PROP_ARTIST, dialog->priv->artist, val++, updates);
+	sync_string_property (dialog, RHYTHMDB_PROP_ALBUM_ARTIST, dialog->priv->album_artist, val++, updates);
+	sync_string_property (dialog, RHYTHMDB_PROP_GENRE, dialog->priv->genre, val++, updates);
+	sync_string_property (dialog, RHYTHMDB_PROP_ARTIST_SORTNAME, dialog->priv->artist_sortname, val++, updates);
+	sync_string_property (dialog, RHYTHMDB_PROP_ALBUM_SORTNAME, dialog->priv->album_sortname, val++, updates);
+	sync_string_property (dialog, RHYTHMDB_PROP_ALBUM_ARTIST_SORTNAME, dialog->priv->album_artist_sortname, val++, updates);
 
 	if (strlen (year_str) > 0) {
 		GDate *date = NULL;
@@ -1569,28 +1583,25 @@ rb_song_info_sync_entries_multiple (RBSongInfo *dialog)
 		type = rhythmdb_get_property_type (dialog->priv->db,
 						   RHYTHMDB_PROP_DATE);
 
-		g_value_init (&val, type);
-		g_value_set_ulong (&val, (date ? g_date_get_julian (date) : 0));
+		g_value_init (val, type);
+		g_value_set_ulong (val, (date ? g_date_get_julian (date) : 0));
 
 		for (tem = dialog->priv->selected_entries; tem; tem = tem->next) {
 			entry = (RhythmDBEntry *)tem->data;
-			rhythmdb_entry_set (dialog->priv->db, entry,
-					    RHYTHMDB_PROP_DATE, &val);
-			changed = TRUE;
+			queue_update (updates, entry, RHYTHMDB_PROP_DATE, val);
 		}
-		g_value_unset (&val);
 		if (date)
 			g_date_free (date);
-
 	}
+	val++;
 
 	discn = g_ascii_strtoull (discn_str, &endptr, 10);
 	if (endptr != discn_str) {
 		GType type;
 		type = rhythmdb_get_property_type (dialog->priv->db,
 						   RHYTHMDB_PROP_DISC_NUMBER);
-		g_value_init (&val, type);
-		g_value_set_ulong (&val, discn);
+		g_value_init (val, type);
+		g_value_set_ulong (val, discn);
 
 		for (tem = dialog->priv->selected_entries; tem; tem = tem->next) {
 			gulong entry_disc_num;
@@ -1598,17 +1609,23 @@ rb_song_info_sync_entries_multiple (RBSongInfo *dialog)
 			entry = (RhythmDBEntry *)tem->data;
 			entry_disc_num = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DISC_NUMBER);
 
-			if (discn != entry_disc_num) {
-				rhythmdb_entry_set (dialog->priv->db, entry,
-						    RHYTHMDB_PROP_DISC_NUMBER, &val);
-				changed = TRUE;
-			}
+			if (discn != entry_disc_num)
+				queue_update (updates, entry, RHYTHMDB_PROP_DISC_NUMBER, val);
 		}
-		g_value_unset (&val);
 	}
-
-	if (changed)
-		rhythmdb_commit (dialog->priv->db);
+	val++;
+	g_assert (val == vals + N_MULTIPLE_PROPERTIES);
+
+	/* this commits the changes too */
+	rhythmdb_entry_set_many (dialog->priv->db,
+				 (RhythmDBEntryUpdate *) updates->data,
+				 updates->len);
+	g_array_free (updates, TRUE);
+
+	for (i = 0; i < N_MULTIPLE_PROPERTIES; i++) {
+		if (G_IS_VALUE (&vals[i]))
+			g_value_unset (&vals[i]);
+	}
 }
 
 static void